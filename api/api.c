@@ -29,6 +29,8 @@
 #include <stdio.h>
 
 #include <iniparser.h>
+#include <mutexes.h>
+#include <semaphores.h>
 
 #include "api.h"
 
@@ -39,19 +41,165 @@
 #include <ts-940s.h>
 
 struct supported_rig supported_rigs[] = {
-	{ "FT-736R", ft736r_init },
-	{ "TS-140S", ts140s_init },
-	{ "TS-440S", ts440s_init },
-	{ "TS-680S", ts140s_init },
-	{ "TS-711A", ts711a_init },
-	{ "TS-711E", ts711a_init },
-	{ "TS-811A", ts711a_init },
-	{ "TS-811B", ts711a_init },
-	{ "TS-811E", ts711a_init },
-	{ "TS-940S", ts940s_init },
-	{ "", NULL }
+	{ "FT-736R", ft736r_init, ft736r_defaults },
+	{ "TS-140S", ts140s_init, ts140s_defaults },
+	{ "TS-440S", ts440s_init, ts440s_defaults },
+	{ "TS-680S", ts140s_init, ts140s_defaults },
+	{ "TS-711A", ts711a_init, ts711a_defaults },
+	{ "TS-711E", ts711a_init, ts711a_defaults },
+	{ "TS-811A", ts711a_init, ts711a_defaults },
+	{ "TS-811B", ts711a_init, ts711a_defaults },
+	{ "TS-811E", ts711a_init, ts711a_defaults },
+	{ "TS-940S", ts940s_init, ts940s_defaults },
+	{ "", NULL, NULL }
 };
 
+/*
+ * Reads that are already waiting on the rig.  An identical read that
+ * comes in meanwhile waits for the one in flight and gets its result
+ * instead of sending another command.
+ */
+enum flight_op {
+	FLIGHT_FREQUENCY,
+	FLIGHT_MODE,
+	FLIGHT_VFO,
+	FLIGHT_PTT,
+	FLIGHT_SQUELCH,
+	FLIGHT_SMETER
+};
+
+struct flight {
+	enum flight_op	op;
+	enum vfos		vfo;
+	uint64_t		result;
+	unsigned		refs;		// The caller doing the read plus waiters
+	semaphore_t		done;		// Posted once per waiter
+	struct flight	*next;
+};
+
+struct single_flight {
+	mutex_t			lock;
+	struct flight	*active;
+	struct flight	*spare;		// Finished flights kept for reuse
+	uint64_t		coalesced;
+};
+
+static uint64_t do_flight(struct rig *rig, enum flight_op op, enum vfos vfo)
+{
+	switch (op) {
+		case FLIGHT_FREQUENCY:
+			return rig->get_frequency(rig->cbdata, vfo);
+		case FLIGHT_MODE:
+			return rig->get_mode(rig->cbdata);
+		case FLIGHT_VFO:
+			return rig->get_vfo(rig->cbdata);
+		case FLIGHT_PTT:
+			return (uint64_t)(int64_t)rig->get_ptt(rig->cbdata);
+		case FLIGHT_SQUELCH:
+			return (uint64_t)(int64_t)rig->get_squelch(rig->cbdata);
+		case FLIGHT_SMETER:
+			return (uint64_t)(int64_t)rig->get_smeter(rig->cbdata);
+	}
+	return 0;
+}
+
+/*
+ * Called with the lock held.  Every post of done has been waited for by
+ * the time refs drops to zero, so the flight can go back on the spare
+ * list as it is.
+ */
+static void put_flight(struct single_flight *sf, struct flight *f)
+{
+	if (--f->refs == 0) {
+		f->next = sf->spare;
+		sf->spare = f;
+	}
+}
+
+static struct flight *get_flight(struct single_flight *sf)
+{
+	struct flight	*f = sf->spare;
+
+	if (f) {
+		sf->spare = f->next;
+		return f;
+	}
+	f = (struct flight *)calloc(1, sizeof(struct flight));
+	if (f == NULL)
+		return NULL;
+	if (semaphore_init(&f->done, 0) != 0) {
+		free(f);
+		return NULL;
+	}
+	return f;
+}
+
+static void free_flights(struct single_flight *sf)
+{
+	struct flight	*f;
+
+	while ((f = sf->spare) != NULL) {
+		sf->spare = f->next;
+		semaphore_destroy(&f->done);
+		free(f);
+	}
+}
+
+static uint64_t single_flight(struct rig *rig, enum flight_op op, enum vfos vfo)
+{
+	struct single_flight	*sf = rig->flights;
+	struct flight			*f;
+	struct flight			**prev;
+	uint64_t				ret;
+	unsigned				i;
+
+	if (sf == NULL || mutex_lock(&sf->lock) != 0)
+		return do_flight(rig, op, vfo);
+	for (f = sf->active; f; f = f->next) {
+		if (f->op == op && f->vfo == vfo)
+			break;
+	}
+	if (f) {
+		f->refs++;
+		sf->coalesced++;
+		mutex_unlock(&sf->lock);
+		semaphore_wait(&f->done);
+		mutex_lock(&sf->lock);
+		ret = f->result;
+		put_flight(sf, f);
+		mutex_unlock(&sf->lock);
+		return ret;
+	}
+	f = get_flight(sf);
+	if (f == NULL) {
+		mutex_unlock(&sf->lock);
+		return do_flight(rig, op, vfo);
+	}
+	f->op = op;
+	f->vfo = vfo;
+	f->refs = 1;
+	f->next = sf->active;
+	sf->active = f;
+	mutex_unlock(&sf->lock);
+
+	ret = do_flight(rig, op, vfo);
+
+	mutex_lock(&sf->lock);
+	f->result = ret;
+	// Anything arriving from here on needs a fresh read
+	for (prev = &sf->active; *prev; prev = &(*prev)->next) {
+		if (*prev == f) {
+			*prev = f->next;
+			break;
+		}
+	}
+	for (i = 1; i < f->refs; i++)
+		semaphore_post(&f->done);
+	put_flight(sf, f);
+	mutex_unlock(&sf->lock);
+	return ret;
+}
+
 int set_default(struct _dictionary_ *d, const char *section, const char *key, const char *dflt)
 {
 	char	skey[1024];
@@ -156,82 +304,148 @@ struct bandlimit *new_bandlimit(struct rig *rig, char *name, bool tx)
 	return limit;
 }
 
-struct rig *init_rig(struct _dictionary_ *d, char *section)
+static struct supported_rig *find_supported_rig(struct _dictionary_ *d, char *section)
 {
-	int					i;
-	char				*rig_name;
-	struct rig			*rig;
-	int					key_count;
-	char				**keys;
-	size_t				slen;
-	struct bandlimit	*limit;
+	int		i;
+	char	*rig_name;
 
 	rig_name = getstring(d, section, "rig", NULL);
 	if (rig_name==NULL)
 		return NULL;
 	for (i=0; supported_rigs[i].init != NULL; i++) {
 		if (strcmp(supported_rigs[i].name, rig_name)==0)
-			break;
+			return &supported_rigs[i];
+	}
+	return NULL;
+}
+
+static void free_bandlimits(struct rig *rig)
+{
+	struct bandlimit	*limit, *next_limit;
+
+	for (limit = rig->tx_limits; limit; limit = next_limit) {
+		next_limit = limit->next;
+		free(limit);
+	}
+	rig->tx_limits = NULL;
+	for (limit = rig->rx_limits; limit; limit = next_limit) {
+		next_limit = limit->next;
+		free(limit);
+	}
+	rig->rx_limits = NULL;
+}
+
+/*
+ * Fills in band edges from the *_bandlimit_* keys.  The limit names
+ * point into the dictionary.
+ */
+static int load_bandlimits(struct rig *rig, struct _dictionary_ *d, char *section)
+{
+	int					i;
+	int					key_count;
+	char				**keys;
+	size_t				slen;
+	struct bandlimit	*limit;
+	bool				tx;
+	bool				high;
+	size_t				plen;
+
+	slen = strlen(section);
+	slen++;
+	key_count = iniparser_getsecnkeys(d, section);
+	keys = iniparser_getseckeys(d, section);
+	if (keys == NULL)
+		return 0;
+	for (i=0; i<key_count; i++) {
+		if (strncmp(keys[i]+slen, "rx_bandlimit_low_", 17) == 0) {
+			tx = false;
+			high = false;
+			plen = 17;
+		}
+		else if (strncmp(keys[i]+slen, "rx_bandlimit_high_", 18) == 0) {
+			tx = false;
+			high = true;
+			plen = 18;
+		}
+		else if (strncmp(keys[i]+slen, "tx_bandlimit_low_", 17) == 0) {
+			tx = true;
+			high = false;
+			plen = 17;
+		}
+		else if (strncmp(keys[i]+slen, "tx_bandlimit_high_", 18) == 0) {
+			tx = true;
+			high = true;
+			plen = 18;
+		}
+		else
+			continue;
+		limit = find_bandlimit_by_name(rig, keys[i]+slen+plen, tx);
+		if (limit == NULL)
+			limit = new_bandlimit(rig, keys[i]+slen+plen, tx);
+		if (limit == NULL) {
+			free(keys);
+			return ENOMEM;
+		}
+		if (high)
+			limit->high = getuint64(d, section, keys[i]+slen, UINT64_MAX);
+		else
+			limit->low = getuint64(d, section, keys[i]+slen, 0);
 	}
-	if (supported_rigs[i].init == NULL)
+	free(keys);
+	return 0;
+}
+
+struct rig *init_rig(struct _dictionary_ *d, char *section)
+{
+	struct supported_rig	*sr;
+	struct rig				*rig;
+
+	sr = find_supported_rig(d, section);
+	if (sr == NULL)
 		return NULL;
-	rig = supported_rigs[i].init(d, section);
+	rig = sr->init(d, section);
 	if (rig != NULL) {
-		slen = strlen(section);
-		slen++;
-		// Fill in band edges.
-		key_count = iniparser_getsecnkeys(d, section);
-		keys = iniparser_getseckeys(d, section);
-		for (i=0; i<key_count; i++) {
-			if (strncmp(keys[i]+slen, "rx_bandlimit_low_", 17) == 0) {
-				limit = find_bandlimit_by_name(rig, keys[i]+slen+17, false);
-				if (limit == NULL)
-					limit = new_bandlimit(rig, keys[i]+slen+17, false);
-				if (limit == NULL) {
-					close_rig(rig);
-					return NULL;
-				}
-				limit->low = getuint64(d, section, keys[i]+slen, 0);
-			}
-			else if (strncmp(keys[i]+slen, "rx_bandlimit_high_", 18) == 0) {
-				limit = find_bandlimit_by_name(rig, keys[i]+slen+18, false);
-				if (limit == NULL)
-					limit = new_bandlimit(rig, keys[i]+slen+18, false);
-				if (limit == NULL) {
-					close_rig(rig);
-					return NULL;
-				}
-				limit->high = getuint64(d, section, keys[i]+slen, UINT64_MAX);
-			}
-			if (strncmp(keys[i]+slen, "tx_bandlimit_low_", 17) == 0) {
-				limit = find_bandlimit_by_name(rig, keys[i]+slen+17, true);
-				if (limit == NULL)
-					limit = new_bandlimit(rig, keys[i]+slen+17, true);
-				if (limit == NULL) {
-					close_rig(rig);
-					return NULL;
-				}
-				limit->low = getuint64(d, section, keys[i]+slen, 0);
-			}
-			else if (strncmp(keys[i]+slen, "tx_bandlimit_high_", 18) == 0) {
-				limit = find_bandlimit_by_name(rig, keys[i]+slen+18, true);
-				if (limit == NULL)
-					limit = new_bandlimit(rig, keys[i]+slen+18, true);
-				if (limit == NULL) {
-					close_rig(rig);
-					return NULL;
-				}
-				limit->high = getuint64(d, section, keys[i]+slen, UINT64_MAX);
-			}
+		rig->flights = (struct single_flight *)calloc(1, sizeof(struct single_flight));
+		if (rig->flights != NULL && mutex_init(&rig->flights->lock) != 0) {
+			free(rig->flights);
+			rig->flights = NULL;
+		}
+		if (load_bandlimits(rig, d, section) != 0) {
+			close_rig(rig);
+			return NULL;
 		}
 	}
 	return rig;
 }
 
+void rig_defaults(struct _dictionary_ *d, char *section)
+{
+	struct supported_rig	*sr;
+
+	sr = find_supported_rig(d, section);
+	if (sr != NULL && sr->defaults != NULL)
+		sr->defaults(d, section);
+}
+
+int reconfigure_rig(struct rig *rig, struct _dictionary_ *d, char *section)
+{
+	int	ret;
+
+	if (rig == NULL || d == NULL)
+		return EINVAL;
+	rig_defaults(d, section);
+	free_bandlimits(rig);
+	ret = load_bandlimits(rig, d, section);
+	if (ret != 0)
+		return ret;
+	if (rig->reconfigure == NULL)
+		return 0;
+	return rig->reconfigure(rig->cbdata, d, section);
+}
+
 int close_rig(struct rig *rig)
 {
 	int	ret;
-	struct bandlimit	*limit, *next_limit;
 
 	if (rig == NULL)
 		return EINVAL;
@@ -239,32 +453,157 @@ int close_rig(struct rig *rig)
 		return 0;
 	ret = rig->close(rig->cbdata);
 	if (ret==0) {
-		for (limit = rig->tx_limits; limit; limit = next_limit) {
-			next_limit = limit->next;
-			free(limit);
-		}
-		for (limit = rig->rx_limits; limit; limit = next_limit) {
-			next_limit = limit->next;
-			free(limit);
+		free_bandlimits(rig);
+		if (rig->flights) {
+			free_flights(rig->flights);
+			mutex_destroy(&rig->flights->lock);
+			free(rig->flights);
 		}
 		free(rig);
 	}
 	return ret;
 }
 
+/*
+ * Makes the changes in txn one call at a time, for backends without a
+ * commit callback.
+ */
+static int replay_txn(struct rig *rig, const struct rig_txn *txn)
+{
+	int	ret;
+
+	if (txn->fields & RIG_TXN_VFO_A) {
+		ret = rig->set_frequency(rig->cbdata, VFO_A, txn->vfo_a);
+		if (ret != 0)
+			return ret;
+	}
+	if (txn->fields & RIG_TXN_VFO_B) {
+		ret = rig->set_frequency(rig->cbdata, VFO_B, txn->vfo_b);
+		if (ret != 0)
+			return ret;
+	}
+	if (txn->fields & RIG_TXN_FREQ) {
+		if (txn->split)
+			ret = rig->set_split_frequency(rig->cbdata, txn->freq, txn->tx_freq);
+		else
+			ret = rig->set_frequency(rig->cbdata, VFO_UNKNOWN, txn->freq);
+		if (ret != 0)
+			return ret;
+	}
+	if (txn->fields & RIG_TXN_MODE)
+		return rig->set_mode(rig->cbdata, txn->mode);
+	return 0;
+}
+
+/*
+ * Sends what an open transaction has collected so far and leaves it
+ * open.  The first failure is kept for rig_commit().
+ */
+static int flush_txn(struct rig *rig)
+{
+	struct rig_txn	txn;
+	int				ret;
+
+	if (!rig->in_txn || rig->txn.fields == 0)
+		return 0;
+	txn = rig->txn;
+	rig->txn.fields = 0;
+	if (rig->commit)
+		ret = rig->commit(rig->cbdata, &txn);
+	else
+		ret = replay_txn(rig, &txn);
+	if (ret != 0 && rig->txn_ret == 0)
+		rig->txn_ret = ret;
+	return ret;
+}
+
+/*
+ * Which VFO is current isn't known until the rig is asked, so a change
+ * to the current VFO and one to a named VFO can't be collected together.
+ */
+static int txn_frequency(struct rig *rig, unsigned field)
+{
+	unsigned	other;
+
+	if (field == RIG_TXN_FREQ)
+		other = RIG_TXN_VFO_A | RIG_TXN_VFO_B;
+	else
+		other = RIG_TXN_FREQ;
+	if (rig->txn.fields & other)
+		return flush_txn(rig);
+	return 0;
+}
+
+int rig_begin(struct rig *rig)
+{
+	if (rig == NULL)
+		return EINVAL;
+	if (rig->in_txn)
+		return EBUSY;
+	rig->txn.fields = 0;
+	rig->txn_ret = 0;
+	rig->in_txn = true;
+	return 0;
+}
+
+int rig_commit(struct rig *rig)
+{
+	if (rig == NULL || !rig->in_txn)
+		return EINVAL;
+	flush_txn(rig);
+	rig->in_txn = false;
+	return rig->txn_ret;
+}
+
 int set_frequency(struct rig *rig, enum vfos vfo, uint64_t freq)
 {
+	unsigned	field;
+	int			ret;
+
 	if (rig == NULL)
 		return EINVAL;
 	if (rig->set_frequency == NULL)
 		return ENOTSUP;
 	if (find_bandlimit_by_freq(rig, freq, false) == NULL)
 		return EINVAL;
+	if (rig->in_txn) {
+		switch (vfo) {
+			case VFO_UNKNOWN:
+				field = RIG_TXN_FREQ;
+				break;
+			case VFO_A:
+				field = RIG_TXN_VFO_A;
+				break;
+			case VFO_B:
+				field = RIG_TXN_VFO_B;
+				break;
+			default:
+				field = 0;
+				break;
+		}
+		ret = field ? txn_frequency(rig, field) : flush_txn(rig);
+		if (ret != 0)
+			return ret;
+		if (field) {
+			rig->txn.fields |= field;
+			if (field == RIG_TXN_VFO_A)
+				rig->txn.vfo_a = freq;
+			else if (field == RIG_TXN_VFO_B)
+				rig->txn.vfo_b = freq;
+			else {
+				rig->txn.freq = freq;
+				rig->txn.split = false;
+			}
+			return 0;
+		}
+	}
 	return rig->set_frequency(rig->cbdata, vfo, freq);
 }
 
 int set_split_frequency(struct rig *rig, uint64_t freq_rx, uint64_t freq_tx)
 {
+	int	ret;
+
 	if (rig == NULL)
 		return EINVAL;
 	if (rig->set_split_frequency == NULL)
@@ -273,11 +612,23 @@ int set_split_frequency(struct rig *rig, uint64_t freq_rx, uint64_t freq_tx)
 		return EINVAL;
 	if (find_bandlimit_by_freq(rig, freq_tx, true) == NULL)
 		return EINVAL;
+	if (rig->in_txn) {
+		ret = txn_frequency(rig, RIG_TXN_FREQ);
+		if (ret != 0)
+			return ret;
+		rig->txn.fields |= RIG_TXN_FREQ;
+		rig->txn.freq = freq_rx;
+		rig->txn.split = true;
+		rig->txn.tx_freq = freq_tx;
+		return 0;
+	}
 	return rig->set_split_frequency(rig->cbdata, freq_rx, freq_tx);
 }
 
 int set_duplex(struct rig *rig, uint64_t freq_rx, enum rig_modes mode_rx, uint64_t freq_tx, enum rig_modes mode_tx)
 {
+	int	ret;
+
 	if (rig == NULL)
 		return EINVAL;
 	if (rig->set_duplex == NULL)
@@ -286,6 +637,9 @@ int set_duplex(struct rig *rig, uint64_t freq_rx, enum rig_modes mode_rx, uint64
 		return EINVAL;
 	if (find_bandlimit_by_freq(rig, freq_tx, true) == NULL)
 		return EINVAL;
+	ret = flush_txn(rig);
+	if (ret != 0)
+		return ret;
 	return rig->set_duplex(rig->cbdata, freq_rx, mode_rx, freq_tx, mode_tx);
 }
 
@@ -295,7 +649,8 @@ uint64_t get_frequency(struct rig *rig, enum vfos vfo)
 		return 0;
 	if (rig->get_frequency == NULL)
 		return 0;
-	return rig->get_frequency(rig->cbdata, vfo);
+	flush_txn(rig);
+	return single_flight(rig, FLIGHT_FREQUENCY, vfo);
 }
 
 int get_split_frequency(struct rig *rig, uint64_t *freq_rx, uint64_t *freq_tx)
@@ -304,6 +659,7 @@ int get_split_frequency(struct rig *rig, uint64_t *freq_rx, uint64_t *freq_tx)
 		return EINVAL;
 	if (rig->get_split_frequency == NULL)
 		return ENOTSUP;
+	flush_txn(rig);
 	return rig->get_split_frequency(rig->cbdata, freq_rx, freq_tx);
 }
 
@@ -313,6 +669,7 @@ int get_duplex(struct rig *rig, uint64_t *freq_rx, enum rig_modes *mode_rx, uint
 		return EINVAL;
 	if (rig->get_duplex == NULL)
 		return ENOTSUP;
+	flush_txn(rig);
 	return rig->get_duplex(rig->cbdata, freq_rx, mode_rx, freq_tx, mode_tx);
 }
 
@@ -324,6 +681,11 @@ int set_mode(struct rig *rig, enum rig_modes mode)
 		return ENOTSUP;
 	if ((rig->supported_modes & mode) == 0)
 		return ENOTSUP;
+	if (rig->in_txn) {
+		rig->txn.fields |= RIG_TXN_MODE;
+		rig->txn.mode = mode;
+		return 0;
+	}
 	return rig->set_mode(rig->cbdata, mode);
 }
 
@@ -333,17 +695,23 @@ enum rig_modes get_mode(struct rig *rig)
 		return MODE_UNKNOWN;
 	if (rig->get_mode == NULL)
 		return MODE_UNKNOWN;
-	return rig->get_mode(rig->cbdata);
+	flush_txn(rig);
+	return (enum rig_modes)single_flight(rig, FLIGHT_MODE, VFO_UNKNOWN);
 }
 
 int set_vfo(struct rig *rig, enum vfos vfo)
 {
+	int	ret;
+
 	if (rig == NULL)
 		return EINVAL;
 	if (rig->set_vfo == NULL)
 		return ENOTSUP;
 	if ((rig->supported_vfos & vfo) == 0)
 		return ENOTSUP;
+	ret = flush_txn(rig);
+	if (ret != 0)
+		return ret;
 	return rig->set_vfo(rig->cbdata, vfo);
 }
 
@@ -353,15 +721,21 @@ enum vfos get_vfo(struct rig *rig)
 		return VFO_UNKNOWN;
 	if (rig->get_vfo == NULL)
 		return VFO_UNKNOWN;
-	return rig->get_vfo(rig->cbdata);
+	flush_txn(rig);
+	return (enum vfos)single_flight(rig, FLIGHT_VFO, VFO_UNKNOWN);
 }
 
 int set_ptt(struct rig *rig, bool tx)
 {
+	int	ret;
+
 	if (rig == NULL)
 		return EINVAL;
 	if (rig->set_ptt == NULL)
 		return ENOTSUP;
+	ret = flush_txn(rig);
+	if (ret != 0)
+		return ret;
 	return rig->set_ptt(rig->cbdata, tx);
 }
 
@@ -371,7 +745,8 @@ int get_ptt(struct rig *rig)
 		return -1;
 	if (rig->get_ptt == NULL)
 		return -1;
-	return rig->get_ptt(rig->cbdata);
+	flush_txn(rig);
+	return (int)(int64_t)single_flight(rig, FLIGHT_PTT, VFO_UNKNOWN);
 }
 
 int get_squelch(struct rig *rig)
@@ -380,7 +755,8 @@ int get_squelch(struct rig *rig)
 		return -1;
 	if (rig->get_squelch == NULL)
 		return -1;
-	return rig->get_squelch(rig->cbdata);
+	flush_txn(rig);
+	return (int)(int64_t)single_flight(rig, FLIGHT_SQUELCH, VFO_UNKNOWN);
 }
 
 int get_smeter(struct rig *rig)
@@ -389,6 +765,27 @@ int get_smeter(struct rig *rig)
 		return -1;
 	if (rig->get_smeter == NULL)
 		return -1;
-	return rig->get_smeter(rig->cbdata);
+	flush_txn(rig);
+	return (int)(int64_t)single_flight(rig, FLIGHT_SMETER, VFO_UNKNOWN);
+}
+
+uint64_t get_coalesced_reads(struct rig *rig)
+{
+	uint64_t	ret;
+
+	if (rig == NULL || rig->flights == NULL)
+		return 0;
+	mutex_lock(&rig->flights->lock);
+	ret = rig->flights->coalesced;
+	mutex_unlock(&rig->flights->lock);
+	return ret;
 }
 
+int set_notify(struct rig *rig, rig_notify_t notify, void *notify_data)
+{
+	if (rig == NULL)
+		return EINVAL;
+	if (rig->set_notify == NULL)
+		return ENOTSUP;
+	return rig->set_notify(rig->cbdata, notify, notify_data);
+}
@@ -30,6 +30,7 @@
 #include <stdbool.h>
 
 struct _dictionary_;
+struct single_flight;
 
 enum rig_modes {
 	MODE_UNKNOWN	= 0,
@@ -55,6 +56,46 @@ enum vfos {
 	VFO_SUB			= 0x20, // For duplex mode only.
 };
 
+/*
+ * Rig state reported by a backend when the rig tells us about a change
+ * on its own (ie: someone turned the knob).  Anything the backend doesn't
+ * know is left as 0/MODE_UNKNOWN/VFO_UNKNOWN or -1.
+ */
+struct rig_status {
+	uint64_t			freq;		// Frequency of the current VFO
+	enum rig_modes		mode;		// Mode of the current VFO
+	enum vfos			vfo;		// Current VFO
+	int					ptt;		// 1 if transmitting
+	int					split;		// 1 if operating split
+};
+
+/*
+ * Called from the backend's I/O thread with the new state.  It must not
+ * call back into the rig.
+ */
+typedef void (*rig_notify_t)(void *notify_data, const struct rig_status *status);
+
+/*
+ * The end state a transaction asks for.  Only the parts named in fields
+ * are changed, later calls replace earlier ones.
+ */
+enum rig_txn_fields {
+	RIG_TXN_FREQ	= 0x01,	// freq on the current VFO, split on tx_freq if split
+	RIG_TXN_VFO_A	= 0x02,	// vfo_a on VFO A
+	RIG_TXN_VFO_B	= 0x04,	// vfo_b on VFO B
+	RIG_TXN_MODE	= 0x08,	// mode on the current VFO
+};
+
+struct rig_txn {
+	unsigned			fields;		// Bitmask of enum rig_txn_fields
+	uint64_t			freq;
+	bool				split;
+	uint64_t			tx_freq;
+	uint64_t			vfo_a;
+	uint64_t			vfo_b;
+	enum rig_modes		mode;
+};
+
 struct bandlimit {
 	char				*name;
 	uint64_t			low;
@@ -84,13 +125,21 @@ struct rig {
 	int (*get_ptt)(void *cbdata);
 	int (*get_squelch)(void *cbdata);
 	int (*get_smeter)(void *cbdata);
+	int (*set_notify)(void *cbdata, rig_notify_t notify, void *notify_data);
+	int (*reconfigure)(void *cbdata, struct _dictionary_ *d, const char *section);
+	int (*commit)(void *cbdata, const struct rig_txn *txn);
 
 	void		*cbdata;
+	struct single_flight	*flights;	// Reads currently waiting on the rig
+	bool		in_txn;				// Between rig_begin() and rig_commit()
+	struct rig_txn	txn;			// Changes waiting for rig_commit()
+	int			txn_ret;			// First failure sending txn
 };
 
 struct supported_rig {
 	char		name[32];
 	struct rig	*(*init)(struct _dictionary_ *d, const char *section);
+	void		(*defaults)(struct _dictionary_ *d, const char *section);
 };
 
 int set_default(struct _dictionary_ *d, const char *section, const char *key, const char *dflt);
@@ -104,12 +153,51 @@ uint64_t getuint64(struct _dictionary_ *d, const char *section, const char *key,
  */
 struct rig *init_rig(struct _dictionary_ *d, char *section);
 
+/*
+ * Fills in the backend defaults for the rig in the specified section
+ * without opening it.  init_rig() does this itself, so this is only
+ * needed to compare a freshly loaded config with a running one.
+ */
+void rig_defaults(struct _dictionary_ *d, char *section);
+
+/*
+ * Applies the band limits and backend timeouts from the specified section
+ * to an already open rig.  Nothing that needs the rig to be reopened
+ * (port, speed, etc) is changed.  The dictionary must outlive the rig.
+ * Must not be called while another thread is using the rig.
+ *
+ * return 0 on success or an errno value on failure
+ */
+int reconfigure_rig(struct rig *rig, struct _dictionary_ *d, char *section);
+
 /*
  * Initializes the rig defined in the specified section of the
  * passed dictionary (parsed INI file)
  */
 int close_rig(struct rig *rig);
 
+/*
+ * Starts collecting changes for the rig to make all at once.  Until
+ * rig_commit(), set_frequency(), set_split_frequency() and set_mode()
+ * are checked and remembered but not sent, so they only fail for bad
+ * arguments.  Anything else sends what's been collected first.  Only
+ * the thread that called rig_begin() may use the rig until rig_commit().
+ *
+ * return 0 on success or an errno value on failure
+ */
+int rig_begin(struct rig *rig);
+
+/*
+ * Sends the changes collected since rig_begin().  A backend that knows
+ * how is given the whole end state so it can skip anything the rig is
+ * already set to and send the rest together, otherwise the changes are
+ * made one at a time.
+ *
+ * return 0 on success or an errno value on failure, in which case some
+ * of the changes may have been made
+ */
+int rig_commit(struct rig *rig);
+
 /*
  * Sets the frequency of the currently selected VFO to freq if vfo == VFO_UNKNOWN
  * If split is enabled, disables it.
@@ -215,4 +303,18 @@ int get_squelch(struct rig *rig);
  */
 int get_smeter(struct rig *rig);
 
+/*
+ * Returns the number of reads that were answered by sharing the result
+ * of an identical read already in progress rather than asking the rig.
+ */
+uint64_t get_coalesced_reads(struct rig *rig);
+
+/*
+ * Sets a function to be called when the rig reports a change without
+ * being asked.  Pass NULL to stop notifications.
+ * 
+ * return 0 on success or an errno value on failure
+ */
+int set_notify(struct rig *rig, rig_notify_t notify, void *notify_data);
+
 #endif
@@ -0,0 +1,166 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Counts heap allocations while polling a rig the way or-rigctld does,
+ * to check the io layer, the rig backends and the rigctld parser and
+ * output don't allocate once they've warmed up.  Run it against a
+ * simulator (or-sim-kenwood, or-sim-yaesu) or a real rig named in the
+ * config file.  Exits non-zero if anything was allocated or any round
+ * failed, since rounds that fail may skip the paths being checked.
+ *
+ * Usage: bench-alloc config section [rounds]
+ *
+ * The section name must be in lower case, as iniparser stores it.
+ */
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <api.h>
+#include <iniparser.h>
+
+#include "../rigctld/output.h"
+#include "../rigctld/parse.h"
+
+#define WARMUP_ROUNDS	20
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+static atomic_bool		counting;
+static atomic_ulong		allocs;
+
+void *malloc(size_t size)
+{
+	if (atomic_load(&counting))
+		atomic_fetch_add(&allocs, 1);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (atomic_load(&counting))
+		atomic_fetch_add(&allocs, 1);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (atomic_load(&counting))
+		atomic_fetch_add(&allocs, 1);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+/*
+ * One client request: parse a command line, ask the rig and build the
+ * reply.  Then a tune between base and 1kHz above it.
+ */
+static int poll_rig(struct rig *rig, uint64_t base, unsigned round)
+{
+	char				line[32];
+	char				*p = line;
+	struct parsed_cmd	cmd;
+	struct output		out = {};
+	int					ret = 0;
+
+	strcpy(line, "+f\n");
+	while (parse_command(&p, &cmd) == 1) {
+		if (output_printf(&out, "get_freq:%cFrequency: %"PRIu64"%c", cmd.sep, get_frequency(rig, VFO_UNKNOWN), cmd.sep) != 0)
+			ret = -1;
+	}
+	if (set_frequency(rig, VFO_UNKNOWN, base + (round & 1) * 1000) != 0)
+		ret = -1;
+	output_printf(&out, "Mode: %d\n", get_mode(rig));
+	output_printf(&out, "PTT: %d\n", get_ptt(rig));
+	output_printf(&out, "VFO: %d\n", get_vfo(rig));
+	output_free(&out);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	dictionary		*d;
+	struct rig		*rig;
+	unsigned		rounds = 100;
+	unsigned		i;
+	unsigned		failed = 0;
+	unsigned long	count;
+	uint64_t		base;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s config section [rounds]\n", argv[0]);
+		return 2;
+	}
+	if (argc > 3)
+		rounds = strtoul(argv[3], NULL, 10);
+	if (output_init() != 0) {
+		fprintf(stderr, "output_init() failed\n");
+		return 2;
+	}
+	d = iniparser_load(argv[1]);
+	if (d == NULL) {
+		fprintf(stderr, "Unable to load %s\n", argv[1]);
+		return 2;
+	}
+	rig = init_rig(d, argv[2]);
+	if (rig == NULL) {
+		fprintf(stderr, "init_rig() failed\n");
+		return 2;
+	}
+	base = get_frequency(rig, VFO_UNKNOWN);
+	if (base == 0) {
+		fprintf(stderr, "Unable to read the frequency\n");
+		return 2;
+	}
+
+	for (i = 0; i < WARMUP_ROUNDS; i++)
+		poll_rig(rig, base, i);
+	atomic_store(&counting, true);
+	for (i = 0; i < rounds; i++) {
+		if (poll_rig(rig, base, i) != 0)
+			failed++;
+	}
+	atomic_store(&counting, false);
+	count = atomic_load(&allocs);
+
+	printf("Rounds:      %u\n", rounds);
+	printf("Failed:      %u\n", failed);
+	printf("Allocations: %lu\n", count);
+	close_rig(rig);
+	iniparser_freedict(d);
+	return (count || failed) ? 1 : 0;
+}
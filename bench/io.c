@@ -0,0 +1,277 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Runs many simulated rigs through the io layer at once to compare the
+ * io engine with a read thread per rig.  Each rig is a pty with a
+ * forked child on the other end echoing back every semi-colon
+ * terminated command.  Reports the thread count, the context switches
+ * while every rig is idle and the round trip of a query to each rig in
+ * turn.
+ *
+ * Usage: bench-io [-t] [-n rigs] [-i idle_seconds] [-q rounds]
+ *
+ * -t uses a read thread per rig (no frame callback) for comparison.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <datetime.h>
+#include <io.h>
+#include <serial.h>
+
+#include "../sim/sim.h"
+
+#define MAX_RIGS	256
+#define SPEED		38400
+
+struct rig_ctx {
+	struct io_handle	*hdl;
+	uint64_t			async;
+};
+
+static struct sim_port	ports[MAX_RIGS];
+static struct rig_ctx	rigs[MAX_RIGS];
+
+static void echo_rigs(int count)
+{
+	struct pollfd	pfd[MAX_RIGS];
+	char			line[MAX_RIGS][64];
+	size_t			len[MAX_RIGS] = {};
+	char			c;
+	int				i;
+
+	for (i = 0; i < count; i++) {
+		pfd[i].fd = ports[i].fd;
+		pfd[i].events = POLLIN;
+	}
+	for (;;) {
+		if (poll(pfd, count, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < count; i++) {
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			if (read(pfd[i].fd, &c, 1) != 1)
+				continue;
+			if (len[i] < sizeof(line[i]))
+				line[i][len[i]++] = c;
+			if (c == ';') {
+				sim_send(&ports[i], line[i], len[i]);
+				len[i] = 0;
+			}
+		}
+	}
+}
+
+static size_t frame(void *cbdata, const char *buf, size_t len)
+{
+	const char	*end = memchr(buf, ';', len);
+
+	return end ? end - buf + 1 : 0;
+}
+
+static struct io_response *read_response(void *cbdata)
+{
+	struct rig_ctx		*rig = cbdata;
+	struct io_response	*ret = io_alloc_response(rig->hdl, 64);
+	size_t				pos = 0;
+
+	if (ret == NULL)
+		return NULL;
+	if (io_wait_read(rig->hdl, 1000) != 1)
+		goto fail;
+	while (pos < 63) {
+		if (io_read(rig->hdl, ret->msg + pos, 1, 50) != 1)
+			goto fail;
+		if (ret->msg[pos++] == ';') {
+			ret->msg[pos] = 0;
+			ret->len = pos;
+			return ret;
+		}
+	}
+
+fail:
+	io_free_response(rig->hdl, ret);
+	return NULL;
+}
+
+static void async(void *cbdata, struct io_response *resp)
+{
+	((struct rig_ctx *)cbdata)->async++;
+}
+
+static long proc_status(const char *field)
+{
+	FILE	*fp = fopen("/proc/self/status", "r");
+	char	line[256];
+	size_t	flen = strlen(field);
+	long	ret = -1;
+
+	if (fp == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, field, flen) == 0 && line[flen] == ':') {
+			ret = strtol(line + flen + 1, NULL, 10);
+			break;
+		}
+	}
+	fclose(fp);
+	return ret;
+}
+
+static long switches(void)
+{
+	struct rusage	ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+int main(int argc, char **argv)
+{
+	struct io_serial_handle	*serial;
+	struct io_response		*resp;
+	struct io_waiter		w;
+	bool					threads = false;
+	int						count = 32;
+	int						idle = 5;
+	int						rounds = 100;
+	int						failed = 0;
+	uint64_t				start, rt, total = 0, max = 0;
+	long					before;
+	pid_t					child;
+	int						ch, i, r;
+
+	while ((ch = getopt(argc, argv, "ti:n:q:")) != -1) {
+		switch (ch) {
+			case 't':
+				threads = true;
+				break;
+			case 'i':
+				idle = atoi(optarg);
+				break;
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 'q':
+				rounds = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-t] [-n rigs] [-i idle_seconds] [-q rounds]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (count < 1 || count > MAX_RIGS) {
+		fprintf(stderr, "Between 1 and %d rigs\n", MAX_RIGS);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (sim_open(&ports[i], NULL, SPEED, 10) == -1) {
+			perror("sim_open");
+			return EXIT_FAILURE;
+		}
+	}
+	child = fork();
+	if (child == -1) {
+		perror("fork");
+		return EXIT_FAILURE;
+	}
+	if (child == 0)
+		echo_rigs(count);
+
+	for (i = 0; i < count; i++) {
+		serial = serial_open(SERIAL_H_UNSPECIFIED, ports[i].name, SPEED, SERIAL_DWL_8, SERIAL_SB_1, SERIAL_P_NONE, SERIAL_F_NONE, SERIAL_BREAK_DISABLED);
+		if (serial == NULL) {
+			fprintf(stderr, "Unable to open %s\n", ports[i].name);
+			goto done;
+		}
+		rigs[i].hdl = io_start(IO_H_SERIAL, serial, read_response, threads ? NULL : frame, async, &rigs[i]);
+		if (rigs[i].hdl == NULL) {
+			fprintf(stderr, "Unable to start io on %s\n", ports[i].name);
+			goto done;
+		}
+	}
+
+	printf("%d rigs, %s\n", count, threads ? "read thread per rig" : "io engine");
+	printf("threads: %ld\n", proc_status("Threads"));
+	printf("virtual memory: %ld kB\n", proc_status("VmSize"));
+
+	sleep(1);
+	before = switches();
+	sleep(idle);
+	printf("idle context switches: %.1f/s\n", (double)(switches() - before) / idle);
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < count; i++) {
+			start = us_ticks();
+			if (io_expect(rigs[i].hdl, &w, "ID", 2, 0, 0) != 0) {
+				failed++;
+				continue;
+			}
+			if (io_write(rigs[i].hdl, "ID;", 3, 50) == -1) {
+				io_cancel(rigs[i].hdl, &w);
+				failed++;
+				continue;
+			}
+			resp = io_wait_response(rigs[i].hdl, &w);
+			if (resp == NULL) {
+				failed++;
+				continue;
+			}
+			io_free_response(rigs[i].hdl, resp);
+			rt = us_ticks() - start;
+			total += rt;
+			if (rt > max)
+				max = rt;
+		}
+	}
+	if (rounds * count > failed)
+		printf("round trip: %" PRIu64 "us mean, %" PRIu64 "us max\n", total / (rounds * count - failed), max);
+	printf("failed: %d\n", failed);
+
+done:
+	for (i = 0; i < count; i++) {
+		if (rigs[i].hdl)
+			io_end(rigs[i].hdl);
+	}
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
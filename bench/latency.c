@@ -0,0 +1,213 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Measures rigctld round trip latency over each of the given
+ * transports, so loopback TCP can be compared with a Unix socket.  A
+ * target with a '/' in it is a Unix socket path, anything else is
+ * host:port.  The command defaults to \chk_vfo since the daemon
+ * answers it without talking to the rig.
+ *
+ * Usage: bench-latency [-n count] [-c command] target...
+ *
+ * e.g. bench-latency localhost:4532 /var/run/or-rigctld.sock
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WARMUP	100
+
+static uint64_t ns_ticks(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static int connect_target(const char *target)
+{
+	struct sockaddr_un	sa = {};
+	struct addrinfo		hints = {}, *res, *res0;
+	char				host[256];
+	const char			*port;
+	int					s = -1;
+	int					one = 1;
+
+	if (strchr(target, '/')) {
+		if (strlen(target) >= sizeof(sa.sun_path))
+			return -1;
+		sa.sun_family = AF_UNIX;
+		strcpy(sa.sun_path, target);
+		s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (s != -1 && connect(s, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+			close(s);
+			s = -1;
+		}
+		return s;
+	}
+	port = strrchr(target, ':');
+	if (port == NULL || port - target >= sizeof(host))
+		return -1;
+	memcpy(host, target, port - target);
+	host[port - target] = 0;
+	port++;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res0) != 0)
+		return -1;
+	for (res = res0; res; res = res->ai_next) {
+		s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (s == -1)
+			continue;
+		if (connect(s, res->ai_addr, res->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res0);
+	if (s != -1)
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return s;
+}
+
+/*
+ * Sends the command and reads the reply.  If len is zero, the reply is
+ * whatever arrives before the socket goes quiet for 100ms, and its
+ * length is returned so later calls can wait for exactly that much.
+ */
+static ssize_t round_trip(int s, const char *cmd, size_t cmd_len, size_t len)
+{
+	struct pollfd	pfd = {s, POLLIN, 0};
+	char			buf[4096];
+	size_t			got = 0;
+	ssize_t			ret;
+
+	if (write(s, cmd, cmd_len) != (ssize_t)cmd_len)
+		return -1;
+	for (;;) {
+		if (len == 0 && poll(&pfd, 1, got ? 100 : 2000) < 1)
+			return got ? (ssize_t)got : -1;
+		ret = read(s, buf, sizeof(buf));
+		if (ret < 1)
+			return -1;
+		got += ret;
+		if (len && got >= len)
+			return got;
+	}
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t	x = *(const uint64_t *)a;
+	uint64_t	y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+	const char	*cmd = "\\chk_vfo\n";
+	char		*line = NULL;
+	int			count = 10000;
+	int			s;
+	int			i;
+	int			t;
+	ssize_t		len;
+	uint64_t	*samples;
+	uint64_t	start;
+	uint64_t	total;
+
+	while ((i = getopt(argc, argv, "n:c:")) != -1) {
+		switch (i) {
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 'c':
+				line = malloc(strlen(optarg) + 2);
+				if (line == NULL)
+					return EXIT_FAILURE;
+				sprintf(line, "%s\n", optarg);
+				cmd = line;
+				break;
+			default:
+				goto usage;
+		}
+	}
+	if (optind >= argc || count < 1)
+		goto usage;
+	samples = malloc(sizeof(*samples) * count);
+	if (samples == NULL)
+		return EXIT_FAILURE;
+
+	printf("%-32s %9s %9s %9s %9s %9s\n", "target", "min us", "p50 us", "p99 us", "max us", "mean us");
+	for (t = optind; t < argc; t++) {
+		s = connect_target(argv[t]);
+		if (s == -1) {
+			fprintf(stderr, "Unable to connect to %s\n", argv[t]);
+			return EXIT_FAILURE;
+		}
+		len = round_trip(s, cmd, strlen(cmd), 0);
+		for (i = 0; len > 0 && i < WARMUP; i++) {
+			if (round_trip(s, cmd, strlen(cmd), len) != len)
+				len = -1;
+		}
+		total = 0;
+		for (i = 0; len > 0 && i < count; i++) {
+			start = ns_ticks();
+			if (round_trip(s, cmd, strlen(cmd), len) != len)
+				len = -1;
+			samples[i] = ns_ticks() - start;
+			total += samples[i];
+		}
+		close(s);
+		if (len <= 0) {
+			fprintf(stderr, "Bad reply from %s\n", argv[t]);
+			return EXIT_FAILURE;
+		}
+		qsort(samples, count, sizeof(*samples), compare_u64);
+		printf("%-32s %9.1f %9.1f %9.1f %9.1f %9.1f\n", argv[t], samples[0] / 1000.0,
+		    samples[count / 2] / 1000.0, samples[count * 99 / 100] / 1000.0,
+		    samples[count - 1] / 1000.0, total / 1000.0 / count);
+	}
+	free(samples);
+	free(line);
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "Usage: %s [-n count] [-c command] target...\n", argv[0]);
+	return EXIT_FAILURE;
+}
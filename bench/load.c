@@ -0,0 +1,527 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Load generator for rigctld.  Opens a number of connections and sends
+ * a weighted mix of commands at a fixed total rate (or as fast as the
+ * server answers with -r 0), then prints one JSON object with the
+ * throughput, errors and latency so runs can be compared by a script.
+ *
+ * Commands are sent with the extended response prefix so every reply
+ * ends with an RPRT line, a non-zero RPRT counts as an error.  Each
+ * connection has one command outstanding.  With a rate, latency is
+ * measured from when a command was due rather than when it went out,
+ * so a server that falls behind can't hide it.
+ *
+ * Usage: or-rigctld-bench [-c connections] [-r rate] [-d seconds]
+ *            [-m mix] target
+ *
+ * target is host:port, or a Unix socket path if it has a '/' in it.
+ * mix is a comma separated list of command=weight, e.g.
+ *
+ * or-rigctld-bench -c 16 -r 500 -m 'f=10,m=5,F 14074000=1' localhost:4532
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_COMMANDS	32
+#define REPLY_TIMEOUT	5000000000ULL	// ns to wait for a reply
+
+static const char *default_mix = "f=30,m=20,t=20,\\get_split_freq=10,F 14074000=10,\\dump_state=10";
+
+struct command {
+	char		*text;		// As given, without the prefix or newline
+	char		*line;		// What's sent
+	size_t		line_len;
+	unsigned	weight;
+	uint64_t	requests;
+	uint64_t	errors;
+};
+
+struct sample {
+	uint64_t	ns;
+	int			cmd;
+};
+
+struct client {
+	int			s;
+	bool		busy;
+	int			cmd;
+	uint64_t	due;		// When the outstanding command was due
+	char		buf[65536];
+	size_t		len;
+};
+
+static struct command	commands[MAX_COMMANDS];
+static int				command_count;
+static unsigned			total_weight;
+static struct sample	*samples;
+static size_t			sample_count;
+static size_t			sample_size;
+static uint64_t			disconnects;
+static uint64_t			timeouts;
+
+static uint64_t ns_ticks(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static int connect_target(const char *target)
+{
+	struct sockaddr_un	sa = {};
+	struct addrinfo		hints = {}, *res, *res0;
+	char				host[256];
+	const char			*port;
+	int					s = -1;
+	int					one = 1;
+
+	if (strchr(target, '/')) {
+		if (strlen(target) >= sizeof(sa.sun_path))
+			return -1;
+		sa.sun_family = AF_UNIX;
+		strcpy(sa.sun_path, target);
+		s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (s != -1 && connect(s, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+			close(s);
+			s = -1;
+		}
+		return s;
+	}
+	port = strrchr(target, ':');
+	if (port == NULL || port - target >= sizeof(host))
+		return -1;
+	memcpy(host, target, port - target);
+	host[port - target] = 0;
+	port++;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res0) != 0)
+		return -1;
+	for (res = res0; res; res = res->ai_next) {
+		s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (s == -1)
+			continue;
+		if (connect(s, res->ai_addr, res->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res0);
+	if (s != -1)
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return s;
+}
+
+/*
+ * Parses command=weight[,command=weight...].  The weight is after the
+ * last '=' so commands may contain one.
+ */
+static int parse_mix(const char *mix)
+{
+	char		*copy;
+	char		*item;
+	char		*next;
+	char		*eq;
+	long		weight;
+	struct command	*c;
+
+	copy = strdup(mix);
+	if (copy == NULL)
+		return -1;
+	for (item = copy; item && *item; item = next) {
+		next = strchr(item, ',');
+		if (next)
+			*next++ = 0;
+		eq = strrchr(item, '=');
+		if (eq == NULL || eq == item || command_count == MAX_COMMANDS)
+			goto fail;
+		*eq = 0;
+		weight = strtol(eq + 1, NULL, 10);
+		if (weight < 1)
+			goto fail;
+		c = &commands[command_count++];
+		c->text = strdup(item);
+		c->line_len = strlen(item) + 2;
+		c->line = malloc(c->line_len + 1);
+		if (c->text == NULL || c->line == NULL)
+			goto fail;
+		sprintf(c->line, "+%s\n", item);
+		c->weight = weight;
+		total_weight += weight;
+	}
+	free(copy);
+	return command_count ? 0 : -1;
+
+fail:
+	free(copy);
+	return -1;
+}
+
+/* xorshift, seeded the same every run so runs send the same sequence */
+static uint32_t rnd(void)
+{
+	static uint32_t	x = 2463534242U;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+static int pick_command(void)
+{
+	unsigned	r = rnd() % total_weight;
+	int			i;
+
+	for (i = 0; i < command_count - 1; i++) {
+		if (r < commands[i].weight)
+			break;
+		r -= commands[i].weight;
+	}
+	return i;
+}
+
+static int add_sample(uint64_t ns, int cmd)
+{
+	struct sample	*grown;
+
+	if (sample_count == sample_size) {
+		sample_size = sample_size ? sample_size * 2 : 65536;
+		grown = realloc(samples, sample_size * sizeof(*samples));
+		if (grown == NULL)
+			return -1;
+		samples = grown;
+	}
+	samples[sample_count].ns = ns;
+	samples[sample_count].cmd = cmd;
+	sample_count++;
+	return 0;
+}
+
+static int send_command(struct client *cl, uint64_t due)
+{
+	struct command	*c;
+
+	cl->cmd = pick_command();
+	c = &commands[cl->cmd];
+	if (write(cl->s, c->line, c->line_len) != (ssize_t)c->line_len)
+		return -1;
+	cl->busy = true;
+	cl->due = due;
+	cl->len = 0;
+	c->requests++;
+	return 0;
+}
+
+/*
+ * Looks for the RPRT line that ends an extended response.  Returns 1
+ * and sets rprt once the reply is complete.
+ */
+static int reply_done(struct client *cl, int *rprt)
+{
+	char	*line;
+	char	*nl;
+
+	if (cl->len == 0 || cl->buf[cl->len - 1] != '\n')
+		return 0;
+	cl->buf[cl->len - 1] = 0;
+	nl = strrchr(cl->buf, '\n');
+	line = nl ? nl + 1 : cl->buf;
+	cl->buf[cl->len - 1] = '\n';
+	if (strncmp(line, "RPRT ", 5) != 0)
+		return 0;
+	*rprt = atoi(line + 5);
+	return 1;
+}
+
+/*
+ * Returns -1 if the connection has failed.
+ */
+static int read_reply(struct client *cl, uint64_t now)
+{
+	ssize_t	ret;
+	int		rprt;
+
+	if (cl->len == sizeof(cl->buf))
+		cl->len = 0;	// Only the end matters
+	ret = read(cl->s, cl->buf + cl->len, sizeof(cl->buf) - cl->len);
+	if (ret < 1)
+		return -1;
+	cl->len += ret;
+	if (reply_done(cl, &rprt)) {
+		cl->busy = false;
+		if (rprt != 0)
+			commands[cl->cmd].errors++;
+		if (add_sample(now - cl->due, cl->cmd) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * A command outstanding on a failed connection counts as an error.
+ */
+static void fail_client(struct client *cl)
+{
+	if (cl->busy)
+		commands[cl->cmd].errors++;
+	close(cl->s);
+	cl->s = -1;
+	cl->busy = false;
+}
+
+static int compare_sample(const void *a, const void *b)
+{
+	uint64_t	x = ((const struct sample *)a)->ns;
+	uint64_t	y = ((const struct sample *)b)->ns;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			putchar('\\');
+		putchar(*str);
+	}
+	putchar('"');
+}
+
+/*
+ * The sample at rank (count - 1) * num / den of the ones for cmd, or
+ * every sample if cmd is -1.  samples must be sorted.
+ */
+static double percentile(int cmd, uint64_t count, uint64_t num, uint64_t den)
+{
+	uint64_t	rank = (count - 1) * num / den;
+	uint64_t	seen = 0;
+	size_t		i;
+
+	for (i = 0; i < sample_count; i++) {
+		if (cmd != -1 && samples[i].cmd != cmd)
+			continue;
+		if (seen++ == rank)
+			return samples[i].ns / 1000.0;
+	}
+	return 0;
+}
+
+static void print_results(const char *target, int connections, unsigned rate, double elapsed)
+{
+	uint64_t	errors = 0;
+	uint64_t	total = 0;
+	uint64_t	count;
+	size_t		i;
+	int			c;
+
+	for (c = 0; c < command_count; c++)
+		errors += commands[c].errors;
+	for (i = 0; i < sample_count; i++)
+		total += samples[i].ns;
+	qsort(samples, sample_count, sizeof(*samples), compare_sample);
+	printf("{\"target\":");
+	print_json_string(target);
+	printf(",\"connections\":%d,\"rate\":%u,\"seconds\":%.3f", connections, rate, elapsed);
+	printf(",\"replies\":%zu,\"errors\":%" PRIu64 ",\"disconnects\":%" PRIu64 ",\"timeouts\":%" PRIu64,
+	    sample_count, errors, disconnects, timeouts);
+	printf(",\"throughput\":%.1f", sample_count / elapsed);
+	if (sample_count) {
+		printf(",\"latency_us\":{\"min\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f,\"mean\":%.1f}",
+		    samples[0].ns / 1000.0, percentile(-1, sample_count, 50, 100),
+		    percentile(-1, sample_count, 99, 100), percentile(-1, sample_count, 999, 1000),
+		    samples[sample_count - 1].ns / 1000.0, total / 1000.0 / sample_count);
+	}
+	printf(",\"commands\":{");
+	for (c = 0; c < command_count; c++) {
+		count = 0;
+		for (i = 0; i < sample_count; i++) {
+			if (samples[i].cmd == c)
+				count++;
+		}
+		printf("%s", c ? "," : "");
+		print_json_string(commands[c].text);
+		printf(":{\"requests\":%" PRIu64 ",\"replies\":%" PRIu64 ",\"errors\":%" PRIu64,
+		    commands[c].requests, count, commands[c].errors);
+		if (count)
+			printf(",\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f", percentile(c, count, 50, 100),
+			    percentile(c, count, 99, 100), percentile(c, count, 999, 1000));
+		printf("}");
+	}
+	printf("}}\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char		*mix = default_mix;
+	const char		*target;
+	int				connections = 8;
+	unsigned		rate = 0;
+	double			duration = 10;
+	struct client	*clients;
+	struct pollfd	*pfds;
+	int				*pfd_client;
+	int				npfds;
+	int				live;
+	int				i;
+	int				timeout;
+	uint64_t		start;
+	uint64_t		end;
+	uint64_t		now;
+	uint64_t		next_due;
+	uint64_t		interval = 0;
+
+	while ((i = getopt(argc, argv, "c:r:d:m:")) != -1) {
+		switch (i) {
+			case 'c':
+				connections = atoi(optarg);
+				break;
+			case 'r':
+				rate = strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				duration = strtod(optarg, NULL);
+				break;
+			case 'm':
+				mix = optarg;
+				break;
+			default:
+				goto usage;
+		}
+	}
+	if (optind != argc - 1 || connections < 1 || duration <= 0)
+		goto usage;
+	target = argv[optind];
+	if (parse_mix(mix) == -1) {
+		fprintf(stderr, "Bad command mix %s\n", mix);
+		return EXIT_FAILURE;
+	}
+	clients = calloc(connections, sizeof(*clients));
+	pfds = calloc(connections, sizeof(*pfds));
+	pfd_client = calloc(connections, sizeof(*pfd_client));
+	if (clients == NULL || pfds == NULL || pfd_client == NULL)
+		return EXIT_FAILURE;
+	for (i = 0; i < connections; i++) {
+		clients[i].s = connect_target(target);
+		if (clients[i].s == -1) {
+			fprintf(stderr, "Unable to connect to %s\n", target);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (rate)
+		interval = 1000000000ULL / rate;
+	start = ns_ticks();
+	end = start + (uint64_t)(duration * 1000000000);
+	next_due = start;
+	for (;;) {
+		now = ns_ticks();
+		// Hand out whatever is due to idle connections
+		live = 0;
+		for (i = 0; i < connections; i++) {
+			if (clients[i].s == -1)
+				continue;
+			live++;
+			if (clients[i].busy) {
+				if (now - clients[i].due > REPLY_TIMEOUT) {
+					timeouts++;
+					fail_client(&clients[i]);
+				}
+				continue;
+			}
+			if (now >= end || (rate && next_due > now))
+				continue;
+			if (send_command(&clients[i], rate ? next_due : now) == -1) {
+				disconnects++;
+				fail_client(&clients[i]);
+				continue;
+			}
+			next_due += interval;
+		}
+		npfds = 0;
+		for (i = 0; i < connections; i++) {
+			if (clients[i].s == -1 || !clients[i].busy)
+				continue;
+			pfds[npfds].fd = clients[i].s;
+			pfds[npfds].events = POLLIN;
+			pfd_client[npfds] = i;
+			npfds++;
+		}
+		if (live == 0 || (npfds == 0 && now >= end))
+			break;
+		timeout = 100;
+		if (rate && next_due > now && next_due - now < 100000000)
+			timeout = (next_due - now) / 1000000;
+		if (poll(pfds, npfds, timeout) == -1 && errno != EINTR)
+			return EXIT_FAILURE;
+		now = ns_ticks();
+		for (i = 0; i < npfds; i++) {
+			if (pfds[i].revents == 0)
+				continue;
+			if (read_reply(&clients[pfd_client[i]], now) == -1) {
+				disconnects++;
+				fail_client(&clients[pfd_client[i]]);
+			}
+		}
+	}
+	now = ns_ticks();
+	print_results(target, connections, rate, (now - start) / 1e9);
+
+	for (i = 0; i < connections; i++) {
+		if (clients[i].s != -1)
+			close(clients[i].s);
+	}
+	for (i = 0; i < command_count; i++) {
+		free(commands[i].text);
+		free(commands[i].line);
+	}
+	free(samples);
+	free(pfd_client);
+	free(pfds);
+	free(clients);
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "Usage: %s [-c connections] [-r rate] [-d seconds] [-m mix] target\n\n"
+	    "mix is a comma separated list of command=weight, the default is\n%s\n", argv[0], default_mix);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,131 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Measures how many rigctld commands per second the command parser
+ * handles, using a file of client command lines (one per line, as a
+ * Hamlib client sends them).  Mode and VFO arguments are looked up the
+ * way the handlers do.
+ *
+ * Usage: bench-parse [capture file [seconds]]
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../rigctld/parse.h"
+
+static uint64_t ns_ticks(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	const char			*path = "bench/hamlib-capture.txt";
+	double				seconds = 2;
+	FILE				*f;
+	char				**lines = NULL;
+	size_t				line_count = 0;
+	char				in[1024];
+	char				work[1024];
+	char				*p;
+	struct parsed_cmd	cmd;
+	uint64_t			start, elapsed, deadline;
+	uint64_t			commands = 0, failed = 0, passes = 0;
+	unsigned			sink = 0;
+	size_t				i;
+	int					ret;
+
+	if (argc > 1)
+		path = argv[1];
+	if (argc > 2)
+		seconds = strtod(argv[2], NULL);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	while (fgets(in, sizeof(in), f)) {
+		p = strchr(in, '\n');
+		if (p)
+			*p = 0;
+		lines = realloc(lines, sizeof(*lines) * (line_count + 1));
+		if (lines == NULL || (lines[line_count] = strdup(in)) == NULL) {
+			perror("allocating lines");
+			return EXIT_FAILURE;
+		}
+		line_count++;
+	}
+	fclose(f);
+	if (line_count == 0) {
+		fprintf(stderr, "%s has no commands\n", path);
+		return EXIT_FAILURE;
+	}
+
+	start = ns_ticks();
+	deadline = start + (uint64_t)(seconds * 1000000000);
+	do {
+		for (i = 0; i < line_count; i++) {
+			// Parsing is destructive, the daemon parses its receive buffer
+			strcpy(work, lines[i]);
+			p = work;
+			while ((ret = parse_command(&p, &cmd)) == 1) {
+				commands++;
+				switch (cmd.cmd) {
+					case 'M':
+					case 'X':
+						sink += parse_mode(cmd.argv[0]);
+						break;
+					case 'V':
+						sink += parse_vfo(cmd.argv[0]);
+						break;
+					case 'S':
+						sink += parse_vfo(cmd.argv[1]);
+						break;
+				}
+			}
+			if (ret == -1)
+				failed++;
+		}
+		passes++;
+	} while (ns_ticks() < deadline);
+	elapsed = ns_ticks() - start;
+
+	printf("%zu lines, %"PRIu64" passes, %"PRIu64" commands (%"PRIu64" lines failed, sink %u)\n",
+	    line_count, passes, commands, failed, sink);
+	printf("%.0f commands/s, %.1f ns/command\n",
+	    commands / (elapsed / 1e9), (double)elapsed / commands);
+	for (i = 0; i < line_count; i++)
+		free(lines[i]);
+	free(lines);
+	return EXIT_SUCCESS;
+}
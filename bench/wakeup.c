@@ -0,0 +1,270 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Measures the cost of a single event loop wakeup with a number of idle
+ * connections registered, using both the select() loop the way
+ * or-rigctld used to build it and an edge-triggered epoll set.
+ *
+ * The idle connections are real loopback TCP connections whose other
+ * ends are held open by a child process.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef WITH_EPOLL
+#include <sys/epoll.h>
+#endif
+
+static uint64_t ns_ticks(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Opens count idle connections to ourselves and returns the accepted
+ * sockets in socks.  The connecting ends live in a child process whose
+ * pid is returned.
+ */
+static pid_t open_idle(int *socks, int count)
+{
+	struct sockaddr_in	sa = {};
+	socklen_t			salen = sizeof(sa);
+	int					l;
+	int					i;
+	int					s;
+	pid_t				pid;
+
+	l = socket(AF_INET, SOCK_STREAM, 0);
+	if (l == -1)
+		return -1;
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(l, (struct sockaddr *)&sa, sizeof(sa)) == -1 || listen(l, SOMAXCONN) == -1
+	    || getsockname(l, (struct sockaddr *)&sa, &salen) == -1) {
+		close(l);
+		return -1;
+	}
+	pid = fork();
+	if (pid == 0) {
+		close(l);
+		for (i = 0; i < count; i++) {
+			s = socket(AF_INET, SOCK_STREAM, 0);
+			if (s == -1 || connect(s, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+				_exit(1);
+		}
+		for (;;)
+			pause();
+	}
+	for (i = 0; i < count; i++) {
+		socks[i] = accept(l, NULL, NULL);
+		if (socks[i] == -1) {
+			kill(pid, SIGTERM);
+			waitpid(pid, NULL, 0);
+			pid = -1;
+			break;
+		}
+	}
+	close(l);
+	return pid;
+}
+
+/*
+ * One wakeup the way the select() loop does it... build the sets from
+ * scratch, wait, then check every connection.
+ */
+static int64_t bench_select(int *socks, int count, int active[2], int iterations)
+{
+	fd_set		rx_set;
+	fd_set		tx_set;
+	fd_set		err_set;
+	int			max_sock;
+	int			i;
+	int			j;
+	char		ch = 0;
+	uint64_t	start;
+
+	if (active[0] >= FD_SETSIZE)
+		return -1;
+	for (i = 0; i < count; i++) {
+		if (socks[i] >= FD_SETSIZE)
+			return -1;
+	}
+	start = ns_ticks();
+	for (i = 0; i < iterations; i++) {
+		if (write(active[1], &ch, 1) != 1)
+			return -1;
+		FD_ZERO(&rx_set);
+		FD_ZERO(&tx_set);
+		FD_ZERO(&err_set);
+		max_sock = active[0];
+		FD_SET(active[0], &rx_set);
+		FD_SET(active[0], &err_set);
+		for (j = 0; j < count; j++) {
+			FD_SET(socks[j], &rx_set);
+			FD_SET(socks[j], &err_set);
+			if (socks[j] > max_sock)
+				max_sock = socks[j];
+		}
+		if (select(max_sock + 1, &rx_set, &tx_set, &err_set, NULL) < 1)
+			return -1;
+		for (j = 0; j < count; j++) {
+			if (FD_ISSET(socks[j], &rx_set) || FD_ISSET(socks[j], &err_set))
+				return -1;
+		}
+		if (FD_ISSET(active[0], &rx_set)) {
+			if (read(active[0], &ch, 1) != 1)
+				return -1;
+		}
+	}
+	return (ns_ticks() - start) / iterations;
+}
+
+#ifdef WITH_EPOLL
+static int64_t bench_epoll(int *socks, int count, int active[2], int iterations)
+{
+	struct epoll_event	ev = {};
+	struct epoll_event	evs[64];
+	int					efd;
+	int					i;
+	int					j;
+	int					ret;
+	char				ch = 0;
+	uint64_t			start;
+	int64_t				result = -1;
+
+	efd = epoll_create1(0);
+	if (efd == -1)
+		return -1;
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	for (i = 0; i < count; i++) {
+		ev.data.fd = socks[i];
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, socks[i], &ev) == -1)
+			goto done;
+	}
+	ev.data.fd = active[0];
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, active[0], &ev) == -1)
+		goto done;
+	start = ns_ticks();
+	for (i = 0; i < iterations; i++) {
+		if (write(active[1], &ch, 1) != 1)
+			goto done;
+		ret = epoll_wait(efd, evs, sizeof(evs) / sizeof(evs[0]), -1);
+		if (ret < 1)
+			goto done;
+		for (j = 0; j < ret; j++) {
+			if (evs[j].data.fd != active[0])
+				goto done;
+			if (read(active[0], &ch, 1) != 1)
+				goto done;
+		}
+	}
+	result = (ns_ticks() - start) / iterations;
+done:
+	close(efd);
+	return result;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	static const int	counts[] = {10, 100, 1000};
+	struct rlimit		rl;
+	int					iterations = 100000;
+	int					active[2];
+	int					*socks;
+	int					i;
+	int					j;
+	int64_t				sel;
+	int64_t				epl = -1;
+	pid_t				pid;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+			iterations = atoi(argv[++i]);
+		else {
+			fprintf(stderr, "Usage: %s [-i iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (iterations < 1)
+		iterations = 1;
+
+	// We need a bit over a thousand descriptors in the child.
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, active) == -1) {
+		perror("socketpair");
+		return 1;
+	}
+
+	printf("%-12s %18s %18s\n", "connections", "select ns/wakeup", "epoll ns/wakeup");
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		socks = calloc(counts[i], sizeof(int));
+		if (socks == NULL)
+			return 1;
+		pid = open_idle(socks, counts[i]);
+		if (pid == -1) {
+			fprintf(stderr, "Unable to open %d idle connections\n", counts[i]);
+			return 1;
+		}
+		sel = bench_select(socks, counts[i], active, iterations);
+#ifdef WITH_EPOLL
+		epl = bench_epoll(socks, counts[i], active, iterations);
+#endif
+		printf("%-12d ", counts[i]);
+		if (sel < 0)
+			printf("%18s ", "n/a");
+		else
+			printf("%18" PRId64 " ", sel);
+		if (epl < 0)
+			printf("%18s\n", "n/a");
+		else
+			printf("%18" PRId64 "\n", epl);
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		for (j = 0; j < counts[i]; j++)
+			close(socks[j]);
+		free(socks);
+	}
+	return 0;
+}
@@ -32,140 +32,561 @@
 #include <stdio.h>
 
 #include <api.h>
+#include <atomics.h>
+#include <datetime.h>
 #include <iniparser.h>
+#include <log.h>
 
 #include "io.h"
 #include "serial/serial.h"
+#include "tcp/tcp.h"
 #ifdef WITH_TERMIOS
 #include "serial/io_termios.h"
+#include "io_engine.h"
 #endif
 
+// Pool buffers are kept aligned for struct io_response
+#define IO_POOL_STRIDE	((offsetof(struct io_response, msg) + IO_RX_LEN + 1 + 7) & ~(size_t)7)
+
+/*
+ * Returns a response with room for len bytes and a terminator.  It
+ * comes from the handle's pool unless they're all in use or len is more
+ * than IO_RX_LEN, so responses normally cost no allocations.  Release
+ * it with io_free_response().
+ */
+struct io_response *io_alloc_response(struct io_handle *hdl, size_t len)
+{
+	struct io_response	*ret = NULL;
+
+	if (len <= IO_RX_LEN) {
+		mutex_lock(&hdl->lock);
+		if (hdl->pool_avail)
+			ret = (struct io_response *)(hdl->pool + hdl->pool_free[--hdl->pool_avail] * IO_POOL_STRIDE);
+		mutex_unlock(&hdl->lock);
+		if (ret)
+			return ret;
+	}
+	return (struct io_response *)malloc(offsetof(struct io_response, msg) + len + 1);
+}
+
+/*
+ * Releases any response from this handle, including those passed to
+ * waiters.  Must not be called with the lock held.
+ */
+void io_free_response(struct io_handle *hdl, struct io_response *resp)
+{
+	char	*p = (char *)resp;
+
+	if (resp == NULL)
+		return;
+	if (hdl->pool && p >= hdl->pool && p < hdl->pool + IO_POOL_LEN * IO_POOL_STRIDE) {
+		mutex_lock(&hdl->lock);
+		hdl->pool_free[hdl->pool_avail++] = (p - hdl->pool) / IO_POOL_STRIDE;
+		mutex_unlock(&hdl->lock);
+		return;
+	}
+	free(resp);
+}
+
+/*
+ * Only called by the read thread or the io engine.  Returns false if the queue is full.
+ */
+static bool queue_push(struct io_handle *hdl, struct io_response *resp, unsigned waiter)
+{
+	unsigned			head = hdl->queue_head;
+	struct io_queued	*q;
+
+	if (head - atomic_load(&hdl->queue_tail) == IO_QUEUE_LEN)
+		return false;
+	q = &hdl->queue[head & (IO_QUEUE_LEN - 1)];
+	q->resp = resp;
+	q->received = us_ticks();
+	q->waiter = waiter;
+	atomic_store(&hdl->queue_head, head + 1);
+	semaphore_post(&hdl->queued);
+	return true;
+}
+
+/*
+ * Only called by the delivery thread.  Returns false if the queue is empty.
+ */
+static bool queue_pop(struct io_handle *hdl, struct io_queued *out)
+{
+	unsigned	tail = hdl->queue_tail;
+
+	if (tail == atomic_load(&hdl->queue_head))
+		return false;
+	*out = hdl->queue[tail & (IO_QUEUE_LEN - 1)];
+	atomic_store(&hdl->queue_tail, tail + 1);
+	return true;
+}
+
+static void queue_response(struct io_handle *hdl, struct io_response *resp, unsigned waiter)
+{
+	if (resp)
+		log_data(LOG_IO, LOG_LEVEL_TRACE, "RX", resp->msg, resp->len);
+	if (!queue_push(hdl, resp, waiter)) {
+		hdl->dropped++;
+		log_printf(LOG_IO, LOG_LEVEL_WARNING, "Response queue full, %" PRIu64 " dropped", hdl->dropped);
+		io_free_response(hdl, resp);
+	}
+}
+
+/*
+ * Reads responses and queues them for the delivery thread.  A read
+ * timeout is only queued if a waiter was already waiting when the read
+ * started, so it doesn't cut a later waiter short.
+ */
 static void read_thread(void *arg)
 {
 	struct io_handle	*hdl = (struct io_handle *)arg;
 	struct io_response	*resp;
-	bool				use_sem;
+	unsigned			waiter;
 
 	while(!hdl->terminate) {
 		mutex_lock(&hdl->lock);
-		use_sem = hdl->sync_pending;
+		waiter = hdl->waiters ? hdl->waiters->gen : 0;
 		mutex_unlock(&hdl->lock);
 		resp = hdl->read_cb(hdl->cbdata);
-		mutex_lock(&hdl->lock);
-		if (hdl->response)
-			free(hdl->response);
-		hdl->response = resp;
-		if (hdl->sync_pending) {
-			mutex_unlock(&hdl->lock);
+		if (resp == NULL && waiter == 0)
+			continue;
+		queue_response(hdl, resp, waiter);
+	}
+	log_thread_exit();
+}
+
+#ifdef WITH_TERMIOS
+size_t io_filter(struct io_handle *hdl, char *buf, size_t len)
+{
+	switch(hdl->type) {
+		case IO_H_TCP:
+			return tcp_filter(hdl->handle.tcp, buf, len);
+		default:
+			return len;
+	}
+}
+
+/*
+ * Frames whatever has arrived and queues each complete response, the
+ * io engine's equivalent of a read_cb.
+ */
+void io_input(struct io_handle *hdl, const char *buf, size_t len, uint64_t now)
+{
+	struct io_response	*resp;
+	size_t				flen;
+	size_t				used;
+	size_t				off = 0;
+
+	hdl->active_tick = now;
+	while (len) {
+		used = len;
+		if (used > IO_RX_LEN - hdl->rx_len)
+			used = IO_RX_LEN - hdl->rx_len;
+		memcpy(hdl->rx + hdl->rx_len, buf, used);
+		hdl->rx_len += used;
+		buf += used;
+		len -= used;
+		off = 0;
+		while (off < hdl->rx_len && (flen = hdl->frame_cb(hdl->cbdata, hdl->rx + off, hdl->rx_len - off)) > 0) {
+			resp = io_alloc_response(hdl, flen);
 			if (resp == NULL) {
-				if (use_sem) {
-					semaphore_post(&hdl->response_semaphore);
-					semaphore_wait(&hdl->ack_semaphore);
-				}
+				log_printf(LOG_IO, LOG_LEVEL_ERROR, "Unable to allocate %zu byte response", flen);
 			}
 			else {
-				semaphore_post(&hdl->response_semaphore);
-				semaphore_wait(&hdl->ack_semaphore);
+				resp->len = flen;
+				memcpy(resp->msg, hdl->rx + off, flen);
+				resp->msg[flen] = 0;
+				queue_response(hdl, resp, 0);
 			}
+			off += flen;
 		}
+		if (off) {
+			memmove(hdl->rx, hdl->rx + off, hdl->rx_len - off);
+			hdl->rx_len -= off;
+		}
+		else if (hdl->rx_len == IO_RX_LEN) {
+			log_data(LOG_IO, LOG_LEVEL_WARNING, "Discarding unframed", hdl->rx, hdl->rx_len);
+			hdl->rx_len = 0;
+		}
+	}
+}
+
+static uint64_t waiter_deadline(struct io_handle *hdl, struct io_waiter *w)
+{
+	uint64_t	start = w->since > hdl->active_tick ? w->since : hdl->active_tick;
+
+	return start + (uint64_t)hdl->response_timeout * 1000;
+}
+
+/*
+ * A waiter times out response_timeout after it was registered or the
+ * last data arrived, whichever is later, and only the oldest one is
+ * timing at any time, the same as a read_cb timing out one read.
+ */
+uint64_t io_expire(struct io_handle *hdl, uint64_t now)
+{
+	struct io_waiter	*w;
+	uint64_t			deadline;
+	uint64_t			ret = 0;
+	unsigned			gen = 0;
+
+	if (hdl->rx_len) {
+		deadline = hdl->active_tick + (uint64_t)hdl->char_timeout * 1000;
+		if (deadline > now)
+			ret = deadline;
 		else {
+			log_data(LOG_IO, LOG_LEVEL_DEBUG, "Discarding partial", hdl->rx, hdl->rx_len);
+			hdl->rx_len = 0;
+		}
+	}
+	mutex_lock(&hdl->lock);
+	for (w = hdl->waiters; w && w->timed_out; w = w->next)
+		;
+	if (w && waiter_deadline(hdl, w) <= now) {
+		w->timed_out = true;
+		gen = w->gen;
+		hdl->active_tick = now;
+		for (w = w->next; w && w->timed_out; w = w->next)
+			;
+	}
+	if (w) {
+		deadline = waiter_deadline(hdl, w);
+		if (ret == 0 || deadline < ret)
+			ret = deadline;
+	}
+	mutex_unlock(&hdl->lock);
+	if (gen)
+		queue_response(hdl, NULL, gen);
+	return ret;
+}
+#endif
+
+static bool response_matches(struct io_waiter *w, struct io_response *resp)
+{
+	if (w->len && resp->len != w->len)
+		return false;
+	if (w->matchlen+w->matchpos > resp->len)
+		return false;
+	if (w->match != NULL && strncmp(w->match+w->matchpos, resp->msg, w->matchlen) != 0)
+		return false;
+	return true;
+}
+
+/*
+ * Takes responses off the queue in order.  Each goes to the oldest
+ * waiter it matches (a timeout goes to the waiter that was oldest when
+ * the read started), the rest go to the async callback.  Since this is
+ * the only thread calling async_cb, no io locks are held when it's
+ * called.
+ */
+static void delivery_thread(void *arg)
+{
+	struct io_handle	*hdl = (struct io_handle *)arg;
+	struct io_queued	q;
+	struct io_waiter	**wp;
+	struct io_waiter	*w;
+
+	for (;;) {
+		semaphore_wait(&hdl->queued);
+		if (!queue_pop(hdl, &q)) {
+			if (hdl->terminate)
+				break;
+			continue;
+		}
+		mutex_lock(&hdl->lock);
+		for (wp = &hdl->waiters; *wp; wp = &(*wp)->next) {
+			if (q.resp == NULL ? (*wp)->gen == q.waiter : response_matches(*wp, q.resp))
+				break;
+		}
+		w = *wp;
+		if (w) {
+			*wp = w->next;
+			w->response = q.resp;
 			mutex_unlock(&hdl->lock);
-			hdl->async_cb(hdl->cbdata, resp);
+			semaphore_post(&w->semaphore);
+			continue;
 		}
+		mutex_unlock(&hdl->lock);
+		if (q.resp == NULL)
+			continue;
+		log_printf(LOG_IO, LOG_LEVEL_TRACE, "Async response queued for %" PRIu64 "us", us_ticks() - q.received);
+		hdl->async_cb(hdl->cbdata, q.resp);
+		io_free_response(hdl, q.resp);
 	}
-	return;
+	log_thread_exit();
 }
 
 /*
- * Reads responses from the rig until one starts with the first matchlen
- * bytes of match.
+ * Registers w to receive the next response that starts with the first
+ * matchlen bytes of match (from matchpos) and, if len isn't zero, is
+ * exactly len bytes long.  Call before sending the query, then collect
+ * the response with io_wait_response() or give up with io_cancel().
  * 
- * Returns the null-terminated malloc()ed string of retlen length
- * 
- * Non-matching strings are passed to the async callback
+ * Returns 0 on success or -1 on failure.
  */
-struct io_response *io_get_response(struct io_handle *hdl, const char *match, size_t matchlen, size_t matchpos)
+int io_expect(struct io_handle *hdl, struct io_waiter *w, const char *match, size_t matchlen, size_t matchpos, size_t len)
 {
-	struct io_response *resp = NULL;
-
-	if (match == NULL && matchlen > 0)
-		return NULL;
+	struct io_waiter	**wp;
+	bool				first;
 
-	if (mutex_lock(&hdl->sync_lock) != 0)
-		return NULL;
+	if (hdl == NULL || w == NULL || (match == NULL && matchlen > 0))
+		return -1;
+	w->next = NULL;
+	w->match = match;
+	w->matchlen = matchlen;
+	w->matchpos = matchpos;
+	w->len = len;
+	w->response = NULL;
+	w->timed_out = false;
+	if (semaphore_init(&w->semaphore, 0) != 0)
+		return -1;
 	if (mutex_lock(&hdl->lock) != 0) {
-		mutex_unlock(&hdl->sync_lock);
-		return NULL;
+		semaphore_destroy(&w->semaphore);
+		return -1;
 	}
-	hdl->sync_pending = true;
+	if (++hdl->waiter_gen == 0)
+		hdl->waiter_gen = 1;
+	w->gen = hdl->waiter_gen;
+	w->since = us_ticks();
+	first = true;
+	for (wp = &hdl->waiters; *wp; wp = &(*wp)->next) {
+		if (!(*wp)->timed_out)
+			first = false;
+	}
+	*wp = w;
 	mutex_unlock(&hdl->lock);
+#ifdef WITH_TERMIOS
+	// The engine may not be timing anything
+	if (first && hdl->fd != -1)
+		io_engine_wake();
+#endif
+	return 0;
+}
 
-	/*
-	 * This loop must be exiting with only sync_lock held and AFTER
-	 * response_semaphore has been waited on.  If semaphore_wait() fails, we're
-	 * going to have a bad time.
-	 */
-	for(;;) {
-		// Failure is not an option...
-		semaphore_wait(&hdl->response_semaphore);
-		if (mutex_lock(&hdl->lock) != 0)
+/*
+ * Returns the response for w, or NULL on a read timeout.  Release it
+ * with io_free_response().
+ */
+struct io_response *io_wait_response(struct io_handle *hdl, struct io_waiter *w)
+{
+	// Failure is not an option...
+	semaphore_wait(&w->semaphore);
+	semaphore_destroy(&w->semaphore);
+	return w->response;
+}
+
+/*
+ * Gives up on w, for when the query couldn't be sent or an earlier
+ * response in a batch timed out.
+ */
+void io_cancel(struct io_handle *hdl, struct io_waiter *w)
+{
+	struct io_waiter	**wp;
+
+	mutex_lock(&hdl->lock);
+	for (wp = &hdl->waiters; *wp; wp = &(*wp)->next) {
+		if (*wp == w)
 			break;
-		resp = hdl->response;
-		hdl->response = NULL;
+	}
+	if (*wp) {
+		*wp = w->next;
 		mutex_unlock(&hdl->lock);
-		if (resp==NULL)
-			break;
-		if (matchlen+matchpos > resp->len || (match != NULL && strncmp(match+matchpos, resp->msg, matchlen) != 0)) {
-			hdl->async_cb(hdl->cbdata, resp);
-			free(resp);
-			resp = NULL;
-			semaphore_post(&hdl->ack_semaphore);
-		}
-		else
-			break;
 	}
-	
-	/* 
-	 * Failure here is also bad, but we're saved by the ack semaphore.
-	 */
+	else {
+		// Already answered, the post may not have happened yet
+		mutex_unlock(&hdl->lock);
+		semaphore_wait(&w->semaphore);
+		io_free_response(hdl, w->response);
+	}
+	semaphore_destroy(&w->semaphore);
+}
+
+/*
+ * Waits for a response that starts with the first matchlen bytes of
+ * match (from matchpos).  Since this is called after the query is sent,
+ * a quick enough response may already have gone to the async callback,
+ * io_expect() before sending doesn't have that problem.
+ * 
+ * Returns the response, or NULL on a read timeout.
+ * 
+ * Non-matching responses are passed to the async callback by the
+ * delivery thread.
+ */
+struct io_response *io_get_response(struct io_handle *hdl, const char *match, size_t matchlen, size_t matchpos)
+{
+	struct io_waiter	w;
+
+	if (io_expect(hdl, &w, match, matchlen, matchpos, 0) != 0)
+		return NULL;
+	return io_wait_response(hdl, &w);
+}
+
+/*
+ * Sets how long the io engine waits for a response and for the rest of
+ * a partial one.  A handle using a read_cb does its own timing.
+ */
+void io_set_timeouts(struct io_handle *hdl, unsigned response_timeout, unsigned char_timeout)
+{
+	if (hdl == NULL)
+		return;
 	mutex_lock(&hdl->lock);
-	hdl->sync_pending = false;
-	semaphore_post(&hdl->ack_semaphore);
+	hdl->response_timeout = response_timeout;
+	hdl->char_timeout = char_timeout;
 	mutex_unlock(&hdl->lock);
-	mutex_unlock(&hdl->sync_lock);
-	return resp;
+#ifdef WITH_TERMIOS
+	if (hdl->fd != -1)
+		io_engine_wake();
+#endif
 }
 
-struct io_handle *io_start(enum io_handle_type htype, void *handle, io_read_callback rcb, io_async_callback acb, void *cbdata)
+/*
+ * If fcb isn't NULL and the port can be polled, the handle is read by
+ * the io engine and rcb is not used.  Otherwise it gets a read thread
+ * that calls rcb.
+ */
+struct io_handle *io_start(enum io_handle_type htype, void *handle, io_read_callback rcb, io_frame_callback fcb, io_async_callback acb, void *cbdata)
 {
 	struct io_handle *ret = (struct io_handle *)calloc(1, sizeof(struct io_handle));
 
 	ret->type = htype;
+	ret->fd = -1;
 	switch(htype) {
 		case IO_H_SERIAL:
 			ret->handle.serial = (struct io_serial_handle *)handle;
 			ret->read_cb = rcb;
+			ret->frame_cb = fcb;
+			ret->async_cb = acb;
+			ret->cbdata = cbdata;
+			if (fcb)
+				ret->fd = serial_fd(ret->handle.serial);
+			break;
+		case IO_H_TCP:
+			ret->handle.tcp = (struct io_tcp_handle *)handle;
+			ret->read_cb = rcb;
+			ret->frame_cb = fcb;
 			ret->async_cb = acb;
 			ret->cbdata = cbdata;
+			if (fcb)
+				ret->fd = tcp_fd(ret->handle.tcp);
 			break;
 		default:
 			free(ret);
 			return NULL;
 	}
+	ret->response_timeout = 1000;
+	ret->char_timeout = 50;
+	ret->pool = (char *)malloc(IO_POOL_LEN * IO_POOL_STRIDE);
+	if (ret->pool) {
+		for (; ret->pool_avail < IO_POOL_LEN; ret->pool_avail++)
+			ret->pool_free[ret->pool_avail] = ret->pool_avail;
+	}
 
-	mutex_init(&ret->sync_lock);
 	mutex_init(&ret->lock);
-	semaphore_init(&ret->response_semaphore, 0);
-	semaphore_init(&ret->ack_semaphore, 0);
+	semaphore_init(&ret->queued, 0);
+	create_thread(delivery_thread, ret, &ret->delivery_thread);
+#ifdef WITH_TERMIOS
+	if (ret->fd != -1 && io_engine_add(ret) == 0)
+		return ret;
+#endif
+	ret->fd = -1;
+	if (rcb == NULL) {
+		log_printf(LOG_IO, LOG_LEVEL_ERROR, "No read callback for an unpollable port");
+		ret->terminate = true;
+		semaphore_post(&ret->queued);
+		wait_thread(ret->delivery_thread);
+		mutex_destroy(&ret->lock);
+		semaphore_destroy(&ret->queued);
+		free(ret->pool);
+		free(ret);
+		return NULL;
+	}
 	create_thread(read_thread, ret, &ret->read_thread);
 	return ret;
 }
 
-struct io_handle *io_start_from_dictionary(dictionary *d, const char *section, enum io_handle_type htype, io_read_callback rcb, io_async_callback acb, void *cbdata)
+/*
+ * Reads the line settings used by a serial port, or sent to the far
+ * end of a tcp one.
+ */
+static int line_from_dictionary(dictionary *d, const char *section, unsigned *speed,
+		enum serial_data_word_length *wlen, enum serial_stop_bits *sbits,
+		enum serial_parity *parity, enum serial_flow *flow)
+{
+	char	*value;
+	int		i;
+
+	*speed = getint(d, section, "speed", 9600);
+	i = getint(d, section, "databits", 8);
+	switch (i) {
+		case 8:
+			*wlen = SERIAL_DWL_8;
+			break;
+		case 7:
+			*wlen = SERIAL_DWL_7;
+			break;
+		case 6:
+			*wlen = SERIAL_DWL_6;
+			break;
+		case 5:
+			*wlen = SERIAL_DWL_5;
+			break;
+		default:
+			return -1;
+	}
+	i = getint(d, section, "stopbits", 8);
+	switch (i) {
+		case 1:
+			*sbits = SERIAL_SB_1;
+			break;
+		case 2:
+			*sbits = SERIAL_SB_2;
+			break;
+		default:
+			return -1;
+	}
+	value = getstring(d, section, "parity", "N");
+	switch (toupper(value[0])) {
+		case 'N':
+			*parity = SERIAL_P_NONE;
+			break;
+		case 'O':
+			*parity = SERIAL_P_ODD;
+			break;
+		case 'E':
+			*parity = SERIAL_P_EVEN;
+			break;
+		case 'H':
+			*parity = SERIAL_P_HIGH;
+			break;
+		case 'L':
+			*parity = SERIAL_P_LOW;
+			break;
+		default:
+			return -1;
+	}
+	value = getstring(d, section, "flow", "N");
+	switch (toupper(value[0])) {
+		case 'N':
+			*flow = SERIAL_F_NONE;
+			break;
+		case 'C':
+			*flow = SERIAL_F_CTS;
+			break;
+		default:
+			return -1;
+	}
+	return 0;
+}
+
+struct io_handle *io_start_from_dictionary(dictionary *d, const char *section, enum io_handle_type htype, io_read_callback rcb, io_frame_callback fcb, io_async_callback acb, void *cbdata)
 {
-	struct io_handle 		*ret;
-	char					*value;
-	int						i;
+	struct io_handle 				*ret;
+	char							*value;
+	unsigned						speed;
+	enum serial_data_word_length	wlen;
+	enum serial_stop_bits			sbits;
+	enum serial_parity				parity;
+	enum serial_flow				flow;
 
 	if (section == NULL)
 		return NULL;
@@ -176,90 +597,28 @@ struct io_handle *io_start_from_dictionary(dictionary *d, const char *section, e
 			return NULL;
 		if (strcmp(value, "serial")==0)
 			htype = IO_H_SERIAL;
+		else if (strcmp(value, "tcp")==0)
+			htype = IO_H_TCP;
 	}
 
 	if (htype < IO_H_FIRST || htype > IO_H_LAST || htype == IO_H_UNKNOWN)
 		return NULL;
+	if (line_from_dictionary(d, section, &speed, &wlen, &sbits, &parity, &flow) != 0)
+		return NULL;
 	
 	switch (htype) {
 		case IO_H_SERIAL: {
 			struct io_serial_handle			*serial;
 			char							*port;
-			int								speed;
-			enum serial_data_word_length	wlen;
-			enum serial_stop_bits			sbits;
-			enum serial_parity				parity;
-			enum serial_flow				flow;
 
 			port = getstring(d, section, "port", NULL);
 			if (port == NULL)
 				return NULL;
 
-			speed = getint(d, section, "speed", 9600);
-			i = getint(d, section, "databits", 8);
-			switch (i) {
-				case 8:
-					wlen = SERIAL_DWL_8;
-					break;
-				case 7:
-					wlen = SERIAL_DWL_7;
-					break;
-				case 6:
-					wlen = SERIAL_DWL_6;
-					break;
-				case 5:
-					wlen = SERIAL_DWL_5;
-					break;
-				default:
-					return NULL;
-			}
-			i = getint(d, section, "stopbits", 8);
-			switch (i) {
-				case 1:
-					sbits = SERIAL_SB_1;
-					break;
-				case 2:
-					sbits = SERIAL_SB_2;
-					break;
-				default:
-					return NULL;
-			}
-			value = getstring(d, section, "parity", "N");
-			switch (toupper(value[0])) {
-				case 'N':
-					parity = SERIAL_P_NONE;
-					break;
-				case 'O':
-					parity = SERIAL_P_ODD;
-					break;
-				case 'E':
-					parity = SERIAL_P_EVEN;
-					break;
-				case 'H':
-					parity = SERIAL_P_HIGH;
-					break;
-				case 'L':
-					parity = SERIAL_P_LOW;
-					break;
-				default:
-					return NULL;
-			}
-			value = getstring(d, section, "flow", "N");
-			switch (toupper(value[0])) {
-				case 'N':
-					flow = SERIAL_F_NONE;
-					break;
-				case 'C':
-					flow = SERIAL_F_CTS;
-					break;
-				default:
-					return NULL;
-			}
-
 			serial = serial_open(SERIAL_H_UNSPECIFIED, port, speed, wlen, sbits, parity, flow, SERIAL_BREAK_DISABLED);
 			if (serial == NULL)
 				return NULL;
-			ret = io_start(htype, serial, rcb, acb, cbdata);
+			ret = io_start(htype, serial, rcb, fcb, acb, cbdata);
 			if (ret == NULL) {
 				serial_close(serial);
 				free(serial);
@@ -267,6 +626,27 @@ struct io_handle *io_start_from_dictionary(dictionary *d, const char *section, e
 			}
 			return ret;
 		}
+		case IO_H_TCP: {
+			struct io_tcp_handle			*tcp;
+			char							*host;
+			char							*port;
+
+			host = getstring(d, section, "host", NULL);
+			port = getstring(d, section, "port", NULL);
+			if (host == NULL || port == NULL)
+				return NULL;
+
+			tcp = tcp_open(host, port, getint(d, section, "rfc2217", 0) != 0, speed, wlen, sbits, parity, flow);
+			if (tcp == NULL)
+				return NULL;
+			ret = io_start(htype, tcp, rcb, fcb, acb, cbdata);
+			if (ret == NULL) {
+				tcp_close(tcp);
+				free(tcp);
+				return NULL;
+			}
+			return ret;
+		}
 		default:
 			return NULL;
 	}
@@ -280,18 +660,29 @@ int io_end(struct io_handle *hdl)
 		return EINVAL;
 
 	hdl->terminate = true;
+#ifdef WITH_TERMIOS
+	if (hdl->fd != -1)
+		io_engine_remove(hdl);
+	else
+		wait_thread(hdl->read_thread);
+#else
 	wait_thread(hdl->read_thread);
-	mutex_destroy(&hdl->sync_lock);
+#endif
+	// The delivery thread finishes what's queued, then exits
+	semaphore_post(&hdl->queued);
+	wait_thread(hdl->delivery_thread);
 	mutex_destroy(&hdl->lock);
-	semaphore_destroy(&hdl->response_semaphore);
-	semaphore_destroy(&hdl->ack_semaphore);
-	if (hdl->response)
-		free(hdl->response);
+	semaphore_destroy(&hdl->queued);
+	free(hdl->pool);
 	switch(hdl->type) {
 		case IO_H_SERIAL:
 			serial_close(hdl->handle.serial);
 			free(hdl->handle.serial);
 			break;
+		case IO_H_TCP:
+			tcp_close(hdl->handle.tcp);
+			free(hdl->handle.tcp);
+			break;
 		default:
 			retval = EINVAL;
 			break;
@@ -309,6 +700,8 @@ int io_wait_write(struct io_handle *hdl, unsigned timeout)
 	switch(hdl->type) {
 		case IO_H_SERIAL:
 			return serial_wait_write(hdl->handle.serial, timeout);
+		case IO_H_TCP:
+			return tcp_wait_write(hdl->handle.tcp, timeout);
 		default:
 			return EINVAL;
 	}
@@ -321,12 +714,20 @@ int io_write(struct io_handle *hdl, const void *buf, size_t nbytes, unsigned tim
 	if (hdl == NULL || buf == NULL || nbytes == 0)
 		return -1;
 
+	log_data(LOG_IO, LOG_LEVEL_TRACE, "TX", buf, nbytes);
 	switch(hdl->type) {
 		case IO_H_SERIAL:
 			ret = serial_write(hdl->handle.serial, buf, nbytes, timeout);
+			if (ret < 0)
+				log_printf(LOG_IO, LOG_LEVEL_ERROR, "Serial write of %u bytes failed", (unsigned)nbytes);
 			if (ret)
 				return ret;
 			return serial_drain(hdl->handle.serial);
+		case IO_H_TCP:
+			ret = tcp_write(hdl->handle.tcp, buf, nbytes, timeout);
+			if (ret < 0)
+				log_printf(LOG_IO, LOG_LEVEL_ERROR, "TCP write of %u bytes failed", (unsigned)nbytes);
+			return ret;
 		default:
 			return -1;
 	}
@@ -340,6 +741,8 @@ int io_wait_read(struct io_handle *hdl, unsigned timeout)
 	switch(hdl->type) {
 		case IO_H_SERIAL:
 			return serial_wait_read(hdl->handle.serial, timeout);
+		case IO_H_TCP:
+			return tcp_wait_read(hdl->handle.tcp, timeout);
 		default:
 			return EINVAL;
 	}
@@ -353,6 +756,8 @@ int io_read(struct io_handle *hdl, void *buf, size_t nbytes, unsigned timeout)
 	switch(hdl->type) {
 		case IO_H_SERIAL:
 			return serial_read(hdl->handle.serial, buf, nbytes, timeout);
+		case IO_H_TCP:
+			return tcp_read(hdl->handle.tcp, buf, nbytes, timeout);
 		default:
 			return -1;
 	}
@@ -366,6 +771,8 @@ int io_pending(struct io_handle *hdl)
 	switch(hdl->type) {
 		case IO_H_SERIAL:
 			return serial_pending(hdl->handle.serial);
+		case IO_H_TCP:
+			return tcp_pending(hdl->handle.tcp);
 		default:
 			return -1;
 	}
@@ -28,6 +28,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include <iniparser.h>
 #include <threads.h>
@@ -38,7 +39,8 @@ enum io_handle_type {
 	IO_H_FIRST,
 	IO_H_UNKNOWN = IO_H_FIRST,
 	IO_H_SERIAL,
-	IO_H_LAST = IO_H_SERIAL
+	IO_H_TCP,
+	IO_H_LAST = IO_H_TCP
 };
 
 struct io_response {
@@ -49,30 +51,93 @@ struct io_response {
 typedef struct io_response *(*io_read_callback)(void *);
 typedef void (*io_async_callback)(void *, struct io_response *);
 
+/*
+ * Returns the length of the response at the start of buf, or 0 if it
+ * isn't complete yet.  Called by the io engine thread as data arrives,
+ * so it must not block.  A handle with one is read by the io engine
+ * rather than its own read thread when the port can be polled.
+ */
+typedef size_t (*io_frame_callback)(void *, const char *buf, size_t len);
+
+#define IO_RX_LEN		256		// Longest response the io engine can frame
+#define IO_POOL_LEN		16		// Responses of up to IO_RX_LEN kept by each handle
+
+/*
+ * Responses read by the read thread wait here for the delivery thread,
+ * so reading never waits on whoever consumes them.
+ */
+#define IO_QUEUE_LEN	64		// Must be a power of two
+
+struct io_queued {
+	struct io_response	*resp;		// NULL for a read timeout a waiter should see
+	uint64_t			received;	// us_ticks() when it was read
+	unsigned			waiter;		// gen of the oldest waiter when the read started
+};
+
+/*
+ * A query waiting for its response.  Register it with io_expect()
+ * before sending the query so several can be outstanding at once.
+ * Each response goes to the oldest waiter it matches, so responses are
+ * handed out in the order the queries were sent.  Usually lives on the
+ * caller's stack.
+ */
+struct io_waiter {
+	struct io_waiter	*next;
+	const char			*match;		// Response must have matchlen bytes of match at matchpos
+	size_t				matchlen;
+	size_t				matchpos;
+	size_t				len;		// If non-zero, response must be exactly this long
+	unsigned			gen;
+	uint64_t			since;		// us_ticks() when registered
+	bool				timed_out;	// The io engine has queued its timeout
+	struct io_response	*response;	// Set before semaphore is posted
+	semaphore_t			semaphore;
+};
+
 struct io_handle {
 	enum io_handle_type	type;
 	void				*cbdata;
 	io_read_callback	read_cb;
+	io_frame_callback	frame_cb;
 	io_async_callback	async_cb;
 	union {
 		struct io_serial_handle	*serial;
+		struct io_tcp_handle	*tcp;
 	} handle;
-	bool				terminate;			// Terminate the read thread
-	semaphore_t			response_semaphore;	// Posted when a message is received and sync_pending is true
-	semaphore_t			ack_semaphore;		// Posted when the thing which waited on response_semaphore
-													// has used the response (ie: read next)
-	mutex_t				sync_lock;			// Held by something waiting for a specific response
-	mutex_t				lock;				// Held when reading/writing shared data
-	thread_t			read_thread;		// The read thread
-	bool				sync_pending;		// True if there is a thread waiting on response_semaphore
-	struct io_response	*response;			// Set before response_semaphore is posted.
-	size_t				response_len;
+	bool				terminate;			// Terminate the read and delivery threads
+	mutex_t				lock;				// Held when reading/writing waiters and timeouts
+	thread_t			read_thread;		// The read thread, if the io engine isn't reading
+	int					fd;					// Polled by the io engine, -1 if there's a read thread
+	bool				polled;				// fd hasn't hung up
+	struct io_handle	*engine_next;		// Protected by the io engine lock
+	char				rx[IO_RX_LEN];		// Partial response, io engine only
+	size_t				rx_len;
+	uint64_t			active_tick;		// us_ticks() when data last arrived or a wait timed out
+	unsigned			response_timeout;	// ms to wait for a response
+	unsigned			char_timeout;		// ms to wait for the rest of one
+	thread_t			delivery_thread;	// Runs async_cb and hands responses to waiters
+	struct io_waiter	*waiters;			// Oldest first
+	unsigned			waiter_gen;			// Incremented for each waiter, never zero
+	struct io_queued	queue[IO_QUEUE_LEN];
+	unsigned			queue_head;			// Only written by the read thread
+	unsigned			queue_tail;			// Only written by the delivery thread
+	semaphore_t			queued;				// Posted for each response queued
+	uint64_t			dropped;			// Responses lost to a full queue
+	char				*pool;				// IO_POOL_LEN response buffers
+	unsigned char		pool_free[IO_POOL_LEN];	// Free buffers, protected by lock
+	unsigned			pool_avail;
 };
 
-struct io_handle *io_start(enum io_handle_type htype, void *handle, io_read_callback rcb, io_async_callback acb, void *cbdata);
-struct io_handle *io_start_from_dictionary(dictionary *d, const char *section, enum io_handle_type htype, io_read_callback rcb, io_async_callback acb, void *cbdata);
+struct io_handle *io_start(enum io_handle_type htype, void *handle, io_read_callback rcb, io_frame_callback fcb, io_async_callback acb, void *cbdata);
+struct io_handle *io_start_from_dictionary(dictionary *d, const char *section, enum io_handle_type htype, io_read_callback rcb, io_frame_callback fcb, io_async_callback acb, void *cbdata);
 int io_end(struct io_handle *hdl);
+void io_set_timeouts(struct io_handle *hdl, unsigned response_timeout, unsigned char_timeout);
 struct io_response *io_get_response(struct io_handle *hdl, const char *match, size_t matchlen, size_t matchpos);
+int io_expect(struct io_handle *hdl, struct io_waiter *w, const char *match, size_t matchlen, size_t matchpos, size_t len);
+struct io_response *io_wait_response(struct io_handle *hdl, struct io_waiter *w);
+void io_cancel(struct io_handle *hdl, struct io_waiter *w);
+struct io_response *io_alloc_response(struct io_handle *hdl, size_t len);
+void io_free_response(struct io_handle *hdl, struct io_response *resp);
 int io_wait_write(struct io_handle *hdl, unsigned timeout);
 int io_write(struct io_handle *hdl, const void *buf, size_t nbytes, unsigned timeout);
 int io_wait_read(struct io_handle *hdl, unsigned timeout);
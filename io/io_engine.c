@@ -0,0 +1,323 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef WITH_EPOLL
+#include <sys/epoll.h>
+#else
+#include <sys/select.h>
+#endif
+#ifdef WITH_EVENTFD
+#include <sys/eventfd.h>
+#else
+#include <fcntl.h>
+#endif
+
+#include <datetime.h>
+#include <log.h>
+#include <mutexes.h>
+#include <threads.h>
+
+#include "io_engine.h"
+
+#define IO_ENGINE_EVENTS	32
+
+static struct {
+	bool				inited;		// lock is usable
+	mutex_t				lock;		// Held by the thread except while it waits
+	bool				running;
+	bool				stop;
+	thread_t			thread;
+	struct io_handle	*handles;
+	int					wake_fd[2];	// eventfd (both the same) or a pipe
+#ifdef WITH_EPOLL
+	int					epoll_fd;
+#endif
+} engine;
+
+void io_engine_wake(void)
+{
+	uint64_t	one = 1;
+
+#ifdef WITH_EVENTFD
+	write(engine.wake_fd[1], &one, sizeof(one));
+#else
+	write(engine.wake_fd[1], &one, 1);
+#endif
+}
+
+static void drain_wake(void)
+{
+	uint64_t	buf[8];
+
+	while (read(engine.wake_fd[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+#ifdef WITH_EPOLL
+static bool engine_has(struct io_handle *hdl)
+{
+	struct io_handle	*h;
+
+	for (h = engine.handles; h; h = h->engine_next) {
+		if (h == hdl)
+			return true;
+	}
+	return false;
+}
+#endif
+
+/*
+ * Stops polling a port that has gone away.  Its waiters still time out.
+ */
+static void engine_unwatch(struct io_handle *hdl)
+{
+	hdl->polled = false;
+#ifdef WITH_EPOLL
+	epoll_ctl(engine.epoll_fd, EPOLL_CTL_DEL, hdl->fd, NULL);
+#endif
+}
+
+static void engine_read(struct io_handle *hdl)
+{
+	char	buf[IO_RX_LEN];
+	ssize_t	rd;
+	size_t	len;
+
+	for (;;) {
+		rd = read(hdl->fd, buf, sizeof(buf));
+		if (rd > 0) {
+			len = io_filter(hdl, buf, rd);
+			if (len)
+				io_input(hdl, buf, len, us_ticks());
+			if (rd < sizeof(buf))
+				return;
+			continue;
+		}
+		if (rd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+		log_printf(LOG_IO, LOG_LEVEL_ERROR, "Port on fd %d has gone away", hdl->fd);
+		engine_unwatch(hdl);
+		return;
+	}
+}
+
+static void engine_thread(void *arg)
+{
+	struct io_handle	*hdl;
+	uint64_t			now;
+	uint64_t			next;
+	uint64_t			deadline;
+	int					timeout;
+	int					ret;
+#ifdef WITH_EPOLL
+	struct epoll_event	evs[IO_ENGINE_EVENTS];
+	int					i;
+#else
+	fd_set				rx_set;
+	struct timeval		tv;
+	int					max_fd;
+#endif
+
+	mutex_lock(&engine.lock);
+	while (!engine.stop) {
+		now = us_ticks();
+		next = 0;
+		for (hdl = engine.handles; hdl; hdl = hdl->engine_next) {
+			deadline = io_expire(hdl, now);
+			if (deadline && (next == 0 || deadline < next))
+				next = deadline;
+		}
+		// Rounded up so a timeout is never checked just before it's due
+		timeout = next ? (int)((next - now + 999) / 1000) : -1;
+#ifdef WITH_EPOLL
+		mutex_unlock(&engine.lock);
+		ret = epoll_wait(engine.epoll_fd, evs, IO_ENGINE_EVENTS, timeout);
+		mutex_lock(&engine.lock);
+		for (i = 0; i < ret; i++) {
+			hdl = (struct io_handle *)evs[i].data.ptr;
+			if (hdl == NULL)
+				drain_wake();
+			// It may have been removed while we waited
+			else if (engine_has(hdl) && hdl->polled)
+				engine_read(hdl);
+		}
+#else
+		/* select() rebuilds its set every time through the loop */
+		FD_ZERO(&rx_set);
+		FD_SET(engine.wake_fd[0], &rx_set);
+		max_fd = engine.wake_fd[0];
+		for (hdl = engine.handles; hdl; hdl = hdl->engine_next) {
+			if (!hdl->polled)
+				continue;
+			FD_SET(hdl->fd, &rx_set);
+			if (hdl->fd > max_fd)
+				max_fd = hdl->fd;
+		}
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		mutex_unlock(&engine.lock);
+		ret = select(max_fd + 1, &rx_set, NULL, NULL, timeout == -1 ? NULL : &tv);
+		mutex_lock(&engine.lock);
+		if (ret > 0) {
+			if (FD_ISSET(engine.wake_fd[0], &rx_set))
+				drain_wake();
+			for (hdl = engine.handles; hdl; hdl = hdl->engine_next) {
+				if (hdl->polled && FD_ISSET(hdl->fd, &rx_set))
+					engine_read(hdl);
+			}
+		}
+#endif
+	}
+	mutex_unlock(&engine.lock);
+	log_thread_exit();
+}
+
+/*
+ * Called with the lock held
+ */
+static int engine_start(void)
+{
+#ifdef WITH_EPOLL
+	struct epoll_event	ev = {};
+#endif
+
+#ifdef WITH_EVENTFD
+	engine.wake_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (engine.wake_fd[0] == -1)
+		return -1;
+	engine.wake_fd[1] = engine.wake_fd[0];
+#else
+	if (pipe(engine.wake_fd) == -1)
+		return -1;
+	fcntl(engine.wake_fd[0], F_SETFL, fcntl(engine.wake_fd[0], F_GETFL) | O_NONBLOCK);
+	fcntl(engine.wake_fd[1], F_SETFL, fcntl(engine.wake_fd[1], F_GETFL) | O_NONBLOCK);
+#endif
+#ifdef WITH_EPOLL
+	engine.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (engine.epoll_fd == -1)
+		goto fail_wake;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(engine.epoll_fd, EPOLL_CTL_ADD, engine.wake_fd[0], &ev) == -1)
+		goto fail_epoll;
+#endif
+	engine.stop = false;
+	if (create_thread(engine_thread, NULL, &engine.thread) != 0)
+		goto fail_epoll;
+	engine.running = true;
+	return 0;
+
+fail_epoll:
+#ifdef WITH_EPOLL
+	close(engine.epoll_fd);
+fail_wake:
+#endif
+	close(engine.wake_fd[0]);
+	if (engine.wake_fd[1] != engine.wake_fd[0])
+		close(engine.wake_fd[1]);
+	return -1;
+}
+
+static void engine_end(void)
+{
+	wait_thread(engine.thread);
+#ifdef WITH_EPOLL
+	close(engine.epoll_fd);
+#endif
+	close(engine.wake_fd[0]);
+	if (engine.wake_fd[1] != engine.wake_fd[0])
+		close(engine.wake_fd[1]);
+	engine.running = false;
+}
+
+int io_engine_add(struct io_handle *hdl)
+{
+#ifdef WITH_EPOLL
+	struct epoll_event	ev = {};
+#endif
+
+	if (!engine.inited) {
+		if (mutex_init(&engine.lock) != 0)
+			return -1;
+		engine.inited = true;
+	}
+	mutex_lock(&engine.lock);
+	if (!engine.running && engine_start() != 0) {
+		mutex_unlock(&engine.lock);
+		return -1;
+	}
+#ifdef WITH_EPOLL
+	ev.events = EPOLLIN;
+	ev.data.ptr = hdl;
+	if (epoll_ctl(engine.epoll_fd, EPOLL_CTL_ADD, hdl->fd, &ev) == -1) {
+		if (engine.handles == NULL) {
+			engine.stop = true;
+			mutex_unlock(&engine.lock);
+			io_engine_wake();
+			engine_end();
+			return -1;
+		}
+		mutex_unlock(&engine.lock);
+		return -1;
+	}
+#endif
+	hdl->polled = true;
+	hdl->engine_next = engine.handles;
+	engine.handles = hdl;
+	mutex_unlock(&engine.lock);
+	io_engine_wake();
+	return 0;
+}
+
+/*
+ * Once this returns the engine won't touch hdl again.  Removing the
+ * last handle stops the engine.
+ */
+void io_engine_remove(struct io_handle *hdl)
+{
+	struct io_handle	**hp;
+	bool				last;
+
+	mutex_lock(&engine.lock);
+	for (hp = &engine.handles; *hp; hp = &(*hp)->engine_next) {
+		if (*hp == hdl) {
+			*hp = hdl->engine_next;
+			break;
+		}
+	}
+	if (hdl->polled)
+		engine_unwatch(hdl);
+	last = engine.handles == NULL;
+	if (last)
+		engine.stop = true;
+	mutex_unlock(&engine.lock);
+	io_engine_wake();
+	if (last)
+		engine_end();
+}
@@ -0,0 +1,71 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+/*
+ * A single thread that reads every io handle with a pollable port and a
+ * frame callback, so an idle rig costs no thread and no wakeups.  io.c
+ * does the framing and timeouts for it through io_input() and
+ * io_expire().
+ *
+ * io_start() and io_end() add and remove handles and must not race
+ * each other, the first one creates the engine.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io.h"
+
+int io_engine_add(struct io_handle *hdl);
+void io_engine_remove(struct io_handle *hdl);
+
+/*
+ * Makes the engine look at timeouts again, for when a handle has one
+ * sooner than it's waiting for.
+ */
+void io_engine_wake(void);
+
+/*
+ * Called by the engine with data just read from hdl's port.  Removes
+ * anything that isn't from the rig, such as telnet commands on a tcp
+ * port, and returns how much is left.
+ */
+size_t io_filter(struct io_handle *hdl, char *buf, size_t len);
+
+/*
+ * Called by the engine with data read from hdl at now (us_ticks()).
+ */
+void io_input(struct io_handle *hdl, const char *buf, size_t len, uint64_t now);
+
+/*
+ * Called by the engine to time out a partial response or the oldest
+ * waiter.  Returns when it next needs calling, or 0 if hdl is idle.
+ */
+uint64_t io_expire(struct io_handle *hdl, uint64_t now);
+
+#endif
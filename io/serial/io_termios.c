@@ -42,6 +42,12 @@
 #include "serial.h"
 #include "io_termios.h"
 
+/* Linux spells hardware flow control as a single flag */
+#if !defined(CCTS_OFLOW) && defined(CRTSCTS)
+#define CCTS_OFLOW	CRTSCTS
+#define CRTS_IFLOW	0
+#endif
+
 #define SUPPORTED_SPEED(x) \
 	if (speed <= (x)) \
 		return B##x
@@ -236,10 +242,6 @@ struct io_serial_handle *serial_termios_open(const char *path,
 	if (tcgetattr(hdl->fd, &tio) != 0)
 		goto fail;
 	cfmakeraw(&tio);
-	if (cfsetospeed(&tio, rate_to_macro(speed)) != 0)
-		goto fail;
-	if (cfsetispeed(&tio, rate_to_macro(speed)) != 0)
-		goto fail;
 	tio.c_iflag = IGNBRK|IGNPAR;
 	tio.c_oflag = 0;
 	tio.c_cflag = CREAD|CLOCAL;
@@ -301,6 +303,11 @@ struct io_serial_handle *serial_termios_open(const char *path,
 		default:
 			goto fail;
 	}
+	/* Some systems (ie: Linux) keep the speed in c_cflag, so set it last */
+	if (cfsetospeed(&tio, rate_to_macro(speed)) != 0)
+		goto fail;
+	if (cfsetispeed(&tio, rate_to_macro(speed)) != 0)
+		goto fail;
 	if (tcsetattr(hdl->fd, TCSANOW, &tio) != 0)
 		goto fail;
 
@@ -586,7 +593,14 @@ int serial_termios_drain(struct io_serial_handle *hdl)
 {
 	struct serial_termios_impl	*thdl = (struct serial_termios_impl *)hdl->handle;
 
-	return ioctl(thdl->fd, TIOCDRAIN);
+	return tcdrain(thdl->fd);
+}
+
+int serial_termios_fd(struct io_serial_handle *hdl)
+{
+	struct serial_termios_impl	*thdl = (struct serial_termios_impl *)hdl->handle;
+
+	return thdl->fd;
 }
 
 #endif
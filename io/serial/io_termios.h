@@ -48,6 +48,7 @@ int serial_termios_write(struct io_serial_handle *hdl, const void *buf, size_t n
 int serial_termios_read(struct io_serial_handle *hdl, void *buf, size_t nbytes, unsigned timeout);
 int serial_termios_pending(struct io_serial_handle *hdl);
 int serial_termios_drain(struct io_serial_handle *hdl);
+int serial_termios_fd(struct io_serial_handle *hdl);
 
 #endif
 
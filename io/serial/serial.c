@@ -231,3 +231,18 @@ int serial_drain(struct io_serial_handle *hdl)
 			return -1;
 	}
 }
+
+int serial_fd(struct io_serial_handle *hdl)
+{
+	if (hdl == NULL)
+		return -1;
+
+	switch(hdl->type) {
+#ifdef WITH_TERMIOS
+		case SERIAL_H_TERMIOS:
+			return serial_termios_fd(hdl);
+#endif
+		default:
+			return -1;
+	}
+}
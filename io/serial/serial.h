@@ -104,5 +104,6 @@ int serial_write(struct io_serial_handle *hdl, const void *buf, size_t nbytes, u
 int serial_read(struct io_serial_handle *hdl, void *buf, size_t nbytes, unsigned timeout);
 int serial_pending(struct io_serial_handle *hdl);
 int serial_drain(struct io_serial_handle *hdl);
+int serial_fd(struct io_serial_handle *hdl);
 
 #endif
@@ -0,0 +1,516 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#include <unistd.h>
+#endif
+
+#include <log.h>
+#include <mutexes.h>
+#include <sockets.h>
+
+#include "tcp.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+#define TCP_CONNECT_TIMEOUT		5000	// ms
+#define TCP_SETUP_TIMEOUT		1000	// ms to send the RFC 2217 settings
+
+// Telnet (RFC 854) commands and options
+#define TELNET_SE			240
+#define TELNET_SB			250
+#define TELNET_WILL			251
+#define TELNET_WONT			252
+#define TELNET_DO			253
+#define TELNET_DONT			254
+#define TELNET_IAC			255
+#define TELOPT_BINARY		0
+#define TELOPT_SGA			3
+#define TELOPT_COM_PORT		44
+
+// RFC 2217 client to server subcommands
+#define CPO_SET_BAUDRATE	1
+#define CPO_SET_DATASIZE	2
+#define CPO_SET_PARITY		3
+#define CPO_SET_STOPSIZE	4
+#define CPO_SET_CONTROL		5
+
+int tcp_wait_write(struct io_tcp_handle *hdl, unsigned timeout)
+{
+	fd_set			fds;
+	struct timeval	tv = {};
+
+	FD_ZERO(&fds);
+	FD_SET(hdl->sock, &fds);
+	tv.tv_sec = timeout/1000;
+	tv.tv_usec = (timeout % 1000)*1000;
+	switch (select(hdl->sock+1, NULL, &fds, NULL, &tv)) {
+		case 0:
+			return 0;
+		case -1:
+			return -1;
+		default:
+			return FD_ISSET(hdl->sock, &fds) ? 1 : 0;
+	}
+}
+
+int tcp_wait_read(struct io_tcp_handle *hdl, unsigned timeout)
+{
+	fd_set			fds;
+	struct timeval	tv = {};
+
+	FD_ZERO(&fds);
+	FD_SET(hdl->sock, &fds);
+	tv.tv_sec = timeout/1000;
+	tv.tv_usec = (timeout % 1000)*1000;
+	switch (select(hdl->sock+1, &fds, NULL, NULL, &tv)) {
+		case 0:
+			return 0;
+		case -1:
+			return -1;
+		default:
+			return FD_ISSET(hdl->sock, &fds) ? 1 : 0;
+	}
+}
+
+/*
+ * Sends all of buf, must be called with write_lock held.
+ */
+static int tcp_send(struct io_tcp_handle *hdl, const unsigned char *buf, size_t len, unsigned timeout)
+{
+	ssize_t	ret;
+
+	while (len) {
+		if (tcp_wait_write(hdl, timeout) != 1)
+			return -1;
+		ret = send(hdl->sock, (const char *)buf, len, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Sends what it can of the queued telnet replies without waiting, must
+ * be called with reply_lock held.
+ */
+static void tcp_send_replies(struct io_tcp_handle *hdl)
+{
+	ssize_t	ret;
+
+	ret = send(hdl->sock, (const char *)hdl->replies, hdl->replies_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (ret <= 0)
+		return;
+	hdl->replies_len -= ret;
+	memmove(hdl->replies, hdl->replies + ret, hdl->replies_len);
+}
+
+/*
+ * Sends any telnet replies the reader queued while a writer had the
+ * socket.  If done, the socket is handed back to the reader once
+ * there are none left.  Must be called with write_lock held.
+ */
+static int tcp_flush_replies(struct io_tcp_handle *hdl, bool done, unsigned timeout)
+{
+	unsigned char	buf[sizeof(hdl->replies)];
+	size_t			len;
+	int				ret = 0;
+
+	for (;;) {
+		mutex_lock(&hdl->reply_lock);
+		len = hdl->replies_len;
+		if (len == 0 || ret != 0) {
+			hdl->replies_len = 0;
+			hdl->writing = !done;
+			mutex_unlock(&hdl->reply_lock);
+			return ret;
+		}
+		memcpy(buf, hdl->replies, len);
+		hdl->replies_len = 0;
+		hdl->writing = true;
+		mutex_unlock(&hdl->reply_lock);
+		ret = tcp_send(hdl, buf, len, timeout);
+	}
+}
+
+/*
+ * Appends a COM-PORT-OPTION subnegotiation with an len byte big endian
+ * value to buf, doubling any IAC in the value.
+ */
+static size_t cpo_append(unsigned char *buf, unsigned char cmd, uint32_t value, unsigned len)
+{
+	size_t	pos = 0;
+
+	buf[pos++] = TELNET_IAC;
+	buf[pos++] = TELNET_SB;
+	buf[pos++] = TELOPT_COM_PORT;
+	buf[pos++] = cmd;
+	while (len--) {
+		buf[pos] = (value >> (len * 8)) & 0xff;
+		if (buf[pos++] == TELNET_IAC)
+			buf[pos++] = TELNET_IAC;
+	}
+	buf[pos++] = TELNET_IAC;
+	buf[pos++] = TELNET_SE;
+	return pos;
+}
+
+/*
+ * Asks for a binary session and sends the line settings.  Replies are
+ * handled by tcp_filter() as they arrive.
+ */
+static int tcp_rfc2217_setup(struct io_tcp_handle *hdl, unsigned speed,
+		enum serial_data_word_length wlen, enum serial_stop_bits sbits,
+		enum serial_parity parity, enum serial_flow flow)
+{
+	unsigned char	buf[96];
+	size_t			len = 0;
+	int				ret;
+	static const unsigned char	negotiate[] = {
+		TELNET_IAC, TELNET_WILL, TELOPT_BINARY,
+		TELNET_IAC, TELNET_DO, TELOPT_BINARY,
+		TELNET_IAC, TELNET_WILL, TELOPT_SGA,
+		TELNET_IAC, TELNET_DO, TELOPT_SGA,
+		TELNET_IAC, TELNET_WILL, TELOPT_COM_PORT,
+	};
+
+	memcpy(buf, negotiate, sizeof(negotiate));
+	len = sizeof(negotiate);
+	len += cpo_append(buf + len, CPO_SET_BAUDRATE, speed, 4);
+	len += cpo_append(buf + len, CPO_SET_DATASIZE, 5 + (wlen - SERIAL_DWL_5), 1);
+	switch (parity) {
+		case SERIAL_P_NONE:
+			len += cpo_append(buf + len, CPO_SET_PARITY, 1, 1);
+			break;
+		case SERIAL_P_ODD:
+			len += cpo_append(buf + len, CPO_SET_PARITY, 2, 1);
+			break;
+		case SERIAL_P_EVEN:
+			len += cpo_append(buf + len, CPO_SET_PARITY, 3, 1);
+			break;
+		case SERIAL_P_HIGH:
+			len += cpo_append(buf + len, CPO_SET_PARITY, 4, 1);
+			break;
+		case SERIAL_P_LOW:
+			len += cpo_append(buf + len, CPO_SET_PARITY, 5, 1);
+			break;
+	}
+	switch (sbits) {
+		case SERIAL_SB_1:
+			len += cpo_append(buf + len, CPO_SET_STOPSIZE, 1, 1);
+			break;
+		case SERIAL_SB_1_5:
+			len += cpo_append(buf + len, CPO_SET_STOPSIZE, 3, 1);
+			break;
+		case SERIAL_SB_2:
+			len += cpo_append(buf + len, CPO_SET_STOPSIZE, 2, 1);
+			break;
+	}
+	len += cpo_append(buf + len, CPO_SET_CONTROL, flow == SERIAL_F_CTS ? 3 : 1, 1);
+
+	mutex_lock(&hdl->write_lock);
+	ret = tcp_flush_replies(hdl, false, TCP_SETUP_TIMEOUT);
+	if (ret == 0)
+		ret = tcp_send(hdl, buf, len, TCP_SETUP_TIMEOUT);
+	if (tcp_flush_replies(hdl, true, TCP_SETUP_TIMEOUT) != 0)
+		ret = -1;
+	mutex_unlock(&hdl->write_lock);
+	return ret;
+}
+
+static int tcp_connect(const char *host, const char *port)
+{
+	struct addrinfo	hints = {};
+	struct addrinfo	*res;
+	struct addrinfo	*ai;
+	struct timeval	tv;
+	fd_set			fds;
+	int				sock = -1;
+	int				err;
+	socklen_t		errlen;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo(host, port, &hints, &res);
+	if (err != 0) {
+		log_printf(LOG_IO, LOG_LEVEL_ERROR, "Unable to look up %s port %s: %s", host, port, gai_strerror(err));
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock == -1)
+			continue;
+		if (socket_nonblocking(sock) == 0) {
+			if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			if (errno == EINPROGRESS) {
+				FD_ZERO(&fds);
+				FD_SET(sock, &fds);
+				tv.tv_sec = TCP_CONNECT_TIMEOUT / 1000;
+				tv.tv_usec = (TCP_CONNECT_TIMEOUT % 1000) * 1000;
+				errlen = sizeof(err);
+				if (select(sock+1, NULL, &fds, NULL, &tv) == 1
+				    && getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&err, &errlen) == 0
+				    && err == 0)
+					break;
+			}
+		}
+		closesocket(sock);
+		sock = -1;
+	}
+	freeaddrinfo(res);
+	if (sock == -1)
+		log_printf(LOG_IO, LOG_LEVEL_ERROR, "Unable to connect to %s port %s", host, port);
+	return sock;
+}
+
+struct io_tcp_handle *tcp_open(const char *host, const char *port, bool rfc2217,
+		unsigned speed, enum serial_data_word_length wlen, enum serial_stop_bits sbits,
+		enum serial_parity parity, enum serial_flow flow)
+{
+	struct io_tcp_handle	*ret;
+	int						sock;
+	int						one = 1;
+
+	if (host == NULL || port == NULL)
+		return NULL;
+	sock = tcp_connect(host, port);
+	if (sock == -1)
+		return NULL;
+	// Commands are small and a rig waits for each one
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+
+	ret = (struct io_tcp_handle *)calloc(1, sizeof(struct io_tcp_handle));
+	if (ret == NULL) {
+		closesocket(sock);
+		return NULL;
+	}
+	ret->sock = sock;
+	ret->rfc2217 = rfc2217;
+	ret->state = TCP_TS_DATA;
+	if (mutex_init(&ret->write_lock) != 0) {
+		closesocket(sock);
+		free(ret);
+		return NULL;
+	}
+	if (mutex_init(&ret->reply_lock) != 0) {
+		mutex_destroy(&ret->write_lock);
+		closesocket(sock);
+		free(ret);
+		return NULL;
+	}
+	if (rfc2217 && tcp_rfc2217_setup(ret, speed, wlen, sbits, parity, flow) != 0) {
+		log_printf(LOG_IO, LOG_LEVEL_ERROR, "Unable to send RFC 2217 settings to %s port %s", host, port);
+		tcp_close(ret);
+		free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+int tcp_close(struct io_tcp_handle *hdl)
+{
+	if (hdl == NULL)
+		return EINVAL;
+	closesocket(hdl->sock);
+	hdl->sock = -1;
+	mutex_destroy(&hdl->reply_lock);
+	mutex_destroy(&hdl->write_lock);
+	return 0;
+}
+
+int tcp_write(struct io_tcp_handle *hdl, const void *buf, size_t nbytes, unsigned timeout)
+{
+	const unsigned char	*in = buf;
+	unsigned char		out[128];
+	size_t				len = 0;
+	size_t				i;
+	int					ret = 0;
+
+	mutex_lock(&hdl->write_lock);
+	if (!hdl->rfc2217)
+		ret = tcp_send(hdl, in, nbytes, timeout);
+	else {
+		ret = tcp_flush_replies(hdl, false, timeout);
+		for (i = 0; i < nbytes && ret == 0; i++) {
+			out[len++] = in[i];
+			if (in[i] == TELNET_IAC)
+				out[len++] = TELNET_IAC;
+			if (len >= sizeof(out) - 1 || i + 1 == nbytes) {
+				ret = tcp_send(hdl, out, len, timeout);
+				len = 0;
+			}
+		}
+		if (tcp_flush_replies(hdl, true, timeout) != 0)
+			ret = -1;
+	}
+	mutex_unlock(&hdl->write_lock);
+	return ret == 0 ? (int)nbytes : -1;
+}
+
+/*
+ * Refuses any option other than the ones asked for in
+ * tcp_rfc2217_setup().  Options that were asked for aren't answered, so
+ * the two ends can't loop.  This runs on the io engine thread, so the
+ * reply is left for the writer if there is one and never waited on.
+ */
+static void tcp_negotiate(struct io_tcp_handle *hdl, unsigned char verb, unsigned char opt)
+{
+	unsigned char	reply[3] = {TELNET_IAC, 0, opt};
+
+	switch (verb) {
+		case TELNET_DO:
+			if (opt == TELOPT_BINARY || opt == TELOPT_SGA || opt == TELOPT_COM_PORT)
+				return;
+			reply[1] = TELNET_WONT;
+			break;
+		case TELNET_WILL:
+			if (opt == TELOPT_BINARY || opt == TELOPT_SGA)
+				return;
+			reply[1] = TELNET_DONT;
+			break;
+		case TELNET_DONT:
+			if (opt == TELOPT_COM_PORT)
+				log_printf(LOG_IO, LOG_LEVEL_WARNING, "Remote end doesn't support RFC 2217, line settings not changed");
+			return;
+		default:
+			return;
+	}
+	mutex_lock(&hdl->reply_lock);
+	if (hdl->replies_len + sizeof(reply) <= sizeof(hdl->replies)) {
+		memcpy(hdl->replies + hdl->replies_len, reply, sizeof(reply));
+		hdl->replies_len += sizeof(reply);
+	}
+	else
+		log_printf(LOG_IO, LOG_LEVEL_WARNING, "Too many telnet options to refuse, ignoring option %u", opt);
+	if (!hdl->writing)
+		tcp_send_replies(hdl);
+	mutex_unlock(&hdl->reply_lock);
+}
+
+size_t tcp_filter(struct io_tcp_handle *hdl, char *buf, size_t len)
+{
+	unsigned char	*in = (unsigned char *)buf;
+	size_t			out = 0;
+	size_t			i;
+
+	if (!hdl->rfc2217)
+		return len;
+	for (i = 0; i < len; i++) {
+		switch (hdl->state) {
+			case TCP_TS_DATA:
+				if (in[i] == TELNET_IAC)
+					hdl->state = TCP_TS_IAC;
+				else
+					buf[out++] = in[i];
+				break;
+			case TCP_TS_IAC:
+				switch (in[i]) {
+					case TELNET_IAC:
+						buf[out++] = in[i];
+						hdl->state = TCP_TS_DATA;
+						break;
+					case TELNET_WILL:
+					case TELNET_WONT:
+					case TELNET_DO:
+					case TELNET_DONT:
+						hdl->verb = in[i];
+						hdl->state = TCP_TS_OPTION;
+						break;
+					case TELNET_SB:
+						hdl->state = TCP_TS_SB;
+						break;
+					default:
+						hdl->state = TCP_TS_DATA;
+						break;
+				}
+				break;
+			case TCP_TS_OPTION:
+				tcp_negotiate(hdl, hdl->verb, in[i]);
+				hdl->state = TCP_TS_DATA;
+				break;
+			// The COM-PORT-OPTION replies only confirm the settings
+			case TCP_TS_SB:
+				if (in[i] == TELNET_IAC)
+					hdl->state = TCP_TS_SB_IAC;
+				break;
+			case TCP_TS_SB_IAC:
+				hdl->state = in[i] == TELNET_SE ? TCP_TS_DATA : TCP_TS_SB;
+				break;
+		}
+	}
+	return out;
+}
+
+int tcp_read(struct io_tcp_handle *hdl, void *buf, size_t nbytes, unsigned timeout)
+{
+	char	*pos = buf;
+	size_t	rd;
+	ssize_t	tr;
+
+	for(rd=0; rd < nbytes;) {
+		if (tcp_wait_read(hdl, timeout) != 1)
+			return -1;
+		tr = recv(hdl->sock, pos+rd, nbytes-rd, 0);
+		if (tr == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				continue;
+			return -1;
+		}
+		// The far end closed the connection
+		if (tr == 0)
+			return -1;
+		rd += tcp_filter(hdl, pos+rd, tr);
+	}
+	return rd;
+}
+
+int tcp_pending(struct io_tcp_handle *hdl)
+{
+	int	avail = 0;
+
+	if (ioctl(hdl->sock, FIONREAD, &avail) == -1)
+		return -1;
+	return avail;
+}
+
+int tcp_fd(struct io_tcp_handle *hdl)
+{
+	return hdl->sock;
+}
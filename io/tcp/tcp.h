@@ -0,0 +1,85 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TCP_H
+#define TCP_H
+
+/*
+ * A rig port reached over TCP, such as a ser2net port.  With rfc2217
+ * the connection is a telnet session and the line settings are sent to
+ * the far end with the RFC 2217 COM-PORT-OPTION.  Otherwise the bytes
+ * pass through untouched.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <mutexes.h>
+
+#include "serial.h"
+
+enum tcp_telnet_state {
+	TCP_TS_DATA,
+	TCP_TS_IAC,
+	TCP_TS_OPTION,
+	TCP_TS_SB,
+	TCP_TS_SB_IAC
+};
+
+struct io_tcp_handle {
+	int						sock;
+	bool					rfc2217;
+	enum tcp_telnet_state	state;		// Telnet parser, only used by the reader
+	unsigned char			verb;		// WILL, WONT, DO or DONT being parsed
+	mutex_t					write_lock;	// Held by a writer for the whole write
+	/*
+	 * Telnet replies from the reader wait here while a writer has the
+	 * socket, so the reader never waits for a write.  reply_lock is
+	 * never held while blocked.
+	 */
+	mutex_t					reply_lock;
+	bool					writing;
+	unsigned char			replies[30];
+	size_t					replies_len;
+};
+
+struct io_tcp_handle *tcp_open(const char *host, const char *port, bool rfc2217,
+		unsigned speed, enum serial_data_word_length wlen, enum serial_stop_bits sbits,
+		enum serial_parity parity, enum serial_flow flow);
+int tcp_close(struct io_tcp_handle *hdl);
+int tcp_wait_write(struct io_tcp_handle *hdl, unsigned timeout);
+int tcp_wait_read(struct io_tcp_handle *hdl, unsigned timeout);
+int tcp_write(struct io_tcp_handle *hdl, const void *buf, size_t nbytes, unsigned timeout);
+int tcp_read(struct io_tcp_handle *hdl, void *buf, size_t nbytes, unsigned timeout);
+int tcp_pending(struct io_tcp_handle *hdl);
+int tcp_fd(struct io_tcp_handle *hdl);
+
+/*
+ * Removes telnet commands from len bytes just read from the socket,
+ * answering any that need it.  Returns how many bytes are left.
+ */
+size_t tcp_filter(struct io_tcp_handle *hdl, char *buf, size_t len);
+
+#endif
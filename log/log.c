@@ -0,0 +1,468 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomics.h>
+#include <datetime.h>
+#include <mutexes.h>
+#include <semaphores.h>
+#include <threads.h>
+
+#include "log.h"
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL	__declspec(thread)
+#else
+#define THREAD_LOCAL	__thread
+#endif
+
+#define LOG_RECORD_SIZE	96		// Bytes of text or data in a record
+#define LOG_RING_SIZE	256		// Records per thread, must be a power of two
+
+enum log_record_type {
+	LOG_RECORD_TEXT,
+	LOG_RECORD_DATA
+};
+
+struct log_record {
+	uint64_t		tick;
+	const char		*label;		// Data records only
+	unsigned		total;		// Length before truncation
+	unsigned char	len;
+	unsigned char	subsystem;
+	unsigned char	level;
+	unsigned char	type;
+	char			data[LOG_RECORD_SIZE];
+};
+
+/*
+ * Only the owning thread writes head and dropped, only the log thread
+ * writes tail.  Once the owning thread has exited, the log thread frees
+ * the ring after writing out what's left in it.
+ */
+struct log_ring {
+	unsigned			head;
+	unsigned			tail;
+	unsigned			dropped;
+	unsigned			reported;	// Log thread's copy of dropped
+	unsigned			exited;		// Set by the owning thread as it exits
+	unsigned			id;
+	struct log_ring		*next;
+	struct log_record	records[LOG_RING_SIZE];
+};
+
+volatile int log_levels[LOG_SUBSYSTEM_COUNT] = {
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_WARNING
+};
+
+static const char *subsystem_names[LOG_SUBSYSTEM_COUNT] = {
+	"net",
+	"io",
+	"kenwood",
+	"yaesu"
+};
+
+static const char *level_names[] = {
+	"off",
+	"error",
+	"warning",
+	"info",
+	"debug",
+	"trace"
+};
+#define LEVEL_COUNT	(sizeof(level_names) / sizeof(level_names[0]))
+
+static THREAD_LOCAL struct log_ring	*my_ring;
+static mutex_t				rings_lock;		// Only held to add to new_rings or take it
+static bool					rings_lock_init;
+static struct log_ring		*new_rings;		// Not yet seen by the log thread
+static struct log_ring		*rings;			// Only used by the log thread
+static unsigned				ring_count;
+
+static FILE					*log_file;
+static thread_t				log_thread_id;
+static semaphore_t			log_wake;
+static unsigned				log_running;
+static unsigned				log_sleeping;	// Log thread is waiting on log_wake
+static unsigned				log_terminate;
+static uint64_t				log_base_tick;
+
+static struct log_ring *get_ring(void)
+{
+	struct log_ring	*ring;
+
+	if (my_ring)
+		return my_ring;
+	ring = (struct log_ring *)calloc(1, sizeof(struct log_ring));
+	if (ring == NULL)
+		return NULL;
+	mutex_lock(&rings_lock);
+	ring->id = ring_count++;
+	ring->next = new_rings;
+	new_rings = ring;
+	mutex_unlock(&rings_lock);
+	my_ring = ring;
+	return ring;
+}
+
+void log_thread_exit(void)
+{
+	if (my_ring == NULL)
+		return;
+	atomic_store(&my_ring->exited, 1);
+	my_ring = NULL;
+}
+
+static void format_record(FILE *f, const struct log_record *rec, unsigned thread)
+{
+	uint64_t		ms = rec->tick - log_base_tick;
+	unsigned char	ch;
+	unsigned		i;
+
+	fprintf(f, "%5"PRIu64".%03u %-7s %-7s t%u ", ms / 1000, (unsigned)(ms % 1000),
+	    subsystem_names[rec->subsystem], level_names[rec->level], thread);
+	if (rec->type == LOG_RECORD_TEXT)
+		fwrite(rec->data, 1, rec->len, f);
+	else {
+		fprintf(f, "%s ", rec->label);
+		for (i = 0; i < rec->len; i++) {
+			ch = rec->data[i];
+			switch (ch) {
+				case '\\':
+					fputs("\\\\", f);
+					break;
+				case '\r':
+					fputs("\\r", f);
+					break;
+				case '\n':
+					fputs("\\n", f);
+					break;
+				default:
+					if (ch < 0x20 || ch > 0x7e)
+						fprintf(f, "\\x%02x", ch);
+					else
+						fputc(ch, f);
+					break;
+			}
+		}
+	}
+	if (rec->total > rec->len)
+		fprintf(f, "... (%u bytes)", rec->total);
+	fputc('\n', f);
+}
+
+/*
+ * Returns a record to fill in, or NULL if it should be written directly
+ * or dropped.
+ */
+static struct log_record *reserve_record(struct log_ring **ringp)
+{
+	struct log_ring	*ring;
+
+	*ringp = NULL;
+	if (!atomic_load(&log_running))
+		return NULL;
+	ring = get_ring();
+	if (ring == NULL)
+		return NULL;
+	*ringp = ring;
+	if (ring->head - atomic_load(&ring->tail) >= LOG_RING_SIZE) {
+		atomic_store(&ring->dropped, ring->dropped + 1);
+		return NULL;
+	}
+	return &ring->records[ring->head & (LOG_RING_SIZE - 1)];
+}
+
+static void commit_record(struct log_ring *ring, struct log_record *rec)
+{
+	if (ring == NULL) {
+		// The log thread isn't running
+		format_record(stderr, rec, 0);
+		return;
+	}
+	atomic_store(&ring->head, ring->head + 1);
+	atomic_fence();
+	if (atomic_load(&log_sleeping)) {
+		atomic_store(&log_sleeping, 0);
+		semaphore_post(&log_wake);
+	}
+}
+
+void log_write(enum log_subsystem sub, enum log_level lvl, const char *format, ...)
+{
+	struct log_ring		*ring;
+	struct log_record	*rec;
+	struct log_record	local;
+	va_list				args;
+	int					ret;
+
+	rec = reserve_record(&ring);
+	if (rec == NULL) {
+		if (ring)
+			return;
+		rec = &local;
+	}
+	rec->tick = ms_ticks();
+	rec->subsystem = sub;
+	rec->level = lvl;
+	rec->type = LOG_RECORD_TEXT;
+	va_start(args, format);
+	ret = vsnprintf(rec->data, sizeof(rec->data), format, args);
+	va_end(args);
+	if (ret < 0)
+		ret = 0;
+	rec->total = ret;
+	rec->len = ret < LOG_RECORD_SIZE ? ret : LOG_RECORD_SIZE - 1;
+	commit_record(ring, rec);
+}
+
+void log_write_data(enum log_subsystem sub, enum log_level lvl, const char *label, const void *data, size_t len)
+{
+	struct log_ring		*ring;
+	struct log_record	*rec;
+	struct log_record	local;
+
+	rec = reserve_record(&ring);
+	if (rec == NULL) {
+		if (ring)
+			return;
+		rec = &local;
+	}
+	rec->tick = ms_ticks();
+	rec->subsystem = sub;
+	rec->level = lvl;
+	rec->type = LOG_RECORD_DATA;
+	rec->label = label;
+	rec->total = len;
+	rec->len = len < LOG_RECORD_SIZE ? len : LOG_RECORD_SIZE;
+	memcpy(rec->data, data, rec->len);
+	commit_record(ring, rec);
+}
+
+/*
+ * Writes out everything in the rings, returns the number of records
+ * written.
+ */
+static unsigned drain_rings(void)
+{
+	struct log_ring	**prev;
+	struct log_ring	*ring;
+	struct log_ring	*added;
+	unsigned		head;
+	unsigned		dropped;
+	unsigned		exited;
+	unsigned		count = 0;
+
+	mutex_lock(&rings_lock);
+	added = new_rings;
+	new_rings = NULL;
+	mutex_unlock(&rings_lock);
+	while (added) {
+		ring = added;
+		added = ring->next;
+		ring->next = rings;
+		rings = ring;
+	}
+	for (prev = &rings; (ring = *prev) != NULL;) {
+		// Read first, nothing is added to the ring after it's set
+		exited = atomic_load(&ring->exited);
+		head = atomic_load(&ring->head);
+		while (ring->tail != head) {
+			format_record(log_file, &ring->records[ring->tail & (LOG_RING_SIZE - 1)], ring->id);
+			atomic_store(&ring->tail, ring->tail + 1);
+			count++;
+		}
+		dropped = atomic_load(&ring->dropped);
+		if (dropped != ring->reported) {
+			fprintf(log_file, "t%u dropped %u log records\n", ring->id, dropped - ring->reported);
+			ring->reported = dropped;
+		}
+		if (exited) {
+			*prev = ring->next;
+			free(ring);
+		}
+		else
+			prev = &ring->next;
+	}
+	return count;
+}
+
+static void log_thread(void *arg)
+{
+	for (;;) {
+		if (drain_rings())
+			continue;
+		if (atomic_load(&log_terminate))
+			break;
+		/*
+		 * Writers check log_sleeping after publishing a record, so
+		 * anything they published before seeing it clear is picked up
+		 * by the second drain.
+		 */
+		atomic_store(&log_sleeping, 1);
+		atomic_fence();
+		if (drain_rings()) {
+			atomic_store(&log_sleeping, 0);
+			continue;
+		}
+		fflush(log_file);
+		semaphore_wait(&log_wake);
+	}
+	drain_rings();
+	fflush(log_file);
+}
+
+int log_start(const char *path)
+{
+	int		ret;
+
+	if (atomic_load(&log_running))
+		return EBUSY;
+	if (!rings_lock_init) {
+		ret = mutex_init(&rings_lock);
+		if (ret)
+			return ret;
+		rings_lock_init = true;
+	}
+	if (path) {
+		log_file = fopen(path, "a");
+		if (log_file == NULL)
+			return errno;
+	}
+	else
+		log_file = stderr;
+	ret = semaphore_init(&log_wake, 0);
+	if (ret)
+		goto fail;
+	log_base_tick = ms_ticks();
+	log_terminate = 0;
+	log_sleeping = 0;
+	atomic_store(&log_running, 1);
+	ret = create_thread(log_thread, NULL, &log_thread_id);
+	if (ret) {
+		atomic_store(&log_running, 0);
+		semaphore_destroy(&log_wake);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	if (log_file != stderr)
+		fclose(log_file);
+	log_file = NULL;
+	return ret;
+}
+
+void log_stop(void)
+{
+	if (!atomic_load(&log_running))
+		return;
+	atomic_store(&log_running, 0);
+	atomic_store(&log_terminate, 1);
+	semaphore_post(&log_wake);
+	wait_thread(log_thread_id);
+	semaphore_destroy(&log_wake);
+	if (log_file != stderr)
+		fclose(log_file);
+	log_file = NULL;
+}
+
+void log_set_level(enum log_subsystem sub, enum log_level lvl)
+{
+	if (sub < LOG_SUBSYSTEM_COUNT && lvl < LEVEL_COUNT)
+		log_levels[sub] = lvl;
+}
+
+void log_adjust_levels(int delta)
+{
+	int		i;
+	int		lvl;
+
+	for (i = 0; i < LOG_SUBSYSTEM_COUNT; i++) {
+		lvl = log_levels[i] + delta;
+		if (lvl < LOG_LEVEL_OFF)
+			lvl = LOG_LEVEL_OFF;
+		if (lvl > LOG_LEVEL_TRACE)
+			lvl = LOG_LEVEL_TRACE;
+		log_levels[i] = lvl;
+	}
+}
+
+static int find_name(const char **names, size_t count, const char *name, size_t len)
+{
+	size_t	i;
+
+	for (i = 0; i < count; i++) {
+		if (strlen(names[i]) == len && strncmp(names[i], name, len) == 0)
+			return i;
+	}
+	return -1;
+}
+
+int log_parse_levels(const char *str)
+{
+	const char	*end;
+	const char	*eq;
+	int			sub;
+	int			lvl;
+	int			i;
+
+	while (*str) {
+		end = strchr(str, ',');
+		if (end == NULL)
+			end = strchr(str, 0);
+		eq = memchr(str, '=', end - str);
+		if (eq == NULL)
+			return EINVAL;
+		if (eq - str == 3 && strncmp(str, "all", 3) == 0)
+			sub = -1;
+		else {
+			sub = find_name(subsystem_names, LOG_SUBSYSTEM_COUNT, str, eq - str);
+			if (sub == -1)
+				return EINVAL;
+		}
+		lvl = find_name(level_names, LEVEL_COUNT, eq + 1, end - (eq + 1));
+		if (lvl == -1)
+			return EINVAL;
+		if (sub == -1) {
+			for (i = 0; i < LOG_SUBSYSTEM_COUNT; i++)
+				log_set_level(i, lvl);
+		}
+		else
+			log_set_level(sub, lvl);
+		str = *end ? end + 1 : end;
+	}
+	return 0;
+}
@@ -0,0 +1,107 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+
+/*
+ * Logging never blocks the caller.  Each thread writes fixed size
+ * records into its own ring and a background thread formats and writes
+ * them out.  If a ring fills up, records are dropped and counted.
+ * 
+ * The level is checked before anything else is done, so a disabled
+ * log_printf() or log_data() costs a load and a branch.
+ */
+
+enum log_subsystem {
+	LOG_NET,		// rigctld clients
+	LOG_IO,			// Bytes to and from rigs
+	LOG_KENWOOD,
+	LOG_YAESU,
+	LOG_SUBSYSTEM_COUNT
+};
+
+enum log_level {
+	LOG_LEVEL_OFF,
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_DEBUG,
+	LOG_LEVEL_TRACE
+};
+
+extern volatile int log_levels[LOG_SUBSYSTEM_COUNT];
+
+#define log_enabled(sub, lvl)	(log_levels[(sub)] >= (lvl))
+
+#define log_printf(sub, lvl, ...) do { \
+	if (log_enabled((sub), (lvl))) \
+		log_write((sub), (lvl), __VA_ARGS__); \
+} while(0)
+
+/*
+ * Logs len bytes of data after a short label, non-printable characters
+ * are escaped by the log thread.
+ */
+#define log_data(sub, lvl, label, data, len) do { \
+	if (log_enabled((sub), (lvl))) \
+		log_write_data((sub), (lvl), (label), (data), (len)); \
+} while(0)
+
+void log_write(enum log_subsystem sub, enum log_level lvl, const char *format, ...);
+void log_write_data(enum log_subsystem sub, enum log_level lvl, const char *label, const void *data, size_t len);
+
+/*
+ * Starts the log thread writing to path, or stderr if path is NULL.
+ * Until it's started (and after it's stopped) log records are written
+ * directly to stderr.
+ * 
+ * Returns 0 on success or an errno value.
+ */
+int log_start(const char *path);
+void log_stop(void);
+
+/*
+ * A thread that may have logged calls this just before it returns, so
+ * its ring can be freed once it has been written out.
+ */
+void log_thread_exit(void);
+
+/*
+ * Levels may be changed at any time from any thread (or a signal
+ * handler).
+ */
+void log_set_level(enum log_subsystem sub, enum log_level lvl);
+void log_adjust_levels(int delta);
+
+/*
+ * Parses a comma separated list of subsystem=level settings, "all" sets
+ * every subsystem.  Returns 0 on success or EINVAL.
+ */
+int log_parse_levels(const char *str);
+
+#endif
@@ -29,192 +29,386 @@
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <netinet/tcp.h>
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
 #ifdef WITH_SIGNAL
 #include <signal.h>
 #endif
+#ifdef WITH_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef WITH_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#include <unistd.h>
 
 #include <api.h>
+#include <atomics.h>
+#include <datetime.h>
 #include <iniparser.h>
+#include <log.h>
+#include <mutexes.h>
+#include <semaphores.h>
+#include <threads.h>
+
+#include "rigctld/metrics.h"
+#include "rigctld/output.h"
+#include "rigctld/parse.h"
+
+/*
+ * Rigs, listeners and connections are all registered with the event loop,
+ * so each starts with the type to tell them apart.
+ */
+enum event_source {
+	EVENT_LISTENER,
+	EVENT_CONNECTION,
+	EVENT_RIG,
+	EVENT_RELOAD
+};
+
+struct request;
+
+/*
+ * What to do with a connection whose backlog (output not yet sent plus
+ * input waiting for the worker) exceeds max_output.
+ */
+enum output_policy {
+	OUTPUT_PAUSE,		// Stop reading until the backlog halves
+	OUTPUT_DROP,		// Disconnect it
+	OUTPUT_COALESCE		// Pause, and answer its queued reads from the state
+};
+
+struct backlog_stats {
+	unsigned			pauses;
+	unsigned			drops;
+	unsigned			coalesced;		// Reads answered from stale state, updated by the worker
+	unsigned			oversize;		// Lines longer than max_output
+};
+
+/*
+ * What a connection can ask to have pushed with \subscribe.
+ */
+enum subscription {
+	SUB_FREQ	= 1 << 0,
+	SUB_MODE	= 1 << 1,
+	SUB_VFO		= 1 << 2,
+	SUB_SPLIT	= 1 << 3,
+	SUB_PTT		= 1 << 4,
+	SUB_ALL		= 0x1f
+};
+
+struct subscription_name {
+	const char	*name;
+	unsigned	subs;
+};
+static const struct subscription_name subscription_names[] = {
+	{"freq", SUB_FREQ},
+	{"mode", SUB_MODE},
+	{"vfo", SUB_VFO},
+	{"split", SUB_SPLIT},
+	{"ptt", SUB_PTT},
+	{"all", SUB_ALL},
+	{"none", 0},
+	{NULL, 0}
+};
+
+/*
+ * The values last pushed to a subscribed connection.
+ */
+struct pushed_state {
+	uint64_t			freq;
+	enum rig_modes		mode;
+	enum vfos			vfo;
+	int					split;
+	int					ptt;
+};
+
+/*
+ * What we know about a rig, shared by every connection to it.  The
+ * vfo?_freq/vfo?_mode values are the last ones set or seen, the others
+ * are only used while their tick is within state_lifetime.
+ */
+struct rig_state {
+	enum vfos			current_vfo;
+	uint64_t			vfoa_freq;
+	uint64_t			vfob_freq;
+	uint64_t			vfom_freq;
+	uint64_t			vfos_freq;
+	bool				split;
+	enum rig_modes		vfoa_mode;
+	enum rig_modes		vfob_mode;
+	enum rig_modes		vfom_mode;
+	enum rig_modes		vfos_mode;
+	uint64_t			freq;			// Frequency of the current VFO
+	enum rig_modes		mode;			// Mode of the current VFO
+	int					ptt;
+	uint64_t			freq_tick;
+	uint64_t			mode_tick;
+	uint64_t			vfo_tick;
+	uint64_t			ptt_tick;
+	uint64_t			split_tick;
+};
 
+/*
+ * Every command for a rig is run by that rig's worker thread so a slow
+ * rig never holds up the event loop.  The worker puts finished requests
+ * on the done list and pokes notify_fd, the event loop then moves the
+ * replies to the connections.
+ */
 struct rig_entry {
+	enum event_source	type;
 	struct rig			*rig;
+	char				*section;		// Config section the rig came from
+	thread_t			worker;
+	bool				terminate;		// Set to stop the worker
+	bool				park;			// Set to have the worker wait for resume
+	bool				reseed;			// Rig was reopened, reread the state
+	semaphore_t			parked;			// Posted by the worker once parked
+	semaphore_t			resume;			// Posted to let a parked worker go on
+	mutex_t				queue_lock;		// Protects the queue and done lists
+	semaphore_t			queue_sem;		// Posted once for each queued request
+	struct request		*queue_head;
+	struct request		*queue_tail;
+	struct request		*done_head;
+	struct request		*done_tail;
+	int					notify_fd[2];	// eventfd (both the same) or a pipe
+	/*
+	 * Updated by the worker and the backend's notify callback with
+	 * state_lock held.  state_seq is odd while an update is in
+	 * progress so the event loop can read without locking.
+	 */
+	mutex_t				state_lock;
+	unsigned			state_seq;
+	struct rig_state	state;
+	unsigned			state_lifetime;	// Milliseconds a read stays fresh
+	size_t				max_output;		// Largest backlog per connection
+	enum output_policy	output_policy;
+	struct backlog_stats	backlog;
+	unsigned			accepted;		// rigctld connections accepted
+	unsigned			subscribers;	// Subscribed connections, changed with atomic_inc()/atomic_dec()
+	struct command_metrics	metrics;
 	struct rig_entry	*next_rig_entry;
 	struct rig_entry	*prev_rig_entry;
 };
 struct rig_entry	*rigs = NULL;
 
 struct listener {
-	struct rig		*rig;
-	int				socket;
-	struct listener	*next_listener;
-	struct listener	*prev_listener;
+	enum event_source	type;
+	struct rig_entry	*entry;
+	int					socket;
+	bool				metrics;		// Serves OpenMetrics over HTTP, not rigctld
+	char				*path;			// Unix socket to remove on exit
+	struct listener		*next_listener;
 };
 struct listener		*listeners = NULL;
 
 struct connection {
+	enum event_source	type;
 	int					socket;
-	struct rig			*rig;
+	uint32_t			events;			// Events currently registered with epoll
+	struct rig_entry	*entry;
+	unsigned			pending;		// Requests queued or running for this connection
+	bool				closed;			// Socket closed, free once pending is zero
+	bool				metrics;		// A metrics scrape
+	bool				closing;		// Close once the output has been sent
+	size_t				queued;			// Bytes of input waiting for the worker
+	bool				paused;			// Not reading until the backlog drains
+	unsigned			behind;			// Worker may coalesce reads, set with atomic_store()
+	unsigned			subscribed;		// Set by the worker with atomic_store()
+	unsigned			pushing;		// What the event loop is pushing
+	struct pushed_state	pushed;
 	char				*rx_buf;
 	size_t				rx_buf_size;
 	size_t				rx_buf_pos;
-	char				*tx_buf;
-	size_t				tx_buf_size;
-	size_t				tx_buf_pos;
-	size_t				tx_buf_terminator;
+	struct output		out;
 	struct connection	*next_connection;
 	struct connection	*prev_connection;
-	enum vfos			current_vfo;
-	uint64_t			vfoa_freq;
-	uint64_t			vfob_freq;
-	uint64_t			vfom_freq;
-	uint64_t			vfos_freq;
-	bool				split;
-	enum rig_modes		vfoa_mode;
-	enum rig_modes		vfob_mode;
-	enum rig_modes		vfom_mode;
-	enum rig_modes		vfos_mode;
 };
 struct connection	*connections = NULL;
 
-struct long_cmd {
-	const char	*lng;
-	char		shrt;
-	size_t		len;
-};
-struct long_cmd long_cmds[] = {
-	{"\\set_split_freq", 'I', 15},
-	{"\\get_split_freq", 'i', 15},
-	{"\\set_split_mode", 'X', 15},
-	{"\\get_split_mode", 'x', 15},
-	{"\\set_rptr_shift", 'R', 15},
-	{"\\get_rptr_shift", 'r', 15},
-	{"\\set_ctcss_tone", 'C', 15},
-	{"\\get_ctcss_tone", 'c', 15},
-	{"\\set_rptr_offs", 'O', 14},
-	{"\\get_rptr_offs", 'o', 14},
-	{"\\set_split_vfo", 'S', 14},
-	{"\\get_split_vfo", 's', 14},
-	{"\\set_ctcss_sql", '\x90', 14},
-	{"\\get_ctcss_sql", '\x91', 14},
-	{"\\set_powerstat", '\x87', 14},
-	{"\\get_powerstat", '\x88', 14},
-	{"\\set_dcs_code", 'D', 13},
-	{"\\get_dcs_code", 'd', 13},
-	{"\\set_dcs_sql", '\x92', 12},
-	{"\\get_dcs_sql", '\x93', 12},
-	{"\\set_channel", 'H', 12},
-	{"\\get_channel", 'h', 12},
-	{"\\send_morse", 'b', 11},
-	{"\\dump_state", '\x8f', 11},
-	{"\\set_level", 'L', 10},
-	{"\\get_level", 'l', 10},
-	{"\\send_dtmf", '\x89', 10},
-	{"\\recv_dtmf", '\x8a', 10},
-	{"\\dump_caps", '1', 10},
-	{"\\dump_conf", '3', 10},
-	{"\\set_freq", 'F', 9},
-	{"\\get_freq", 'f', 9},
-	{"\\set_mode", 'M', 9},
-	{"\\get_mode", 'm', 9},
-	{"\\set_func", 'U', 9},
-	{"\\get_func", 'u', 9},
-	{"\\set_parm", 'P', 9},
-	{"\\get_parm", 'p', 9},
-	{"\\set_bank", 'B', 9},
-	{"\\get_info", '_', 9},
-	{"\\send_cmd", 'w', 9},
-	{"\\power2mW", '2', 9},
-	{"\\mW2power", '4', 9},
-	{"\\set_trn", 'A', 8},
-	{"\\get_trn", 'a', 8},
-	{"\\set_rit", 'J', 8},
-	{"\\get_rit", 'j', 8},
-	{"\\set_xit", 'Z', 8},
-	{"\\get_xit", 'z', 8},
-	{"\\set_ant", 'Y', 8},
-	{"\\get_ant", 'y', 8},
-	{"\\get_dcd", '\x8b', 8},
-	{"\\chk_vfo", '\xf0', 8},
-	{"\\set_vfo", 'V', 8},
-	{"\\get_vfo", 'v', 8},
-	{"\\set_ptt", 'T', 8},
-	{"\\get_ptt", 't', 8},
-	{"\\set_mem", 'E', 8},
-	{"\\get_mem", 'e', 8},
-	{"\\set_ts", 'N', 7},
-	{"\\get_ts", 'n', 7},
-	{"\\vfo_op", 'G', 7},
-	{"\\reset", '*', 6},
-	{"\\scan", 'g', 5},
-	{"\\halt", '\xf1', 5},
-	{NULL, 0}
+/*
+ * The complete command lines from a connection that need the rig.  The
+ * connection's rx_buf is swapped for buf rather than copying the lines.
+ * The reply is built in the request and only moved to the connection
+ * by the event loop.
+ */
+struct request {
+	struct connection	*conn;
+	char				*buf;
+	size_t				buf_size;
+	size_t				start;			// First line to run
+	size_t				end;			// Just past the last newline
+	struct output		out;
+	uint64_t			received;		// us_ticks() when the lines were read
+	char				sep;			// Extended response separator or 0
+	int					rprt;			// Extended response result
+	bool				deferred;		// Set replies wait for rig_commit()
+	struct request		*next;
 };
+struct request		*free_requests = NULL;
+
+#ifdef WITH_EPOLL
+int					epoll_fd = -1;
+#endif
+
+/*
+ * The running config.  Band limit names point into it, so it's only
+ * replaced once every rig has been moved to the new one.
+ */
+dictionary			*config = NULL;
+char				*config_path = NULL;
+bool				reload_sections = true;	// Add and remove rigs on reload, not just update them
+#ifdef WITH_SIGNAL
+int					reload_fd[2] = {-1, -1};	// Written by the SIGHUP handler
+#endif
+
+static int start_worker(struct rig_entry *entry);
+static void stop_worker(struct rig_entry *entry);
 
-#define debug 1
+/*
+ * Takes a consistent copy of the rig state without locking.
+ */
+static void read_state(struct rig_entry *e, struct rig_state *st)
+{
+	unsigned	seq;
+
+	for (;;) {
+		seq = atomic_load(&e->state_seq);
+		if (seq & 1)
+			continue;
+		*st = e->state;
+		atomic_fence();
+		if (atomic_load(&e->state_seq) == seq)
+			return;
+	}
+}
+
+/*
+ * Never hold the state lock while talking to the rig, the notify
+ * callback needs it from the I/O thread.
+ */
+static void lock_state(struct rig_entry *e)
+{
+	mutex_lock(&e->state_lock);
+	atomic_inc(&e->state_seq);
+	atomic_fence();
+}
+
+/*
+ * Wakes the event loop through the rig's notify_fd.
+ */
+static void wake_loop(struct rig_entry *e)
+{
+	uint64_t	one = 1;
+
+#ifdef WITH_EVENTFD
+	write(e->notify_fd[1], &one, sizeof(one));
+#else
+	write(e->notify_fd[1], &one, 1);
+#endif
+}
+
+/*
+ * Subscribers hear about every update, the event loop works out what
+ * actually changed.
+ */
+static void unlock_state(struct rig_entry *e)
+{
+	atomic_inc(&e->state_seq);
+	mutex_unlock(&e->state_lock);
+	if (atomic_load(&e->subscribers))
+		wake_loop(e);
+}
+
+static bool is_fresh(struct rig_entry *e, uint64_t tick, uint64_t now)
+{
+	return tick != 0 && tick <= now && now - tick < e->state_lifetime;
+}
+
+/*
+ * Like is_fresh(), but any value that has been read at all will do if
+ * any_age is set.
+ */
+static bool usable(struct rig_entry *e, uint64_t tick, uint64_t now, bool any_age)
+{
+	if (any_age)
+		return tick != 0;
+	return is_fresh(e, tick, now);
+}
 
-void save_freq(struct connection *c, uint64_t freq, enum vfos vfo)
+static uint64_t *vfo_freq(struct rig_state *st, enum vfos vfo)
 {
 	switch(vfo) {
 		case VFO_A:
-			c->vfoa_freq = freq;
-			break;
+			return &st->vfoa_freq;
 		case VFO_B:
-			c->vfob_freq = freq;
-			break;
+			return &st->vfob_freq;
 		case VFO_MAIN:
-			c->vfom_freq = freq;
-			break;
+			return &st->vfom_freq;
 		case VFO_SUB:
-			c->vfos_freq = freq;
-			break;
+			return &st->vfos_freq;
 		default:
-			break;
+			return NULL;
 	}
 }
 
-void save_mode(struct connection *c, enum rig_modes mode, enum vfos vfo)
+static enum rig_modes *vfo_mode(struct rig_state *st, enum vfos vfo)
 {
 	switch(vfo) {
 		case VFO_A:
-			c->vfoa_mode = mode;
-			break;
+			return &st->vfoa_mode;
 		case VFO_B:
-			c->vfob_mode = mode;
-			break;
+			return &st->vfob_mode;
 		case VFO_MAIN:
-			c->vfom_mode = mode;
-			break;
+			return &st->vfom_mode;
 		case VFO_SUB:
-			c->vfos_mode = mode;
-			break;
+			return &st->vfos_mode;
 		default:
-			break;
+			return NULL;
 	}
 }
 
-uint64_t current_freq(struct connection *c, enum vfos vfo)
+void save_freq(struct rig_entry *e, uint64_t freq, enum vfos vfo)
 {
-	uint64_t	freq = 0;
+	uint64_t	*f;
 
-	switch(vfo) {
-		case VFO_A:
-			freq = c->vfoa_freq;
-			break;
-		case VFO_B:
-			freq = c->vfob_freq;
-			break;
-		case VFO_MAIN:
-			freq = c->vfom_freq;
-			break;
-		case VFO_SUB:
-			freq = c->vfos_freq;
-			break;
-		default:
-			break;
+	lock_state(e);
+	f = vfo_freq(&e->state, vfo);
+	if (f)
+		*f = freq;
+	unlock_state(e);
+}
+
+void save_mode(struct rig_entry *e, enum rig_modes mode, enum vfos vfo)
+{
+	enum rig_modes	*m;
+
+	lock_state(e);
+	m = vfo_mode(&e->state, vfo);
+	if (m)
+		*m = mode;
+	if (vfo == e->state.current_vfo) {
+		e->state.mode = mode;
+		e->state.mode_tick = ms_ticks();
 	}
-	return freq;
+	else
+		e->state.mode_tick = 0;
+	unlock_state(e);
+}
+
+uint64_t current_freq(struct rig_entry *e, enum vfos vfo)
+{
+	struct rig_state	st;
+	uint64_t			*f;
+
+	read_state(e, &st);
+	f = vfo_freq(&st, vfo);
+	return f ? *f : 0;
 }
 
 enum vfos paired_vfo(enum vfos vfo)
@@ -233,83 +427,240 @@ enum vfos paired_vfo(enum vfos vfo)
 	}
 }
 
-enum rig_modes current_mode(struct connection *c, enum vfos vfo)
+enum rig_modes current_mode(struct rig_entry *e, enum vfos vfo)
 {
-	enum rig_modes	mode = MODE_UNKNOWN;
+	struct rig_state	st;
+	enum rig_modes		*m;
 
-	switch(vfo) {
-		case VFO_A:
-			mode = c->vfoa_mode;
-			break;
-		case VFO_B:
-			mode = c->vfob_mode;
-			break;
-		case VFO_MAIN:
-			mode = c->vfom_mode;
-			break;
-		case VFO_SUB:
-			mode = c->vfos_mode;
-			break;
-		default:
-			break;
+	read_state(e, &st);
+	m = vfo_mode(&st, vfo);
+	return m ? *m : MODE_UNKNOWN;
+}
+
+/*
+ * Reads from the state if it's fresh, and from the rig otherwise.
+ */
+static uint64_t state_freq(struct rig_entry *e)
+{
+	struct rig_state	st;
+	uint64_t			now = ms_ticks();
+	uint64_t			freq;
+
+	read_state(e, &st);
+	if (is_fresh(e, st.freq_tick, now))
+		return st.freq;
+	freq = get_frequency(e->rig, VFO_UNKNOWN);
+	if (freq) {
+		lock_state(e);
+		e->state.freq = freq;
+		e->state.freq_tick = now;
+		unlock_state(e);
+	}
+	return freq;
+}
+
+static enum rig_modes state_mode(struct rig_entry *e)
+{
+	struct rig_state	st;
+	uint64_t			now = ms_ticks();
+	enum rig_modes		mode;
+
+	read_state(e, &st);
+	if (is_fresh(e, st.mode_tick, now))
+		return st.mode;
+	mode = get_mode(e->rig);
+	if (mode != MODE_UNKNOWN) {
+		lock_state(e);
+		e->state.mode = mode;
+		e->state.mode_tick = now;
+		unlock_state(e);
 	}
 	return mode;
 }
 
-void replace_cmd(char *str)
+/*
+ * Rigs that can't select a VFO get a fake one that's always fresh.
+ */
+enum vfos current_vfo(struct rig_entry *e)
 {
-	int		i;
+	struct rig_state	st;
+	uint64_t			now = ms_ticks();
+	enum vfos			vfo;
 
-	for(i=0; long_cmds[i].lng; i++) {
-		if (strncmp(long_cmds[i].lng, str, long_cmds[i].len) == 0) {
-			memmove(str+1, str+long_cmds[i].len, strlen(str+long_cmds[i].len) + 1);
-			*str = long_cmds[i].shrt;
-			return;
+	read_state(e, &st);
+	if (e->rig->get_vfo == NULL || is_fresh(e, st.vfo_tick, now))
+		return st.current_vfo;
+	vfo = get_vfo(e->rig);
+	if (vfo != VFO_UNKNOWN) {
+		lock_state(e);
+		e->state.current_vfo = vfo;
+		e->state.vfo_tick = now;
+		unlock_state(e);
+	}
+	return vfo;
+}
+
+static int state_ptt(struct rig_entry *e)
+{
+	struct rig_state	st;
+	uint64_t			now = ms_ticks();
+	int					ptt;
+
+	read_state(e, &st);
+	if (is_fresh(e, st.ptt_tick, now))
+		return st.ptt;
+	ptt = get_ptt(e->rig);
+	if (ptt != -1) {
+		lock_state(e);
+		e->state.ptt = ptt;
+		e->state.ptt_tick = now;
+		unlock_state(e);
+	}
+	return ptt;
+}
+
+static bool state_split(struct rig_entry *e)
+{
+	struct rig_state	st;
+	uint64_t			now = ms_ticks();
+	bool				split;
+
+	read_state(e, &st);
+	if (is_fresh(e, st.split_tick, now))
+		return st.split;
+	split = get_split_frequency(e->rig, NULL, NULL) == 0;
+	lock_state(e);
+	e->state.split = split;
+	e->state.split_tick = now;
+	unlock_state(e);
+	return split;
+}
+
+/*
+ * Changing the VFO, split or PTT can change what the current VFO shows.
+ */
+static void set_state_vfo(struct rig_entry *e, enum vfos vfo)
+{
+	lock_state(e);
+	e->state.current_vfo = vfo;
+	e->state.vfo_tick = ms_ticks();
+	e->state.freq_tick = 0;
+	e->state.mode_tick = 0;
+	unlock_state(e);
+}
+
+static void set_state_split(struct rig_entry *e, bool split)
+{
+	lock_state(e);
+	e->state.split = split;
+	e->state.split_tick = ms_ticks();
+	e->state.freq_tick = 0;
+	unlock_state(e);
+}
+
+static void set_state_ptt(struct rig_entry *e, int ptt)
+{
+	lock_state(e);
+	e->state.ptt = ptt;
+	e->state.ptt_tick = ms_ticks();
+	e->state.freq_tick = 0;
+	unlock_state(e);
+}
+
+/*
+ * Called by the backend when the rig reports a change by itself.
+ */
+static void state_notify(void *notify_data, const struct rig_status *status)
+{
+	struct rig_entry	*e = (struct rig_entry *)notify_data;
+	uint64_t			now = ms_ticks();
+	uint64_t			*f;
+
+	lock_state(e);
+	if (status->vfo != VFO_UNKNOWN && e->rig->get_vfo) {
+		e->state.current_vfo = status->vfo;
+		e->state.vfo_tick = now;
+	}
+	if (status->freq) {
+		e->state.freq = status->freq;
+		e->state.freq_tick = now;
+		// While transmitting split, the rig shows the TX frequency
+		if (status->ptt != 1) {
+			f = vfo_freq(&e->state, e->state.current_vfo);
+			if (f)
+				*f = status->freq;
 		}
 	}
+	if (status->mode != MODE_UNKNOWN) {
+		e->state.mode = status->mode;
+		e->state.mode_tick = now;
+	}
+	if (status->ptt != -1) {
+		e->state.ptt = status->ptt;
+		e->state.ptt_tick = now;
+	}
+	if (status->split != -1) {
+		e->state.split = status->split;
+		e->state.split_tick = now;
+	}
+	unlock_state(e);
 }
 
-void shorten_cmds(char *str)
+/*
+ * Reads the initial rig state.
+ */
+static void seed_state(struct rig_entry *e)
 {
-	char	*lng;
+	uint64_t		vfoa_freq = 0;
+	uint64_t		vfob_freq = 0;
+	uint64_t		tmp;
+	enum rig_modes	vfoa_mode = MODE_UNKNOWN;
+	enum rig_modes	vfob_mode = MODE_UNKNOWN;
+	bool			split;
 
-	while ((lng = strchr(str, '\\')) != NULL)
-		replace_cmd(lng);
+	split = get_split_frequency(e->rig, &vfoa_freq, &vfob_freq) == 0;
+	if (split) {
+		if (get_vfo(e->rig) == VFO_B) {
+			tmp = vfob_freq;
+			vfob_freq = vfoa_freq;
+			vfoa_freq = tmp;
+			vfob_mode = get_mode(e->rig);
+		}
+		else
+			vfoa_mode = get_mode(e->rig);
+	}
+	lock_state(e);
+	e->state.split = split;
+	e->state.split_tick = ms_ticks();
+	e->state.vfoa_freq = vfoa_freq;
+	e->state.vfob_freq = vfob_freq;
+	e->state.vfoa_mode = vfoa_mode;
+	e->state.vfob_mode = vfob_mode;
+	unlock_state(e);
 }
 
-int add_rig(dictionary *d, char *section)
+/*
+ * Opens a listener for each address addr resolves to and returns how
+ * many were added to the front of the listeners list.
+ */
+static int open_listeners(struct rig_entry *entry, const char *addr, const char *port, bool metrics, int backlog)
 {
-	char				*port;
-	char				*addr;
 	struct addrinfo		hints, *res, *res0;
 	int					listener_count = 0;
-	struct rig_entry	*entry;
 	struct listener		*listener;
+	int					sockopt;
 
-	addr = getstring(d, section, "rigctld_address", NULL);
-	if (addr == NULL)
-		return 0;
-	port = getstring(d, section, "rigctld_port", "4532");
-	entry = (struct rig_entry *)calloc(1, sizeof(struct rig_entry));
-	if (entry == NULL)
-		return 0;
-	entry->rig = init_rig(d, section);
-	if (entry->rig == NULL) {
-		free(entry);
-		return 0;
-	}
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = PF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_protocol = IPPROTO_TCP;
 	hints.ai_flags = AI_ADDRCONFIG|AI_PASSIVE;
-	if (getaddrinfo(addr, port, &hints, &res0) != 0) {
-		close_rig(entry->rig);
-		free(entry);
+	if (getaddrinfo(addr, port, &hints, &res0) != 0)
 		return 0;
-	}
 	for (res = res0; res; res = res->ai_next) {
 		listener = (struct listener *)calloc(1, sizeof(struct listener));
+		if (listener == NULL)
+			break;
 		listener->socket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
 		if (listener->socket == -1) {
 			free(listener);
@@ -320,596 +671,2245 @@ int add_rig(dictionary *d, char *section)
 			free(listener);
 			continue;
 		}
+#ifndef _WIN32
+		// Scrapes are closed from our end and leave the port in TIME_WAIT
+		sockopt = 1;
+		setsockopt(listener->socket, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt));
+#endif
 		if (bind(listener->socket, res->ai_addr, res->ai_addrlen) < 0) {
 			closesocket(listener->socket);
 			free(listener);
 			continue;
 		}
-		listen(listener->socket, 5);
-		listener->rig = entry->rig;
+		listen(listener->socket, backlog);
+		listener->type = EVENT_LISTENER;
+		listener->entry = entry;
+		listener->metrics = metrics;
 		listener->next_listener = listeners;
 		listeners = listener;
 		listener_count++;
 	}
-	if (listener_count) {
-		entry->next_rig_entry = rigs;
-		if (rigs)
-			rigs->prev_rig_entry = entry;
-		rigs = entry;
-		return listener_count;
+	freeaddrinfo(res0);
+	return listener_count;
+}
+
+#ifndef _WIN32
+/*
+ * Local clients can use a Unix socket instead, then its permissions
+ * decide who may connect.  A socket left behind by an earlier run is
+ * replaced, one that's still in use is not.
+ * Returns 1 if the listener was added, 0 otherwise.
+ */
+static int open_unix_listener(struct rig_entry *entry, const char *path, const char *mode, int backlog)
+{
+	struct sockaddr_un	sa = {};
+	struct stat			st;
+	struct listener		*listener;
+	int					sock;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		log_printf(LOG_NET, LOG_LEVEL_ERROR, "Unix socket path %s is too long", path);
+		return 0;
+	}
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock != -1 && connect(sock, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+			log_printf(LOG_NET, LOG_LEVEL_ERROR, "%s is in use by another process", path);
+			closesocket(sock);
+			return 0;
+		}
+		if (sock != -1)
+			closesocket(sock);
+		unlink(path);
+	}
+	listener = (struct listener *)calloc(1, sizeof(struct listener));
+	if (listener == NULL)
+		return 0;
+	listener->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener->socket == -1)
+		goto fail;
+	if (socket_nonblocking(listener->socket) == -1)
+		goto fail;
+	if (bind(listener->socket, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+		goto fail;
+	listener->path = strdup(path);
+	if (listener->path == NULL) {
+		unlink(path);
+		goto fail;
+	}
+	if (mode && chmod(path, strtol(mode, NULL, 8)) == -1)
+		log_printf(LOG_NET, LOG_LEVEL_WARNING, "Unable to set the mode of %s to %s", path, mode);
+	listen(listener->socket, backlog);
+	listener->type = EVENT_LISTENER;
+	listener->entry = entry;
+	listener->next_listener = listeners;
+	listeners = listener;
+	return 1;
+
+fail:
+	log_printf(LOG_NET, LOG_LEVEL_ERROR, "Unable to listen on %s: %s", path, strerror(errno));
+	if (listener->socket != -1)
+		closesocket(listener->socket);
+	free(listener);
+	return 0;
+}
+#endif
+
+static void free_listener(struct listener *l)
+{
+	closesocket(l->socket);
+	if (l->path) {
+		unlink(l->path);
+		free(l->path);
+	}
+	free(l);
+}
+
+/*
+ * The settings that apply to the entry rather than the rig, these can
+ * change at any time.
+ */
+static void read_tunables(struct rig_entry *entry, dictionary *d, char *section)
+{
+	char	*policy;
+
+	entry->state_lifetime = getint(d, section, "state_lifetime", 1000);
+	entry->max_output = getint(d, section, "max_output", 65536);
+	if (entry->max_output < 1024)
+		entry->max_output = 1024;
+	policy = getstring(d, section, "output_policy", "pause");
+	if (strcmp(policy, "drop") == 0)
+		entry->output_policy = OUTPUT_DROP;
+	else if (strcmp(policy, "coalesce") == 0)
+		entry->output_policy = OUTPUT_COALESCE;
+	else {
+		if (strcmp(policy, "pause") != 0)
+			log_printf(LOG_NET, LOG_LEVEL_WARNING, "Unknown output_policy %s, pausing instead", policy);
+		entry->output_policy = OUTPUT_PAUSE;
+	}
+}
+
+/*
+ * Opens the rigctld and metrics listeners for a section.  Metrics are
+ * only served for a rig that can be reached.  Returns the number of
+ * listeners added.
+ */
+static int open_rig_listeners(struct rig_entry *entry, dictionary *d, char *section)
+{
+	char	*port;
+	char	*addr;
+	char	*unix_path;
+	int		listener_count = 0;
+	int		metrics_count;
+	int		backlog;
+
+	// Big enough for every client reconnecting at once
+	backlog = getint(d, section, "listen_backlog", SOMAXCONN);
+	addr = getstring(d, section, "rigctld_address", NULL);
+	unix_path = getstring(d, section, "rigctld_unix_path", NULL);
+	port = getstring(d, section, "rigctld_port", "4532");
+	if (addr)
+		listener_count = open_listeners(entry, addr, port, false, backlog);
+#ifndef _WIN32
+	if (unix_path)
+		listener_count += open_unix_listener(entry, unix_path, getstring(d, section, "rigctld_unix_mode", NULL), backlog);
+#endif
+	addr = getstring(d, section, "metrics_address", NULL);
+	if (listener_count && addr) {
+		port = getstring(d, section, "metrics_port", "9532");
+		metrics_count = open_listeners(entry, addr, port, true, backlog);
+		if (metrics_count == 0)
+			log_printf(LOG_NET, LOG_LEVEL_WARNING, "Unable to listen for metrics on %s port %s", addr, port);
+		listener_count += metrics_count;
+	}
+	return listener_count;
+}
+
+/*
+ * Closes every listener belonging to a rig.
+ */
+static void close_listeners(struct rig_entry *entry)
+{
+	struct listener		**lp;
+	struct listener		*l;
+
+	for (lp = &listeners; *lp;) {
+		l = *lp;
+		if (l->entry == entry) {
+			*lp = l->next_listener;
+			free_listener(l);
+		}
+		else
+			lp = &l->next_listener;
+	}
+}
+
+int add_rig(dictionary *d, char *section)
+{
+	int					listener_count = 0;
+	struct rig_entry	*entry;
+
+	if (getstring(d, section, "rigctld_address", NULL) == NULL
+	    && getstring(d, section, "rigctld_unix_path", NULL) == NULL)
+		return 0;
+	entry = (struct rig_entry *)calloc(1, sizeof(struct rig_entry));
+	if (entry == NULL)
+		return 0;
+	entry->section = strdup(section);
+	if (entry->section == NULL) {
+		free(entry);
+		return 0;
+	}
+	entry->rig = init_rig(d, section);
+	if (entry->rig == NULL) {
+		free(entry->section);
+		free(entry);
+		return 0;
+	}
+	read_tunables(entry, d, section);
+	listener_count = open_rig_listeners(entry, d, section);
+	if (listener_count && start_worker(entry) == -1) {
+		close_listeners(entry);
+		listener_count = 0;
+	}
+	if (listener_count) {
+		entry->type = EVENT_RIG;
+		entry->next_rig_entry = rigs;
+		if (rigs)
+			rigs->prev_rig_entry = entry;
+		rigs = entry;
+		return listener_count;
+	}
+	close_rig(entry->rig);
+	free(entry->section);
+	free(entry);
+	return 0;
+}
+
+void free_connection(struct connection *c)
+{
+	if (c->subscribed)
+		atomic_dec(&c->entry->subscribers);
+	output_free(&c->out);
+	if (c->rx_buf)
+		free(c->rx_buf);
+	free(c);
+}
+
+void close_connection(struct connection *c)
+{
+	log_printf(LOG_NET, LOG_LEVEL_DEBUG, "Closing connection %d", c->socket);
+	closesocket(c->socket);
+	if (c->next_connection)
+		c->next_connection->prev_connection = c->prev_connection;
+	if (c->prev_connection)
+		c->prev_connection->next_connection = c->next_connection;
+	else
+		connections = c->next_connection;
+	/*
+	 * The worker may still be running requests for this connection,
+	 * the last one to complete frees it.
+	 */
+	if (c->pending) {
+		c->closed = true;
+		return;
+	}
+	free_connection(c);
+}
+
+void tx_append(struct request *r, const char *str)
+{
+	log_data(LOG_NET, LOG_LEVEL_TRACE, "TX", str, strlen(str));
+	output_string(&r->out, str);
+}
+
+int tx_printf(struct request *r, const char *format, ...)
+{
+	va_list	args;
+	int		ret;
+
+	va_start(args, format);
+	ret = output_vprintf(&r->out, format, args);
+	va_end(args);
+	if (ret != 0) {
+		tx_append(r, "RPRT -1\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Values are sent one per line, or in extended mode as "Label: value"
+ * followed by the separator.
+ */
+static int tx_label(struct request *r, const char *label)
+{
+	if (r->sep == 0)
+		return 0;
+	if (output_string(&r->out, label) != 0)
+		return -1;
+	return output_append(&r->out, ": ", 2);
+}
+
+static int tx_end(struct request *r)
+{
+	return output_append(&r->out, r->sep ? &r->sep : "\n", 1);
+}
+
+int tx_u64(struct request *r, const char *label, uint64_t val)
+{
+	log_printf(LOG_NET, LOG_LEVEL_TRACE, "TX %s: %"PRIu64, label, val);
+	if (tx_label(r, label) != 0 || output_uint(&r->out, val) != 0)
+		return -1;
+	return tx_end(r);
+}
+
+int tx_int(struct request *r, const char *label, int val)
+{
+	log_printf(LOG_NET, LOG_LEVEL_TRACE, "TX %s: %d", label, val);
+	if (tx_label(r, label) != 0 || output_int(&r->out, val) != 0)
+		return -1;
+	return tx_end(r);
+}
+
+int tx_str(struct request *r, const char *label, const char *str)
+{
+	log_printf(LOG_NET, LOG_LEVEL_TRACE, "TX %s: %s", label, str);
+	if (tx_label(r, label) != 0 || output_string(&r->out, str) != 0)
+		return -1;
+	return tx_end(r);
+}
+
+/*
+ * In extended mode every command ends with an RPRT line, so this only
+ * records the result for end_reply().
+ */
+int tx_rprt(struct request *r, int ret)
+{
+	if (ret > 0)
+		ret = 0-ret;
+	r->rprt = ret;
+	if (r->sep || r->deferred)
+		return 0;
+	log_printf(LOG_NET, LOG_LEVEL_TRACE, "TX RPRT %d", ret);
+	if (output_append(&r->out, "RPRT ", 5) != 0)
+		return -1;
+	if (output_int(&r->out, ret) != 0)
+		return -1;
+	return output_append(&r->out, "\n", 1);
+}
+
+/*
+ * Extended mode replies start with the long command name and arguments.
+ */
+static int begin_reply(struct request *r, struct parsed_cmd *cmd)
+{
+	const char	*name;
+	int			i;
+
+	if (r->sep == 0)
+		return 0;
+	r->rprt = 0;
+	name = parse_cmd_name(cmd->cmd);
+	if (name == NULL)
+		name = "";
+	if (output_string(&r->out, name) != 0 || output_append(&r->out, ":", 1) != 0)
+		return -1;
+	for (i = 0; i < cmd->argc; i++) {
+		if (output_append(&r->out, " ", 1) != 0 || output_string(&r->out, cmd->argv[i]) != 0)
+			return -1;
+	}
+	return output_append(&r->out, &r->sep, 1);
+}
+
+static int end_reply(struct request *r, int ret)
+{
+	if (r->sep == 0)
+		return 0;
+	if (ret == 0)
+		ret = r->rprt;
+	log_printf(LOG_NET, LOG_LEVEL_TRACE, "TX RPRT %d", ret);
+	if (output_append(&r->out, "RPRT ", 5) != 0)
+		return -1;
+	if (output_int(&r->out, ret) != 0)
+		return -1;
+	return output_append(&r->out, "\n", 1);
+}
+
+static int send_vfo(struct request *r, const char *label, enum vfos vfo)
+{
+	const char	*name = vfo_name(vfo);
+
+	if (name == NULL)
+		return -1;
+	return tx_str(r, label, name);
+}
+
+static int send_mode(struct request *r, enum rig_modes mode, bool tx)
+{
+	const char	*name = mode_name(mode);
+
+	if (name == NULL)
+		return -1;
+	if (tx_str(r, tx ? "TX Mode" : "Mode", name) != 0)
+		return -1;
+	return tx_int(r, tx ? "TX Passband" : "Passband", 0);
+}
+
+static int do_frequency_set(struct rig_entry *e, enum vfos vfo, uint64_t freq, bool tx)
+{
+	uint64_t		tx_freq;
+	uint64_t		rx_freq;
+	enum rig_modes	tx_mode;
+	enum rig_modes	rx_mode;
+	int				ret;
+	struct rig_state	st;
+	
+	read_state(e, &st);
+	if (tx) {
+		tx_mode = current_mode(e, vfo);
+		if (tx_mode == MODE_UNKNOWN)
+			tx_mode = state_mode(e);
+		rx_mode = current_mode(e, paired_vfo(vfo));
+		if (rx_mode == MODE_UNKNOWN)
+			rx_mode = tx_mode;
+		rx_freq = current_freq(e, paired_vfo(vfo));
+		tx_freq = freq;
+		if (tx_freq == 0)
+			tx_freq = get_frequency(e->rig, vfo);
+		if (rx_freq == 0)
+			rx_freq = tx_freq;
+	}
+	else {
+		rx_mode = current_mode(e, vfo);
+		if (rx_mode == MODE_UNKNOWN)
+			rx_mode = state_mode(e);
+		tx_mode = current_mode(e, paired_vfo(vfo));
+		if (tx_mode == MODE_UNKNOWN)
+			tx_mode = rx_mode;
+		tx_freq = current_freq(e, paired_vfo(vfo));
+		rx_freq = freq;
+		if (rx_freq == 0)
+			rx_freq = get_frequency(e->rig, vfo);
+		if (tx_freq == 0)
+			tx_freq = rx_freq;
+	}
+
+	if (vfo == VFO_MAIN || vfo == VFO_SUB)
+		ret = set_duplex(e->rig, rx_freq, rx_mode, tx_freq, tx_mode);
+	else if (st.split)
+		ret = set_split_frequency(e->rig, rx_freq, tx_freq);
+	else
+		ret = set_frequency(e->rig, vfo, freq);
+	if (ret != 0)
+		return -1;
+	save_freq(e, freq, vfo);
+	// The current VFO is now receiving on rx_freq
+	lock_state(e);
+	e->state.freq = rx_freq;
+	e->state.freq_tick = ms_ticks();
+	unlock_state(e);
+	return 0;
+}
+
+/*
+ * Command handlers return CMD_OK to carry on with the line, CMD_FAIL to
+ * reply RPRT -1 and give up on the rest of it or CMD_ABORT to just give
+ * up on it.
+ */
+#define CMD_OK		0
+#define CMD_FAIL	-1
+#define CMD_ABORT	-2
+
+typedef int (*cmd_handler_t)(struct request *r, struct parsed_cmd *cmd);
+
+static int cmd_set_freq(struct request *r, struct parsed_cmd *cmd)
+{
+	struct rig_entry	*e = r->conn->entry;
+	enum vfos			vfo = current_vfo(e);
+	uint64_t			u64;
+	int					ret;
+
+	if (sscanf(cmd->argv[0], "%"SCNu64, &u64) != 1)
+		return CMD_FAIL;
+	if (current_freq(e, vfo) == u64)
+		ret = 0;
+	else
+		ret = do_frequency_set(e, vfo, u64, false);
+	if (tx_rprt(r, ret) != 0)
+		return CMD_ABORT;
+	return CMD_OK;
+}
+
+static int cmd_set_split_freq(struct request *r, struct parsed_cmd *cmd)
+{
+	struct rig_entry	*e = r->conn->entry;
+	enum vfos			vfo = current_vfo(e);
+	uint64_t			u64;
+	int					ret;
+
+	if (sscanf(cmd->argv[0], "%"SCNu64, &u64) != 1)
+		return CMD_FAIL;
+	if (current_freq(e, paired_vfo(vfo)) == u64)
+		ret = 0;
+	else
+		ret = do_frequency_set(e, paired_vfo(vfo), u64, true);
+	if (tx_rprt(r, ret) != 0)
+		return CMD_ABORT;
+	return CMD_OK;
+}
+
+static int cmd_get_freq(struct request *r, struct parsed_cmd *cmd)
+{
+	uint64_t	u64;
+
+	u64 = state_freq(r->conn->entry);
+	if (u64 == 0)
+		return CMD_FAIL;
+	tx_u64(r, "Frequency", u64);
+	return CMD_OK;
+}
+
+static int cmd_get_split_freq(struct request *r, struct parsed_cmd *cmd)
+{
+	struct rig_entry	*e = r->conn->entry;
+	enum vfos			vfo = current_vfo(e);
+	uint64_t			tx_freq;
+
+	if (get_split_frequency(e->rig, NULL, &tx_freq) != 0) {
+		tx_freq = current_freq(e, paired_vfo(vfo));
+		if (tx_freq == 0)
+			return CMD_FAIL;
+	}
+	tx_u64(r, "TX Frequency", tx_freq);
+	return CMD_OK;
+}
+
+static int set_vfo_mode(struct request *r, enum vfos vfo, const char *arg)
+{
+	struct rig_entry	*e = r->conn->entry;
+	enum rig_modes		mode;
+	int					ret;
+
+	mode = parse_mode(arg);
+	if (mode == MODE_UNKNOWN)
+		return CMD_FAIL;
+	if (current_mode(e, vfo) == mode)
+		ret = 0;
+	else
+		ret = set_mode(e->rig, mode);
+	if (tx_rprt(r, ret) != 0)
+		return CMD_ABORT;
+	if (ret == 0)
+		save_mode(e, mode, vfo);
+	return CMD_OK;
+}
+
+static int cmd_set_mode(struct request *r, struct parsed_cmd *cmd)
+{
+	return set_vfo_mode(r, current_vfo(r->conn->entry), cmd->argv[0]);
+}
+
+static int cmd_set_split_mode(struct request *r, struct parsed_cmd *cmd)
+{
+	/* TODO: This matters when setting duplex... */
+	return set_vfo_mode(r, paired_vfo(current_vfo(r->conn->entry)), cmd->argv[0]);
+}
+
+static int cmd_get_mode(struct request *r, struct parsed_cmd *cmd)
+{
+	if (send_mode(r, state_mode(r->conn->entry), false) != 0)
+		return CMD_FAIL;
+	return CMD_OK;
+}
+
+static int cmd_get_split_mode(struct request *r, struct parsed_cmd *cmd)
+{
+	struct rig_entry	*e = r->conn->entry;
+
+	if (send_mode(r, current_mode(e, paired_vfo(current_vfo(e))), true) != 0)
+		return CMD_FAIL;
+	return CMD_OK;
+}
+
+static int cmd_set_vfo(struct request *r, struct parsed_cmd *cmd)
+{
+	struct rig_entry	*e = r->conn->entry;
+	enum vfos			vfo;
+	int					ret;
+
+	vfo = parse_vfo(cmd->argv[0]);
+	if (vfo == VFO_UNKNOWN)
+		return CMD_FAIL;
+	if (e->rig->set_vfo) {
+		ret = set_vfo(e->rig, vfo);
+		if (tx_rprt(r, ret) != 0)
+			return CMD_ABORT;
+		if (ret == 0)
+			set_state_vfo(e, vfo);
+	}
+	else {
+		// Fake a VFO...
+		if (do_frequency_set(e, vfo, current_freq(e, vfo), false) != 0)
+			return CMD_FAIL;
+		if (current_mode(e, vfo) == MODE_UNKNOWN)
+			save_mode(e, state_mode(e), vfo);
+		if (set_mode(e->rig, current_mode(e, vfo)) != 0)
+			return CMD_FAIL;
+		set_state_vfo(e, vfo);
+		tx_rprt(r, 0);
+	}
+	return CMD_OK;
+}
+
+static int cmd_set_split_vfo(struct request *r, struct parsed_cmd *cmd)
+{
+	struct rig_entry	*e = r->conn->entry;
+	enum vfos			vfo;
+	uint64_t			u64, rx_freq, tx_freq;
+	int					i;
+	int					ret;
+
+	if (sscanf(cmd->argv[0], "%d", &i) != 1)
+		return CMD_FAIL;
+	if (i==0) {
+		if (state_split(e)) {
+			u64 = state_freq(e);
+			if (u64 == 0)
+				tx_rprt(r, -1);
+			else {
+				ret = set_frequency(e->rig, VFO_UNKNOWN, u64);
+				if (tx_rprt(r, ret) != 0)
+					return CMD_ABORT;
+				if (ret == 0)
+					set_state_split(e, false);
+			}
+		}
+		else
+			tx_rprt(r, 0);
+	}
+	else {
+		if (!state_split(e)) {
+			// "Enable split"
+			// First, switch to the "other" VFO to get the frequency
+			vfo = current_vfo(e);
+			rx_freq = state_freq(e);
+			if (rx_freq == 0)
+				return CMD_FAIL;
+			if (e->rig->set_vfo) {
+				tx_freq = get_frequency(e->rig, paired_vfo(vfo));
+
+				if (tx_freq == 0)
+					return CMD_FAIL;
+			}
+			else {
+				tx_freq = current_freq(e, paired_vfo(vfo));
+			}
+			// And finally, set the split.
+			set_state_split(e, true);
+			ret = do_frequency_set(e, paired_vfo(vfo), tx_freq, true);
+			if (ret != 0)
+				set_state_split(e, false);
+			if (tx_rprt(r, ret) != 0)
+				return CMD_ABORT;
+		}
+		else
+			tx_rprt(r, 0);
+	}
+	return CMD_OK;
+}
+
+static int cmd_get_vfo(struct request *r, struct parsed_cmd *cmd)
+{
+	if (send_vfo(r, "VFO", current_vfo(r->conn->entry)) != 0)
+		return CMD_FAIL;
+	return CMD_OK;
+}
+
+static int cmd_get_split_vfo(struct request *r, struct parsed_cmd *cmd)
+{
+	struct rig_entry	*e = r->conn->entry;
+	enum vfos			vfo;
+	bool				split;
+
+	split = state_split(e);
+	vfo = current_vfo(e);
+	if (vfo == VFO_UNKNOWN)
+		return CMD_FAIL;
+	tx_int(r, "Split", split);
+	if (send_vfo(r, "TX VFO", split ? paired_vfo(vfo) : vfo) != 0)
+		return CMD_FAIL;
+	return CMD_OK;
+}
+
+static int cmd_set_ptt(struct request *r, struct parsed_cmd *cmd)
+{
+	struct rig_entry	*e = r->conn->entry;
+	int					i;
+	int					ret;
+
+	if (sscanf(cmd->argv[0], "%d", &i) != 1)
+		return CMD_FAIL;
+	ret = set_ptt(e->rig, i);
+	if (ret == 0)
+		set_state_ptt(e, i);
+	tx_rprt(r, ret);
+	return CMD_OK;
+}
+
+static int cmd_get_ptt(struct request *r, struct parsed_cmd *cmd)
+{
+	int		ptt = state_ptt(r->conn->entry);
+
+	if (ptt == 0 || ptt == 1) {
+		tx_int(r, "PTT", ptt);
+		return CMD_OK;
+	}
+	return CMD_FAIL;
+}
+
+static int cmd_chk_vfo(struct request *r, struct parsed_cmd *cmd)
+{
+	if (r->sep)
+		tx_int(r, "ChkVFO", 0);
+	else
+		tx_append(r, "CHKVFO 0\n");
+	return CMD_OK;
+}
+
+static int cmd_get_dcd(struct request *r, struct parsed_cmd *cmd)
+{
+	int		dcd = get_squelch(r->conn->entry->rig);
+
+	if (dcd == 0 || dcd == 1) {
+		tx_int(r, "DCD", dcd);
+		return CMD_OK;
+	}
+	return CMD_FAIL;
+}
+
+static int cmd_get_level(struct request *r, struct parsed_cmd *cmd)
+{
+	int		i;
+
+	if (strcmp(cmd->argv[0], "STRENGTH") != 0)
+		return CMD_FAIL;
+	i = get_smeter(r->conn->entry->rig);
+	if (i == -1)
+		return CMD_FAIL;
+	tx_int(r, "Level Value", i-49);
+	return CMD_OK;
+}
+
+static int cmd_dump_state(struct request *r, struct parsed_cmd *cmd)
+{
+	struct rig			*rig = r->conn->entry->rig;
+	struct bandlimit	*limit;
+	int					i;
+
+	// Output copied from the dummy driver...
+	tx_append(r, "0\n");			// Protocol version
+	tx_append(r, "2\n");			// Rig model (dummy)
+	tx_append(r, "2\n");			// ITU region (!)
+		// RX info: lowest/highest freq, modes available, low power, high power, VFOs, antennas
+	i = 0x10000003;	// VFO_MEM, VFO_A, VFO_B
+	if (rig->set_duplex)
+		i |= 0xc000000;
+	for (limit = rig->rx_limits; limit; limit = limit->next)
+		tx_printf(r, "%"PRIu64" %"PRIu64" 0x1ff -1 -1 0x%x 0x01\n", limit->low, limit->high, i);
+		// Terminated with all zeros
+	tx_append(r, "0 0 0 0 0 0 0\n");
+		// TX info (as above)
+	for (limit = rig->tx_limits; limit; limit = limit->next)
+		tx_printf(r, "%"PRIu64" %"PRIu64" 0x1ff 0 100 0x%x 0x01\n", limit->low, limit->high, i);
+	tx_append(r, "0 0 0 0 0 0 0\n");
+		// Tuning steps available, modes, steps
+	tx_append(r, "0 0\n");
+		// Filter sizes, mode, bandwidth
+	tx_append(r, "0 0\n");
+	tx_append(r, "0\n");			// Max RIT
+	tx_append(r, "0\n");			// Max XIT
+	tx_append(r, "0\n");			// Max IF shift
+	tx_append(r, "0\n");			// "announces"
+	tx_append(r, "\n");				// Preamp settings
+	tx_append(r, "\n");				// Attenuator settings
+	tx_append(r, "0x0\n");			// has get func
+	tx_append(r, "0x0\n");			// has set func
+	tx_printf(r, "0x%x\n", rig->get_smeter?0x40000000:0);	// get level
+	tx_append(r, "0x0\n");			// set level
+	tx_append(r, "0x0\n");			// get param
+	tx_append(r, "0x0\n");			// set param
+	return CMD_OK;
+}
+
+/*
+ * \subscribe takes a comma separated list of freq, mode, vfo, split and
+ * ptt, or all or none, and replaces any earlier subscription.  The
+ * event loop pushes the current values and then every change.
+ */
+static int cmd_subscribe(struct request *r, struct parsed_cmd *cmd)
+{
+	struct connection	*c = r->conn;
+	const char			*p = cmd->argv[0];
+	unsigned			subs = 0;
+	size_t				len;
+	int					i;
+
+	while (*p) {
+		len = strcspn(p, ",");
+		for (i = 0; subscription_names[i].name; i++) {
+			if (strlen(subscription_names[i].name) == len && strncmp(p, subscription_names[i].name, len) == 0)
+				break;
+		}
+		if (subscription_names[i].name == NULL)
+			return CMD_FAIL;
+		subs |= subscription_names[i].subs;
+		p += len;
+		if (*p == ',')
+			p++;
+	}
+	// Make sure there's something to start with
+	if (subs & SUB_FREQ)
+		state_freq(c->entry);
+	if (subs & SUB_MODE)
+		state_mode(c->entry);
+	if (subs & SUB_VFO)
+		current_vfo(c->entry);
+	if (subs & SUB_SPLIT)
+		state_split(c->entry);
+	if (subs & SUB_PTT)
+		state_ptt(c->entry);
+	if (subs && !c->subscribed)
+		atomic_inc(&c->entry->subscribers);
+	else if (!subs && c->subscribed)
+		atomic_dec(&c->entry->subscribers);
+	atomic_store(&c->subscribed, subs);
+	if (tx_rprt(r, 0) != 0)
+		return CMD_ABORT;
+	return CMD_OK;
+}
+
+/*
+ * Indexed by the short command, commands without a handler fail.
+ */
+static const cmd_handler_t handlers[256] = {
+	['F'] = cmd_set_freq,
+	['f'] = cmd_get_freq,
+	['I'] = cmd_set_split_freq,
+	['i'] = cmd_get_split_freq,
+	['M'] = cmd_set_mode,
+	['m'] = cmd_get_mode,
+	['X'] = cmd_set_split_mode,
+	['x'] = cmd_get_split_mode,
+	['V'] = cmd_set_vfo,
+	['v'] = cmd_get_vfo,
+	['S'] = cmd_set_split_vfo,
+	['s'] = cmd_get_split_vfo,
+	['T'] = cmd_set_ptt,
+	['t'] = cmd_get_ptt,
+	['l'] = cmd_get_level,
+	[0x8b] = cmd_get_dcd,
+	[0x8f] = cmd_dump_state,
+	[0xe0] = cmd_subscribe,
+	[0xf0] = cmd_chk_vfo,
+};
+
+static bool is_set(unsigned char cmd)
+{
+	switch (cmd) {
+		case 'F':
+		case 'I':
+		case 'M':
+		case 'X':
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Returns true if the line starts with more than one frequency or mode
+ * setting, which the backend can then make in one go.  Lines too long
+ * to copy are just run a command at a time.
+ */
+static bool coalesce_sets(const char *cmdline)
+{
+	char				buf[256];
+	char				*p = buf;
+	struct parsed_cmd	cmd;
+	unsigned			sets = 0;
+
+	if (strlen(cmdline) >= sizeof(buf))
+		return false;
+	strcpy(buf, cmdline);
+	while (parse_command(&p, &cmd) == 1 && is_set(cmd.cmd)) {
+		if (++sets > 1)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * A setting made in a transaction, replied to once it's been committed.
+ */
+#define MAX_PENDING_SETS	16
+struct pending_set {
+	struct parsed_cmd	cmd;
+	char				sep;
+	int					ret;
+	int					rprt;
+};
+
+/*
+ * Commits the transaction and sends the replies to the settings made
+ * in it.  If the commit fails, every setting that was accepted fails
+ * with it and what they saved isn't believed.  Returns -1 if the rest
+ * of the line shouldn't be run.
+ */
+static int commit_sets(struct request *r, struct pending_set *sets, int count)
+{
+	struct rig_entry	*e = r->conn->entry;
+	int					ret;
+	int					i;
+
+	ret = rig_commit(e->rig);
+	if (ret != 0) {
+		log_printf(LOG_NET, LOG_LEVEL_WARNING, "Unable to apply settings: %s", strerror(ret));
+		lock_state(e);
+		e->state.freq_tick = 0;
+		e->state.mode_tick = 0;
+		e->state.split_tick = 0;
+		unlock_state(e);
+	}
+	for (i = 0; i < count; i++) {
+		if (ret != 0 && sets[i].ret == CMD_OK && sets[i].rprt == 0)
+			sets[i].rprt = ret;
+		metrics_command(&e->metrics, sets[i].cmd.cmd, sets[i].ret != CMD_OK || sets[i].rprt != 0, r->received);
+		r->sep = sets[i].sep;
+		if (begin_reply(r, &sets[i].cmd) != 0)
+			return -1;
+		if (sets[i].ret == CMD_OK && tx_rprt(r, sets[i].rprt) != 0)
+			return -1;
+		if (end_reply(r, sets[i].ret) != 0)
+			return -1;
+		if (sets[i].ret != CMD_OK) {
+			if (r->sep == 0)
+				tx_append(r, "RPRT -1\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * An extended response prefix applies to the rest of the line unless
+ * another command has its own.
+ */
+void handle_command(struct request *r, char *cmdline)
+{
+	struct rig_entry	*e = r->conn->entry;
+	struct parsed_cmd	cmd;
+	struct pending_set	sets[MAX_PENDING_SETS];
+	int					count = 0;
+	char				*p;
+	char				sep = 0;
+	bool				txn;
+	int					ret;
+
+	p = strchr(cmdline, '\r');
+	if (p)
+		*p = 0;
+	log_printf(LOG_NET, LOG_LEVEL_TRACE, "RX %d: %s", r->conn->socket, cmdline);
+	txn = coalesce_sets(cmdline) && rig_begin(e->rig) == 0;
+	while ((ret = parse_command(&cmdline, &cmd)) == 1) {
+		if (cmd.sep)
+			sep = cmd.sep;
+		r->sep = sep;
+		r->rprt = 0;
+		if (txn && is_set(cmd.cmd)) {
+			r->deferred = true;
+			ret = handlers[cmd.cmd](r, &cmd);
+			r->deferred = false;
+			if (ret == CMD_ABORT) {
+				rig_commit(e->rig);
+				return;
+			}
+			sets[count].cmd = cmd;
+			sets[count].sep = sep;
+			sets[count].ret = ret;
+			sets[count].rprt = r->rprt;
+			count++;
+			if (ret == CMD_OK && count < MAX_PENDING_SETS)
+				continue;
+		}
+		// The settings end at the first command that isn't one
+		if (txn) {
+			txn = false;
+			ret = commit_sets(r, sets, count);
+			count = 0;
+			if (ret != 0)
+				return;
+			if (is_set(cmd.cmd))
+				continue;
+		}
+		// Known to the parser but not handled, counted under its own name
+		if (handlers[cmd.cmd] == NULL) {
+			metrics_command(&e->metrics, cmd.cmd, true, r->received);
+			tx_append(r, "RPRT -1\n");
+			return;
+		}
+		if (begin_reply(r, &cmd) != 0)
+			return;
+		ret = handlers[cmd.cmd](r, &cmd);
+		metrics_command(&e->metrics, cmd.cmd, ret != CMD_OK || r->rprt != 0, r->received);
+		if (ret == CMD_ABORT)
+			return;
+		if (end_reply(r, ret) != 0)
+			return;
+		if (ret != CMD_OK) {
+			if (r->sep == 0)
+				tx_append(r, "RPRT -1\n");
+			return;
+		}
+	}
+	if (txn && commit_sets(r, sets, count) != 0)
+		return;
+	if (ret == -1) {
+		metrics_command(&e->metrics, 0, true, r->received);
+		tx_append(r, "RPRT -1\n");
+	}
+}
+
+/*
+ * Answers a line made up only of reads from the shared state, appending
+ * the replies to out.  Normally the state has to be fresh, but a
+ * connection that's fallen behind may be answered with any age.  The
+ * line is left as it was so it can still be queued.
+ */
+static bool answer_from_state(struct connection *c, const char *cmd, size_t len, bool any_age, uint64_t received, struct output *out)
+{
+	struct rig_entry	*e = c->entry;
+	struct request		r = {};
+	char				line[64];
+	unsigned char		answered[sizeof(line)];
+	int					count = 0;
+	int					i;
+	struct rig_state	st;
+	uint64_t			now = ms_ticks();
+	bool				vfo_usable;
+	char				*p;
+	struct parsed_cmd	parsed;
+	char				sep = 0;
+	int					ret = 0;
+
+	// Anything this long isn't just reads
+	if (len >= sizeof(line))
+		return false;
+	memcpy(line, cmd, len);
+	line[len] = 0;
+	p = strchr(line, '\r');
+	if (p)
+		*p = 0;
+	r.conn = c;
+	read_state(e, &st);
+	vfo_usable = e->rig->get_vfo == NULL || usable(e, st.vfo_tick, now, any_age);
+	p = line;
+	while (ret == 0 && (ret = parse_command(&p, &parsed)) == 1) {
+		if (parsed.argc != 0)
+			break;
+		if (parsed.sep)
+			sep = parsed.sep;
+		r.sep = sep;
+		if (begin_reply(&r, &parsed) != 0)
+			break;
+		ret = -1;
+		switch (parsed.cmd) {
+			case 'f':
+				if (usable(e, st.freq_tick, now, any_age))
+					ret = tx_u64(&r, "Frequency", st.freq);
+				break;
+			case 'm':
+				if (usable(e, st.mode_tick, now, any_age))
+					ret = send_mode(&r, st.mode, false);
+				break;
+			case 'v':
+				if (vfo_usable)
+					ret = send_vfo(&r, "VFO", st.current_vfo);
+				break;
+			case 't':
+				if (usable(e, st.ptt_tick, now, any_age) && (st.ptt == 0 || st.ptt == 1))
+					ret = tx_int(&r, "PTT", st.ptt);
+				break;
+			case 's':
+				if (vfo_usable && usable(e, st.split_tick, now, any_age)) {
+					tx_int(&r, "Split", st.split);
+					ret = send_vfo(&r, "TX VFO", st.split ? paired_vfo(st.current_vfo) : st.current_vfo);
+				}
+				break;
+		}
+		if (ret == 0)
+			ret = end_reply(&r, 0);
+		answered[count++] = parsed.cmd;
+	}
+	// Only a clean end of line means everything was answered
+	if (ret != 0 || line[0] == 0) {
+		output_free(&r.out);
+		return false;
+	}
+	log_printf(LOG_NET, LOG_LEVEL_TRACE, "RX %d: %s (from state)", c->socket, line);
+	for (i = 0; i < count; i++)
+		metrics_command(&e->metrics, answered[i], false, received);
+	output_splice(out, &r.out);
+	return true;
+}
+
+/*
+ * Requests are only created and retired by the event loop, so they're
+ * recycled through a plain free list, buffer and all.
+ */
+static struct request *new_request(struct connection *c)
+{
+	struct request	*r;
+
+	r = free_requests;
+	if (r)
+		free_requests = r->next;
+	else {
+		r = (struct request *)calloc(1, sizeof(struct request));
+		if (r == NULL)
+			return NULL;
+	}
+	r->conn = c;
+	r->next = NULL;
+	return r;
+}
+
+static void retire_request(struct request *r)
+{
+	output_free(&r->out);
+	r->next = free_requests;
+	free_requests = r;
+}
+
+static void free_request(struct request *r)
+{
+	if (r->buf)
+		free(r->buf);
+	output_free(&r->out);
+	free(r);
+}
+
+/*
+ * If the connection has fallen behind and its rig coalesces, reads are
+ * answered from whatever state there is rather than asking the rig.
+ */
+static void run_request(struct request *r)
+{
+	struct connection	*c = r->conn;
+	char				*line = r->buf + r->start;
+	char				*end = r->buf + r->end;
+	char				*nl;
+
+	while (line < end) {
+		nl = memchr(line, '\n', end - line);
+		if (atomic_load(&c->behind) && answer_from_state(c, line, nl - line, true, r->received, &r->out))
+			atomic_inc(&c->entry->backlog.coalesced);
+		else {
+			*nl = 0;
+			handle_command(r, line);
+		}
+		line = nl + 1;
+	}
+}
+
+static void worker_thread(void *arg)
+{
+	struct rig_entry	*entry = (struct rig_entry *)arg;
+	struct request		*r;
+
+	seed_state(entry);
+	for (;;) {
+		if (semaphore_wait(&entry->queue_sem) != 0)
+			continue;
+		mutex_lock(&entry->queue_lock);
+		if (entry->terminate) {
+			mutex_unlock(&entry->queue_lock);
+			break;
+		}
+		if (entry->park) {
+			entry->park = false;
+			mutex_unlock(&entry->queue_lock);
+			semaphore_post(&entry->parked);
+			while (semaphore_wait(&entry->resume) != 0)
+				;
+			if (entry->reseed && entry->rig != NULL) {
+				entry->reseed = false;
+				seed_state(entry);
+			}
+			continue;
+		}
+		r = entry->queue_head;
+		if (r != NULL) {
+			entry->queue_head = r->next;
+			if (entry->queue_head == NULL)
+				entry->queue_tail = NULL;
+		}
+		mutex_unlock(&entry->queue_lock);
+		if (r == NULL)
+			continue;
+
+		r->next = NULL;
+		run_request(r);
+
+		mutex_lock(&entry->queue_lock);
+		if (entry->done_tail)
+			entry->done_tail->next = r;
+		else
+			entry->done_head = r;
+		entry->done_tail = r;
+		mutex_unlock(&entry->queue_lock);
+		wake_loop(entry);
+	}
+	log_thread_exit();
+}
+
+static int start_worker(struct rig_entry *entry)
+{
+#ifdef WITH_EVENTFD
+	entry->notify_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (entry->notify_fd[0] == -1)
+		return -1;
+	entry->notify_fd[1] = entry->notify_fd[0];
+#else
+	if (pipe(entry->notify_fd) == -1)
+		return -1;
+	fcntl(entry->notify_fd[0], F_SETFL, fcntl(entry->notify_fd[0], F_GETFL) | O_NONBLOCK);
+	fcntl(entry->notify_fd[1], F_SETFL, fcntl(entry->notify_fd[1], F_GETFL) | O_NONBLOCK);
+#endif
+	if (mutex_init(&entry->queue_lock) != 0)
+		goto fail_fd;
+	if (mutex_init(&entry->state_lock) != 0)
+		goto fail_mutex;
+	if (semaphore_init(&entry->queue_sem, 0) != 0)
+		goto fail_state;
+	if (semaphore_init(&entry->parked, 0) != 0)
+		goto fail_sem;
+	if (semaphore_init(&entry->resume, 0) != 0)
+		goto fail_parked;
+	/* Not every backend can tell us about changes, that's fine */
+	set_notify(entry->rig, state_notify, entry);
+	if (create_thread(worker_thread, entry, &entry->worker) != 0)
+		goto fail_resume;
+	return 0;
+
+fail_resume:
+	set_notify(entry->rig, NULL, NULL);
+	semaphore_destroy(&entry->resume);
+fail_parked:
+	semaphore_destroy(&entry->parked);
+fail_sem:
+	semaphore_destroy(&entry->queue_sem);
+fail_state:
+	mutex_destroy(&entry->state_lock);
+fail_mutex:
+	mutex_destroy(&entry->queue_lock);
+fail_fd:
+	close(entry->notify_fd[0]);
+	if (entry->notify_fd[1] != entry->notify_fd[0])
+		close(entry->notify_fd[1]);
+	return -1;
+}
+
+/*
+ * Frees a request that will never complete, and its connection if that
+ * was already closed and waiting for it.
+ */
+static void drop_request(struct request *r)
+{
+	struct connection	*c = r->conn;
+
+	if (--c->pending == 0 && c->closed)
+		free_connection(c);
+	free_request(r);
+}
+
+static void stop_worker(struct rig_entry *entry)
+{
+	struct request	*r;
+
+	mutex_lock(&entry->queue_lock);
+	entry->terminate = true;
+	mutex_unlock(&entry->queue_lock);
+	semaphore_post(&entry->queue_sem);
+	wait_thread(entry->worker);
+	set_notify(entry->rig, NULL, NULL);
+	while (entry->queue_head) {
+		r = entry->queue_head;
+		entry->queue_head = r->next;
+		drop_request(r);
+	}
+	while (entry->done_head) {
+		r = entry->done_head;
+		entry->done_head = r->next;
+		drop_request(r);
+	}
+	semaphore_destroy(&entry->resume);
+	semaphore_destroy(&entry->parked);
+	semaphore_destroy(&entry->queue_sem);
+	mutex_destroy(&entry->state_lock);
+	mutex_destroy(&entry->queue_lock);
+	close(entry->notify_fd[0]);
+	if (entry->notify_fd[1] != entry->notify_fd[0])
+		close(entry->notify_fd[1]);
+}
+
+/*
+ * Hands a request to the rig worker.
+ */
+static void queue_request(struct request *r)
+{
+	struct connection	*c = r->conn;
+	struct rig_entry	*entry = c->entry;
+
+	c->pending++;
+	mutex_lock(&entry->queue_lock);
+	if (entry->queue_tail)
+		entry->queue_tail->next = r;
+	else
+		entry->queue_head = r;
+	entry->queue_tail = r;
+	mutex_unlock(&entry->queue_lock);
+	semaphore_post(&entry->queue_sem);
+}
+
+/*
+ * Stops the worker between requests and waits until it has, so the
+ * event loop can change the rig under it.
+ */
+static void park_worker(struct rig_entry *entry)
+{
+	mutex_lock(&entry->queue_lock);
+	entry->park = true;
+	mutex_unlock(&entry->queue_lock);
+	semaphore_post(&entry->queue_sem);
+	while (semaphore_wait(&entry->parked) != 0)
+		;
+}
+
+static void resume_worker(struct rig_entry *entry)
+{
+	semaphore_post(&entry->resume);
+}
+
+/*
+ * Sends as much of the pending output as the socket will take.
+ * Returns -1 if the connection has failed.
+ */
+static int write_connection(struct connection *c)
+{
+	return output_send(&c->out, c->socket);
+}
+
+/*
+ * Hands every complete line in rx_buf from start on to the worker
+ * by swapping the buffer into a request.  Only the partial line at the
+ * end, if any, is copied into the new rx_buf.
+ */
+static int dispatch_lines(struct connection *c, size_t start, size_t end, uint64_t received)
+{
+	struct request	*r;
+	char			*buf;
+	size_t			size;
+	size_t			tail = c->rx_buf_pos - end;
+
+	r = new_request(c);
+	if (r == NULL)
+		return -1;
+	r->received = received;
+	if (r->buf_size < tail) {
+		buf = (char *)realloc(r->buf, tail);
+		if (buf == NULL) {
+			retire_request(r);
+			return -1;
+		}
+		r->buf = buf;
+		r->buf_size = tail;
+	}
+	buf = r->buf;
+	size = r->buf_size;
+	r->buf = c->rx_buf;
+	r->buf_size = c->rx_buf_size;
+	r->start = start;
+	r->end = end;
+	c->rx_buf = buf;
+	c->rx_buf_size = size;
+	c->rx_buf_pos = tail;
+	if (tail)
+		memcpy(c->rx_buf, r->buf + end, tail);
+	c->queued += end - start;
+	queue_request(r);
+	return 0;
+}
+
+static int push_event(struct connection *c, uint64_t now, const char *label)
+{
+	log_printf(LOG_NET, LOG_LEVEL_TRACE, "Pushing %s to %d", label, c->socket);
+	return output_printf(&c->out, "EVENT %"PRIu64".%03u %s: ", now / 1000, (unsigned)(now % 1000), label);
+}
+
+/*
+ * Pushes the subscribed values that differ from what was last pushed to
+ * the connection as "EVENT <time> <Label>: <value>" lines.  Nothing is
+ * pushed while the connection is paused, once it resumes it only gets
+ * the latest values.
+ */
+static int push_connection(struct connection *c)
+{
+	struct rig_state	st;
+	unsigned			subs = atomic_load(&c->subscribed);
+	unsigned			added = subs & ~c->pushing;
+	uint64_t			now;
+	const char			*name;
+
+	// Newly subscribed values start with what they are now
+	if (added & SUB_FREQ)
+		c->pushed.freq = 0;
+	if (added & SUB_MODE)
+		c->pushed.mode = MODE_UNKNOWN;
+	if (added & SUB_VFO)
+		c->pushed.vfo = VFO_UNKNOWN;
+	if (added & SUB_SPLIT)
+		c->pushed.split = -1;
+	if (added & SUB_PTT)
+		c->pushed.ptt = -1;
+	c->pushing = subs;
+	if (subs == 0 || c->paused)
+		return 0;
+	read_state(c->entry, &st);
+	now = ms_time();
+	if ((subs & SUB_FREQ) && st.freq_tick && st.freq != c->pushed.freq) {
+		c->pushed.freq = st.freq;
+		if (push_event(c, now, "Frequency") != 0 || output_uint(&c->out, st.freq) != 0 || output_append(&c->out, "\n", 1) != 0)
+			return -1;
+	}
+	name = mode_name(st.mode);
+	if ((subs & SUB_MODE) && st.mode_tick && name && st.mode != c->pushed.mode) {
+		c->pushed.mode = st.mode;
+		if (push_event(c, now, "Mode") != 0 || output_string(&c->out, name) != 0 || output_append(&c->out, "\n", 1) != 0)
+			return -1;
+	}
+	name = vfo_name(st.current_vfo);
+	if ((subs & SUB_VFO) && (st.vfo_tick || c->entry->rig->get_vfo == NULL) && name && st.current_vfo != c->pushed.vfo) {
+		c->pushed.vfo = st.current_vfo;
+		if (push_event(c, now, "VFO") != 0 || output_string(&c->out, name) != 0 || output_append(&c->out, "\n", 1) != 0)
+			return -1;
+	}
+	if ((subs & SUB_SPLIT) && st.split_tick && st.split != c->pushed.split) {
+		c->pushed.split = st.split;
+		if (push_event(c, now, "Split") != 0 || output_int(&c->out, st.split) != 0 || output_append(&c->out, "\n", 1) != 0)
+			return -1;
+	}
+	if ((subs & SUB_PTT) && st.ptt_tick && (st.ptt == 0 || st.ptt == 1) && st.ptt != c->pushed.ptt) {
+		c->pushed.ptt = st.ptt;
+		if (push_event(c, now, "PTT") != 0 || output_int(&c->out, st.ptt) != 0 || output_append(&c->out, "\n", 1) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int read_connection(struct connection *c);
+static int check_backlog(struct connection *c);
+
+/*
+ * Sends what it can and applies the backlog policy.  A resumed
+ * connection can queue more output without the socket ever becoming
+ * unwritable, so keep sending until it stops resuming.
+ */
+static int flush_connection(struct connection *c)
+{
+	int	ret;
+
+	do {
+		if (write_connection(c) == -1)
+			return -1;
+		if (c->closing)
+			return c->out.len ? 0 : -1;
+		ret = check_backlog(c);
+	} while (ret == 1);
+	return ret;
+}
+
+/*
+ * Applies the rig's output policy once a connection's backlog passes
+ * max_output, and resumes a paused connection once it has halved.
+ * Returns -1 if the connection should be closed, 1 if it was resumed
+ * and may have new output.
+ */
+static int check_backlog(struct connection *c)
+{
+	struct rig_entry	*e = c->entry;
+	size_t				backlog = c->out.len + c->queued;
+
+	if (c->paused) {
+		if (backlog > e->max_output / 2)
+			return 0;
+		log_printf(LOG_NET, LOG_LEVEL_DEBUG, "Resuming connection %d", c->socket);
+		c->paused = false;
+		atomic_store(&c->behind, 0);
+		// Nothing new will be signalled for what arrived while paused
+		if (read_connection(c) == -1 || push_connection(c) == -1)
+			return -1;
+		return 1;
+	}
+	if (backlog <= e->max_output)
+		return 0;
+	switch (e->output_policy) {
+		case OUTPUT_DROP:
+			e->backlog.drops++;
+			log_printf(LOG_NET, LOG_LEVEL_WARNING, "Dropping connection %d with %u bytes backlog", c->socket, (unsigned)backlog);
+			return -1;
+		case OUTPUT_COALESCE:
+			atomic_store(&c->behind, 1);
+			// Fall through
+		case OUTPUT_PAUSE:
+			e->backlog.pauses++;
+			log_printf(LOG_NET, LOG_LEVEL_INFO, "Pausing connection %d with %u bytes backlog", c->socket, (unsigned)backlog);
+			c->paused = true;
+			break;
+	}
+	return 0;
+}
+
+/*
+ * Handles every complete line in rx_buf.  Leading lines that can be
+ * answered from the rig state are answered immediately, the rest go to
+ * the worker in one request.
+ */
+static int handle_lines(struct connection *c)
+{
+	uint64_t	now = us_ticks();
+	char		*nl;
+	size_t		start;
+	size_t		end;
+
+	// Find the end of the last complete line
+	for (end = c->rx_buf_pos; end > 0; end--) {
+		if (c->rx_buf[end - 1] == '\n')
+			break;
+	}
+	if (end == 0) {
+		if (c->rx_buf_pos >= c->entry->max_output) {
+			c->entry->backlog.oversize++;
+			log_printf(LOG_NET, LOG_LEVEL_WARNING, "Dropping connection %d, line too long", c->socket);
+			return -1;
+		}
+		return 0;
+	}
+	start = 0;
+	if (c->pending == 0) {
+		while (start < end) {
+			nl = memchr(c->rx_buf + start, '\n', end - start);
+			if (!answer_from_state(c, c->rx_buf + start, nl - (c->rx_buf + start), false, now, &c->out))
+				break;
+			start = nl - c->rx_buf + 1;
+		}
+	}
+	if (start < end)
+		return dispatch_lines(c, start, end, now);
+	// Everything was answered, keep the partial line if any
+	c->rx_buf_pos -= end;
+	if (c->rx_buf_pos)
+		memmove(c->rx_buf, c->rx_buf + end, c->rx_buf_pos);
+	return 0;
+}
+
+/*
+ * Writes the OpenMetrics exposition for a rig.
+ */
+static int write_metrics(struct rig_entry *e, struct output *out)
+{
+	struct connection	*c;
+	unsigned			open = 0;
+	uint64_t			buffered = 0;
+	uint64_t			largest = 0;
+	uint64_t			queued = 0;
+
+	for (c = connections; c; c = c->next_connection) {
+		if (c->entry != e || c->metrics)
+			continue;
+		open++;
+		buffered += c->out.len;
+		if (c->out.len > largest)
+			largest = c->out.len;
+		queued += c->queued;
+	}
+	if (metrics_gauge(out, "rigctld_connections", "Open rigctld connections", open) != 0
+	    || metrics_counter(out, "rigctld_connections_accepted", "rigctld connections accepted", e->accepted) != 0
+	    || metrics_commands(out, &e->metrics) != 0
+	    || metrics_gauge(out, "rigctld_output_bytes", "Reply bytes waiting to be sent", buffered) != 0
+	    || metrics_gauge(out, "rigctld_output_largest_bytes", "Most reply bytes waiting on one connection", largest) != 0
+	    || metrics_gauge(out, "rigctld_input_queued_bytes", "Command bytes waiting for the rig", queued) != 0
+	    || metrics_gauge(out, "rigctld_output_limit_bytes", "Backlog allowed per connection", e->max_output) != 0
+	    || metrics_counter(out, "rigctld_backlog_pauses", "Connections paused for their backlog", e->backlog.pauses) != 0
+	    || metrics_counter(out, "rigctld_backlog_drops", "Connections dropped for their backlog", e->backlog.drops) != 0
+	    || metrics_counter(out, "rigctld_backlog_coalesced_reads", "Reads answered from old state for a connection that fell behind", atomic_load(&e->backlog.coalesced)) != 0
+	    || metrics_counter(out, "rigctld_backlog_oversize_lines", "Connections dropped for a line longer than the backlog limit", e->backlog.oversize) != 0
+	    || metrics_counter(out, "rigctld_rig_coalesced_reads", "Rig reads that shared one already in progress", get_coalesced_reads(e->rig)) != 0
+	    || metrics_end(out) != 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * A metrics connection gets one reply to its first HTTP request and is
+ * closed once that has been sent.  Only GET /metrics is served.
+ */
+static int handle_scrape(struct connection *c)
+{
+	struct output	body = {};
+	const char		*path;
+	size_t			i;
+	int				ret;
+
+	// Wait for the blank line that ends the headers
+	for (i = 1; i < c->rx_buf_pos; i++) {
+		if (c->rx_buf[i] != '\n')
+			continue;
+		if (c->rx_buf[i - 1] == '\n' || (i > 1 && c->rx_buf[i - 1] == '\r' && c->rx_buf[i - 2] == '\n'))
+			break;
+	}
+	if (i >= c->rx_buf_pos) {
+		if (c->rx_buf_pos >= c->entry->max_output)
+			return -1;
+		return 0;
+	}
+	c->closing = true;
+	path = "GET /metrics";
+	if (c->rx_buf_pos <= strlen(path) || memcmp(c->rx_buf, path, strlen(path)) != 0
+	    || (c->rx_buf[strlen(path)] != ' ' && c->rx_buf[strlen(path)] != '?'))
+		return output_string(&c->out, "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+	if (write_metrics(c->entry, &body) != 0) {
+		output_free(&body);
+		return -1;
+	}
+	ret = output_printf(&c->out, "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+	    "Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)body.len);
+	output_splice(&c->out, &body);
+	return ret;
+}
+
+/*
+ * Reads what's available on the socket, at most max_output at a time,
+ * and handles the lines.  Nothing is read while the connection is
+ * paused, the data stays in the socket so the client sees TCP
+ * backpressure.
+ * Returns -1 if the connection has been closed by the peer or failed.
+ */
+static int read_connection(struct connection *c)
+{
+	size_t	limit = c->entry->max_output;
+	int		ret;
+	int		avail;
+	char	*buf;
+	bool	more;
+
+	while (!c->paused && !c->closing) {
+		more = false;
+		for (;;) {
+			if (c->rx_buf_pos >= limit) {
+				more = true;
+				break;
+			}
+			if (ioctl(c->socket, FIONREAD, &avail) == -1)
+				return -1;
+			if (avail < 1)
+				avail = 1;
+			if ((size_t)avail > limit - c->rx_buf_pos)
+				avail = limit - c->rx_buf_pos;
+			if (c->rx_buf_size - c->rx_buf_pos < (size_t)avail) {
+				buf = realloc(c->rx_buf, c->rx_buf_pos + avail);
+				if (buf == NULL)
+					return -1;
+				c->rx_buf = buf;
+				c->rx_buf_size = c->rx_buf_pos + avail;
+			}
+			ret = recv(c->socket, c->rx_buf + c->rx_buf_pos, avail, MSG_DONTWAIT);
+			if (ret == 0)
+				return -1;
+			if (ret < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+					break;
+				return -1;
+			}
+			c->rx_buf_pos += ret;
+		}
+		if (c->metrics) {
+			if (handle_scrape(c) == -1)
+				return -1;
+		}
+		else if (handle_lines(c) == -1 || check_backlog(c) == -1)
+			return -1;
+		if (!more)
+			break;
+	}
+	return 0;
+}
+
+/*
+ * Sets up a connection for an accepted socket.  Nothing here talks to
+ * the rig, replies that can come from the state use the rig's shared
+ * state and everything else waits for the worker.
+ */
+static struct connection *add_connection(struct listener *l, int sock)
+{
+	struct connection	*c;
+	int					sockopt;
+
+	if (socket_nonblocking(sock) == -1) {
+		closesocket(sock);
+		return NULL;
+	}
+	c = (struct connection *)calloc(1, sizeof(struct connection));
+	if (c == NULL) {
+		closesocket(sock);
+		return NULL;
+	}
+	c->type = EVENT_CONNECTION;
+	c->socket = sock;
+	log_printf(LOG_NET, LOG_LEVEL_DEBUG, "Accepted connection %d", c->socket);
+	if (l->path == NULL) {
+		sockopt = 1;
+		setsockopt(c->socket, IPPROTO_TCP, TCP_NODELAY, &sockopt, sizeof(sockopt));
+	}
+	c->entry = l->entry;
+	c->metrics = l->metrics;
+	if (!c->metrics)
+		c->entry->accepted++;
+	c->next_connection = connections;
+	if (connections)
+		connections->prev_connection = c;
+	connections = c;
+	return c;
+}
+
+#ifndef WITH_EPOLL
+/* select() rebuilds its sets every time through the loop */
+static int update_events(struct connection *c)
+{
+	return 0;
+}
+
+static int watch_listeners(struct rig_entry *entry)
+{
+	return 0;
+}
+
+static int watch_rig(struct rig_entry *entry)
+{
+	return 0;
+}
+#else
+/*
+ * Listeners are level-triggered, anything accept_connections() leaves
+ * behind is reported again.
+ */
+static int watch_listeners(struct rig_entry *entry)
+{
+	struct epoll_event	ev = {};
+	struct listener		*l;
+
+	for (l = listeners; l; l=l->next_listener) {
+		if (l->entry != entry)
+			continue;
+		ev.events = EPOLLIN;
+		ev.data.ptr = l;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, l->socket, &ev) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int watch_rig(struct rig_entry *entry)
+{
+	struct epoll_event	ev = {};
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = entry;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, entry->notify_fd[0], &ev) == -1)
+		return -1;
+	return watch_listeners(entry);
+}
+
+/*
+ * Connections are edge-triggered and always registered for input.
+ * EPOLLOUT is only armed while there is output pending so an idle
+ * connection never causes a wakeup.
+ */
+static int update_events(struct connection *c)
+{
+	struct epoll_event	ev = {};
+
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	if (c->out.len)
+		ev.events |= EPOLLOUT;
+	if (ev.events == c->events)
+		return 0;
+	ev.data.ptr = c;
+	if (epoll_ctl(epoll_fd, c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->socket, &ev) == -1)
+		return -1;
+	c->events = ev.events;
+	return 0;
+}
+
+static void handle_connection_event(struct connection *c, uint32_t events)
+{
+	if (events & EPOLLERR) {
+		close_connection(c);
+		return;
+	}
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+		if (read_connection(c) == -1) {
+			close_connection(c);
+			return;
+		}
+	}
+	/*
+	 * Try to send right away, and only fall back to waiting for
+	 * EPOLLOUT if the socket buffer is full.
+	 */
+	if (flush_connection(c) == -1 || update_events(c) == -1)
+		close_connection(c);
+}
+#endif
+
+/*
+ * Takes every connection waiting on a listener so a burst of clients
+ * reconnecting is handled in one pass rather than one per wakeup.
+ */
+static void accept_connections(struct listener *l)
+{
+	struct connection	*c;
+	int					sock;
+
+	for (;;) {
+		sock = accept(l->socket, NULL, NULL);
+		if (sock == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+		c = add_connection(l, sock);
+		if (c != NULL && update_events(c) == -1)
+			close_connection(c);
+	}
+}
+
+/*
+ * Brings every subscriber to a rig up to date.
+ */
+static void push_changes(struct rig_entry *entry)
+{
+	struct connection	*c;
+	struct connection	*nc;
+
+	for (c = connections; c; c = nc) {
+		nc = c->next_connection;
+		if (c->entry != entry || (atomic_load(&c->subscribed) == 0 && c->pushing == 0))
+			continue;
+		if (push_connection(c) == -1 || flush_connection(c) == -1)
+			close_connection(c);
+		else
+			update_events(c);
+	}
+}
+
+/*
+ * Moves the replies for finished requests to their connections, and
+ * pushes state changes to subscribers.
+ */
+static void handle_completions(struct rig_entry *entry)
+{
+	struct request		*r;
+	struct request		*nr;
+	struct connection	*c;
+	uint64_t			cnt;
+
+	while (read(entry->notify_fd[0], &cnt, sizeof(cnt)) > 0)
+		;
+	mutex_lock(&entry->queue_lock);
+	r = entry->done_head;
+	entry->done_head = entry->done_tail = NULL;
+	mutex_unlock(&entry->queue_lock);
+	for (; r; r = nr) {
+		nr = r->next;
+		c = r->conn;
+		c->pending--;
+		c->queued -= r->end - r->start;
+		if (c->closed) {
+			if (c->pending == 0)
+				free_connection(c);
+		}
+		else {
+			output_splice(&c->out, &r->out);
+			/*
+			 * Completions are handled after the rest of the batch, so
+			 * dropping the connection here is safe.  The request may
+			 * have changed the subscription.
+			 */
+			if (push_connection(c) == -1 || flush_connection(c) == -1)
+				close_connection(c);
+			else
+				update_events(c);
+		}
+		retire_request(r);
 	}
-	close_rig(entry->rig);
-	free(entry);
-	return 0;
+	if (atomic_load(&entry->subscribers))
+		push_changes(entry);
 }
 
-void close_connection(struct connection *c)
+#ifdef WITH_SIGNAL
+/*
+ * Closes a rig's connections and listeners, and the rig itself.
+ */
+static void remove_rig(struct rig_entry *entry)
 {
-	if (debug)
-		printf("Closing socket %d\n", c->socket);
-	closesocket(c->socket);
-	if (c->tx_buf)
-		free(c->tx_buf);
-	if (c->rx_buf)
-		free(c->rx_buf);
-	if (c->next_connection)
-		c->next_connection->prev_connection = c->prev_connection;
-	if (c->prev_connection)
-		c->prev_connection->next_connection = c->next_connection;
+	struct connection	*c;
+	struct connection	*nc;
+
+	for (c = connections; c; c = nc) {
+		nc = c->next_connection;
+		if (c->entry == entry)
+			close_connection(c);
+	}
+	close_listeners(entry);
+	stop_worker(entry);
+	if (entry->rig)
+		close_rig(entry->rig);
+	if (entry->next_rig_entry)
+		entry->next_rig_entry->prev_rig_entry = entry->prev_rig_entry;
+	if (entry->prev_rig_entry)
+		entry->prev_rig_entry->next_rig_entry = entry->next_rig_entry;
 	else
-		connections = c->next_connection;
-	free(c);
+		rigs = entry->next_rig_entry;
+	free(entry->section);
+	free(entry);
 }
 
-void tx_append(struct connection *c, const char *str)
+static struct rig_entry *find_rig(const char *section)
 {
-	char	*buf;
-	size_t	len = strlen(str);
+	struct rig_entry	*e;
 
-	if (debug)
-		printf("TX: %s", str);
-	if ((c->tx_buf_size - c->tx_buf_terminator) < len) {
-		buf = (char *)realloc(c->tx_buf, c->tx_buf_size + len);
-		if (buf == NULL)
-			return;
-		c->tx_buf = buf;
-		c->tx_buf[c->tx_buf_size] = 0;
-		c->tx_buf_size += len;
+	for (e = rigs; e; e = e->next_rig_entry) {
+		if (strcmp(e->section, section) == 0)
+			return e;
 	}
-	memcpy(c->tx_buf + c->tx_buf_terminator, str, len);
-	c->tx_buf_terminator += len;
+	return NULL;
 }
 
-int tx_printf(struct connection *c, const char *format, ...)
+/* Changing any of these means reopening the rig */
+static const char *link_keys[] = {"rig", "type", "host", "port", "rfc2217", "speed", "databits", "stopbits", "parity", "flow", NULL};
+/* And these mean reopening the listeners */
+static const char *listen_keys[] = {"rigctld_address", "rigctld_port", "rigctld_unix_path", "rigctld_unix_mode", "metrics_address", "metrics_port", "listen_backlog", NULL};
+/* These are read by read_tunables(), everything else goes to the backend */
+static const char *tunable_keys[] = {"state_lifetime", "max_output", "output_policy", NULL};
+
+static bool key_listed(const char *key, const char **keys)
 {
-	va_list	args;
-	char	buf[128];
-	int		ret;
+	for (; *keys; keys++) {
+		if (strcmp(key, *keys) == 0)
+			return true;
+	}
+	return false;
+}
 
-	va_start(args, format);
-	ret = vsnprintf(buf, sizeof(buf), format, args);
-	if (ret < 0 || ret >= sizeof(buf)) {
-		tx_append(c, "RPRT -1\n");
-		return -1;
+static bool keys_differ(dictionary *a, dictionary *b, char *section, const char **keys)
+{
+	char	*va;
+	char	*vb;
+
+	for (; *keys; keys++) {
+		va = getstring(a, section, *keys, NULL);
+		vb = getstring(b, section, *keys, NULL);
+		if (va == NULL || vb == NULL) {
+			if (va != vb)
+				return true;
+		}
+		else if (strcmp(va, vb) != 0)
+			return true;
 	}
-	tx_append(c, buf);
-	return 0;
+	return false;
 }
 
-int tx_rprt(struct connection *c, int ret)
+/*
+ * Returns true if any key in a's section that the backend reads isn't
+ * the same in b.
+ */
+static bool backend_keys_missing(dictionary *a, dictionary *b, char *section)
 {
-	char	buf[64];
-	int		sret;
+	char	**keys;
+	char	*key;
+	char	*va;
+	char	*vb;
+	int		count;
+	int		i;
+	bool	ret = false;
 
-	if (ret > 0)
-		ret = 0-ret;
-	sret = snprintf(buf, sizeof(buf), "RPRT %d\n", ret);
-	if (sret > 0 && sret < sizeof(buf)) {
-		tx_append(c, buf);
-		return 0;
+	count = iniparser_getsecnkeys(a, section);
+	keys = iniparser_getseckeys(a, section);
+	if (keys == NULL)
+		return count > 0;
+	for (i = 0; i < count && !ret; i++) {
+		key = strchr(keys[i], ':') + 1;
+		if (key_listed(key, listen_keys) || key_listed(key, tunable_keys))
+			continue;
+		va = iniparser_getstring(a, keys[i], NULL);
+		vb = iniparser_getstring(b, keys[i], NULL);
+		if (va == NULL || vb == NULL)
+			ret = va != vb;
+		else
+			ret = strcmp(va, vb) != 0;
 	}
-	tx_append(c, "RPRT -1\n");
-	return -1;
+	free(keys);
+	return ret;
 }
 
-static int send_vfo(struct connection *c, enum vfos vfo)
+static bool backend_keys_differ(dictionary *a, dictionary *b, char *section)
 {
-	char	*buf = "VFOA\n";
-	
-	switch(vfo) {
-		case VFO_B:
-			buf = "VFOB\n";
-			break;
-		case VFO_MEMORY:
-			buf = "MEM\n";
-			break;
-		case VFO_A:
-			buf = "VFOA\n";
-			break;
-		case VFO_MAIN:
-			buf = "Main\n";
-			break;
-		case VFO_SUB:
-			buf = "Sub\n";
-			break;
-		default:
-			return -1;
+	return backend_keys_missing(a, b, section) || backend_keys_missing(b, a, section);
+}
+
+/*
+ * Puts the running values back into a new config whose values couldn't
+ * be used, so the next reload compares against what is really running.
+ */
+static void copy_keys(dictionary *from, dictionary *to, char *section, const char **keys)
+{
+	char	skey[1024];
+	char	*val;
+	int		sret;
+
+	for (; *keys; keys++) {
+		sret = snprintf(skey, sizeof(skey), "%s:%s", section, *keys);
+		if (sret < 0 || sret >= sizeof(skey))
+			continue;
+		val = getstring(from, section, *keys, NULL);
+		if (val)
+			iniparser_set(to, skey, val);
+		else
+			iniparser_unset(to, skey);
 	}
-	tx_append(c, buf);
-	return 0;
 }
 
-enum vfos current_vfo(struct connection *c)
+/*
+ * Closes the rig and opens it again with the new link settings, or the
+ * old ones if that fails.  The worker must be parked.
+ */
+static int reopen_rig(struct rig_entry *entry, dictionary *d)
 {
-	if (c->rig->get_vfo)
-		return get_vfo(c->rig);
-	else
-		return c->current_vfo;
+	set_notify(entry->rig, NULL, NULL);
+	close_rig(entry->rig);
+	entry->rig = init_rig(d, entry->section);
+	if (entry->rig == NULL) {
+		log_printf(LOG_NET, LOG_LEVEL_ERROR, "Unable to open %s with the new settings, reverting", entry->section);
+		copy_keys(config, d, entry->section, link_keys);
+		entry->rig = init_rig(d, entry->section);
+		if (entry->rig == NULL)
+			return -1;
+	}
+	lock_state(entry);
+	memset(&entry->state, 0, sizeof(entry->state));
+	unlock_state(entry);
+	entry->reseed = true;
+	set_notify(entry->rig, state_notify, entry);
+	return 0;
 }
 
-static int send_mode(struct connection *c, enum rig_modes mode)
+/*
+ * Applies a new config to a running rig.  Only a change to how the rig
+ * is connected reopens it, the rest is changed in place and connections
+ * are kept either way.  The worker is only parked, which waits for the
+ * command it's running, if the backend's settings changed.  Returns -1
+ * if the rig is gone.
+ */
+static int reload_rig(struct rig_entry *entry, dictionary *d)
 {
-	char	*buf;
+	bool	relink = keys_differ(config, d, entry->section, link_keys);
+	bool	relisten = keys_differ(config, d, entry->section, listen_keys);
+	bool	reconfig = backend_keys_differ(config, d, entry->section);
+	int		ret = 0;
 
-	switch (mode) {
-		case MODE_USB:
-			buf="USB";
-			break;
-		case MODE_LSB:
-			buf="LSB";
-			break;
-		case MODE_CW:
-			buf="CW";
-			break;
-		case MODE_CWR:
-			buf="CWR";
-			break;
-		case MODE_FSK:
-			buf="RTTY";
-			break;
-		case MODE_AM:
-			buf="AM";
-			break;
-		case MODE_FM:
-			buf="FM";
-			break;
-		default:
-			buf=NULL;
-			break;
+	read_tunables(entry, d, entry->section);
+	if (relink || reconfig) {
+		park_worker(entry);
+		if (relink)
+			ret = reopen_rig(entry, d);
+		else if (reconfigure_rig(entry->rig, d, entry->section) != 0)
+			log_printf(LOG_NET, LOG_LEVEL_ERROR, "Unable to apply the new settings to %s", entry->section);
+		resume_worker(entry);
 	}
-	if (buf == NULL)
+	if (ret == -1)
 		return -1;
-	return tx_printf(c, "%s\n0\n", buf);
+	if (relisten) {
+		close_listeners(entry);
+		if (open_rig_listeners(entry, d, entry->section) == 0) {
+			log_printf(LOG_NET, LOG_LEVEL_ERROR, "Unable to listen with the new settings for %s, reverting", entry->section);
+			copy_keys(config, d, entry->section, listen_keys);
+			open_rig_listeners(entry, d, entry->section);
+		}
+		watch_listeners(entry);
+	}
+	log_printf(LOG_NET, LOG_LEVEL_INFO, "Reloaded %s%s%s", entry->section, relink ? ", reopened the rig" : "", relisten ? ", reopened listeners" : "");
+	return 0;
 }
 
-static int do_frequency_set(struct connection *c, enum vfos vfo, uint64_t freq, bool tx)
+/*
+ * Rereads the config file.  Runs between batches of events so nothing
+ * freed here is still referenced.
+ */
+static void reload_config(void)
 {
-	uint64_t		tx_freq;
-	uint64_t		rx_freq;
-	enum rig_modes	tx_mode;
-	enum rig_modes	rx_mode;
-	
-	if (tx) {
-		tx_mode = current_mode(c, vfo);
-		if (tx_mode == MODE_UNKNOWN)
-			tx_mode = get_mode(c->rig);
-		rx_mode = current_mode(c, paired_vfo(vfo));
-		if (rx_mode == MODE_UNKNOWN)
-			rx_mode = tx_mode;
-		rx_freq = current_freq(c, paired_vfo(vfo));
-		tx_freq = freq;
-		if (tx_freq == 0)
-			tx_freq = get_frequency(c->rig, vfo);
-		if (rx_freq == 0)
-			rx_freq = tx_freq;
+	dictionary			*d;
+	struct rig_entry	*e;
+	struct rig_entry	*ne;
+	int					count;
+	int					i;
+	char				*section;
+
+	log_printf(LOG_NET, LOG_LEVEL_INFO, "Reloading %s", config_path);
+	d = iniparser_load(config_path);
+	if (d == NULL) {
+		log_printf(LOG_NET, LOG_LEVEL_ERROR, "Unable to parse %s, keeping the running config", config_path);
+		return;
 	}
-	else {
-		rx_mode = current_mode(c, vfo);
-		if (rx_mode == MODE_UNKNOWN)
-			rx_mode = get_mode(c->rig);
-		tx_mode = current_mode(c, paired_vfo(vfo));
-		if (tx_mode == MODE_UNKNOWN)
-			tx_mode = rx_mode;
-		tx_freq = current_freq(c, paired_vfo(vfo));
-		rx_freq = freq;
-		if (rx_freq == 0)
-			rx_freq = get_frequency(c->rig, vfo);
-		if (tx_freq == 0)
-			tx_freq = rx_freq;
+	// The running config has the backend defaults filled in, match it
+	count = iniparser_getnsec(d);
+	for (i = 0; i < count; i++) {
+		section = iniparser_getsecname(d, i);
+		if (section != NULL)
+			rig_defaults(d, section);
 	}
-
-	if (vfo == VFO_MAIN || vfo == VFO_SUB) {
-		if (set_duplex(c->rig, rx_freq, rx_mode, tx_freq, tx_mode) == 0) {
-			save_freq(c, freq, vfo);
-			return 0;
+	for (e = rigs; e; e = ne) {
+		ne = e->next_rig_entry;
+		if (!iniparser_find_entry(d, e->section)) {
+			log_printf(LOG_NET, LOG_LEVEL_INFO, "%s was removed", e->section);
+			remove_rig(e);
 		}
-	}
-	else if (c->split) {
-		if (set_split_frequency(c->rig, rx_freq, tx_freq) == 0) {
-			save_freq(c, freq, vfo);
-			return 0;
+		else if (reload_rig(e, d) == -1) {
+			log_printf(LOG_NET, LOG_LEVEL_ERROR, "Unable to reopen %s, closing it", e->section);
+			remove_rig(e);
 		}
 	}
-	else {
-		if (set_frequency(c->rig, vfo, freq) == 0) {
-			save_freq(c, freq, vfo);
-			return 0;
+	if (reload_sections) {
+		for (i = 0; i < count; i++) {
+			section = iniparser_getsecname(d, i);
+			if (section == NULL)
+				continue;
+			if (find_rig(section) == NULL && add_rig(d, section)) {
+				log_printf(LOG_NET, LOG_LEVEL_INFO, "Added %s", section);
+				watch_rig(rigs);
+			}
 		}
 	}
-	return -1;
+	iniparser_freedict(config);
+	config = d;
 }
 
-#define GET_ARG(c) { \
-	char *new_arg = strchr(c, ' '); \
-	if (new_arg == NULL) \
-		goto fail; \
-	while (*new_arg == ' ') \
-		new_arg++; \
-	c = strchr(new_arg, ' '); \
-	if (c == NULL) \
-		c = strchr(new_arg, 0); \
-	arg = alloca((c - new_arg) + 1); \
-	if (arg == NULL) \
-		goto fail; \
-	strncpy(arg, new_arg, c - new_arg); \
-	arg[c - new_arg] = 0; \
-}
-
-void handle_command(struct connection *c, size_t len)
-{
-	char			*cmdline = strdup(c->rx_buf);
-	char			*cmd;
-	char			*arg;
-	size_t			remain = c->rx_buf_size - (c->rx_buf_pos + len + 1);
-	uint64_t		u64;
-	uint64_t		rx_freq, tx_freq;
-	int				i;
-	char			*buf;
-	int				ret;
-	enum rig_modes	mode;
-	enum vfos		vfo;
-	struct bandlimit *limit;
+/*
+ * Returns false once there's nothing left for this process to serve.
+ */
+static bool handle_reload(void)
+{
+	char	buf[16];
+
+	while (read(reload_fd[0], buf, sizeof(buf)) > 0)
+		;
+	reload_config();
+	return rigs != NULL || reload_sections;
+}
+#endif
+
+#ifdef WITH_EPOLL
+static enum event_source	reload_source = EVENT_RELOAD;
+
+void main_loop(void)
+{
+	struct epoll_event	evs[64];
+	struct epoll_event	ev = {};
+	int					ret;
+	int					i;
+	struct rig_entry	*entry;
+	enum event_source	*src;
+	bool				reload;
 
-	// First, clean up the buffer...
-	if (remain) {
-		memmove(c->rx_buf, c->rx_buf + len + 1, c->rx_buf_size - (len + 1));
-		c->rx_buf_pos = 0;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1)
+		return;
+	for (entry = rigs; entry; entry = entry->next_rig_entry) {
+		if (watch_rig(entry) == -1)
+			return;
 	}
-	else {
-		free(c->rx_buf);
-		c->rx_buf_pos = 0;
-		c->rx_buf_size = 0;
-		c->rx_buf = NULL;
-	}
-	buf = strchr(cmdline, '\r');
-	if (buf)
-		*buf = 0;
-	if (debug)
-		printf("RX: %s\n", cmdline);
-	shorten_cmds(cmdline);
-	if (debug)
-		printf("SC: %s\n", cmdline);
-	// Now handle the commands...
-	for (cmd = cmdline; *cmd; cmd++) {
-		switch(*cmd) {
-			case 'F':
-				vfo = current_vfo(c);
-				GET_ARG(cmd);
-				if (sscanf(arg, "%"SCNu64, &u64) != 1)
-					goto fail;
-				if (current_freq(c, vfo) == u64)
-					ret = 0;
-				else
-					ret = do_frequency_set(c, vfo, u64, false);
-				if (tx_rprt(c, 0) != 0)
-					goto abort;
-				break;
-			case 'I':
-				vfo = current_vfo(c);
-				GET_ARG(cmd);
-				if (sscanf(arg, "%"SCNu64, &u64) != 1)
-					goto fail;
-				if (current_freq(c, paired_vfo(vfo)) == u64)
-					ret = 0;
-				else
-					ret = do_frequency_set(c, paired_vfo(vfo), u64, true);
-				if (tx_rprt(c, 0) != 0)
-					goto abort;
-				break;
-			case 'f':
-				u64 = get_frequency(c->rig, VFO_UNKNOWN);
-				if (u64 == 0)
-					goto fail;
-				tx_printf(c, "%"PRIu64"\n", u64);
-				break;
-			case 'i':
-				vfo = current_vfo(c);
-				ret = get_split_frequency(c->rig, NULL, &tx_freq);
-				if (ret != 0) {
-					tx_freq = current_freq(c, paired_vfo(vfo));
-					if (tx_freq == 0)
-						goto fail;
-				}
-				tx_printf(c, "%"PRIu64"\n", tx_freq);
-				break;
-			case 'M':
-				vfo = current_vfo(c);
-				GET_ARG(cmd);
-				mode = MODE_UNKNOWN;
-				if (strcmp(arg, "USB")==0)
-					mode = MODE_USB;
-				else if (strcmp(arg, "LSB")==0)
-					mode = MODE_LSB;
-				else if (strcmp(arg, "CW")==0)
-					mode = MODE_CW;
-				else if (strcmp(arg, "CWR")==0)
-					mode = MODE_CWR;
-				else if (strcmp(arg, "RTTY")==0)
-					mode = MODE_FSK;
-				else if (strcmp(arg, "AM")==0)
-					mode = MODE_AM;
-				else if (strcmp(arg, "FM")==0)
-					mode = MODE_FM;
-				if (mode == MODE_UNKNOWN)
-					goto fail;
-				GET_ARG(cmd);
-				if (current_mode(c, vfo) == mode)
-					ret = 0;
-				else
-					ret = set_mode(c->rig, mode);
-				if (tx_rprt(c, ret) == 0)
-					save_mode(c, mode, vfo);
-				else
-					goto abort;
-				break;
-			case 'X':
-				vfo = paired_vfo(current_vfo(c));
-				GET_ARG(cmd);
-				mode = MODE_UNKNOWN;
-				if (strcmp(arg, "USB")==0)
-					mode = MODE_USB;
-				else if (strcmp(arg, "LSB")==0)
-					mode = MODE_LSB;
-				else if (strcmp(arg, "CW")==0)
-					mode = MODE_CW;
-				else if (strcmp(arg, "CWR")==0)
-					mode = MODE_CWR;
-				else if (strcmp(arg, "RTTY")==0)
-					mode = MODE_FSK;
-				else if (strcmp(arg, "AM")==0)
-					mode = MODE_AM;
-				else if (strcmp(arg, "FM")==0)
-					mode = MODE_FM;
-				if (mode == MODE_UNKNOWN)
-					goto fail;
-				GET_ARG(cmd);
-				/* TODO: This matters when setting duplex... */
-				if (current_mode(c, vfo) == mode)
-					ret = 0;
-				else
-					ret = set_mode(c->rig, mode);
-				if (tx_rprt(c, ret) == 0)
-					save_mode(c, mode, vfo);
-				else
-					goto abort;
-				break;
-			case 'm':
-				mode = get_mode(c->rig);
-				send_mode(c, mode);
-				break;
-			case 'x':
-				mode = current_mode(c, paired_vfo(current_vfo(c)));
-				send_mode(c, mode);
-				break;
-			case 'V':
-				GET_ARG(cmd);
-				vfo = VFO_UNKNOWN;
-				if ((strcmp(arg, "VFOA")==0) || (strcmp(arg, "VFO")==0))
-					vfo = VFO_A;
-				else if (strcmp(arg, "VFOB")==0)
-					vfo = VFO_B;
-				else if (strcmp(arg, "MEM")==0)
-					vfo = VFO_MEMORY;
-				else if (strcmp(arg, "Main")==0)
-					vfo = VFO_MAIN;
-				else if (strcmp(arg, "Sub")==0)
-					vfo = VFO_SUB;
-				if (vfo == VFO_UNKNOWN)
-					goto fail;
-				if (c->rig->set_vfo) {
-					if (tx_rprt(c, set_vfo(c->rig, vfo)) == 0)
-						c->current_vfo = vfo;
-					else
-						goto abort;
-				}
-				else {
-					// Fake a VFO...
-					if (do_frequency_set(c, vfo, current_freq(c, vfo), false) != 0)
-						goto fail;
-					if (current_mode(c, vfo) == MODE_UNKNOWN)
-						save_mode(c, get_mode(c->rig), vfo);
-					if (set_mode(c->rig, current_mode(c, vfo)) != 0)
-						goto fail;
-					c->current_vfo = vfo;
-					tx_append(c, "RPRT 0\n");
-				}
-				break;
-			case 'S':
-				GET_ARG(cmd);
-				if (sscanf(arg, "%d", &i) != 1)
-					goto fail;
-				if (i==0) {
-					if (get_split_frequency(c->rig, NULL, NULL) == 0) {
-						u64 = get_frequency(c->rig, VFO_UNKNOWN);
-						if (u64 == 0)
-							tx_append(c, "RPRT -1\n");
-						else {
-							if (tx_rprt(c, set_frequency(c->rig, VFO_UNKNOWN, u64)) != 0)
-								goto abort;
-							c->split = false;
-						}
-					}
-					else
-						tx_append(c, "RPRT 0\n");
-				}
-				else {
-					if (get_split_frequency(c->rig, NULL, NULL) != 0) {
-						// "Enable split"
-						// First, switch to the "other" VFO to get the frequency
-						vfo = current_vfo(c);
-						rx_freq = get_frequency(c->rig, VFO_UNKNOWN);
-						if (rx_freq == 0)
-							goto fail;
-						if (c->rig->set_vfo) {
-							tx_freq = get_frequency(c->rig, paired_vfo(vfo));
-
-							if (tx_freq == 0)
-								goto fail;
-						}
-						else {
-							tx_freq = current_freq(c, paired_vfo(vfo));
-						}
-						// And finally, set the split.
-						c->split = true;
-						if (tx_rprt(c, do_frequency_set(c, paired_vfo(vfo), tx_freq, true)) != 0) {
-							c->split = false;
-							goto abort;
-						}
-					}
-					else
-						tx_append(c, "RPRT 0\n");
-				}
-				GET_ARG(cmd);
-				break;
-			case 'v':
-				vfo = current_vfo(c);
-				if (send_vfo(c, vfo) != 0)
-					goto fail;
-				break;
-			case 's':
-				ret = get_split_frequency(c->rig, NULL, NULL);
-				vfo = current_vfo(c);
-				if (vfo == VFO_UNKNOWN)
-					goto fail;
-				tx_append(c, ret==0?"1\n":"0\n");
-				if (ret) {
-					if (send_vfo(c, vfo) != 0)
-						goto fail;
-				}
-				else {
-					if (send_vfo(c, paired_vfo(vfo)) != 0)
-						goto fail;
-				}
-				break;
-			case 'T':
-				GET_ARG(cmd);
-				if (sscanf(arg, "%d", &i) != 1)
-					goto fail;
-				tx_rprt(c, set_ptt(c->rig, i));
-				break;
-			case 't':
-				switch (get_ptt(c->rig)) {
-					case 0:
-						tx_append(c, "0\n");
-						break;
-					case 1:
-						tx_append(c, "1\n");
-						break;
-					default:
-						goto fail;
-				}
-				break;
-			case '\xf0':
-				tx_append(c, "CHKVFO 0\n");
-				break;
-			case '\x8b':
-				switch (get_squelch(c->rig)) {
-					case 0:
-						tx_append(c, "0\n");
-						break;
-					case 1:
-						tx_append(c, "1\n");
-						break;
-					default:
-						goto fail;
-				}
-				break;
-			case 'l':
-				GET_ARG(cmd);
-				if (strcmp(arg, "STRENGTH") == 0) {
-					i = get_smeter(c->rig);
-					if ( i == -1)
-						goto fail;
-					tx_printf(c, "%d\n", i-49);
-				}
-				else
-					goto fail;
-				break;
-			case '\x8f':
-				// Output copied from the dummy driver...
-				tx_append(c, "0\n");			// Protocol version
-				tx_append(c, "2\n");			// Rig model (dummy)
-				tx_append(c, "2\n");			// ITU region (!)
-					// RX info: lowest/highest freq, modes available, low power, high power, VFOs, antennas
-				i = 0x10000003;	// VFO_MEM, VFO_A, VFO_B
-				if (c->rig->set_duplex)
-					i |= 0xc000000;
-				for (limit = c->rig->rx_limits; limit; limit = limit->next)
-					tx_printf(c, "%"PRIu64" %"PRIu64" 0x1ff -1 -1 0x%x 0x01\n", limit->low, limit->high, i);
-					// Terminated with all zeros
-				tx_append(c, "0 0 0 0 0 0 0\n");
-					// TX info (as above)
-				for (limit = c->rig->tx_limits; limit; limit = limit->next)
-					tx_printf(c, "%"PRIu64" %"PRIu64" 0x1ff 0 100 0x%x 0x01\n", limit->low, limit->high, i);
-				tx_append(c, "0 0 0 0 0 0 0\n");
-					// Tuning steps available, modes, steps
-				tx_append(c, "0 0\n");
-					// Filter sizes, mode, bandwidth
-				tx_append(c, "0 0\n");
-				tx_append(c, "0\n");			// Max RIT
-				tx_append(c, "0\n");			// Max XIT
-				tx_append(c, "0\n");			// Max IF shift
-				tx_append(c, "0\n");			// "announces"
-				tx_append(c, "\n");				// Preamp settings
-				tx_append(c, "\n");				// Attenuator settings
-				tx_append(c, "0x0\n");			// has get func
-				tx_append(c, "0x0\n");			// has set func
-				tx_printf(c, "0x%x\n", c->rig->get_smeter?0x40000000:0);	// get level
-				tx_append(c, "0x0\n");			// set level
-				tx_append(c, "0x0\n");			// get param
-				tx_append(c, "0x0\n");			// set param
-				break;
-			case '\r':
-			case '\n':
-			case ' ':
-				break;
-			default:
-				goto fail;
-		}
-		// Did args extend to the end?
-		if (*cmd == 0)
-			break;
+#ifdef WITH_SIGNAL
+	if (reload_fd[0] != -1) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &reload_source;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reload_fd[0], &ev) == -1)
+			return;
 	}
-	free(cmdline);
-	return;
+#endif
 
-fail:
-	tx_append(c, "RPRT -1\n");
-abort:
-	free(cmdline);
+	for (;;) {
+		reload = false;
+		ret = epoll_wait(epoll_fd, evs, sizeof(evs) / sizeof(evs[0]), -1);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		for (i = 0; i < ret; i++) {
+			src = (enum event_source *)evs[i].data.ptr;
+			switch (*src) {
+				case EVENT_LISTENER:
+					accept_connections((struct listener *)src);
+					break;
+				case EVENT_CONNECTION:
+					handle_connection_event((struct connection *)src, evs[i].events);
+					break;
+				case EVENT_RIG:
+					break;
+				case EVENT_RELOAD:
+					reload = true;
+					break;
+			}
+		}
+		/*
+		 * Completions go last since they don't free connections with
+		 * events still waiting in this batch.
+		 */
+		for (i = 0; i < ret; i++) {
+			src = (enum event_source *)evs[i].data.ptr;
+			if (*src == EVENT_RIG)
+				handle_completions((struct rig_entry *)src);
+		}
+#ifdef WITH_SIGNAL
+		if (reload && !handle_reload())
+			return;
+#endif
+	}
 }
-
-void main_loop(void) {
+#else
+void main_loop(void)
+{
 	fd_set				rx_set;
 	fd_set				tx_set;
 	fd_set				err_set;
 	int					max_sock;
 	int					ret;
-	int					avail;
-	int					sockopt;
 	struct listener		*l;
 	struct connection	*c;
-	char				*buf;
+	struct connection	*nc;
+	struct rig_entry	*entry;
 
 	for (;;) {
 		max_sock = 0;
@@ -922,106 +2922,77 @@ void main_loop(void) {
 			if (l->socket > max_sock)
 				max_sock = l->socket;
 		}
+		// The rig workers' completion notifications
+		for (entry = rigs; entry; entry = entry->next_rig_entry) {
+			FD_SET(entry->notify_fd[0], &rx_set);
+			if (entry->notify_fd[0] > max_sock)
+				max_sock = entry->notify_fd[0];
+		}
+#ifdef WITH_SIGNAL
+		if (reload_fd[0] != -1) {
+			FD_SET(reload_fd[0], &rx_set);
+			if (reload_fd[0] > max_sock)
+				max_sock = reload_fd[0];
+		}
+#endif
 		// Next, add all active connections to the other sets as appropriate
 		for (c = connections; c; c=c->next_connection) {
-			FD_SET(c->socket, &rx_set);
+			if (!c->paused)
+				FD_SET(c->socket, &rx_set);
 			FD_SET(c->socket, &err_set);
 			if (c->socket > max_sock)
 				max_sock = c->socket;
-			if (c->tx_buf_terminator)
+			if (c->out.len)
 				FD_SET(c->socket, &tx_set);
 		}
 		// select()
 		ret = select(max_sock+1, &rx_set, &tx_set, &err_set, NULL);
-		if (ret==-1)
+		if (ret==-1) {
+			if (errno == EINTR)
+				continue;
 			return;
+		}
 		if (ret == 0)
 			continue;
+		// Collect replies from the rig workers
+		for (entry = rigs; entry; entry = entry->next_rig_entry) {
+			if (FD_ISSET(entry->notify_fd[0], &rx_set))
+				handle_completions(entry);
+		}
 		// Read/write data as appropriate...
-		for (c = connections; c; c=c->next_connection) {
+		for (c = connections; c; c=nc) {
+			nc = c->next_connection;
 			// First, the exceptions... we'll just close it for now.
 			if (FD_ISSET(c->socket, &err_set)) {
 				close_connection(c);
+				continue;
 			}
 			// Next the writes
 			if (FD_ISSET(c->socket, &tx_set)) {
-				if (c->tx_buf != NULL && c->tx_buf_terminator) {
-					ret = send(c->socket, c->tx_buf + c->tx_buf_pos, c->tx_buf_terminator - c->tx_buf_pos, 0);
-					if (ret > 0) {
-						c->tx_buf_pos += ret;
-						if (c->tx_buf_pos >= c->tx_buf_terminator) {
-							c->tx_buf_size = 0;
-							c->tx_buf_pos = 0;
-							c->tx_buf_terminator = 0;
-						}
-					}
-					else if (ret < 0)
-						close_connection(c);
+				if (flush_connection(c) == -1) {
+					close_connection(c);
+					continue;
 				}
 			}
 			// Now the read()s.
 			if (FD_ISSET(c->socket, &rx_set)) {
-				ret = ioctl(c->socket, FIONREAD, &avail);
-				if (ret == -1)
-					close_connection(c);
-				else if (avail > 0) {
-					buf = realloc(c->rx_buf, c->rx_buf_size + avail);
-					if (buf == NULL)
-						close_connection(c);
-					else {
-						c->rx_buf = buf;
-						c->rx_buf_size += avail;
-						ret = recv(c->socket, c->rx_buf + c->rx_buf_pos, avail, MSG_DONTWAIT);
-						if (ret <= 0)
-							close_connection(c);
-						else {
-							c->rx_buf_pos += ret;
-							if ((buf = memchr(c->rx_buf, '\n', c->rx_buf_pos)) != NULL) {
-								*buf = 0;
-								handle_command(c, (size_t)(buf - c->rx_buf));
-							}
-						}
-					}
-				}
-				else
+				if (read_connection(c) == -1)
 					close_connection(c);
 			}
 		}
 		// Accept() new connections...
 		for (l = listeners; l; l=l->next_listener) {
-			if (FD_ISSET(l->socket, &rx_set)) {
-				c = (struct connection *)calloc(1, sizeof(struct connection));
-				if (c == NULL)
-					continue;
-				c->socket = accept(l->socket, NULL, NULL);
-				if (c->socket == -1) {
-					free(c);
-					continue;
-				}
-				if (debug)
-					printf("Accepted new connection %d\n", c->socket);
-				sockopt = 1;
-				setsockopt(c->socket, IPPROTO_TCP, TCP_NODELAY, &sockopt, sizeof(sockopt));
-				c->rig = l->rig;
-				c->next_connection = connections;
-				connections = c;
-				/* Read the current state */
-				c->split = get_split_frequency(c->rig, &c->vfoa_freq, &c->vfob_freq) == 0;
-				if (c->split) {
-					if (get_vfo(c->rig) == VFO_B) {
-						c->vfom_freq = c->vfob_freq;
-						c->vfob_freq = c->vfoa_freq;
-						c->vfoa_freq = c->vfom_freq;
-						c->vfom_freq = 0;
-						c->vfob_mode = get_mode(c->rig);
-					}
-					else
-						c->vfoa_mode = get_mode(c->rig);
-				}
-			}
+			if (FD_ISSET(l->socket, &rx_set))
+				accept_connections(l);
 		}
+#ifdef WITH_SIGNAL
+		// Nothing from this pass is still referenced, safe to reload
+		if (reload_fd[0] != -1 && FD_ISSET(reload_fd[0], &rx_set) && !handle_reload())
+			return;
+#endif
 	}
 }
+#endif
 
 void cleanup(void)
 {
@@ -1031,6 +3002,7 @@ void cleanup(void)
 	struct listener		*nl;
 	struct rig_entry	*r;
 	struct rig_entry	*nr;
+	struct request		*rq;
 
 	for (c=connections; c;) {
 		nc = c->next_connection;
@@ -1039,15 +3011,25 @@ void cleanup(void)
 	}
 	for (l=listeners; l;) {
 		nl = l->next_listener;
-		closesocket(l->socket);
-		free(l);
+		free_listener(l);
 		l = nl;
 	}
 	for (r=rigs; r;) {
 		nr = r->next_rig_entry;
+		stop_worker(r);
 		close_rig(r->rig);
+		free(r->section);
+		free(r);
 		r = nr;
 	}
+	while (free_requests) {
+		rq = free_requests;
+		free_requests = rq->next;
+		free_request(rq);
+	}
+	if (config)
+		iniparser_freedict(config);
+	log_stop();
 }
 
 void die(int sig)
@@ -1055,12 +3037,33 @@ void die(int sig)
 	exit(0);
 }
 
+#ifdef WITH_SIGNAL
+/*
+ * SIGUSR1 turns logging up a level, SIGUSR2 turns it down
+ */
+void adjust_logging(int sig)
+{
+	log_adjust_levels(sig == SIGUSR1 ? 1 : -1);
+}
+
+/*
+ * SIGHUP rereads the config, the event loop does the work.
+ */
+void request_reload(int sig)
+{
+	char	c = 0;
+
+	if (reload_fd[1] != -1)
+		write(reload_fd[1], &c, 1);
+}
+#endif
+
 int main(int argc, char **argv)
 {
 	int			i;
 	int			rig_count;
-	dictionary	*d = NULL;
 	int			active_rig_count = 0;
+	char		*log_path = NULL;
 #ifdef WITH_FORK
 	pid_t		pid;
 	bool		use_fork = true;
@@ -1074,12 +3077,30 @@ int main(int argc, char **argv)
 					i++;
 					if (i >= argc)
 						goto usage;
-					d = iniparser_load(argv[i]);
-					if (d == NULL) {
+					if (config)
+						iniparser_freedict(config);
+					config_path = argv[i];
+					config = iniparser_load(config_path);
+					if (config == NULL) {
 						fprintf(stderr, "Unable to parse %s\n", argv[i]);
 						return 1;
 					}
 					break;
+				case 'd':
+					i++;
+					if (i >= argc)
+						goto usage;
+					if (log_parse_levels(argv[i]) != 0) {
+						fprintf(stderr, "Unable to parse log levels %s\n", argv[i]);
+						return 1;
+					}
+					break;
+				case 'l':
+					i++;
+					if (i >= argc)
+						goto usage;
+					log_path = argv[i];
+					break;
 #ifdef WITH_FORK
 				case 'f':
 					use_fork = false;
@@ -1090,22 +3111,34 @@ int main(int argc, char **argv)
 		else
 			goto usage;
 	}
-	if (d == NULL)
+	if (config == NULL)
 		goto usage;
+#ifdef WITH_SIGNAL
+	// daemon() changes to /, so remember where the config is for SIGHUP
+	config_path = realpath(config_path, NULL);
+	if (config_path == NULL) {
+		fprintf(stderr, "Unable to resolve the config path!  Aborting.\n");
+		return 1;
+	}
+#endif
 
 	/*
 	 * Now for each rig in the INI file, fire up a thread to do the
 	 * socket interface
 	 */
-	rig_count = iniparser_getnsec(d);
+	rig_count = iniparser_getnsec(config);
 	if (rig_count <= 0) {
 		fprintf(stderr, "No rigs found!  Aborting.\n");
 		return 1;
 	}
 
+	if (output_init() != 0) {
+		fprintf(stderr, "Unable to set up output buffers!  Aborting.\n");
+		return 1;
+	}
 	atexit(cleanup);
 #ifdef WITH_SIGNAL
-	signal(SIGHUP, die);
+	signal(SIGHUP, request_reload);
 	signal(SIGINT, die);
 	signal(SIGKILL, die);
 	signal(SIGPIPE, die);
@@ -1115,8 +3148,8 @@ int main(int argc, char **argv)
 	signal(SIGXFSZ, die);
 	signal(SIGVTALRM, die);
 	signal(SIGPROF, die);
-	signal(SIGUSR1, die);
-	signal(SIGUSR2, die);
+	signal(SIGUSR1, adjust_logging);
+	signal(SIGUSR2, adjust_logging);
 #ifdef SIGTHR
 	signal(SIGTHR, die);
 #endif
@@ -1125,6 +3158,16 @@ int main(int argc, char **argv)
 #endif
 #endif
 
+#ifdef WITH_FORK
+	// Forked children start their own log thread
+	if (!use_fork)
+#endif
+	{
+		if (log_start(log_path) != 0) {
+			fprintf(stderr, "Unable to start logging!  Aborting.\n");
+			return 1;
+		}
+	}
 	for (i=0; i<rig_count; i++) {
 #ifdef WITH_FORK
 		if (use_fork) {
@@ -1132,14 +3175,17 @@ int main(int argc, char **argv)
 			if (pid == 0) {
 				// Child process
 				daemon(0, 0);
-				active_rig_count += add_rig(d, iniparser_getsecname(d, i));
+				log_start(log_path);
+				// A child only ever serves the one rig
+				reload_sections = false;
+				active_rig_count += add_rig(config, iniparser_getsecname(config, i));
 				break;
 			}
 		}
 		else
 #endif
 		{
-			active_rig_count += add_rig(d, iniparser_getsecname(d, i));
+			active_rig_count += add_rig(config, iniparser_getsecname(config, i));
 		}
 	}
 
@@ -1152,25 +3198,37 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+#ifdef WITH_SIGNAL
+	// Created late so forked children each get their own
+	if (pipe(reload_fd) == 0) {
+		fcntl(reload_fd[0], F_SETFL, fcntl(reload_fd[0], F_GETFL) | O_NONBLOCK);
+		fcntl(reload_fd[1], F_SETFL, fcntl(reload_fd[1], F_GETFL) | O_NONBLOCK);
+	}
+	else
+		log_printf(LOG_NET, LOG_LEVEL_WARNING, "Unable to create the reload pipe, SIGHUP will be ignored");
+#endif
 	main_loop();
 
-	if (d)
-		iniparser_freedict(d);
 	return 0;
 usage:
 	printf("Usage:\n"
-		"%s %s-c <config>\n\n"
+		"%s %s[-d <levels>] [-l <logfile>] -c <config>\n\n"
 #ifdef WITH_FORK
 		"If -f is passed, remains in the forground and doesn't fork\n\n"
 #endif
-		"Where <config> is the path to the ini file\n\n", argv[0],
+		"Where <config> is the path to the ini file\n\n"
+		"<levels> is a comma separated list of subsystem=level where subsystem\n"
+		"is net, io, kenwood, yaesu or all and level is off, error, warning,\n"
+		"info, debug or trace.  SIGUSR1 and SIGUSR2 raise and lower all levels.\n"
+		"Logs go to stderr unless a <logfile> is given.\n\n"
+		"SIGHUP rereads <config> without dropping connections.\n\n", argv[0],
 #ifdef WITH_FORK
 		"[-f] "
 #else
 		""
 #endif
 		);
-	if (d)
-		iniparser_freedict(d);
+	if (config)
+		iniparser_freedict(config);
 	return 1;
 }
@@ -0,0 +1,55 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ATOMICS_H
+#define ATOMICS_H
+
+/*
+ * Just enough atomic operations for lock-free readers.  Loads acquire,
+ * stores release, and atomic_inc()/atomic_dec() return the new value.
+ * atomic_add64() and atomic_load64() are for 64-bit statistics
+ * counters and don't order anything else.
+ */
+
+#ifdef WIN32_THREADS
+#include <Windows.h>
+#define atomic_load(p)			(MemoryBarrier(), *(volatile unsigned *)(p))
+#define atomic_store(p, v)		do { MemoryBarrier(); *(volatile unsigned *)(p) = (v); MemoryBarrier(); } while(0)
+#define atomic_inc(p)			((unsigned)InterlockedIncrement((volatile LONG *)(p)))
+#define atomic_dec(p)			((unsigned)InterlockedDecrement((volatile LONG *)(p)))
+#define atomic_fence()			MemoryBarrier()
+#define atomic_add64(p, v)		((uint64_t)InterlockedExchangeAdd64((volatile LONG64 *)(p), (v)) + (v))
+#define atomic_load64(p)		((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0))
+#else
+#define atomic_load(p)			__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_store(p, v)		__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_inc(p)			__atomic_add_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define atomic_dec(p)			__atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define atomic_fence()			__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define atomic_add64(p, v)		__atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#define atomic_load64(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#endif
+
+#endif
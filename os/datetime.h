@@ -29,6 +29,15 @@
 #include <inttypes.h>
 
 uint64_t ms_ticks(void);
+/*
+ * Microseconds from a clock that never steps, only useful for
+ * measuring intervals.
+ */
+uint64_t us_ticks(void);
+/*
+ * Milliseconds since the Unix epoch, for timestamps.
+ */
+uint64_t ms_time(void);
 void ms_sleep(unsigned msecs);
 
 #endif
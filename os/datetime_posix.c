@@ -26,6 +26,8 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "datetime.h"
+
 #if _POSIX_TIMERS < 199309
 #error No POSIX timers defined!
 #else
@@ -39,6 +41,24 @@ uint64_t ms_ticks(void)
 	return ((uint64_t)(ts.tv_sec*1000))+(ts.tv_nsec/1000000);
 }
 
+uint64_t us_ticks(void)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return 0;
+	return ((uint64_t)ts.tv_sec*1000000)+(ts.tv_nsec/1000);
+}
+
+uint64_t ms_time(void)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) != 0)
+		return 0;
+	return ((uint64_t)ts.tv_sec*1000)+(ts.tv_nsec/1000000);
+}
+
 void ms_sleep(unsigned msecs)
 {
 	struct timespec	ts = {};
@@ -32,6 +32,30 @@ uint64_t ms_ticks(void)
 	return GetTickCount64();
 }
 
+uint64_t us_ticks(void)
+{
+	static LARGE_INTEGER	freq;
+	LARGE_INTEGER			now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000
+	    + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+
+uint64_t ms_time(void)
+{
+	FILETIME		ft;
+	ULARGE_INTEGER	t;
+
+	GetSystemTimeAsFileTime(&ft);
+	t.LowPart = ft.dwLowDateTime;
+	t.HighPart = ft.dwHighDateTime;
+	// FILETIME counts 100ns intervals from 1601
+	return (t.QuadPart - 116444736000000000ULL) / 10000;
+}
+
 void ms_sleep(unsigned msecs)
 {
 	Sleep(msecs);
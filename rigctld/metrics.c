@@ -0,0 +1,168 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+
+#include <atomics.h>
+#include <datetime.h>
+
+#include "metrics.h"
+#include "parse.h"
+
+// Upper bounds of all but the last bucket, in microseconds
+static const uint64_t bucket_us[METRICS_BUCKETS - 1] = {
+	50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 500000, 1000000, 2500000
+};
+
+static const char *bucket_le[METRICS_BUCKETS] = {
+	"0.00005", "0.0001", "0.00025", "0.0005", "0.001", "0.0025",
+	"0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1.0",
+	"2.5", "+Inf"
+};
+
+void metrics_command(struct command_metrics *m, unsigned char cmd, bool failed, uint64_t received)
+{
+	struct latency_histogram	*h = &m->latency[cmd];
+	uint64_t					now = us_ticks();
+	uint64_t					us = now > received ? now - received : 0;
+	int							i;
+
+	for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+		if (us <= bucket_us[i])
+			break;
+	}
+	atomic_add64(&h->buckets[i], 1);
+	atomic_add64(&h->sum, us);
+	if (failed)
+		atomic_add64(&m->errors[cmd], 1);
+}
+
+static int metric_header(struct output *out, const char *name, const char *type, const char *help)
+{
+	return output_printf(out, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+int metrics_counter(struct output *out, const char *name, const char *help, uint64_t val)
+{
+	if (metric_header(out, name, "counter", help) != 0)
+		return -1;
+	return output_printf(out, "%s_total %"PRIu64"\n", name, val);
+}
+
+int metrics_gauge(struct output *out, const char *name, const char *help, uint64_t val)
+{
+	if (metric_header(out, name, "gauge", help) != 0)
+		return -1;
+	return output_printf(out, "%s %"PRIu64"\n", name, val);
+}
+
+static const char *command_label(int cmd)
+{
+	const char	*name;
+
+	if (cmd == 0)
+		return "invalid";
+	name = parse_cmd_name(cmd);
+	if (name == NULL)
+		return "unknown";
+	return name;
+}
+
+static uint64_t command_count(struct command_metrics *m, int cmd)
+{
+	uint64_t	count = 0;
+	int			i;
+
+	for (i = 0; i < METRICS_BUCKETS; i++)
+		count += atomic_load64(&m->latency[cmd].buckets[i]);
+	return count;
+}
+
+/*
+ * Only commands that have been seen are listed.  The counters are read
+ * one at a time while they may be changing, so a scrape can be off by
+ * the commands that finished while it was written.
+ */
+int metrics_commands(struct output *out, struct command_metrics *m)
+{
+	uint64_t	counts[256];
+	uint64_t	buckets[METRICS_BUCKETS];
+	uint64_t	total;
+	uint64_t	sum;
+	const char	*name;
+	int			cmd;
+	int			i;
+
+	for (cmd = 0; cmd < 256; cmd++)
+		counts[cmd] = command_count(m, cmd);
+
+	if (metric_header(out, "rigctld_commands", "counter", "Commands handled") != 0)
+		return -1;
+	for (cmd = 0; cmd < 256; cmd++) {
+		if (counts[cmd] == 0)
+			continue;
+		if (output_printf(out, "rigctld_commands_total{command=\"%s\"} %"PRIu64"\n", command_label(cmd), counts[cmd]) != 0)
+			return -1;
+	}
+
+	if (metric_header(out, "rigctld_command_errors", "counter", "Commands that failed or replied with a non-zero RPRT") != 0)
+		return -1;
+	for (cmd = 0; cmd < 256; cmd++) {
+		if (counts[cmd] == 0)
+			continue;
+		if (output_printf(out, "rigctld_command_errors_total{command=\"%s\"} %"PRIu64"\n", command_label(cmd), atomic_load64(&m->errors[cmd])) != 0)
+			return -1;
+	}
+
+	if (metric_header(out, "rigctld_command_latency_seconds", "histogram", "Time from reading a command to its reply being ready") != 0)
+		return -1;
+	if (output_string(out, "# UNIT rigctld_command_latency_seconds seconds\n") != 0)
+		return -1;
+	for (cmd = 0; cmd < 256; cmd++) {
+		if (counts[cmd] == 0)
+			continue;
+		name = command_label(cmd);
+		for (i = 0; i < METRICS_BUCKETS; i++)
+			buckets[i] = atomic_load64(&m->latency[cmd].buckets[i]);
+		sum = atomic_load64(&m->latency[cmd].sum);
+		total = 0;
+		for (i = 0; i < METRICS_BUCKETS; i++) {
+			total += buckets[i];
+			if (output_printf(out, "rigctld_command_latency_seconds_bucket{command=\"%s\",le=\"%s\"} %"PRIu64"\n", name, bucket_le[i], total) != 0)
+				return -1;
+		}
+		if (output_printf(out, "rigctld_command_latency_seconds_count{command=\"%s\"} %"PRIu64"\n"
+		    "rigctld_command_latency_seconds_sum{command=\"%s\"} %"PRIu64".%06"PRIu64"\n",
+		    name, total, name, sum / 1000000, sum % 1000000) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+int metrics_end(struct output *out)
+{
+	return output_string(out, "# EOF\n");
+}
@@ -0,0 +1,72 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "output.h"
+
+/*
+ * Per-command statistics for the OpenMetrics exporter.  Recording is a
+ * few relaxed atomic adds so it can be done from any thread and is
+ * always on.  Everything is indexed by the short command, 0 counts
+ * lines that didn't parse.
+ * 
+ * Latency is from the socket read that completed the line to the reply
+ * being ready to send, in microseconds.  The last bucket has no upper
+ * bound.
+ */
+#define METRICS_BUCKETS		16
+
+struct latency_histogram {
+	uint64_t	buckets[METRICS_BUCKETS];	// Not cumulative
+	uint64_t	sum;
+};
+
+struct command_metrics {
+	struct latency_histogram	latency[256];
+	uint64_t					errors[256];	// Replies with a non-zero RPRT
+};
+
+/*
+ * Records one command whose lines were read at the us_ticks() value
+ * received.
+ */
+void metrics_command(struct command_metrics *m, unsigned char cmd, bool failed, uint64_t received);
+
+/*
+ * Append OpenMetrics text to out.  The name is given without the
+ * _total suffix for counters.  These return 0 on success or -1 if a
+ * slab couldn't be allocated.
+ */
+int metrics_counter(struct output *out, const char *name, const char *help, uint64_t val);
+int metrics_gauge(struct output *out, const char *name, const char *help, uint64_t val);
+int metrics_commands(struct output *out, struct command_metrics *m);
+int metrics_end(struct output *out);
+
+#endif
@@ -0,0 +1,324 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <sockets.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+#include <mutexes.h>
+
+#include "output.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+// How many idle slabs the pool will hang on to
+#define POOL_MAX	256
+// Slabs sent per call
+#define SEND_IOVS	16
+
+static mutex_t				pool_lock;
+static struct output_slab	*pool;
+static unsigned				pool_count;
+
+int output_init(void)
+{
+	return mutex_init(&pool_lock);
+}
+
+static struct output_slab *get_slab(void)
+{
+	struct output_slab	*slab;
+
+	mutex_lock(&pool_lock);
+	slab = pool;
+	if (slab) {
+		pool = slab->next;
+		pool_count--;
+	}
+	mutex_unlock(&pool_lock);
+	if (slab == NULL) {
+		slab = (struct output_slab *)malloc(sizeof(struct output_slab));
+		if (slab == NULL)
+			return NULL;
+	}
+	slab->next = NULL;
+	slab->len = 0;
+	return slab;
+}
+
+static void put_slab(struct output_slab *slab)
+{
+	mutex_lock(&pool_lock);
+	if (pool_count < POOL_MAX) {
+		slab->next = pool;
+		pool = slab;
+		pool_count++;
+		slab = NULL;
+	}
+	mutex_unlock(&pool_lock);
+	if (slab)
+		free(slab);
+}
+
+/*
+ * Returns a slab with at least one byte free on the end of the chain.
+ */
+static struct output_slab *tail_slab(struct output *out)
+{
+	struct output_slab	*slab = out->tail;
+
+	if (slab && slab->len < OUTPUT_SLAB_SIZE)
+		return slab;
+	slab = get_slab();
+	if (slab == NULL)
+		return NULL;
+	if (out->tail)
+		out->tail->next = slab;
+	else
+		out->head = slab;
+	out->tail = slab;
+	return slab;
+}
+
+int output_append(struct output *out, const char *data, size_t len)
+{
+	struct output_slab	*slab;
+	size_t				chunk;
+
+	while (len) {
+		slab = tail_slab(out);
+		if (slab == NULL)
+			return -1;
+		chunk = OUTPUT_SLAB_SIZE - slab->len;
+		if (chunk > len)
+			chunk = len;
+		memcpy(slab->data + slab->len, data, chunk);
+		slab->len += chunk;
+		out->len += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+int output_string(struct output *out, const char *str)
+{
+	return output_append(out, str, strlen(str));
+}
+
+/*
+ * Formats straight into the last slab, only starting a new one if
+ * the result doesn't fit.
+ */
+int output_vprintf(struct output *out, const char *format, va_list args)
+{
+	struct output_slab	*slab;
+	va_list				aq;
+	size_t				space;
+	int					ret;
+	bool				fresh = false;
+
+	for (;;) {
+		slab = tail_slab(out);
+		if (slab == NULL)
+			return -1;
+		if (slab->len == 0)
+			fresh = true;
+		space = OUTPUT_SLAB_SIZE - slab->len;
+		va_copy(aq, args);
+		ret = vsnprintf(slab->data + slab->len, space, format, aq);
+		va_end(aq);
+		if (ret < 0)
+			return -1;
+		// vsnprintf() wants room for a terminator we don't keep
+		if (ret < space) {
+			slab->len += ret;
+			out->len += ret;
+			return 0;
+		}
+		if (fresh)
+			return -1;
+		// Doesn't fit, start a new slab
+		slab->next = get_slab();
+		if (slab->next == NULL)
+			return -1;
+		out->tail = slab->next;
+	}
+}
+
+int output_printf(struct output *out, const char *format, ...)
+{
+	va_list	args;
+	int		ret;
+
+	va_start(args, format);
+	ret = output_vprintf(out, format, args);
+	va_end(args);
+	return ret;
+}
+
+int output_uint(struct output *out, uint64_t val)
+{
+	char	buf[20];
+	size_t	pos = sizeof(buf);
+
+	do {
+		buf[--pos] = '0' + (val % 10);
+		val /= 10;
+	} while (val);
+	return output_append(out, buf + pos, sizeof(buf) - pos);
+}
+
+int output_int(struct output *out, int64_t val)
+{
+	if (val < 0) {
+		if (output_append(out, "-", 1) != 0)
+			return -1;
+		return output_uint(out, (uint64_t)0 - (uint64_t)val);
+	}
+	return output_uint(out, val);
+}
+
+void output_splice(struct output *dst, struct output *src)
+{
+	if (src->head == NULL)
+		return;
+	if (dst->head == NULL) {
+		*dst = *src;
+	}
+	else {
+		// Anything already sent from src->head would be sent again
+		if (src->pos) {
+			memmove(src->head->data, src->head->data + src->pos, src->head->len - src->pos);
+			src->head->len -= src->pos;
+		}
+		dst->tail->next = src->head;
+		dst->tail = src->tail;
+		dst->len += src->len;
+	}
+	src->head = src->tail = NULL;
+	src->pos = 0;
+	src->len = 0;
+}
+
+/*
+ * Drops len bytes from the start of the output.
+ */
+static void output_consume(struct output *out, size_t len)
+{
+	struct output_slab	*slab;
+
+	out->len -= len;
+	while (len) {
+		slab = out->head;
+		if (len < slab->len - out->pos) {
+			out->pos += len;
+			return;
+		}
+		len -= slab->len - out->pos;
+		out->pos = 0;
+		out->head = slab->next;
+		if (out->head == NULL)
+			out->tail = NULL;
+		put_slab(slab);
+	}
+	// Don't keep an empty slab around as the head
+	if (out->head && out->pos == out->head->len) {
+		slab = out->head;
+		out->head = slab->next;
+		if (out->head == NULL)
+			out->tail = NULL;
+		out->pos = 0;
+		put_slab(slab);
+	}
+}
+
+int output_send(struct output *out, int sock)
+{
+#ifdef _WIN32
+	int					ret;
+
+	while (out->len) {
+		ret = send(sock, out->head->data + out->pos, out->head->len - out->pos, 0);
+		if (ret < 0) {
+			if (WSAGetLastError() == WSAEWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		output_consume(out, ret);
+	}
+#else
+	struct iovec		iov[SEND_IOVS];
+	struct msghdr		msg = {};
+	struct output_slab	*slab;
+	ssize_t				ret;
+	int					i;
+
+	while (out->len) {
+		slab = out->head;
+		iov[0].iov_base = slab->data + out->pos;
+		iov[0].iov_len = slab->len - out->pos;
+		for (i = 1, slab = slab->next; slab && i < SEND_IOVS; i++, slab = slab->next) {
+			iov[i].iov_base = slab->data;
+			iov[i].iov_len = slab->len;
+		}
+		msg.msg_iov = iov;
+		msg.msg_iovlen = i;
+		ret = sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		output_consume(out, ret);
+	}
+#endif
+	return 0;
+}
+
+void output_free(struct output *out)
+{
+	struct output_slab	*slab;
+
+	while (out->head) {
+		slab = out->head;
+		out->head = slab->next;
+		put_slab(slab);
+	}
+	out->tail = NULL;
+	out->pos = 0;
+	out->len = 0;
+}
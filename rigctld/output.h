@@ -0,0 +1,88 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+/*
+ * Output is kept as a chain of fixed size slabs which are recycled
+ * through a shared pool, so building and sending replies doesn't
+ * allocate once the pool has warmed up.  Slabs may be filled by one
+ * thread and sent and released by another.
+ */
+#define OUTPUT_SLAB_SIZE	1024
+
+struct output_slab {
+	struct output_slab	*next;
+	size_t				len;
+	char				data[OUTPUT_SLAB_SIZE];
+};
+
+struct output {
+	struct output_slab	*head;
+	struct output_slab	*tail;
+	size_t				pos;		// Bytes of head already sent
+	size_t				len;		// Bytes not yet sent
+};
+
+/*
+ * Sets up the slab pool, must be called before anything else.
+ * 
+ * return 0 on success or an errno value on failure
+ */
+int output_init(void);
+
+/*
+ * Append to the output, these return 0 on success or -1 if a slab
+ * couldn't be allocated.
+ */
+int output_append(struct output *out, const char *data, size_t len);
+int output_string(struct output *out, const char *str);
+int output_printf(struct output *out, const char *format, ...);
+int output_vprintf(struct output *out, const char *format, va_list args);
+int output_uint(struct output *out, uint64_t val);
+int output_int(struct output *out, int64_t val);
+
+/*
+ * Moves everything in src to the end of dst without copying.
+ */
+void output_splice(struct output *dst, struct output *src);
+
+/*
+ * Sends as much as the socket will take in as few calls as possible.
+ * Returns -1 if the socket failed, 0 otherwise.
+ */
+int output_send(struct output *out, int sock);
+
+/*
+ * Discards everything in the output.
+ */
+void output_free(struct output *out);
+
+#endif
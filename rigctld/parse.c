@@ -0,0 +1,321 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse.h"
+
+/*
+ * Long command names, sorted so they can be found with a binary search.
+ */
+struct long_cmd {
+	const char		*lng;
+	size_t			len;
+	unsigned char	shrt;
+};
+static const struct long_cmd long_cmds[] = {
+	{"chk_vfo", 7, 0xf0},
+	{"dump_caps", 9, '1'},
+	{"dump_conf", 9, '3'},
+	{"dump_state", 10, 0x8f},
+	{"get_ant", 7, 'y'},
+	{"get_channel", 11, 'h'},
+	{"get_ctcss_sql", 13, 0x91},
+	{"get_ctcss_tone", 14, 'c'},
+	{"get_dcd", 7, 0x8b},
+	{"get_dcs_code", 12, 'd'},
+	{"get_dcs_sql", 11, 0x93},
+	{"get_freq", 8, 'f'},
+	{"get_func", 8, 'u'},
+	{"get_info", 8, '_'},
+	{"get_level", 9, 'l'},
+	{"get_mem", 7, 'e'},
+	{"get_mode", 8, 'm'},
+	{"get_parm", 8, 'p'},
+	{"get_powerstat", 13, 0x88},
+	{"get_ptt", 7, 't'},
+	{"get_rit", 7, 'j'},
+	{"get_rptr_offs", 13, 'o'},
+	{"get_rptr_shift", 14, 'r'},
+	{"get_split_freq", 14, 'i'},
+	{"get_split_mode", 14, 'x'},
+	{"get_split_vfo", 13, 's'},
+	{"get_trn", 7, 'a'},
+	{"get_ts", 6, 'n'},
+	{"get_vfo", 7, 'v'},
+	{"get_xit", 7, 'z'},
+	{"halt", 4, 0xf1},
+	{"mW2power", 8, '4'},
+	{"power2mW", 8, '2'},
+	{"recv_dtmf", 9, 0x8a},
+	{"reset", 5, '*'},
+	{"scan", 4, 'g'},
+	{"send_cmd", 8, 'w'},
+	{"send_dtmf", 9, 0x89},
+	{"send_morse", 10, 'b'},
+	{"set_ant", 7, 'Y'},
+	{"set_bank", 8, 'B'},
+	{"set_channel", 11, 'H'},
+	{"set_ctcss_sql", 13, 0x90},
+	{"set_ctcss_tone", 14, 'C'},
+	{"set_dcs_code", 12, 'D'},
+	{"set_dcs_sql", 11, 0x92},
+	{"set_freq", 8, 'F'},
+	{"set_func", 8, 'U'},
+	{"set_level", 9, 'L'},
+	{"set_mem", 7, 'E'},
+	{"set_mode", 8, 'M'},
+	{"set_parm", 8, 'P'},
+	{"set_powerstat", 13, 0x87},
+	{"set_ptt", 7, 'T'},
+	{"set_rit", 7, 'J'},
+	{"set_rptr_offs", 13, 'O'},
+	{"set_rptr_shift", 14, 'R'},
+	{"set_split_freq", 14, 'I'},
+	{"set_split_mode", 14, 'X'},
+	{"set_split_vfo", 13, 'S'},
+	{"set_trn", 7, 'A'},
+	{"set_ts", 6, 'N'},
+	{"set_vfo", 7, 'V'},
+	{"set_xit", 7, 'Z'},
+	{"subscribe", 9, 0xe0},
+	{"vfo_op", 6, 'G'},
+};
+#define LONG_CMD_COUNT	(sizeof(long_cmds) / sizeof(long_cmds[0]))
+
+/*
+ * The number of arguments each short command takes, indexed by the
+ * command.  Anything not listed is not a command.
+ */
+struct cmd_args {
+	bool	known;
+	int		args;
+};
+static const struct cmd_args cmd_args[256] = {
+	['F'] = {true, 1},	['f'] = {true, 0},
+	['M'] = {true, 2},	['m'] = {true, 0},
+	['I'] = {true, 1},	['i'] = {true, 0},
+	['X'] = {true, 2},	['x'] = {true, 0},
+	['S'] = {true, 2},	['s'] = {true, 0},
+	['N'] = {true, 1},	['n'] = {true, 0},
+	['L'] = {true, 2},	['l'] = {true, 1},
+	['U'] = {true, 2},	['u'] = {true, 1},
+	['P'] = {true, 2},	['p'] = {true, 1},
+	['G'] = {true, 1},	['g'] = {true, 2},
+	['A'] = {true, 1},	['a'] = {true, 0},
+	['R'] = {true, 1},	['r'] = {true, 0},
+	['O'] = {true, 1},	['o'] = {true, 0},
+	['C'] = {true, 1},	['c'] = {true, 0},
+	['D'] = {true, 1},	['d'] = {true, 0},
+	['V'] = {true, 1},	['v'] = {true, 0},
+	['T'] = {true, 1},	['t'] = {true, 0},
+	['E'] = {true, 1},	['e'] = {true, 0},
+	['H'] = {true, 1},	['h'] = {true, 1},
+	['J'] = {true, 1},	['j'] = {true, 0},
+	['Z'] = {true, 1},	['z'] = {true, 0},
+	['Y'] = {true, 1},	['y'] = {true, 0},
+	['B'] = {true, 1},	['_'] = {true, 0},
+	['w'] = {true, 1},	['b'] = {true, 1},
+	['2'] = {true, 3},	['4'] = {true, 3},
+	['*'] = {true, 1},	['1'] = {true, 0},
+	['3'] = {true, 0},
+	[0x87] = {true, 1},	[0x88] = {true, 0},
+	[0x89] = {true, 1},	[0x8a] = {true, 0},
+	[0x8b] = {true, 0},	[0x8f] = {true, 0},
+	[0x90] = {true, 1},	[0x91] = {true, 0},
+	[0x92] = {true, 1},	[0x93] = {true, 0},
+	[0xe0] = {true, 1},
+	[0xf0] = {true, 0},	[0xf1] = {true, 0},
+};
+
+struct mode_name {
+	const char		*name;
+	enum rig_modes	mode;
+};
+static const struct mode_name mode_names[] = {
+	{"USB", MODE_USB},
+	{"LSB", MODE_LSB},
+	{"CW", MODE_CW},
+	{"CWR", MODE_CWR},
+	{"RTTY", MODE_FSK},
+	{"AM", MODE_AM},
+	{"FM", MODE_FM},
+	{NULL, MODE_UNKNOWN}
+};
+
+/*
+ * The first name for each VFO is the one we send.
+ */
+struct vfo_name {
+	const char	*name;
+	enum vfos	vfo;
+};
+static const struct vfo_name vfo_names[] = {
+	{"VFOA", VFO_A},
+	{"VFOB", VFO_B},
+	{"MEM", VFO_MEMORY},
+	{"Main", VFO_MAIN},
+	{"Sub", VFO_SUB},
+	{"VFO", VFO_A},
+	{NULL, VFO_UNKNOWN}
+};
+
+unsigned char parse_long_cmd(const char *name, size_t len)
+{
+	size_t	lo = 0;
+	size_t	hi = LONG_CMD_COUNT;
+	size_t	mid;
+	int		cmp;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		cmp = strncmp(name, long_cmds[mid].lng, len);
+		if (cmp == 0 && len < long_cmds[mid].len)
+			cmp = -1;
+		if (cmp == 0)
+			return long_cmds[mid].shrt;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return 0;
+}
+
+const char *parse_cmd_name(unsigned char cmd)
+{
+	size_t	i;
+
+	for (i = 0; i < LONG_CMD_COUNT; i++) {
+		if (long_cmds[i].shrt == cmd)
+			return long_cmds[i].lng;
+	}
+	return NULL;
+}
+
+int parse_command(char **line, struct parsed_cmd *cmd)
+{
+	char	*p = *line;
+	char	*name;
+	bool	more;
+	int		i;
+
+	while (*p == ' ' || *p == '\r' || *p == '\n')
+		p++;
+	if (*p == 0) {
+		*line = p;
+		return 0;
+	}
+	switch (*p) {
+		case '+':
+			cmd->sep = '\n';
+			p++;
+			break;
+		case ';':
+		case '|':
+		case ',':
+			cmd->sep = *(p++);
+			break;
+		default:
+			cmd->sep = 0;
+			break;
+	}
+	if (*p == '\\') {
+		name = ++p;
+		while (*p && *p != ' ')
+			p++;
+		cmd->cmd = parse_long_cmd(name, p - name);
+	}
+	else
+		cmd->cmd = (unsigned char)*(p++);
+	if (cmd->cmd == 0 || !cmd_args[cmd->cmd].known)
+		goto fail;
+	cmd->argc = cmd_args[cmd->cmd].args;
+	more = (*p == ' ');
+	for (i = 0; i < cmd->argc; i++) {
+		if (!more)
+			goto fail;
+		while (*p == ' ')
+			p++;
+		cmd->argv[i] = p;
+		while (*p && *p != ' ')
+			p++;
+		more = (*p == ' ');
+		if (more)
+			*(p++) = 0;
+	}
+	*line = p;
+	return 1;
+
+fail:
+	*line = p;
+	return -1;
+}
+
+enum rig_modes parse_mode(const char *name)
+{
+	const struct mode_name	*m;
+
+	for (m = mode_names; m->name; m++) {
+		if (strcmp(m->name, name) == 0)
+			return m->mode;
+	}
+	return MODE_UNKNOWN;
+}
+
+const char *mode_name(enum rig_modes mode)
+{
+	const struct mode_name	*m;
+
+	for (m = mode_names; m->name; m++) {
+		if (m->mode == mode)
+			return m->name;
+	}
+	return NULL;
+}
+
+enum vfos parse_vfo(const char *name)
+{
+	const struct vfo_name	*v;
+
+	for (v = vfo_names; v->name; v++) {
+		if (strcmp(v->name, name) == 0)
+			return v->vfo;
+	}
+	return VFO_UNKNOWN;
+}
+
+const char *vfo_name(enum vfos vfo)
+{
+	const struct vfo_name	*v;
+
+	for (v = vfo_names; v->name; v++) {
+		if (v->vfo == vfo)
+			return v->name;
+	}
+	return NULL;
+}
@@ -0,0 +1,82 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stddef.h>
+
+#include <api.h>
+
+/*
+ * Splits rigctld command lines into commands.  Long commands like
+ * \get_freq are translated to their one character form so callers only
+ * ever see short commands, which they can use to index a table.
+ */
+#define PARSE_MAX_ARGS	3
+
+struct parsed_cmd {
+	unsigned char	cmd;					// Short command
+	char			sep;					// Extended response separator or 0
+	int				argc;
+	char			*argv[PARSE_MAX_ARGS];	// Point into the parsed line
+};
+
+/*
+ * Parses the next command from *line and advances *line past it.  The
+ * line is modified to terminate the arguments.
+ * 
+ * A command may be prefixed with '+', ';', '|' or ',' to ask for a
+ * Hamlib extended response, sep is then set to the separator to put
+ * between reply fields ('\n' for '+').
+ * 
+ * Returns 1 if a command was parsed, 0 at the end of the line and -1
+ * if the command is unknown or is missing arguments.
+ */
+int parse_command(char **line, struct parsed_cmd *cmd);
+
+/*
+ * Returns the short form of a long command name (without the leading
+ * backslash) or 0 if the name isn't known.
+ */
+unsigned char parse_long_cmd(const char *name, size_t len);
+
+/*
+ * Returns the long name of a short command (without the backslash) or
+ * NULL.
+ */
+const char *parse_cmd_name(unsigned char cmd);
+
+/*
+ * Translate between the Hamlib mode and VFO names and our values.  The
+ * lookups return MODE_UNKNOWN and VFO_UNKNOWN for unknown names, the
+ * name functions return NULL for values Hamlib has no name for.
+ */
+enum rig_modes parse_mode(const char *name);
+const char *mode_name(enum rig_modes mode);
+enum vfos parse_vfo(const char *name);
+const char *vfo_name(enum vfos vfo);
+
+#endif
@@ -43,6 +43,7 @@
 #include <api.h>
 #include <iniparser.h>
 #include <io.h>
+#include <log.h>
 #include <serial.h>
 #include <datetime.h>
 
@@ -363,46 +364,37 @@ struct khf_command khf_cmd[] = {
 };
 
 /*
- * realloc()s a string to the specified size.
- * If realloc() failes, free()s the string and
- * sets it to NULL
+ * Returns the length of the semi-colon terminated response at the start
+ * of buf, or 0 if the semi-colon hasn't arrived yet.
  */
-static void resize_response(struct io_response **resp, size_t newsize)
+size_t kenwood_hf_frame(void *cbdata, const char *buf, size_t len)
 {
-	struct io_response *newresp = realloc(*resp, newsize);
+	const char	*end = memchr(buf, ';', len);
 
-	if(newresp == NULL)
-		free(&resp);
-	*resp=newresp;
+	return end ? end - buf + 1 : 0;
 }
 
 /*
  * Reads a single semi-colon terminated string from the serial port
- * and returns a null terminated malloc()ed struct io_response *
+ * and returns a null terminated struct io_response * from the handle's
+ * pool.  Nothing the rig sends is longer than IO_RX_LEN.
  */
 struct io_response *kenwood_hf_read_response(void *cbdata)
 {
-	size_t	retsize = 128;
 	size_t	pos = 0;
 	int		rd;
 	struct kenwood_hf *khf = (struct kenwood_hf *)cbdata;
-	struct io_response	*ret = (struct io_response *)malloc(retsize);
+	struct io_response	*ret = io_alloc_response(khf->handle, IO_RX_LEN);
 
 	if (ret == NULL)
 		return NULL;
 	if (io_wait_read(khf->handle, khf->response_timeout) != 1)
 		goto fail;
-	for(;;) {
+	while (pos < IO_RX_LEN) {
 		rd = io_read(khf->handle, ret->msg+pos, 1, khf->char_timeout);
 		if (rd != 1)
 			goto fail;
 		pos++;
-		if(pos + 1 + offsetof(struct io_response, msg) == retsize) {
-			retsize *= 2;
-			resize_response(&ret, retsize);
-			if (ret==NULL)
-				goto fail;
-		}
 		if (ret->msg[pos-1] == ';') {
 			ret->msg[pos] = 0;
 			ret->len = pos;
@@ -411,41 +403,137 @@ struct io_response *kenwood_hf_read_response(void *cbdata)
 	}
 
 fail:
-	if(ret)
-		free(ret);
+	io_free_response(khf->handle, ret);
 	return NULL;
 }
 
 /*
- * Sends the first wlen bytes of cmd to the serial port
+ * Writes jobs in order, each once the rig will listen to it.  Sleeping
+ * out inter_cmd_delay and set_cmd_delays happens here, so a set's
+ * caller returns as soon as it's written and a settle_ok read doesn't
+ * wait for the rig to settle.  Times are monotonic.
  */
-static int kenwood_send(struct kenwood_hf *khf, const char *cmd, size_t wlen)
+static void kenwood_sched_thread(void *arg)
 {
-	uint64_t	now = ms_ticks();
-	
+	struct kenwood_hf	*khf = (struct kenwood_hf *)arg;
+	struct kenwood_job	*job;
+	uint64_t			deadline;
+	uint64_t			now;
+	unsigned			i;
+
+	for (;;) {
+		semaphore_wait(&khf->sched_sem);
+		mutex_lock(&khf->sched_mtx);
+		job = khf->jobs;
+		if (job)
+			khf->jobs = job->next;
+		mutex_unlock(&khf->sched_mtx);
+		if (job == NULL) {
+			if (khf->sched_stop)
+				break;
+			continue;
+		}
+		deadline = khf->next_send;
+		if (!job->settle_ok && khf->settled > deadline)
+			deadline = khf->settled;
+		now = us_ticks();
+		if (deadline > now)
+			ms_sleep((unsigned)((deadline - now + 999) / 1000));
+		// Registered now so the response timeout doesn't include the wait
+		for (i = 0; i < job->count; i++) {
+			if (io_expect(khf->handle, &job->waiters[i], job->match[i], strlen(job->match[i]), 0, 0) != 0)
+				break;
+		}
+		if (i < job->count)
+			job->ret = -1;
+		else
+			job->ret = io_write(khf->handle, job->cmd, job->len, khf->char_timeout);
+		if (job->ret == -1) {
+			while (i)
+				io_cancel(khf->handle, &job->waiters[--i]);
+		}
+		/*
+		 * io_write() drains, and the rig only starts acting on a
+		 * command once it has all of it, so the delays start now.
+		 */
+		now = us_ticks();
+		khf->next_send = now + (uint64_t)khf->inter_cmd_delay * 1000;
+		if (now + (uint64_t)job->delay * 1000 > khf->settled)
+			khf->settled = now + (uint64_t)job->delay * 1000;
+		semaphore_post(&job->sent);
+	}
+	log_thread_exit();
+}
+
+/*
+ * Queues job and waits for it to be written, but not for any delay
+ * after it.  Returns the io_write() result, or -1 with the waiters not
+ * registered.
+ */
+static int kenwood_submit(struct kenwood_hf *khf, struct kenwood_job *job)
+{
+	struct kenwood_job	**jp;
+
+	if (!khf->sched_running)
+		return -1;
+	if (semaphore_init(&job->sent, 0) != 0)
+		return -1;
+	job->next = NULL;
+	mutex_lock(&khf->sched_mtx);
+	for (jp = &khf->jobs; *jp; jp = &(*jp)->next)
+		;
+	*jp = job;
+	mutex_unlock(&khf->sched_mtx);
+	semaphore_post(&khf->sched_sem);
+	semaphore_wait(&job->sent);
+	semaphore_destroy(&job->sent);
+	return job->ret;
+}
+
+/*
+ * Sends the first wlen bytes of cmd to the serial port, after which
+ * the rig ignores commands for delay ms.
+ */
+static int kenwood_send(struct kenwood_hf *khf, const char *cmd, size_t wlen, unsigned delay)
+{
+	struct kenwood_job	job = {};
+
 	if (khf == NULL)
 		return -1;
 
-	if(now <= khf->last_cmd_tick + khf->inter_cmd_delay + khf->additional_intercmd_delay)
-		ms_sleep((unsigned)(khf->last_cmd_tick + khf->inter_cmd_delay + khf->additional_intercmd_delay - now));
-	khf->last_cmd_tick = ms_ticks();
-	khf->additional_intercmd_delay = 0;
-	return io_write(khf->handle, cmd, wlen, khf->char_timeout);
+	job.cmd = cmd;
+	job.len = wlen;
+	job.delay = delay;
+	return kenwood_submit(khf, &job);
 }
 
 /*
- * Sends the first cmdlen bytes of cmd to the serial port, then calls
- * kenwood_get_response() to wait for a response matching the first
- * matchlen bytes of match.
+ * Sends the first cmdlen bytes of cmd to the serial port and waits for
+ * a response matching match.  The waiter is registered before sending
+ * so a quick response isn't missed.
  * 
- * Returns a null-termianted malloc()ed string and sets retlen to the
- * length of that string.
+ * Returns a null-termianted response to release with io_free_response().
  */
-static struct io_response *kenwood_cmd_response(struct kenwood_hf *khf, const char *match, size_t matchlen, const char *cmd, size_t cmdlen)
+static struct io_response *kenwood_cmd_response(struct kenwood_hf *khf, const char *match, bool settle_ok, const char *cmd, size_t cmdlen)
 {
-	if (kenwood_send(khf, cmd, cmdlen) == -1)
+	struct io_response	*resp;
+	struct io_waiter	w;
+	struct kenwood_job	job = {};
+
+	job.cmd = cmd;
+	job.len = cmdlen;
+	job.settle_ok = settle_ok;
+	job.count = 1;
+	job.waiters = &w;
+	job.match = &match;
+	if (kenwood_submit(khf, &job) == -1) {
+		log_printf(LOG_KENWOOD, LOG_LEVEL_WARNING, "Unable to send %.*s", (int)cmdlen, cmd);
 		return NULL;
-	return io_get_response(khf->handle, match, matchlen, 0);
+	}
+	resp = io_wait_response(khf->handle, &w);
+	if (resp == NULL)
+		log_printf(LOG_KENWOOD, LOG_LEVEL_WARNING, "No response to %.*s", (int)cmdlen, cmd);
+	return resp;
 }
 
 /*
@@ -467,7 +555,89 @@ static struct io_response *kenwood_command_response(struct kenwood_hf *khf, stru
 	if (cmdinfo == NULL || cmd == NULL || cmdlen == 0)
 		return NULL;
 
-	return kenwood_cmd_response(khf, cmdinfo->read_prefix, strlen(cmdinfo->read_prefix), cmd, cmdlen);
+	return kenwood_cmd_response(khf, cmdinfo->read_prefix, kenwood_hf_cmd_settle(khf, cmdinfo->cmd_num), cmd, cmdlen);
+}
+
+#define KW_HF_MAX_READS	4
+
+/*
+ * Sends count parameterless read commands back-to-back and waits for
+ * all of their responses, which the rig sends in the same order.  Every
+ * waiter is registered first, so this costs about one round trip rather
+ * than one per command.  With an inter_cmd_delay the commands are still
+ * spaced out.  They go out while the rig is settling only if all of
+ * them are settle_reads.
+ * 
+ * Fills resps with responses to release with io_free_response() and
+ * returns 0, or returns -1 with nothing to release.
+ */
+static int kenwood_read_commands(struct kenwood_hf *khf, unsigned count, const enum kenwood_hf_commands *cmds, struct io_response **resps)
+{
+	struct io_waiter	waiters[KW_HF_MAX_READS];
+	const char			*match[KW_HF_MAX_READS];
+	struct kenwood_job	job = {};
+	struct khf_command	*cmdinfo;
+	char				cmdstr[KW_HF_MAX_READS * sizeof(cmdinfo->cmd)];
+	size_t				ends[KW_HF_MAX_READS];
+	size_t				len = 0;
+	size_t				start;
+	unsigned			sent = 0;
+	unsigned			i;
+
+	if (count == 0 || count > KW_HF_MAX_READS)
+		return -1;
+	job.settle_ok = true;
+	for (i = 0; i < count; i++) {
+		cmdinfo = kenwood_find_command(cmds[i]);
+		if (cmdinfo == NULL || !kenwood_hf_cmd_read(khf, cmds[i]) || cmdinfo->get_params_count)
+			return -1;
+		len += sprintf(cmdstr+len, "%s;", cmdinfo->cmd);
+		ends[i] = len;
+		match[i] = cmdinfo->read_prefix;
+		if (!kenwood_hf_cmd_settle(khf, cmds[i]))
+			job.settle_ok = false;
+	}
+
+	if (khf->inter_cmd_delay == 0) {
+		job.cmd = cmdstr;
+		job.len = len;
+		job.count = count;
+		job.waiters = waiters;
+		job.match = match;
+		if (kenwood_submit(khf, &job) == -1)
+			goto send_failed;
+	}
+	else {
+		for (start = 0; sent < count; start = ends[sent++]) {
+			job.cmd = cmdstr+start;
+			job.len = ends[sent]-start;
+			job.settle_ok = kenwood_hf_cmd_settle(khf, cmds[sent]);
+			job.count = 1;
+			job.waiters = &waiters[sent];
+			job.match = &match[sent];
+			if (kenwood_submit(khf, &job) == -1)
+				goto send_failed;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		resps[i] = io_wait_response(khf->handle, &waiters[i]);
+		if (resps[i] == NULL) {
+			log_printf(LOG_KENWOOD, LOG_LEVEL_WARNING, "No response to %.*s", (int)(ends[i]-(i ? ends[i-1] : 0)), cmdstr+(i ? ends[i-1] : 0));
+			while (++i < count)
+				io_cancel(khf->handle, &waiters[i]);
+			for (i = 0; i < count && resps[i]; i++)
+				io_free_response(khf->handle, resps[i]);
+			return -1;
+		}
+	}
+	return 0;
+
+send_failed:
+	log_printf(LOG_KENWOOD, LOG_LEVEL_WARNING, "Unable to send %.*s", (int)len, cmdstr);
+	while (sent)
+		io_cancel(khf->handle, &waiters[--sent]);
+	return -1;
 }
 
 static int kenwood_rscanf(enum kenwood_hf_commands cmd, struct io_response *resp, ...)
@@ -534,13 +704,16 @@ static int kenwood_rscanf(enum kenwood_hf_commands cmd, struct io_response *resp
 	return ret;
 }
 
-struct io_response *kenwood_hf_command(struct kenwood_hf *khf, bool set, enum kenwood_hf_commands cmd, ...)
+#define KW_HF_CMD_MAX	128
+
+/*
+ * Formats cmd with its set or get parameters from args into cmdstr,
+ * which must have room for KW_HF_CMD_MAX bytes.  Returns the length.
+ */
+static int kenwood_format(struct khf_command *cmdinfo, bool set, char *cmdstr, va_list args)
 {
-	char			cmdstr[128];
-	char			pstr[128];
+	char			pstr[KW_HF_CMD_MAX];
 	unsigned		i;
-	va_list			args;
-	struct khf_command	*cmdinfo = kenwood_find_command(cmd);
 	int				ival;
 	unsigned		uval;
 	uint64_t		qval;
@@ -550,23 +723,11 @@ struct io_response *kenwood_hf_command(struct kenwood_hf *khf, bool set, enum ke
 	unsigned		count;
 	unsigned char	*par;
 
-	if (cmdinfo == NULL)
-		return NULL;
-	if (set) {
-		if (!kenwood_hf_cmd_set(khf, cmd))
-			return NULL;
-	}
-	else {
-		if (!kenwood_hf_cmd_read(khf, cmd))
-			return NULL;
-	}
-
 	count = set?cmdinfo->set_params_count:cmdinfo->get_params_count;
 	par = set?cmdinfo->set_params:cmdinfo->get_params;
 
 	strcpy(cmdstr, cmdinfo->cmd);
 	len = strlen(cmdstr);
-	va_start(args, cmd);
 	for(i=0; i<count; i++) {
 		switch(params[par[i]].type) {
 			case 'Q':
@@ -590,44 +751,193 @@ struct io_response *kenwood_hf_command(struct kenwood_hf *khf, bool set, enum ke
 				strcpy(cmdstr+len, pstr);
 				break;
 			default:
-				va_end(args);
-				return NULL;
-		}
-		if (ret == -1) {
-			va_end(args);
-			return NULL;
+				return -1;
 		}
+		if (ret == -1)
+			return -1;
 		len += ret;
 	}
 	cmdstr[len++]=';';
 	cmdstr[len]=0;
+	return len;
+}
+
+/*
+ * Sends a read command and returns the response, to release with
+ * io_free_response(), or NULL.
+ */
+struct io_response *kenwood_hf_command(struct kenwood_hf *khf, enum kenwood_hf_commands cmd, ...)
+{
+	char			cmdstr[KW_HF_CMD_MAX];
+	va_list			args;
+	struct khf_command	*cmdinfo = kenwood_find_command(cmd);
+	int				len;
+
+	if (cmdinfo == NULL || !kenwood_hf_cmd_read(khf, cmd))
+		return NULL;
+
+	va_start(args, cmd);
+	len = kenwood_format(cmdinfo, false, cmdstr, args);
 	va_end(args);
-	if (set) {
-		struct io_response *resp = (struct io_response *)malloc(offsetof(struct io_response, msg));
-		resp->len = kenwood_send(khf, cmdstr, len);
-		khf->additional_intercmd_delay = khf->set_cmd_delays[cmd];
-		return resp;
-	}
+	if (len == -1)
+		return NULL;
 	return kenwood_command_response(khf, cmdinfo, cmdstr, len);
 }
 
-static struct kenwood_if *kenwood_parse_if(struct io_response *resp)
+/*
+ * Sends a set command.  Returns 0 once it's written or -1 if it can't
+ * be.
+ */
+int kenwood_hf_set(struct kenwood_hf *khf, enum kenwood_hf_commands cmd, ...)
+{
+	char			cmdstr[KW_HF_CMD_MAX];
+	va_list			args;
+	struct khf_command	*cmdinfo = kenwood_find_command(cmd);
+	int				len;
+
+	if (cmdinfo == NULL || !kenwood_hf_cmd_set(khf, cmd))
+		return -1;
+
+	va_start(args, cmd);
+	len = kenwood_format(cmdinfo, true, cmdstr, args);
+	va_end(args);
+	if (len == -1)
+		return -1;
+	if (kenwood_send(khf, cmdstr, len, khf->set_cmd_delays[cmd]) == -1)
+		return -1;
+	return 0;
+}
+
+/*
+ * Set commands waiting to go out together.  A command is added to the
+ * same write as the one before it unless the rig needs time to settle
+ * after that one, so the result is the fewest writes the rig accepts.
+ */
+struct kenwood_burst {
+	char		cmds[KW_HF_CMD_MAX * 4];
+	size_t		len;
+	unsigned	delay;		// set_cmd_delays of the last command added
+};
+
+static int kenwood_burst_send(struct kenwood_hf *khf, struct kenwood_burst *b)
+{
+	if (b->len == 0)
+		return 0;
+	if (kenwood_send(khf, b->cmds, b->len, b->delay) == -1) {
+		log_printf(LOG_KENWOOD, LOG_LEVEL_WARNING, "Unable to send %.*s", (int)b->len, b->cmds);
+		return -1;
+	}
+	b->len = 0;
+	return 0;
+}
+
+static int kenwood_burst_add(struct kenwood_hf *khf, struct kenwood_burst *b, enum kenwood_hf_commands cmd, ...)
+{
+	struct khf_command	*cmdinfo = kenwood_find_command(cmd);
+	va_list				args;
+	int					len;
+
+	if (cmdinfo == NULL || !kenwood_hf_cmd_set(khf, cmd))
+		return -1;
+	if (b->len && (b->delay || khf->inter_cmd_delay || b->len + KW_HF_CMD_MAX > sizeof(b->cmds))) {
+		if (kenwood_burst_send(khf, b) != 0)
+			return -1;
+	}
+	va_start(args, cmd);
+	len = kenwood_format(cmdinfo, true, b->cmds + b->len, args);
+	va_end(args);
+	if (len == -1)
+		return -1;
+	b->len += len;
+	b->delay = khf->set_cmd_delays[cmd];
+	return 0;
+}
+
+static enum rig_modes kenwood_mode(enum khf_mode mode)
+{
+	switch (mode) {
+		case KHF_MODE_LSB:
+			return MODE_LSB;
+		case KHF_MODE_USB:
+			return MODE_USB;
+		case KHF_MODE_CW:
+			return MODE_CW;
+		case KHF_MODE_FM:
+			return MODE_FM;
+		case KHF_MODE_AM:
+			return MODE_AM;
+		case KHF_MODE_FSK:
+			return MODE_FSK;
+		case KHF_MODE_CWN:
+			return MODE_CWN;
+		default:
+			return MODE_UNKNOWN;
+	}
+}
+
+/*
+ * The reverse of kenwood_mode()
+ */
+static int kenwood_khf_mode(enum rig_modes rmode, enum khf_mode *mode)
 {
-	struct kenwood_if *ret = (struct kenwood_if *)malloc(sizeof(struct kenwood_if));
+	switch(rmode) {
+		case MODE_LSB:
+			*mode = KHF_MODE_LSB;
+			break;
+		case MODE_USB:
+			*mode = KHF_MODE_USB;
+			break;
+		case MODE_CW:
+			*mode = KHF_MODE_CW;
+			break;
+		case MODE_FM:
+			*mode = KHF_MODE_FM;
+			break;
+		case MODE_AM:
+			*mode = KHF_MODE_AM;
+			break;
+		case MODE_FSK:
+			*mode = KHF_MODE_FSK;
+			break;
+		case MODE_CWN:
+			*mode = KHF_MODE_CWN;
+			break;
+		default:
+			return -1;
+	}
+	return 0;
+}
 
-	if(ret == NULL)
-		return ret;
+static enum vfos kenwood_vfo(enum khf_function func)
+{
+	switch (func) {
+		case FUNCTION_VFO_A:
+			return VFO_A;
+		case FUNCTION_VFO_B:
+			return VFO_B;
+		case FUNCTION_MEMORY:
+			return VFO_MEMORY;
+		case FUNCTION_COM:
+			return VFO_COM;
+		default:
+			return VFO_UNKNOWN;
+	}
+}
 
+/*
+ * Parses an IF response into ret.  Returns 0 on success or -1.
+ */
+static int kenwood_parse_if(struct io_response *resp, struct kenwood_if *ret)
+{
 	switch(kenwood_rscanf(KW_HF_CMD_IF, resp, &ret->freq, &ret->step, &ret->rit,
 			&ret->rit_on, &ret->xit_on, &ret->bank, &ret->channel, &ret->tx,
 			&ret->mode, &ret->function, &ret->scan, &ret->split, &ret->tone,
 			&ret->tone_freq, &ret->offset)) {
 		case EOF:
 		case 0:
-			free(ret);
-			return NULL;
+			return -1;
 		default:
-			return ret;
+			return 0;
 	}
 }
 
@@ -635,24 +945,38 @@ static struct kenwood_if *kenwood_parse_if(struct io_response *resp)
  * This handles any "extra" responses recieved
  * ie: AI mode
  * 
- * Any lock may be held, so MUST NOT lock or post semaphores.
+ * Called from the io delivery thread, which also hands responses to
+ * waiters, so MUST NOT send commands or wait for the rig.
  */
 void kenwood_hf_handle_extra(void *handle, struct io_response *resp)
 {
 	struct kenwood_hf	*khf = (struct kenwood_hf *)handle;
-	struct kenwood_if	*rif;
+	struct kenwood_if	rif;
+	struct rig_status	status;
+	rig_notify_t		notify;
+	void				*notify_data;
 
 	if (resp==NULL)
 		return;
 
+	log_printf(LOG_KENWOOD, LOG_LEVEL_DEBUG, "Unsolicited %.*s", (int)resp->len, resp->msg);
 	if (resp->len >= 2) {
 		if (resp->msg[0] == 'I' && resp->msg[1] == 'F') {
-			rif = kenwood_parse_if(resp);
-			if (rif != NULL) {
+			if (kenwood_parse_if(resp, &rif) == 0) {
 				mutex_lock(&khf->cache_mtx);
-				khf->last_if = *rif;
+				khf->last_if = rif;
+				khf->last_if_tick = ms_ticks();
+				notify = khf->notify;
+				notify_data = khf->notify_data;
 				mutex_unlock(&khf->cache_mtx);
-				free(rif);
+				if (notify) {
+					status.freq = rif.freq;
+					status.mode = kenwood_mode(rif.mode);
+					status.vfo = kenwood_vfo(rif.function);
+					status.ptt = rif.tx == SW_ON;
+					status.split = rif.split == SW_ON;
+					notify(notify_data, &status);
+				}
 			}
 		}
 	}
@@ -660,41 +984,56 @@ void kenwood_hf_handle_extra(void *handle, struct io_response *resp)
 	return;
 }
 
+/*
+ * Stores an IF response read at now in the cache.  Returns with
+ * cache_mtx held if lock is set, even on failure.
+ */
+static int kenwood_cache_if(struct kenwood_hf *khf, struct io_response *resp, uint64_t now, bool lock)
+{
+	struct kenwood_if	rif;
+
+	if (kenwood_parse_if(resp, &rif) != 0) {
+		if (lock)
+			mutex_lock(&khf->cache_mtx);
+		return -1;
+	}
+	mutex_lock(&khf->cache_mtx);
+	khf->last_if = rif;
+	if(!lock)
+		mutex_unlock(&khf->cache_mtx);
+	khf->last_if_tick = now;
+	return 0;
+}
+
+static bool kenwood_if_fresh(struct kenwood_hf *khf, uint64_t now)
+{
+	return khf->last_if_tick != 0 && khf->last_if_tick + khf->if_lifetime >= now;
+}
+
 static int kenwood_update_if(struct kenwood_hf *khf, bool lock)
 {
 	uint64_t			now = ms_ticks();
 	struct io_response	*resp;
-	struct kenwood_if	*rif;
+	int					ret;
 
 	/*
 	 * We shouldn't really need to do this ever because of AI mode
 	 */
-	if (khf == NULL || (khf->last_if_tick != 0 && khf->last_if_tick + khf->if_lifetime >= now)) {
+	if (khf == NULL || kenwood_if_fresh(khf, now)) {
 		if (lock)
 			mutex_lock(&khf->cache_mtx);
 		return 0;
 	}
 
-	resp = kenwood_hf_command(khf, false, KW_HF_CMD_IF);
+	resp = kenwood_hf_command(khf, KW_HF_CMD_IF);
 	if (resp==NULL) {
 		if (lock)
 			mutex_lock(&khf->cache_mtx);
 		return -1;
 	}
-	rif = kenwood_parse_if(resp);
-	free(resp);
-	if (rif == NULL) {
-		if (lock)
-			mutex_lock(&khf->cache_mtx);
-		return -1;
-	}
-	mutex_lock(&khf->cache_mtx);
-	khf->last_if = *rif;
-	if(!lock)
-		mutex_unlock(&khf->cache_mtx);
-	free(rif);
-	khf->last_if_tick = now;
-	return 0;
+	ret = kenwood_cache_if(khf, resp, now, lock);
+	io_free_response(khf->handle, resp);
+	return ret;
 }
 
 struct kenwood_hf *kenwood_hf_new(struct _dictionary_ *d, const char *section)
@@ -707,7 +1046,36 @@ struct kenwood_hf *kenwood_hf_new(struct _dictionary_ *d, const char *section)
 		free(khf);
 		return NULL;
 	}
+	if (mutex_init(&khf->sched_mtx) != 0) {
+		mutex_destroy(&khf->cache_mtx);
+		free(khf);
+		return NULL;
+	}
+	if (semaphore_init(&khf->sched_sem, 0) != 0) {
+		mutex_destroy(&khf->sched_mtx);
+		mutex_destroy(&khf->cache_mtx);
+		free(khf);
+		return NULL;
+	}
+
+	kenwood_hf_reconfigure(khf, d, section);
+
+	return khf;
+}
 
+/*
+ * Reads the timeouts from the config.  Also used to apply a new config
+ * to a running rig without reopening it.
+ */
+int kenwood_hf_reconfigure(void *cbdata, struct _dictionary_ *d, const char *section)
+{
+	struct kenwood_hf *khf = (struct kenwood_hf *)cbdata;
+	char				*value;
+	size_t				len;
+	int					i;
+
+	if (khf == NULL || d == NULL)
+		return EINVAL;
 	/*
 	 * Set up some reasonable defaults to be shared among ALL rigs
 	 */
@@ -716,28 +1084,41 @@ struct kenwood_hf *kenwood_hf_new(struct _dictionary_ *d, const char *section)
 	khf->send_timeout = getint(d, section, "send_timeout", 500);
 	khf->if_lifetime = getint(d, section, "cache_lifetime", 1000);
 	khf->inter_cmd_delay = getint(d, section, "inter_cmd_delay", 0);
-
-	return khf;
+	/*
+	 * Reads the rig answers while it's ignoring commands after a set,
+	 * eg: "settle_reads = IF,FA".  None by default, the older rigs
+	 * ignore everything.
+	 */
+	memset(khf->settle_reads, 0, sizeof(khf->settle_reads));
+	value = getstring(d, section, "settle_reads", "");
+	for (value += strspn(value, ", "); *value; value += strspn(value, ", ")) {
+		len = strcspn(value, ", ");
+		for (i=0; khf_cmd[i].cmd_num != KW_HF_CMD_COUNT; i++) {
+			if (strlen(khf_cmd[i].cmd) == len && strncmp(khf_cmd[i].cmd, value, len) == 0)
+				kenwood_hf_setbits(khf->settle_reads, khf_cmd[i].cmd_num, KW_HF_TERMINATOR);
+		}
+		value += len;
+	}
+	if (khf->handle)
+		io_set_timeouts(khf->handle, khf->response_timeout, khf->char_timeout);
+	return 0;
 }
 
 int kenwood_hf_init(struct kenwood_hf *khf)
 {
 	struct io_response			*resp;
 
+	io_set_timeouts(khf->handle, khf->response_timeout, khf->char_timeout);
+	if (create_thread(kenwood_sched_thread, khf, &khf->sched_thread) != 0)
+		return -1;
+	khf->sched_running = true;
 	// Send an IF command to synchronize... may fail.
-	resp = kenwood_hf_command(khf, false, KW_HF_CMD_IF);
-	if (resp)
-		free(resp);
+	resp = kenwood_hf_command(khf, KW_HF_CMD_IF);
+	io_free_response(khf->handle, resp);
 	// Lock the front panel and enable AI mode
-	resp = kenwood_hf_command(khf, true, KW_HF_CMD_LK, 0);
-	if (resp)
-		free(resp);
-	else
+	if (kenwood_hf_set(khf, KW_HF_CMD_LK, 0) != 0)
 		return -1;
-	resp = kenwood_hf_command(khf, true, KW_HF_CMD_AI, 1);
-	if (resp)
-		free(resp);
-	else
+	if (kenwood_hf_set(khf, KW_HF_CMD_AI, 1) != 0)
 		return -1;
 	// Get the initial state...
 	return kenwood_update_if(khf, false);
@@ -748,6 +1129,8 @@ void kenwood_hf_free(struct kenwood_hf *khf)
 	if (khf == NULL)
 		return;
 	mutex_destroy(&khf->cache_mtx);
+	mutex_destroy(&khf->sched_mtx);
+	semaphore_destroy(&khf->sched_sem);
 	free(khf);
 }
 
@@ -780,12 +1163,8 @@ void kenwood_hf_set_cmd_delays(struct kenwood_hf *khf, ...)
 
 static int disable_rit_xit(struct kenwood_hf *khf, bool xit)
 {
-	struct io_response			*resp;
-
-	resp = kenwood_hf_command(khf, true, xit?KW_HF_CMD_XT:KW_HF_CMD_RT, SW_OFF);
-	if (resp == NULL)
+	if (kenwood_hf_set(khf, xit?KW_HF_CMD_XT:KW_HF_CMD_RT, SW_OFF) != 0)
 		return EINTR;
-	free(resp);
 	mutex_lock(&khf->cache_mtx);
 	if (xit)
 		khf->last_if.xit_on = SW_OFF;
@@ -798,7 +1177,6 @@ static int disable_rit_xit(struct kenwood_hf *khf, bool xit)
 int kenwood_hf_set_frequency(void *cbdata, enum vfos vfo, uint64_t freq)
 {
 	struct kenwood_hf			*khf = (struct kenwood_hf *)cbdata;
-	struct io_response			*resp;
 	enum kenwood_hf_commands	cmd;
 	enum khf_function			func;
 	enum khf_sw					split;
@@ -828,9 +1206,13 @@ int kenwood_hf_set_frequency(void *cbdata, enum vfos vfo, uint64_t freq)
 			case FUNCTION_VFO_B:
 				cmd = KW_HF_CMD_FB;
 				break;
+			default:
+				return EACCES;
 		}
 	}
 	else {
+		// Setting a named VFO leaves split and RIT/XIT as they are
+		split = rit_on = xit_on = SW_OFF;
 		switch(vfo) {
 			case VFO_A:
 				cmd = KW_HF_CMD_FA;
@@ -842,18 +1224,14 @@ int kenwood_hf_set_frequency(void *cbdata, enum vfos vfo, uint64_t freq)
 				return EACCES;
 		}
 	}
-	resp = kenwood_hf_command(khf, true, cmd, freq);
-	if (resp == NULL)
+	if (kenwood_hf_set(khf, cmd, freq) != 0)
 		return ENODEV;
 	mutex_lock(&khf->cache_mtx);
 	khf->last_if.freq = freq;
 	mutex_unlock(&khf->cache_mtx);
-	free(resp);
 	if (split == SW_ON) {
-		resp = kenwood_hf_command(khf, true, KW_HF_CMD_SP, SW_OFF);
-		if (resp == NULL)
+		if (kenwood_hf_set(khf, KW_HF_CMD_SP, SW_OFF) != 0)
 			return EINTR;
-		free(resp);
 		mutex_lock(&khf->cache_mtx);
 		khf->last_if.split = SW_OFF;
 		mutex_unlock(&khf->cache_mtx);
@@ -875,7 +1253,6 @@ int kenwood_hf_set_frequency(void *cbdata, enum vfos vfo, uint64_t freq)
 int kenwood_hf_set_split_frequency(void *cbdata, uint64_t freq_rx, uint64_t freq_tx)
 {
 	struct kenwood_hf			*khf = (struct kenwood_hf *)cbdata;
-	struct io_response			*resp;
 	enum kenwood_hf_commands	rx_cmd;
 	enum kenwood_hf_commands	tx_cmd;
 	enum khf_function			func;
@@ -906,18 +1283,16 @@ int kenwood_hf_set_split_frequency(void *cbdata, uint64_t freq_rx, uint64_t freq
 			rx_cmd = KW_HF_CMD_FB;
 			tx_cmd = KW_HF_CMD_FA;
 			break;
+		default:
+			return EACCES;
 	}
-	resp = kenwood_hf_command(khf, true, rx_cmd, freq_rx);
-	if (resp == NULL)
+	if (kenwood_hf_set(khf, rx_cmd, freq_rx) != 0)
 		return ENODEV;
 	mutex_lock(&khf->cache_mtx);
 	khf->last_if.freq = freq_rx;
 	mutex_unlock(&khf->cache_mtx);
-	free(resp);
-	resp = kenwood_hf_command(khf, true, tx_cmd, freq_tx);
-	if (resp == NULL)
+	if (kenwood_hf_set(khf, tx_cmd, freq_tx) != 0)
 		return ENODEV;
-	free(resp);
 	if (rit_on == SW_ON) {
 		ret = disable_rit_xit(khf, false);
 		if (ret != 0)
@@ -929,13 +1304,11 @@ int kenwood_hf_set_split_frequency(void *cbdata, uint64_t freq_rx, uint64_t freq
 			return ret;
 	}
 	if (split == SW_OFF) {
-		resp = kenwood_hf_command(khf, true, KW_HF_CMD_SP, SW_ON);
-		if (resp == NULL)
+		if (kenwood_hf_set(khf, KW_HF_CMD_SP, SW_ON) != 0)
 			return ENODEV;
 		mutex_lock(&khf->cache_mtx);
 		khf->last_if.split = SW_ON;
 		mutex_unlock(&khf->cache_mtx);
-		free(resp);
 	}
 	return 0;
 }
@@ -966,124 +1339,234 @@ uint64_t kenwood_hf_get_frequency(void *cbdata, enum vfos vfo)
 			default:
 				return EACCES;
 		}
-		resp = kenwood_hf_command(khf, false, cmd);
+		resp = kenwood_hf_command(khf, cmd);
 		if (resp == NULL)
 			return ENODEV;
 		kenwood_rscanf(cmd, resp, &ret);
-		free(resp);
+		io_free_response(khf->handle, resp);
 	}
 	return ret;
 }
 
+/*
+ * Sends the reads back-to-back so they cost one round trip instead of
+ * up to three.  If the IF cache is stale, which VFO is which isn't known
+ * yet so both FA and FB are read along with IF.
+ */
 int kenwood_hf_get_split_frequency(void *cbdata, uint64_t *rx_freq, uint64_t *tx_freq)
 {
 	struct kenwood_hf			*khf = (struct kenwood_hf *)cbdata;
-	enum khf_function			func;
-	enum khf_sw					split;
-	enum khf_sw					rit_on;
-	enum khf_sw					xit_on;
-	enum khf_sw					tx;
-	int							rit;
+	struct kenwood_if			rif;
+	enum kenwood_hf_commands	cmds[3];
+	struct io_response			*resps[3];
 	enum kenwood_hf_commands	rx_cmd;
 	enum kenwood_hf_commands	tx_cmd;
-	struct io_response			*resp;
+	unsigned					count = 0;
+	unsigned					i;
+	bool						fresh;
+	int							ret = 0;
+	uint64_t					now = ms_ticks();
 
 	if (khf == NULL)
 		return EINVAL;
 
-	kenwood_update_if(khf, true);
-	func = khf->last_if.function;
-	split = khf->last_if.split;
-	rit_on = khf->last_if.rit_on;
-	xit_on = khf->last_if.xit_on;
-	rit = khf->last_if.rit;
-	tx = khf->last_if.tx;
-	mutex_unlock(&khf->cache_mtx);
-	if (split == SW_OFF) {
-		if (rit_on == xit_on)
+	fresh = kenwood_if_fresh(khf, now);
+	if (fresh) {
+		mutex_lock(&khf->cache_mtx);
+		rif = khf->last_if;
+		mutex_unlock(&khf->cache_mtx);
+		if (rif.split == SW_OFF && rif.rit_on == rif.xit_on)
 			return EACCES;
-	}
-	switch(func) {
-		case FUNCTION_MEMORY:
-		case FUNCTION_COM:
+		if (rif.function != FUNCTION_VFO_A && rif.function != FUNCTION_VFO_B)
 			return EACCES;
-		case FUNCTION_VFO_A:
-			rx_cmd = KW_HF_CMD_FA;
-			tx_cmd = KW_HF_CMD_FB;
-			break;
-		case FUNCTION_VFO_B:
-			rx_cmd = KW_HF_CMD_FB;
-			tx_cmd = KW_HF_CMD_FA;
-			break;
+		rx_cmd = rif.function == FUNCTION_VFO_A ? KW_HF_CMD_FA : KW_HF_CMD_FB;
+		tx_cmd = rif.function == FUNCTION_VFO_A ? KW_HF_CMD_FB : KW_HF_CMD_FA;
+		if (rx_freq != NULL)
+			cmds[count++] = rx_cmd;
+		if (tx_freq != NULL)
+			cmds[count++] = tx_cmd;
+		if (count == 0)
+			return 0;
 	}
-	if (rx_freq != NULL) {
-		resp = kenwood_hf_command(khf, false, rx_cmd);
-		if (resp == NULL)
-			return ENODEV;
-		kenwood_rscanf(rx_cmd, resp, rx_freq);
-		free(resp);
-		if (rit_on == SW_ON) {
-			if (xit_on != SW_ON)
-				if (tx == SW_ON)
-					rx_freq += rit;
+	else {
+		cmds[count++] = KW_HF_CMD_IF;
+		if (rx_freq != NULL || tx_freq != NULL) {
+			cmds[count++] = KW_HF_CMD_FA;
+			cmds[count++] = KW_HF_CMD_FB;
 		}
 	}
-	if (tx_freq != NULL) {
-		resp = kenwood_hf_command(khf, false, tx_cmd);
-		if (resp == NULL)
-			return ENODEV;
-		kenwood_rscanf(tx_cmd, resp, tx_freq);
-		free(resp);
-		if (xit_on == SW_ON) {
-			if (rit_on != SW_ON)
-				if (tx == SW_OFF)
-					tx_freq += rit;
+	if (kenwood_read_commands(khf, count, cmds, resps) != 0)
+		return ENODEV;
+	if (!fresh) {
+		if (kenwood_cache_if(khf, resps[0], now, true) != 0) {
+			mutex_unlock(&khf->cache_mtx);
+			ret = ENODEV;
+			goto done;
 		}
+		rif = khf->last_if;
+		mutex_unlock(&khf->cache_mtx);
+		if ((rif.split == SW_OFF && rif.rit_on == rif.xit_on) ||
+		    (rif.function != FUNCTION_VFO_A && rif.function != FUNCTION_VFO_B)) {
+			ret = EACCES;
+			goto done;
+		}
+		rx_cmd = rif.function == FUNCTION_VFO_A ? KW_HF_CMD_FA : KW_HF_CMD_FB;
+		tx_cmd = rif.function == FUNCTION_VFO_A ? KW_HF_CMD_FB : KW_HF_CMD_FA;
 	}
-	return 0;
+
+	for (i = 0; i < count; i++) {
+		if (rx_freq != NULL && cmds[i] == rx_cmd) {
+			kenwood_rscanf(rx_cmd, resps[i], rx_freq);
+			if (rif.rit_on == SW_ON) {
+				if (rif.xit_on != SW_ON)
+					if (rif.tx == SW_ON)
+						*rx_freq += rif.rit;
+			}
+		}
+		if (tx_freq != NULL && cmds[i] == tx_cmd) {
+			kenwood_rscanf(tx_cmd, resps[i], tx_freq);
+			if (rif.xit_on == SW_ON) {
+				if (rif.rit_on != SW_ON)
+					if (rif.tx == SW_OFF)
+						*tx_freq += rif.rit;
+			}
+		}
+	}
+
+done:
+	for (i = 0; i < count; i++)
+		io_free_response(khf->handle, resps[i]);
+	return ret;
 }
 
 int kenwood_hf_set_mode(void *cbdata, enum rig_modes rmode)
 {
 	struct kenwood_hf	*khf = (struct kenwood_hf *)cbdata;
 	enum khf_mode		mode;
-	struct io_response	*resp;
 
 	if (khf == NULL)
 		return EINVAL;
 
-	switch(rmode) {
-		case MODE_LSB:
-			mode = KHF_MODE_LSB;
-			break;
-		case MODE_USB:
-			mode = KHF_MODE_USB;
-			break;
-		case MODE_CW:
-			mode = KHF_MODE_CW;
-			break;
-		case MODE_FM:
-			mode = KHF_MODE_FM;
-			break;
-		case MODE_AM:
-			mode = KHF_MODE_AM;
-			break;
-		case MODE_FSK:
-			mode = KHF_MODE_FSK;
-			break;
-		case MODE_CWN:
-			mode = KHF_MODE_CWN;
-			break;
-		default:
-			return EINVAL;
-	}
-	resp = kenwood_hf_command(khf, true, KW_HF_CMD_MD, mode);
-	if (resp == NULL)
+	if (kenwood_khf_mode(rmode, &mode) != 0)
+		return EINVAL;
+	if (kenwood_hf_set(khf, KW_HF_CMD_MD, mode) != 0)
 		return ENODEV;
 	mutex_lock(&khf->cache_mtx);
 	khf->last_if.mode = mode;
 	mutex_unlock(&khf->cache_mtx);
-	free(resp);
+	return 0;
+}
+
+/*
+ * Sets everything in txn with at most one IF read, leaving out anything
+ * the rig is already set to.  The current VFO is set before the mode as
+ * the separate calls would, the other VFO and split after it so the
+ * mode can go out with the next frequency rather than after a delay.
+ */
+int kenwood_hf_commit(void *cbdata, const struct rig_txn *txn)
+{
+	struct kenwood_hf			*khf = (struct kenwood_hf *)cbdata;
+	struct kenwood_burst		b = {.len = 0};
+	struct kenwood_if			rif;
+	enum kenwood_hf_commands	cur_cmd;
+	enum kenwood_hf_commands	other_cmd;
+	enum khf_mode				mode;
+	bool						on_vfo;
+	bool						freq;
+	bool						split;
+	bool						set_cur = false;
+	bool						set_other = false;
+	uint64_t					cur_freq = 0;
+	uint64_t					other_freq = 0;
+
+	if (khf == NULL || txn == NULL)
+		return EINVAL;
+
+	if (kenwood_update_if(khf, true) != 0) {
+		mutex_unlock(&khf->cache_mtx);
+		return ENODEV;
+	}
+	rif = khf->last_if;
+	mutex_unlock(&khf->cache_mtx);
+	mode = rif.mode;
+	if ((txn->fields & RIG_TXN_MODE) && kenwood_khf_mode(txn->mode, &mode) != 0)
+		return EINVAL;
+	on_vfo = rif.function == FUNCTION_VFO_A || rif.function == FUNCTION_VFO_B;
+	if ((txn->fields & RIG_TXN_FREQ) && !on_vfo)
+		return EACCES;
+	cur_cmd = rif.function == FUNCTION_VFO_B ? KW_HF_CMD_FB : KW_HF_CMD_FA;
+	other_cmd = rif.function == FUNCTION_VFO_B ? KW_HF_CMD_FA : KW_HF_CMD_FB;
+	// Like set_frequency(), a named VFO leaves split and RIT/XIT alone
+	freq = (txn->fields & RIG_TXN_FREQ) != 0;
+	split = freq && txn->split;
+
+	if (txn->fields & RIG_TXN_FREQ) {
+		set_cur = true;
+		cur_freq = txn->freq;
+		// The other VFO isn't in the IF response, so always set it
+		if (split) {
+			set_other = true;
+			other_freq = txn->tx_freq;
+		}
+	}
+	if (txn->fields & RIG_TXN_VFO_A) {
+		if (on_vfo && cur_cmd == KW_HF_CMD_FA) {
+			set_cur = true;
+			cur_freq = txn->vfo_a;
+		}
+		else if (kenwood_burst_add(khf, &b, KW_HF_CMD_FA, txn->vfo_a) != 0)
+			return ENODEV;
+	}
+	if (txn->fields & RIG_TXN_VFO_B) {
+		if (on_vfo && cur_cmd == KW_HF_CMD_FB) {
+			set_cur = true;
+			cur_freq = txn->vfo_b;
+		}
+		else {
+			set_other = true;
+			other_freq = txn->vfo_b;
+			other_cmd = KW_HF_CMD_FB;
+		}
+	}
+
+	if (set_cur && rif.freq != cur_freq) {
+		if (kenwood_burst_add(khf, &b, cur_cmd, cur_freq) != 0)
+			return ENODEV;
+	}
+	if (freq && rif.rit_on == SW_ON) {
+		if (kenwood_burst_add(khf, &b, KW_HF_CMD_RT, SW_OFF) != 0)
+			return EINTR;
+	}
+	if (freq && rif.xit_on == SW_ON) {
+		if (kenwood_burst_add(khf, &b, KW_HF_CMD_XT, SW_OFF) != 0)
+			return EINTR;
+	}
+	if ((txn->fields & RIG_TXN_MODE) && rif.mode != mode) {
+		if (kenwood_burst_add(khf, &b, KW_HF_CMD_MD, mode) != 0)
+			return ENODEV;
+	}
+	if (set_other) {
+		if (kenwood_burst_add(khf, &b, other_cmd, other_freq) != 0)
+			return ENODEV;
+	}
+	if (freq && rif.split != (split ? SW_ON : SW_OFF)) {
+		if (kenwood_burst_add(khf, &b, KW_HF_CMD_SP, split ? SW_ON : SW_OFF) != 0)
+			return ENODEV;
+	}
+	if (kenwood_burst_send(khf, &b) != 0)
+		return ENODEV;
+
+	mutex_lock(&khf->cache_mtx);
+	if (set_cur)
+		khf->last_if.freq = cur_freq;
+	if (freq) {
+		khf->last_if.split = split ? SW_ON : SW_OFF;
+		khf->last_if.rit_on = SW_OFF;
+		khf->last_if.xit_on = SW_OFF;
+	}
+	if (txn->fields & RIG_TXN_MODE)
+		khf->last_if.mode = mode;
+	mutex_unlock(&khf->cache_mtx);
 	return 0;
 }
 
@@ -1095,31 +1578,13 @@ enum rig_modes kenwood_hf_get_mode(void *cbdata)
 	kenwood_update_if(khf, true);
 	mode = khf->last_if.mode;
 	mutex_unlock(&khf->cache_mtx);
-	switch (mode) {
-		case KHF_MODE_LSB:
-			return MODE_LSB;
-		case KHF_MODE_USB:
-			return MODE_USB;
-		case KHF_MODE_CW:
-			return MODE_CW;
-		case KHF_MODE_FM:
-			return MODE_FM;
-		case KHF_MODE_AM:
-			return MODE_AM;
-		case KHF_MODE_FSK:
-			return MODE_FSK;
-		case KHF_MODE_CWN:
-			return MODE_CWN;
-		default:
-			return MODE_UNKNOWN;
-	}
+	return kenwood_mode(mode);
 }
 
 int kenwood_hf_set_vfo(void *cbdata, enum vfos vfo)
 {
 	struct kenwood_hf	*khf = (struct kenwood_hf *)cbdata;
 	enum khf_function	func;
-	struct io_response	*resp;
 
 	if (khf == NULL)
 		return EINVAL;
@@ -1140,8 +1605,7 @@ int kenwood_hf_set_vfo(void *cbdata, enum vfos vfo)
 		default:
 			return EINVAL;
 	}
-	resp = kenwood_hf_command(khf, true, KW_HF_CMD_FN, func);
-	if (resp == NULL)
+	if (kenwood_hf_set(khf, KW_HF_CMD_FN, func) != 0)
 		return ENODEV;
 	/*
 	 *  Force next IF to be sent... changing VFOs can toggle a lot of things.
@@ -1149,7 +1613,6 @@ int kenwood_hf_set_vfo(void *cbdata, enum vfos vfo)
 	 */
 
 	khf->last_if_tick = 0;
-	free(resp);
 	return 0;
 }
 
@@ -1161,32 +1624,16 @@ enum vfos kenwood_hf_get_vfo(void *cbdata)
 	kenwood_update_if(khf, true);
 	cvfo = khf->last_if.function;
 	mutex_unlock(&khf->cache_mtx);
-	switch (cvfo) {
-		case FUNCTION_VFO_A:
-			return VFO_A;
-		case FUNCTION_VFO_B:
-			return VFO_B;
-		case FUNCTION_MEMORY:
-			return VFO_MEMORY;
-		case FUNCTION_COM:
-			return VFO_COM;
-		default:
-			return VFO_UNKNOWN;
-	}
+	return kenwood_vfo(cvfo);
 }
 
 int kenwood_hf_set_ptt(void *cbdata, bool tx)
 {
 	struct kenwood_hf	*khf = (struct kenwood_hf *)cbdata;
-	struct io_response	*resp;
 
 	if (khf == NULL)
 		return EINVAL;
-	if (tx)
-		resp = kenwood_hf_command(khf, true, KW_HF_CMD_TX);
-	else
-		resp = kenwood_hf_command(khf, true, KW_HF_CMD_RX);
-	if (resp == NULL)
+	if (kenwood_hf_set(khf, tx ? KW_HF_CMD_TX : KW_HF_CMD_RX) != 0)
 		return ENODEV;
 	/*
 	 *  Force next IF to be sent... toggling PTT can toggle a lot of things.
@@ -1194,7 +1641,6 @@ int kenwood_hf_set_ptt(void *cbdata, bool tx)
 	 */
 	
 	khf->last_if_tick = 0;
-	free(resp);
 	return 0;
 }
 
@@ -1219,10 +1665,22 @@ int kenwood_hf_get_ptt(void *cbdata)
 	}
 }
 
+int kenwood_hf_set_notify(void *cbdata, rig_notify_t notify, void *notify_data)
+{
+	struct kenwood_hf	*khf = (struct kenwood_hf *)cbdata;
+
+	if (khf == NULL)
+		return EINVAL;
+	mutex_lock(&khf->cache_mtx);
+	khf->notify = notify;
+	khf->notify_data = notify_data;
+	mutex_unlock(&khf->cache_mtx);
+	return 0;
+}
+
 int kenwood_hf_close(void *cbdata)
 {
 	struct kenwood_hf	*khf = (struct kenwood_hf *)cbdata;
-	struct io_response	*resp;
 	int					ret;
 
 	if (khf==NULL)
@@ -1231,16 +1689,15 @@ int kenwood_hf_close(void *cbdata)
 	 * Most rigs don't support this, so it will fail.
 	 * That's OK though.
 	 */
-	resp = kenwood_hf_command(khf, true, KW_HF_CMD_LO);
-	if (resp)
-		free(resp);
-	resp = kenwood_hf_command(khf, true, KW_HF_CMD_LK, 0);
-	if (resp)
-		free(resp);
-	resp = kenwood_hf_command(khf, true, KW_HF_CMD_AI, 0);
-	if (resp)
-		free(resp);
-
+	kenwood_hf_set(khf, KW_HF_CMD_LO);
+	kenwood_hf_set(khf, KW_HF_CMD_LK, 0);
+	kenwood_hf_set(khf, KW_HF_CMD_AI, 0);
+
+	if (khf->sched_running) {
+		khf->sched_stop = true;
+		semaphore_post(&khf->sched_sem);
+		wait_thread(khf->sched_thread);
+	}
 	ret = io_end(khf->handle);
 	kenwood_hf_free(khf);
 	return ret;
@@ -97,6 +97,23 @@ struct kenwood_if {
 	unsigned			offset;
 };
 
+/*
+ * A write waiting for the scheduler thread, on the caller's stack until
+ * sent is posted.
+ */
+struct kenwood_job {
+	const char			*cmd;
+	size_t				len;
+	unsigned			delay;		// The rig ignores commands for this long after
+	bool				settle_ok;	// May be sent while the rig ignores commands
+	unsigned			count;		// Waiters registered just before it's written
+	struct io_waiter	*waiters;
+	const char			**match;	// Response prefix for each waiter
+	int					ret;		// io_write() result
+	semaphore_t			sent;
+	struct kenwood_job	*next;
+};
+
 struct kenwood_hf {
 	struct io_handle 	*handle;
 	unsigned			response_timeout;	// Max time to wait in between responses.
@@ -104,39 +121,54 @@ struct kenwood_hf {
 	unsigned			send_timeout;		// Max time to wait in between chars while sending.
 	unsigned			if_lifetime;		// Time in milliseconds to keep and IF response cached.
 	unsigned			inter_cmd_delay;	// Minimum time between commands
-	unsigned			additional_intercmd_delay;	// Additional one-shot delay...
 	unsigned			set_cmd_delays[KW_HF_CMD_COUNT];	// Additional delay for each command.
-	uint64_t			last_cmd_tick;
 	char				read_cmds[KW_HF_CMD_COUNT/8+1];
 	char				set_cmds[KW_HF_CMD_COUNT/8+1];
+	char				settle_reads[KW_HF_CMD_COUNT/8+1];	// Reads answered during set_cmd_delays
+	thread_t			sched_thread;		// The only thread writing to the rig
+	bool				sched_running;
+	bool				sched_stop;
+	mutex_t				sched_mtx;			// Held when reading/writing jobs
+	semaphore_t			sched_sem;			// Posted for each job and to stop
+	struct kenwood_job	*jobs;				// Oldest first
+	uint64_t			next_send;			// us_ticks() when inter_cmd_delay is up
+	uint64_t			settled;			// us_ticks() when set_cmd_delays is up
 	mutex_t				cache_mtx;
 	struct kenwood_if	last_if;
 	uint64_t			last_if_tick;
 	bool				hands_on;
+	rig_notify_t		notify;				// Called when an AI mode IF arrives
+	void				*notify_data;
 };
 
 #define kenwood_hf_cmd_set(hf, cmd)		((hf->set_cmds[cmd/8] & (1 << (cmd % 8)))?1:0)
 #define kenwood_hf_cmd_read(hf, cmd)	((hf->read_cmds[cmd/8] & (1 << (cmd % 8)))?1:0)
+#define kenwood_hf_cmd_settle(hf, cmd)	((hf->settle_reads[cmd/8] & (1 << (cmd % 8)))?1:0)
 
 int kenwood_hf_init(struct kenwood_hf *khf);
 struct io_response *kenwood_hf_read_response(void *cbdata);
+size_t kenwood_hf_frame(void *cbdata, const char *buf, size_t len);
 void kenwood_hf_handle_extra(void *handle, struct io_response *resp);
 void kenwood_hf_setbits(char *array, ...);
 void kenwood_hf_set_cmd_delays(struct kenwood_hf *khf, ...);
-struct io_response *kenwood_hf_command(struct kenwood_hf *khf, bool set, enum kenwood_hf_commands cmd, ...);
+struct io_response *kenwood_hf_command(struct kenwood_hf *khf, enum kenwood_hf_commands cmd, ...);
+int kenwood_hf_set(struct kenwood_hf *khf, enum kenwood_hf_commands cmd, ...);
 void kenwood_hf_free(struct kenwood_hf *khf);
 struct kenwood_hf *kenwood_hf_new(struct _dictionary_ *d, const char *section);
+int kenwood_hf_reconfigure(void *cbdata, struct _dictionary_ *d, const char *section);
 
 int kenwood_hf_set_frequency(void *cbdata, enum vfos vfo, uint64_t freq);
 int kenwood_hf_set_split_frequency(void *cbdata, uint64_t freq_rx, uint64_t freq_tx);
 uint64_t kenwood_hf_get_frequency(void *cbdata, enum vfos vfo);
 int kenwood_hf_get_split_frequency(void *cbdata, uint64_t *rx_freq, uint64_t *tx_freq);
 int kenwood_hf_set_mode(void *khf, enum rig_modes mode);
+int kenwood_hf_commit(void *cbdata, const struct rig_txn *txn);
 enum rig_modes kenwood_hf_get_mode(void *khf);
 int kenwood_hf_set_vfo(void *cbdata, enum vfos vfo);
 enum vfos kenwood_hf_get_vfo(void *cbdata);
 int kenwood_hf_set_ptt(void *cbdata, bool tx);
 int kenwood_hf_get_ptt(void *cbdata);
+int kenwood_hf_set_notify(void *cbdata, rig_notify_t notify, void *notify_data);
 int kenwood_hf_close(void *cbdata);
 
 #endif
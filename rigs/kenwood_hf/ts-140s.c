@@ -33,18 +33,13 @@
 
 #include "kenwood_hf.h"
 
-struct rig	*ts140s_init(struct _dictionary_ *d, const char *section)
+void	ts140s_defaults(struct _dictionary_ *d, const char *section)
 {
-	struct rig				*ret = (struct rig *)calloc(1, sizeof(struct rig));
-	struct kenwood_hf		*khf;
-	char					*rig_name;
-
-	if (ret == NULL)
-		return NULL;
+	char	*rig_name;
 
 	rig_name = getstring(d, section, "rig", NULL);
 	if (rig_name == NULL)
-		return NULL;
+		return;
 
 	// Fill in serial port defaults
 	set_default(d, section, "type", "serial");
@@ -79,6 +74,17 @@ struct rig	*ts140s_init(struct _dictionary_ *d, const char *section)
 		set_default(d, section, "tx_bandlimit_low_6m", "50000000");
 		set_default(d, section, "tx_bandlimit_high_6m", "54000000");
 	}
+}
+
+struct rig	*ts140s_init(struct _dictionary_ *d, const char *section)
+{
+	struct rig				*ret = (struct rig *)calloc(1, sizeof(struct rig));
+	struct kenwood_hf		*khf;
+
+	if (ret == NULL)
+		return NULL;
+
+	ts140s_defaults(d, section);
 
 	khf = kenwood_hf_new(d, section);
 	if (khf == NULL) {
@@ -94,11 +100,14 @@ struct rig	*ts140s_init(struct _dictionary_ *d, const char *section)
 	ret->set_split_frequency = kenwood_hf_set_split_frequency;
 	ret->get_split_frequency = kenwood_hf_get_split_frequency;
 	ret->set_mode = kenwood_hf_set_mode;
+	ret->commit = kenwood_hf_commit;
 	ret->get_mode = kenwood_hf_get_mode;
 	ret->set_vfo = kenwood_hf_set_vfo;
 	ret->get_vfo = kenwood_hf_get_vfo;
 	ret->set_ptt = kenwood_hf_set_ptt;
 	ret->get_ptt = kenwood_hf_get_ptt;
+	ret->set_notify = kenwood_hf_set_notify;
+	ret->reconfigure = kenwood_hf_reconfigure;
 	ret->cbdata = khf;
 	kenwood_hf_setbits(khf->set_cmds, KW_HF_CMD_AI,
 			KW_HF_CMD_DN, KW_HF_CMD_UP, KW_HF_CMD_FA,
@@ -111,9 +120,9 @@ struct rig	*ts140s_init(struct _dictionary_ *d, const char *section)
 			KW_HF_CMD_FB, KW_HF_CMD_ID, KW_HF_CMD_IF,
 			KW_HF_CMD_LK, KW_HF_CMD_MR, KW_HF_TERMINATOR);
 
-	khf->handle=io_start_from_dictionary(d, section, IO_H_SERIAL, kenwood_hf_read_response, kenwood_hf_handle_extra, khf);
+	khf->handle=io_start_from_dictionary(d, section, IO_H_UNKNOWN, kenwood_hf_read_response, kenwood_hf_frame, kenwood_hf_handle_extra, khf);
 	if (khf->handle == NULL) {
-		free(khf);
+		kenwood_hf_free(khf);
 		free(ret);
 		return NULL;
 	}
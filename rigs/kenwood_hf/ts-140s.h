@@ -28,6 +28,7 @@
 
 #include <api.h>
 
+void	ts140s_defaults(struct _dictionary_ *d, const char *section);
 struct rig	*ts140s_init(struct _dictionary_ *d, const char *section);
 
 #endif
@@ -28,6 +28,7 @@
 
 #include <api.h>
 
+void	ts440s_defaults(struct _dictionary_ *d, const char *section);
 struct rig	*ts440s_init(struct _dictionary_ *d, const char *section);
 
 #endif
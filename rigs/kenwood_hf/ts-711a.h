@@ -28,6 +28,7 @@
 
 #include <api.h>
 
+void	ts711a_defaults(struct _dictionary_ *d, const char *section);
 struct rig	*ts711a_init(struct _dictionary_ *d, const char *section);
 
 #endif
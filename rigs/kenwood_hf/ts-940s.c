@@ -33,14 +33,8 @@
 
 #include "kenwood_hf.h"
 
-struct rig	*ts940s_init(struct _dictionary_ *d, const char *section)
+void	ts940s_defaults(struct _dictionary_ *d, const char *section)
 {
-	struct rig				*ret = (struct rig *)calloc(1, sizeof(struct rig));
-	struct kenwood_hf		*khf;
-
-	if (ret == NULL)
-		return NULL;
-
 	// Fill in serial port defaults
 	set_default(d, section, "type", "serial");
 	set_default(d, section, "speed", "4800");
@@ -68,6 +62,17 @@ struct rig	*ts940s_init(struct _dictionary_ *d, const char *section)
 	set_default(d, section, "tx_bandlimit_high_12m", "24990000");
 	set_default(d, section, "tx_bandlimit_low_10m", "28000000");
 	set_default(d, section, "tx_bandlimit_high_10m", "29700000");
+}
+
+struct rig	*ts940s_init(struct _dictionary_ *d, const char *section)
+{
+	struct rig				*ret = (struct rig *)calloc(1, sizeof(struct rig));
+	struct kenwood_hf		*khf;
+
+	if (ret == NULL)
+		return NULL;
+
+	ts940s_defaults(d, section);
 
 	khf = kenwood_hf_new(d, section);
 	if (khf == NULL) {
@@ -83,11 +88,14 @@ struct rig	*ts940s_init(struct _dictionary_ *d, const char *section)
 	ret->set_split_frequency = kenwood_hf_set_split_frequency;
 	ret->get_split_frequency = kenwood_hf_get_split_frequency;
 	ret->set_mode = kenwood_hf_set_mode;
+	ret->commit = kenwood_hf_commit;
 	ret->get_mode = kenwood_hf_get_mode;
 	ret->set_vfo = kenwood_hf_set_vfo;
 	ret->get_vfo = kenwood_hf_get_vfo;
 	ret->set_ptt = kenwood_hf_set_ptt;
 	ret->get_ptt = kenwood_hf_get_ptt;
+	ret->set_notify = kenwood_hf_set_notify;
+	ret->reconfigure = kenwood_hf_reconfigure;
 	ret->cbdata = khf;
 	kenwood_hf_setbits(khf->set_cmds, KW_HF_CMD_AI, KW_HF_CMD_AT1,
 			KW_HF_CMD_DN, KW_HF_CMD_UP, KW_HF_CMD_DS, KW_HF_CMD_FA,
@@ -102,9 +110,9 @@ struct rig	*ts940s_init(struct _dictionary_ *d, const char *section)
 			KW_HF_CMD_LK, KW_HF_CMD_MR, KW_HF_CMD_MS, KW_HF_CMD_SH,
 			KW_HF_CMD_SL, KW_HF_CMD_VB, KW_HF_TERMINATOR);
 
-	khf->handle=io_start_from_dictionary(d, section, IO_H_SERIAL, kenwood_hf_read_response, kenwood_hf_handle_extra, khf);
+	khf->handle=io_start_from_dictionary(d, section, IO_H_UNKNOWN, kenwood_hf_read_response, kenwood_hf_frame, kenwood_hf_handle_extra, khf);
 	if (khf->handle == NULL) {
-		free(khf);
+		kenwood_hf_free(khf);
 		free(ret);
 		return NULL;
 	}
@@ -28,6 +28,7 @@
 
 #include <api.h>
 
+void	ts940s_defaults(struct _dictionary_ *d, const char *section);
 struct rig	*ts940s_init(struct _dictionary_ *d, const char *section);
 
 #endif
@@ -36,28 +36,19 @@
 static int ft736r_close(void *cbdata)
 {
 	struct yaesu_bincat	*ybc = (struct yaesu_bincat *)cbdata;
-	struct io_response	*resp;
 	int					ret;
 
 	if (ybc==NULL)
 		return EINVAL;
-	resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_CAT_OFF);
-	if (resp)
-		free(resp);
+	yaesu_bincat_set(ybc, Y_BC_CMD_CAT_OFF);
 
 	ret = io_end(ybc->handle);
 	yaesu_bincat_free(ybc);
 	return ret;
 }
 
-struct rig	*ft736r_init(struct _dictionary_ *d, const char *section)
+void	ft736r_defaults(struct _dictionary_ *d, const char *section)
 {
-	struct rig			*ret = (struct rig *)calloc(1, sizeof(struct rig));
-	struct yaesu_bincat	*ybc;
-
-	if (ret == NULL)
-		return NULL;
-
 	// Fill in serial port defaults
 	set_default(d, section, "type", "serial");
 	set_default(d, section, "speed", "4800");
@@ -73,6 +64,17 @@ struct rig	*ft736r_init(struct _dictionary_ *d, const char *section)
 	set_default(d, section, "tx_bandlimit_high_2m", "147999990");
 	set_default(d, section, "tx_bandlimit_low_70cm", "430000000");
 	set_default(d, section, "tx_bandlimit_high_70cm", "449999990");
+}
+
+struct rig	*ft736r_init(struct _dictionary_ *d, const char *section)
+{
+	struct rig			*ret = (struct rig *)calloc(1, sizeof(struct rig));
+	struct yaesu_bincat	*ybc;
+
+	if (ret == NULL)
+		return NULL;
+
+	ft736r_defaults(d, section);
 
 	ybc = yaesu_bincat_new(d, section);
 	if (ybc == NULL) {
@@ -95,6 +97,7 @@ struct rig	*ft736r_init(struct _dictionary_ *d, const char *section)
 	ret->get_ptt = yaesu_bincat_get_ptt;
 	ret->get_squelch = yaesu_bincat_get_squelch;
 	ret->get_smeter = yaesu_bincat_get_smeter;
+	ret->reconfigure = yaesu_bincat_reconfigure;
 	ret->cbdata = ybc;
 	yaesu_bincat_setbits(ybc->set_cmds, Y_BC_CMD_CAT_ON, 
 		Y_BC_CMD_CAT_OFF, Y_BC_CMD_FREQUENCY, Y_BC_CMD_MODE, Y_BC_CMD_TX,
@@ -114,9 +117,9 @@ struct rig	*ft736r_init(struct _dictionary_ *d, const char *section)
 	yaesu_bincat_setbits(ybc->read_cmds, Y_BC_CMD_TEST_SQUELCH,
 		Y_BC_CMD_TEST_S_METER, Y_BC_TERMINATOR);
 
-	ybc->handle=io_start_from_dictionary(d, section, IO_H_SERIAL, yaesu_bincat_read_response, yaesu_bincat_handle_extra, ybc);
+	ybc->handle=io_start_from_dictionary(d, section, IO_H_UNKNOWN, yaesu_bincat_read_response, yaesu_bincat_frame, yaesu_bincat_handle_extra, ybc);
 	if (ybc->handle == NULL) {
-		free(ybc);
+		yaesu_bincat_free(ybc);
 		free(ret);
 		return NULL;
 	}
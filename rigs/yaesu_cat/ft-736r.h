@@ -28,6 +28,7 @@
 
 #include <api.h>
 
+void	ft736r_defaults(struct _dictionary_ *d, const char *section);
 struct rig	*ft736r_init(struct _dictionary_ *d, const char *section);
 
 #endif
@@ -31,6 +31,7 @@
 #include <api.h>
 #include <io.h>
 #include <iniparser.h>
+#include <log.h>
 
 #include "yaesu_bincat.h"
 
@@ -72,7 +73,7 @@ enum ybc_params {
 
 struct ybc_param params[] = {
 	{"FREQUENCY", 8, YBC_PARAM_BIGBCD},
-	{"MODE", 2, YBC_PARAM_BCD},
+	{"MODE", 2, YBC_PARAM_ENUM},		// The narrow modes are 0x82 and 0x88, not BCD
 	{"CTCSS TONE CODE", 2, YBC_PARAM_BCD},
 	{"ID CALLSIGN", 16, YBC_PARAM_ASCII},
 	{"GROUP CODE", 5, YBC_PARAM_BCD},
@@ -124,16 +125,23 @@ struct ybc_command ybc_cmd[] = {
 	{Y_BC_CMD_TEST_S_METER, 0xF7, 0, {0}, 1}
 };
 
+/*
+ * Every response is five bytes
+ */
+size_t yaesu_bincat_frame(void *cbdata, const char *buf, size_t len)
+{
+	return len >= 5 ? 5 : 0;
+}
+
 /*
  * Reads five bytes from the serial port
- * and returns a malloc()ed struct io_response *
+ * and returns a struct io_response * from the handle's pool
  */
 struct io_response *yaesu_bincat_read_response(void *cbdata)
 {
-	size_t	retsize = offsetof(struct io_response, msg)+5;
 	int		rd;
 	struct yaesu_bincat *ybc = (struct yaesu_bincat *)cbdata;
-	struct io_response	*ret = (struct io_response *)malloc(retsize);
+	struct io_response	*ret = io_alloc_response(ybc->handle, 5);
 
 	if (ret == NULL)
 		return NULL;
@@ -150,8 +158,7 @@ struct io_response *yaesu_bincat_read_response(void *cbdata)
 	return ret;
 
 fail:
-	if(ret)
-		free(ret);
+	io_free_response(ybc->handle, ret);
 	return NULL;
 }
 
@@ -200,13 +207,13 @@ static uint64_t round_freq(uint64_t freq)
 	return freq;
 }
 
-struct io_response *yaesu_bincat_command(struct yaesu_bincat *ybc, bool set, enum yaesu_bincat_cmds cmd, ...)
+/*
+ * Fills in the five byte cmdstr from the command's parameters in args.
+ */
+static void yaesu_format(struct ybc_command *cmdinfo, char *cmdstr, va_list args)
 {
-	char				cmdstr[5];
 	unsigned			i;
 	int					j;
-	va_list				args;
-	struct ybc_command	*cmdinfo = yaesu_bindcat_find_command(cmd);
 	int					ival;
 	unsigned			uval;
 	uint64_t			qval;
@@ -216,23 +223,11 @@ struct io_response *yaesu_bincat_command(struct yaesu_bincat *ybc, bool set, enu
 	unsigned			count;
 	enum ybc_params		*par;
 
-	if (cmdinfo == NULL)
-		return NULL;
-	if (set) {
-		if (!yaesu_bincat_cmd_set(ybc, cmd))
-			return NULL;
-	}
-	else {
-		if (!yaesu_bincat_cmd_read(ybc, cmd))
-			return NULL;
-	}
-
-	memset(cmdstr, 0, sizeof(cmdstr));
+	memset(cmdstr, 0, 5);
 	count = cmdinfo->param_count;
 	par = cmdinfo->params;
 
 	cmdstr[4] = cmdinfo->opcode;
-	va_start(args, cmd);
 	for(i=0; i<count; i++) {
 		switch(params[par[i]].type) {
 			case YBC_PARAM_BCD:
@@ -272,30 +267,77 @@ struct io_response *yaesu_bincat_command(struct yaesu_bincat *ybc, bool set, enu
 				break;
 		}
 	}
+}
+
+/*
+ * Sends a read command and returns the response, to release with
+ * io_free_response(), or NULL.
+ */
+struct io_response *yaesu_bincat_command(struct yaesu_bincat *ybc, enum yaesu_bincat_cmds cmd, ...)
+{
+	char				cmdstr[5];
+	va_list				args;
+	struct ybc_command	*cmdinfo = yaesu_bindcat_find_command(cmd);
+	struct io_response	*resp;
+	struct io_waiter	w;
+
+	if (cmdinfo == NULL || !yaesu_bincat_cmd_read(ybc, cmd))
+		return NULL;
+
+	va_start(args, cmd);
+	yaesu_format(cmdinfo, cmdstr, args);
 	va_end(args);
-	if (set) {
-		struct io_response *resp = (struct io_response *)malloc(offsetof(struct io_response, msg));
+	// Answers are five bytes with no header to match on
+	if (io_expect(ybc->handle, &w, NULL, 0, 0, 5) != 0)
+		return NULL;
+	if (io_write(ybc->handle, cmdstr, sizeof(cmdstr), ybc->char_timeout) != 5) {
+		io_cancel(ybc->handle, &w);
+		log_printf(LOG_YAESU, LOG_LEVEL_WARNING, "Unable to send opcode 0x%02x", (unsigned char)cmdstr[4]);
+		return NULL;
+	}
+	resp = io_wait_response(ybc->handle, &w);
+	if (resp == NULL)
+		log_printf(LOG_YAESU, LOG_LEVEL_WARNING, "No response to opcode 0x%02x", (unsigned char)cmdstr[4]);
+	return resp;
+}
 
-		if (resp != NULL)
-			resp->len = io_write(ybc->handle, cmdstr, sizeof(cmdstr), ybc->char_timeout);
-		return resp;
+/*
+ * Sends a set command.  Returns 0 once it's written or -1 if it can't
+ * be.
+ */
+int yaesu_bincat_set(struct yaesu_bincat *ybc, enum yaesu_bincat_cmds cmd, ...)
+{
+	char				cmdstr[5];
+	va_list				args;
+	struct ybc_command	*cmdinfo = yaesu_bindcat_find_command(cmd);
+
+	if (cmdinfo == NULL || !yaesu_bincat_cmd_set(ybc, cmd))
+		return -1;
+
+	va_start(args, cmd);
+	yaesu_format(cmdinfo, cmdstr, args);
+	va_end(args);
+	if (io_write(ybc->handle, cmdstr, sizeof(cmdstr), ybc->char_timeout) != 5) {
+		log_printf(LOG_YAESU, LOG_LEVEL_WARNING, "Unable to send opcode 0x%02x", (unsigned char)cmdstr[4]);
+		return -1;
 	}
-	if (io_write(ybc->handle, cmdstr, sizeof(cmdstr), ybc->char_timeout) != 5)
-		return NULL;
-	return io_get_response(ybc->handle, NULL, 0, 0);
+	return 0;
 }
 
 /*
  * This handles any "extra" responses recieved
  * ie: AQS messages
  * 
- * Any lock may be held, so MUST NOT lock or post semaphores.
+ * Called from the io delivery thread, which also hands responses to
+ * waiters, so MUST NOT send commands or wait for the rig.
  */
 void yaesu_bincat_handle_extra(void *handle, struct io_response *resp)
 {
 	if (resp==NULL)
 		return;
 
+	log_data(LOG_YAESU, LOG_LEVEL_DEBUG, "Unsolicited", resp->msg, resp->len);
+
 	return;
 }
 
@@ -305,25 +347,37 @@ struct yaesu_bincat *yaesu_bincat_new(struct _dictionary_ *d, const char *sectio
 
 	if (ybc == NULL || d == NULL)
 		return NULL;
+	yaesu_bincat_reconfigure(ybc, d, section);
+
+	return ybc;
+}
+
+/*
+ * Reads the timeouts from the config.  Also used to apply a new config
+ * to a running rig without reopening it.
+ */
+int yaesu_bincat_reconfigure(void *cbdata, struct _dictionary_ *d, const char *section)
+{
+	struct yaesu_bincat *ybc = (struct yaesu_bincat *)cbdata;
+
+	if (ybc == NULL || d == NULL)
+		return EINVAL;
 	/*
 	 * Set up some reasonable defaults to be shared among ALL rigs
 	 */
 	ybc->response_timeout = getint(d, section, "response_timeout", 1000);
 	ybc->char_timeout = getint(d, section, "char_timeout", 50);
 	ybc->send_timeout = getint(d, section, "send_timeout", 500);
-
-	return ybc;
+	if (ybc->handle)
+		io_set_timeouts(ybc->handle, ybc->response_timeout, ybc->char_timeout);
+	return 0;
 }
 
 int yaesu_bincat_init(struct yaesu_bincat *ybc)
 {
-	struct io_response		*resp;
-
+	io_set_timeouts(ybc->handle, ybc->response_timeout, ybc->char_timeout);
 	// Enter CAT mode
-	resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_CAT_ON);
-	if (resp)
-		free(resp);
-	else
+	if (yaesu_bincat_set(ybc, Y_BC_CMD_CAT_ON) != 0)
 		return -1;
 	return 0;
 }
@@ -350,27 +404,20 @@ void yaesu_bincat_setbits(char *array, ...)
 int yaesu_bincat_set_frequency(void *cbdata, enum vfos vfo, uint64_t freq)
 {
 	struct yaesu_bincat *ybc = (struct yaesu_bincat *)cbdata;
-	struct io_response	*resp;
 
 	freq = round_freq(freq);
 	if (ybc->duplex_rx || ybc->duplex_tx) {
-		resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_FULL_DUPLEX_OFF);
-		if (resp == NULL)
+		if (yaesu_bincat_set(ybc, Y_BC_CMD_FULL_DUPLEX_OFF) != 0)
 			return ENODEV;
 		ybc->duplex_rx = ybc->duplex_tx = 0;
-		free(resp);
 	}
 	if (ybc->split_offset) {
-		resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_SPLIT_OFF);
-		if (resp == NULL)
+		if (yaesu_bincat_set(ybc, Y_BC_CMD_SPLIT_OFF) != 0)
 			return ENODEV;
-		free(resp);
 	}
 	/* TODO: No VFO control... always set current VFO. */
-	resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_FREQUENCY, freq/10);
-	if (resp == NULL)
+	if (yaesu_bincat_set(ybc, Y_BC_CMD_FREQUENCY, freq/10) != 0)
 		return ENODEV;
-	free(resp);
 	ybc->freq = freq;
 	ybc->split_offset = 0;
 	return 0;
@@ -379,40 +426,27 @@ int yaesu_bincat_set_frequency(void *cbdata, enum vfos vfo, uint64_t freq)
 int yaesu_bincat_set_split_frequency(void *cbdata, uint64_t freq_rx, uint64_t freq_tx)
 {
 	struct yaesu_bincat	*ybc = (struct yaesu_bincat *)cbdata;
-	struct io_response	*resp;
 
 	freq_rx = round_freq(freq_rx);
 	freq_tx = round_freq(freq_tx);
 	if (ybc->duplex_rx || ybc->duplex_tx) {
-		resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_FULL_DUPLEX_OFF);
-		if (resp == NULL)
+		if (yaesu_bincat_set(ybc, Y_BC_CMD_FULL_DUPLEX_OFF) != 0)
 			return ENODEV;
 		ybc->duplex_rx = ybc->duplex_tx = 0;
-		free(resp);
 	}
-	resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_FREQUENCY, freq_rx/10);
-	if (resp == NULL)
+	if (yaesu_bincat_set(ybc, Y_BC_CMD_FREQUENCY, freq_rx/10) != 0)
 		return ENODEV;
-	free(resp);
 	if (freq_tx < freq_rx) {
-		resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_SPLIT_OFFSET, (freq_rx - freq_tx)/10);
-		if (resp == NULL)
+		if (yaesu_bincat_set(ybc, Y_BC_CMD_SPLIT_OFFSET, (freq_rx - freq_tx)/10) != 0)
 			return ENODEV;
-		free(resp);
-		resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_SPLIT_MINUS);
-		if (resp == NULL)
+		if (yaesu_bincat_set(ybc, Y_BC_CMD_SPLIT_MINUS) != 0)
 			return ENODEV;
-		free(resp);
 	}
 	else {
-		resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_SPLIT_OFFSET, (freq_tx - freq_rx)/10);
-		if (resp == NULL)
+		if (yaesu_bincat_set(ybc, Y_BC_CMD_SPLIT_OFFSET, (freq_tx - freq_rx)/10) != 0)
 			return ENODEV;
-		free(resp);
-		resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_SPLIT_PLUS);
-		if (resp == NULL)
+		if (yaesu_bincat_set(ybc, Y_BC_CMD_SPLIT_PLUS) != 0)
 			return ENODEV;
-		free(resp);
 	}
 	ybc->freq = freq_rx;
 	ybc->split_offset = freq_rx - freq_tx;
@@ -462,7 +496,6 @@ static enum rig_modes yaesu_bincat_mode_get_rig_mode(enum ybc_mode mode)
 int yaesu_bincat_set_duplex(void *cbdata, uint64_t freq_rx, enum rig_modes mode_rx, uint64_t freq_tx, enum rig_modes mode_tx)
 {
 	struct yaesu_bincat	*ybc = (struct yaesu_bincat *)cbdata;
-	struct io_response	*resp;
 	enum ybc_mode		tx_mode = get_yaesu_bincat_mode(mode_tx);
 	enum ybc_mode		rx_mode = get_yaesu_bincat_mode(mode_rx);
 
@@ -470,31 +503,19 @@ int yaesu_bincat_set_duplex(void *cbdata, uint64_t freq_rx, enum rig_modes mode_
 	freq_tx = round_freq(freq_tx);
 
 	if (ybc->split_offset) {
-		resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_SPLIT_OFF);
-		if (resp == NULL)
+		if (yaesu_bincat_set(ybc, Y_BC_CMD_SPLIT_OFF) != 0)
 			return ENODEV;
-		free(resp);
 	}
-	resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_FULL_DUPLEX_RX_MODE, rx_mode);
-	if (resp == NULL)
+	if (yaesu_bincat_set(ybc, Y_BC_CMD_FULL_DUPLEX_RX_MODE, rx_mode) != 0)
 		return ENODEV;
-	free(resp);
-	resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_FULL_DUPLEX_TX_MODE, tx_mode);
-	if (resp == NULL)
+	if (yaesu_bincat_set(ybc, Y_BC_CMD_FULL_DUPLEX_TX_MODE, tx_mode) != 0)
 		return ENODEV;
-	free(resp);
-	resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_FULL_DUPLEX_RX_FREQ, freq_rx);
-	if (resp == NULL)
+	if (yaesu_bincat_set(ybc, Y_BC_CMD_FULL_DUPLEX_RX_FREQ, freq_rx/10) != 0)
 		return ENODEV;
-	free(resp);
-	resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_FULL_DUPLEX_TX_FREQ, freq_tx);
-	if (resp == NULL)
+	if (yaesu_bincat_set(ybc, Y_BC_CMD_FULL_DUPLEX_TX_FREQ, freq_tx/10) != 0)
 		return ENODEV;
-	free(resp);
-	resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_FULL_DUPLEX_ON);
-	if (resp == NULL)
+	if (yaesu_bincat_set(ybc, Y_BC_CMD_FULL_DUPLEX_ON) != 0)
 		return ENODEV;
-	free(resp);
 	ybc->freq = freq_rx;
 	ybc->split_offset = 0;
 	ybc->duplex_tx = freq_tx;
@@ -507,7 +528,6 @@ int yaesu_bincat_set_duplex(void *cbdata, uint64_t freq_rx, enum rig_modes mode_
 int yaesu_bincat_set_mode(void *cbdata, enum rig_modes mode)
 {
 	struct yaesu_bincat	*ybc = (struct yaesu_bincat *)cbdata;
-	struct io_response	*resp;
 	enum ybc_mode		ymode;
 
 	switch(mode) {
@@ -532,10 +552,8 @@ int yaesu_bincat_set_mode(void *cbdata, enum rig_modes mode)
 		default:
 			return ENOTSUP;
 	}
-	resp = yaesu_bincat_command(ybc, true, Y_BC_CMD_MODE, ymode);
-	if (resp==NULL)
+	if (yaesu_bincat_set(ybc, Y_BC_CMD_MODE, ymode) != 0)
 		return ENODEV;
-	free(resp);
 	ybc->mode = ymode;
 	return 0;
 }
@@ -543,17 +561,14 @@ int yaesu_bincat_set_mode(void *cbdata, enum rig_modes mode)
 int yaesu_bincat_set_ptt(void *cbdata, bool tx)
 {
 	struct yaesu_bincat		*ybc = (struct yaesu_bincat *)cbdata;
-	struct io_response		*resp;
 	enum yaesu_bincat_cmds	cmd;
 
 	if (tx)
 		cmd = Y_BC_CMD_TX;
 	else
 		cmd = Y_BC_CMD_RX;
-	resp = yaesu_bincat_command(ybc, true, cmd);
-	if (resp==NULL)
+	if (yaesu_bincat_set(ybc, cmd) != 0)
 		return ENODEV;
-	free(resp);
 	ybc->ptt = tx;
 	return 0;
 }
@@ -627,14 +642,14 @@ int yaesu_bincat_get_squelch(void *cbdata)
 	struct io_response	*resp;
 	struct yaesu_bincat *ybc = (struct yaesu_bincat *)cbdata;
 
-	resp = yaesu_bincat_command(ybc, false, Y_BC_CMD_TEST_SQUELCH);
+	resp = yaesu_bincat_command(ybc, Y_BC_CMD_TEST_SQUELCH);
 	if (resp == NULL)
 		return -1;
 	if (resp->msg[1] & 0x80) {
-		free(resp);
+		io_free_response(ybc->handle, resp);
 		return 1;
 	}
-	free(resp);
+	io_free_response(ybc->handle, resp);
 	return 0;
 }
 
@@ -646,11 +661,11 @@ int yaesu_bincat_get_smeter(void *cbdata)
 
 	if (ybc->ptt)
 		return 0;
-	resp = yaesu_bincat_command(ybc, false, Y_BC_CMD_TEST_S_METER);
+	resp = yaesu_bincat_command(ybc, Y_BC_CMD_TEST_S_METER);
 	if (resp == NULL)
 		return -1;
 	ret = ((unsigned char)resp->msg[1])-0x20;
-	free(resp);
+	io_free_response(ybc->handle, resp);
 	if (ret < 0)
 		ret = 0;
 	return ret;
@@ -89,11 +89,14 @@ struct yaesu_bincat {
 
 int yaesu_bincat_init(struct yaesu_bincat *ybc);
 struct io_response *yaesu_bincat_read_response(void *cbdata);
+size_t yaesu_bincat_frame(void *cbdata, const char *buf, size_t len);
 void yaesu_bincat_handle_extra(void *handle, struct io_response *resp);
 void yaesu_bincat_setbits(char *array, ...);
-struct io_response *yaesu_bincat_command(struct yaesu_bincat *ybc, bool set, enum yaesu_bincat_cmds cmd, ...);
+struct io_response *yaesu_bincat_command(struct yaesu_bincat *ybc, enum yaesu_bincat_cmds cmd, ...);
+int yaesu_bincat_set(struct yaesu_bincat *ybc, enum yaesu_bincat_cmds cmd, ...);
 void yaesu_bincat_free(struct yaesu_bincat *ybc);
 struct yaesu_bincat *yaesu_bincat_new(struct _dictionary_ *d, const char *section);
+int yaesu_bincat_reconfigure(void *cbdata, struct _dictionary_ *d, const char *section);
 
 int yaesu_bincat_set_frequency(void *cbdata, enum vfos vfo, uint64_t freq);
 int yaesu_bincat_set_split_frequency(void *cbdata, uint64_t freq_rx, uint64_t freq_tx);
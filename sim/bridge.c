@@ -0,0 +1,440 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A stand-in for ser2net, so tcp rig ports can be tried without one.
+ * Listens on a TCP port and passes bytes between one client at a time
+ * and a serial device, usually the link made by one of the rig
+ * simulators.
+ *
+ * With -r the client is spoken to as an RFC 2217 telnet server.  Line
+ * settings it sends are applied to the device and confirmed, and with
+ * -v they're logged to stderr.
+ *
+ * Usage: or-sim-bridge [-r] [-v] [-p port] device
+ *
+ * e.g. or-sim-kenwood -l /tmp/ts940 and or-sim-bridge -r /tmp/ts940
+ * then "type = tcp", "host = localhost", "port = 7000" and
+ * "rfc2217 = 1" in the rig's section.
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define TELNET_SE			240
+#define TELNET_SB			250
+#define TELNET_WILL			251
+#define TELNET_WONT			252
+#define TELNET_DO			253
+#define TELNET_DONT			254
+#define TELNET_IAC			255
+#define TELOPT_BINARY		0
+#define TELOPT_SGA			3
+#define TELOPT_COM_PORT		44
+
+#define CPO_SET_BAUDRATE	1
+#define CPO_SET_DATASIZE	2
+#define CPO_SET_PARITY		3
+#define CPO_SET_STOPSIZE	4
+#define CPO_SET_CONTROL		5
+#define CPO_SERVER_OFFSET	100
+
+enum telnet_state {
+	TS_DATA,
+	TS_IAC,
+	TS_OPTION,
+	TS_SB,
+	TS_SB_IAC
+};
+
+static volatile sig_atomic_t	done;
+static bool						verbose;
+static bool						rfc2217;
+static int						dev = -1;
+static int						client = -1;
+static enum telnet_state		state;
+static unsigned char			verb;
+static unsigned char			sb[16];
+static size_t					sb_len;
+
+static void on_signal(int sig)
+{
+	done = 1;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char	*pos = buf;
+	ssize_t		ret;
+
+	while (len) {
+		ret = write(fd, pos, len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static speed_t baud_macro(uint32_t baud)
+{
+	switch (baud) {
+		case 300: return B300;
+		case 600: return B600;
+		case 1200: return B1200;
+		case 2400: return B2400;
+		case 4800: return B4800;
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+#ifdef B57600
+		case 57600: return B57600;
+#endif
+#ifdef B115200
+		case 115200: return B115200;
+#endif
+	}
+	return B0;
+}
+
+/*
+ * Applies one COM-PORT-OPTION setting to the device and confirms it.
+ * A value of zero asks for the current setting, which is answered with
+ * zero too since nothing here tracks it.
+ */
+static void com_port(unsigned char cmd, const unsigned char *val, size_t len)
+{
+	struct termios	t;
+	unsigned char	reply[16];
+	size_t			rlen = 0;
+	size_t			i;
+	uint32_t		value = 0;
+
+	for (i = 0; i < len; i++)
+		value = (value << 8) | val[i];
+	if (tcgetattr(dev, &t) == 0 && value) {
+		switch (cmd) {
+			case CPO_SET_BAUDRATE:
+				if (baud_macro(value) != B0)
+					cfsetspeed(&t, baud_macro(value));
+				if (verbose)
+					fprintf(stderr, "-- baud rate %u\n", (unsigned)value);
+				break;
+			case CPO_SET_DATASIZE:
+				t.c_cflag &= ~CSIZE;
+				t.c_cflag |= value == 5 ? CS5 : value == 6 ? CS6 : value == 7 ? CS7 : CS8;
+				if (verbose)
+					fprintf(stderr, "-- data bits %u\n", (unsigned)value);
+				break;
+			case CPO_SET_PARITY:
+				t.c_cflag &= ~(PARENB | PARODD);
+				if (value == 2)
+					t.c_cflag |= PARENB | PARODD;
+				else if (value == 3)
+					t.c_cflag |= PARENB;
+				if (verbose)
+					fprintf(stderr, "-- parity %c\n", "?NOEMS"[value < 6 ? value : 0]);
+				break;
+			case CPO_SET_STOPSIZE:
+				if (value == 2)
+					t.c_cflag |= CSTOPB;
+				else
+					t.c_cflag &= ~CSTOPB;
+				if (verbose)
+					fprintf(stderr, "-- stop bits %s\n", value == 1 ? "1" : value == 2 ? "2" : "1.5");
+				break;
+			case CPO_SET_CONTROL:
+				if (verbose)
+					fprintf(stderr, "-- control %u\n", (unsigned)value);
+				break;
+		}
+		tcsetattr(dev, TCSANOW, &t);
+	}
+	reply[rlen++] = TELNET_IAC;
+	reply[rlen++] = TELNET_SB;
+	reply[rlen++] = TELOPT_COM_PORT;
+	reply[rlen++] = cmd + CPO_SERVER_OFFSET;
+	for (i = 0; i < len && rlen < sizeof(reply) - 3; i++) {
+		reply[rlen++] = val[i];
+		if (val[i] == TELNET_IAC)
+			reply[rlen++] = TELNET_IAC;
+	}
+	reply[rlen++] = TELNET_IAC;
+	reply[rlen++] = TELNET_SE;
+	write_all(client, reply, rlen);
+}
+
+static void negotiate(unsigned char opt)
+{
+	unsigned char	reply[3] = {TELNET_IAC, 0, opt};
+
+	if (verbose)
+		fprintf(stderr, "-- %s %u\n", verb == TELNET_WILL ? "WILL" : verb == TELNET_WONT ? "WONT" : verb == TELNET_DO ? "DO" : "DONT", opt);
+	switch (verb) {
+		case TELNET_WILL:
+			if (opt == TELOPT_BINARY || opt == TELOPT_SGA)
+				return;
+			reply[1] = opt == TELOPT_COM_PORT ? TELNET_DO : TELNET_DONT;
+			break;
+		case TELNET_DO:
+			if (opt == TELOPT_BINARY || opt == TELOPT_SGA)
+				return;
+			reply[1] = TELNET_WONT;
+			break;
+		default:
+			return;
+	}
+	write_all(client, reply, sizeof(reply));
+}
+
+/*
+ * Strips telnet commands from what the client sent, leaving the bytes
+ * for the device in buf.
+ */
+static size_t from_client(unsigned char *buf, size_t len)
+{
+	size_t	out = 0;
+	size_t	i;
+
+	if (!rfc2217)
+		return len;
+	for (i = 0; i < len; i++) {
+		switch (state) {
+			case TS_DATA:
+				if (buf[i] == TELNET_IAC)
+					state = TS_IAC;
+				else
+					buf[out++] = buf[i];
+				break;
+			case TS_IAC:
+				switch (buf[i]) {
+					case TELNET_IAC:
+						buf[out++] = buf[i];
+						state = TS_DATA;
+						break;
+					case TELNET_WILL:
+					case TELNET_WONT:
+					case TELNET_DO:
+					case TELNET_DONT:
+						verb = buf[i];
+						state = TS_OPTION;
+						break;
+					case TELNET_SB:
+						sb_len = 0;
+						state = TS_SB;
+						break;
+					default:
+						state = TS_DATA;
+						break;
+				}
+				break;
+			case TS_OPTION:
+				negotiate(buf[i]);
+				state = TS_DATA;
+				break;
+			case TS_SB:
+				if (buf[i] == TELNET_IAC)
+					state = TS_SB_IAC;
+				else if (sb_len < sizeof(sb))
+					sb[sb_len++] = buf[i];
+				break;
+			case TS_SB_IAC:
+				if (buf[i] == TELNET_SE) {
+					if (sb_len >= 2 && sb[0] == TELOPT_COM_PORT)
+						com_port(sb[1], sb + 2, sb_len - 2);
+					state = TS_DATA;
+				}
+				else {
+					if (sb_len < sizeof(sb))
+						sb[sb_len++] = buf[i];
+					state = TS_SB;
+				}
+				break;
+		}
+	}
+	return out;
+}
+
+static int to_client(const unsigned char *buf, size_t len)
+{
+	unsigned char	out[512];
+	size_t			olen = 0;
+	size_t			i;
+
+	if (!rfc2217)
+		return write_all(client, buf, len);
+	for (i = 0; i < len; i++) {
+		out[olen++] = buf[i];
+		if (buf[i] == TELNET_IAC)
+			out[olen++] = TELNET_IAC;
+		if (olen >= sizeof(out) - 1) {
+			if (write_all(client, out, olen) == -1)
+				return -1;
+			olen = 0;
+		}
+	}
+	return olen ? write_all(client, out, olen) : 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in	sin = {};
+	struct pollfd		pfd[2];
+	struct termios		t;
+	unsigned char		buf[256];
+	unsigned			port = 7000;
+	ssize_t				got;
+	size_t				len;
+	int					listener;
+	int					opt;
+	int					one = 1;
+	static const unsigned char	hello[] = {
+		TELNET_IAC, TELNET_WILL, TELOPT_BINARY,
+		TELNET_IAC, TELNET_DO, TELOPT_BINARY,
+		TELNET_IAC, TELNET_WILL, TELOPT_SGA,
+		TELNET_IAC, TELNET_DO, TELOPT_SGA,
+	};
+
+	while ((opt = getopt(argc, argv, "p:rv")) != -1) {
+		switch (opt) {
+			case 'p':
+				port = strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				rfc2217 = true;
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				goto usage;
+		}
+	}
+	if (optind != argc - 1 || port == 0 || port > 65535)
+		goto usage;
+
+	dev = open(argv[optind], O_RDWR | O_NOCTTY);
+	if (dev == -1) {
+		fprintf(stderr, "Unable to open %s: %s\n", argv[optind], strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (tcgetattr(dev, &t) == 0) {
+		cfmakeraw(&t);
+		tcsetattr(dev, TCSANOW, &t);
+	}
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener == -1) {
+		fprintf(stderr, "Unable to create a socket: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+	if (bind(listener, (struct sockaddr *)&sin, sizeof(sin)) == -1 || listen(listener, 1) == -1) {
+		fprintf(stderr, "Unable to listen on port %u: %s\n", port, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (!done) {
+		if (client == -1) {
+			pfd[0].fd = listener;
+			pfd[0].events = POLLIN;
+			if (poll(pfd, 1, -1) < 1)
+				continue;
+			client = accept(listener, NULL, NULL);
+			if (client == -1)
+				continue;
+			setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			state = TS_DATA;
+			if (verbose)
+				fprintf(stderr, "-- connected\n");
+			if (rfc2217)
+				write_all(client, hello, sizeof(hello));
+			// Nothing the device said before the client arrived is for it
+			tcflush(dev, TCIFLUSH);
+		}
+		pfd[0].fd = client;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = dev;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, 2, -1) < 1)
+			continue;
+		if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			got = read(client, buf, sizeof(buf));
+			if (got <= 0) {
+				if (got == -1 && errno == EINTR)
+					continue;
+				if (verbose)
+					fprintf(stderr, "-- disconnected\n");
+				close(client);
+				client = -1;
+				continue;
+			}
+			len = from_client(buf, got);
+			if (len && write_all(dev, buf, len) == -1)
+				break;
+		}
+		if (pfd[1].revents & POLLIN) {
+			got = read(dev, buf, sizeof(buf));
+			if (got > 0 && to_client(buf, got) == -1) {
+				close(client);
+				client = -1;
+			}
+		}
+		else if (pfd[1].revents & (POLLHUP | POLLERR)) {
+			fprintf(stderr, "%s has gone away\n", argv[optind]);
+			break;
+		}
+	}
+	if (client != -1)
+		close(client);
+	close(listener);
+	close(dev);
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "Usage: %s [-r] [-v] [-p port] device\n", argv[0]);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,431 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Simulates an older Kenwood HF rig (TS-940S and friends) on a pty so
+ * the daemon, io layer and kenwood_hf backend can be run without a rig.
+ * Supports FA, FB, IF, MD, FN, SP, TX, RX, AI, LK and ID, anything else
+ * is answered with "?;".
+ *
+ * Replies are paced by the serial speed (8N2, so 11 bits a character),
+ * and after setting FA, FB or SP the rig is busy for a while and ignores
+ * whatever it's sent, which is what the backends' set_cmd_delays avoid.
+ * With -a reads are still answered while busy, for testing settle_reads.
+ * With -r, reads are answered that long after they arrive, as a rig's
+ * CPU would.
+ *
+ * Front panel changes can be made by writing commands to stdin (eg:
+ * "FA00007050000;"), or with -t the VFO is tuned up 10Hz every
+ * interval.  Either sends an IF if AI is on.  SIGUSR1 prints counters.
+ *
+ * Usage: or-sim-kenwood [-a] [-l link] [-m model] [-s speed] [-b busy_ms]
+ *            [-r reply_ms] [-t tune_ms] [-v]
+ *
+ * e.g. or-sim-kenwood -l /tmp/ts940 then "port = /tmp/ts940" in the
+ * rig's section.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+#define LINE_BITS	11	// 8N2 plus the start bit
+
+struct model {
+	const char	*name;
+	unsigned	id;
+};
+
+/* The IDs kenwood_hf knows about */
+static const struct model models[] = {
+	{"TS-140S", 6},
+	{"TS-680S", 6},
+	{"TS-711", 1},
+	{"TS-811", 2},
+	{"TS-940S", 3},
+	{NULL, 0}
+};
+
+struct rig {
+	uint64_t	fa;
+	uint64_t	fb;
+	uint64_t	fm;			// Memory channel frequency
+	unsigned	mode;
+	unsigned	function;	// 0 = VFO A, 1 = VFO B, 2 = memory
+	unsigned	split;
+	unsigned	tx;
+	unsigned	ai;
+	unsigned	lk;
+	unsigned	id;
+	uint64_t	busy_until;
+};
+
+struct counters {
+	uint64_t	commands;
+	uint64_t	errors;		// Answered with ?;
+	uint64_t	ignored;	// Sent while busy
+	uint64_t	pushes;		// IFs sent for AI
+};
+
+static struct sim_port			port;
+static struct rig				rig = {14074000, 14076000, 14000000, 2, 0, 0, 0, 0, 0, 3, 0};
+static struct counters			counters;
+static volatile sig_atomic_t	done;
+static volatile sig_atomic_t	show_counters;
+static bool						busy_reads;		// Answer reads while busy
+
+static void on_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		show_counters = 1;
+	else
+		done = 1;
+}
+
+static uint64_t *current_freq(void)
+{
+	switch (rig.function) {
+		case 1:
+			return &rig.fb;
+		case 2:
+			return &rig.fm;
+		default:
+			return &rig.fa;
+	}
+}
+
+static int send_reply(const char *fmt, ...)
+{
+	char	buf[64];
+	va_list	ap;
+	int		len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len < 0 || len >= sizeof(buf))
+		return -1;
+	return sim_send(&port, buf, len);
+}
+
+static int send_if(void)
+{
+	return send_reply("IF%011" PRIu64 "%05d%+05d%d%d%d%02d%d%d%d%d%d%d%02d%d;",
+	    *current_freq(), 0, 0, 0, 0, 0, 0, rig.tx, rig.mode, rig.function,
+	    0, rig.split, 0, 0, 0);
+}
+
+static int parse_uint(const char *str, size_t len, uint64_t max, uint64_t *val)
+{
+	size_t	i;
+
+	if (len == 0)
+		return -1;
+	*val = 0;
+	for (i = 0; i < len; i++) {
+		if (str[i] < '0' || str[i] > '9')
+			return -1;
+		*val = *val * 10 + str[i] - '0';
+	}
+	return *val > max ? -1 : 0;
+}
+
+/*
+ * Runs one command (without the ;).  If panel is set, it came from the
+ * front panel rather than the serial port so nothing is answered.
+ * Returns 1 if the rig state changed, 0 if not, -1 for a bad command.
+ */
+static int run_command(const char *cmd, size_t len, bool panel)
+{
+	const char	*arg = cmd + 2;
+	size_t		arg_len = len - 2;
+	uint64_t	val;
+	bool		read = arg_len == 0;
+
+	if (len < 2)
+		return -1;
+	if (strncmp(cmd, "FA", 2) == 0 || strncmp(cmd, "FB", 2) == 0) {
+		uint64_t	*freq = cmd[1] == 'A' ? &rig.fa : &rig.fb;
+
+		if (read)
+			return panel ? -1 : send_reply("%.2s%011" PRIu64 ";", cmd, *freq);
+		if (parse_uint(arg, arg_len, 99999999999ULL, &val) == -1)
+			return -1;
+		*freq = val;
+		return 1;
+	}
+	if (strncmp(cmd, "IF", 2) == 0 && read)
+		return panel ? -1 : send_if();
+	if (strncmp(cmd, "MD", 2) == 0 && !read) {
+		if (parse_uint(arg, arg_len, 7, &val) == -1 || val == 0)
+			return -1;
+		rig.mode = val;
+		return 1;
+	}
+	if (strncmp(cmd, "FN", 2) == 0 && !read) {
+		if (parse_uint(arg, arg_len, 2, &val) == -1)
+			return -1;
+		rig.function = val;
+		return 1;
+	}
+	if (strncmp(cmd, "SP", 2) == 0 && !read) {
+		if (parse_uint(arg, arg_len, 1, &val) == -1)
+			return -1;
+		rig.split = val;
+		return 1;
+	}
+	if ((strncmp(cmd, "TX", 2) == 0 || strncmp(cmd, "RX", 2) == 0) && read) {
+		rig.tx = cmd[0] == 'T';
+		return 1;
+	}
+	if (strncmp(cmd, "AI", 2) == 0 || strncmp(cmd, "LK", 2) == 0) {
+		unsigned	*sw = cmd[0] == 'A' ? &rig.ai : &rig.lk;
+
+		if (read)
+			return panel ? -1 : send_reply("%.2s%u;", cmd, *sw);
+		if (parse_uint(arg, arg_len, 1, &val) == -1)
+			return -1;
+		*sw = val;
+		return 0;
+	}
+	if (strncmp(cmd, "ID", 2) == 0 && read)
+		return panel ? -1 : send_reply("ID%03u;", rig.id);
+	return -1;
+}
+
+/*
+ * A command from the serial port, complete at the time given.
+ */
+static int handle_command(const char *cmd, size_t len, uint64_t complete, uint64_t busy_ns, uint64_t reply_ns)
+{
+	int		ret;
+
+	sim_sleep_until(len == 2 ? complete + reply_ns : complete);
+	sim_log(&port, "<<", cmd, len + 1);
+	counters.commands++;
+	if (complete < rig.busy_until && !(busy_reads && len == 2)) {
+		counters.ignored++;
+		return 0;
+	}
+	ret = run_command(cmd, len, false);
+	if (ret == -1) {
+		counters.errors++;
+		return sim_send(&port, "?;", 2);
+	}
+	if (len > 2 && (strncmp(cmd, "FA", 2) == 0 || strncmp(cmd, "FB", 2) == 0 || strncmp(cmd, "SP", 2) == 0))
+		rig.busy_until = sim_ns() + busy_ns;
+	return 0;
+}
+
+/*
+ * A front panel change, sent as an IF if AI is on.
+ */
+static int panel_change(const char *cmd, size_t len)
+{
+	int		ret;
+
+	ret = run_command(cmd, len, true);
+	if (ret == -1) {
+		fprintf(stderr, "Bad front panel command %.*s\n", (int)len, cmd);
+		return 0;
+	}
+	if (ret == 0 || !rig.ai)
+		return 0;
+	counters.pushes++;
+	return send_if();
+}
+
+static void print_counters(void)
+{
+	fprintf(stderr, "commands %" PRIu64 " errors %" PRIu64 " ignored %" PRIu64 " pushes %" PRIu64 "\n",
+	    counters.commands, counters.errors, counters.ignored, counters.pushes);
+}
+
+int main(int argc, char **argv)
+{
+	const char		*link = NULL;
+	const char		*model = "TS-940S";
+	unsigned		speed = 4800;
+	uint64_t		busy_ns = 200000000;
+	uint64_t		reply_ns = 0;
+	uint64_t		tune_ns = 0;
+	uint64_t		next_tune = 0;
+	uint64_t		now;
+	struct pollfd	pfds[2];
+	char			buf[256];
+	char			cmd[64];
+	size_t			cmd_len = 0;
+	char			panel[64];
+	size_t			panel_len = 0;
+	ssize_t			got;
+	ssize_t			i;
+	int				timeout;
+	int				opt;
+	bool			verbose = false;
+	char			tune[32];
+
+	while ((opt = getopt(argc, argv, "al:m:s:b:r:t:v")) != -1) {
+		switch (opt) {
+			case 'a':
+				busy_reads = true;
+				break;
+			case 'l':
+				link = optarg;
+				break;
+			case 'm':
+				model = optarg;
+				break;
+			case 's':
+				speed = strtoul(optarg, NULL, 10);
+				break;
+			case 'b':
+				busy_ns = strtoull(optarg, NULL, 10) * 1000000;
+				break;
+			case 'r':
+				reply_ns = strtoull(optarg, NULL, 10) * 1000000;
+				break;
+			case 't':
+				tune_ns = strtoull(optarg, NULL, 10) * 1000000;
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				goto usage;
+		}
+	}
+	if (optind != argc || speed == 0)
+		goto usage;
+	for (i = 0; models[i].name; i++) {
+		if (strcmp(models[i].name, model) == 0)
+			break;
+	}
+	if (models[i].name == NULL) {
+		fprintf(stderr, "Unknown model %s\n", model);
+		goto usage;
+	}
+	rig.id = models[i].id;
+
+	if (sim_open(&port, link, speed, LINE_BITS) == -1) {
+		fprintf(stderr, "Unable to open a pty: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	port.verbose = verbose;
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGHUP, on_signal);
+	signal(SIGUSR1, on_signal);
+	printf("%s\n", port.name);
+	fflush(stdout);
+
+	pfds[0].fd = port.fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = STDIN_FILENO;
+	pfds[1].events = POLLIN;
+	if (tune_ns)
+		next_tune = sim_ns() + tune_ns;
+	while (!done) {
+		if (show_counters) {
+			show_counters = 0;
+			print_counters();
+		}
+		timeout = -1;
+		if (tune_ns) {
+			now = sim_ns();
+			if (now >= next_tune) {
+				snprintf(tune, sizeof(tune), "F%c%011" PRIu64, rig.function == 1 ? 'B' : 'A',
+				    (rig.function == 1 ? rig.fb : rig.fa) + 10);
+				if (panel_change(tune, strlen(tune)) == -1)
+					break;
+				next_tune += tune_ns;
+				continue;
+			}
+			timeout = (next_tune - now) / 1000000 + 1;
+		}
+		if (poll(pfds, pfds[1].fd == -1 ? 1 : 2, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfds[0].revents & POLLIN) {
+			got = read(port.fd, buf, sizeof(buf));
+			if (got == -1 && errno != EINTR && errno != EAGAIN)
+				break;
+			now = sim_ns();
+			for (i = 0; i < got; i++) {
+				uint64_t	complete = sim_received(&port, now);
+
+				if (buf[i] != ';') {
+					if (cmd_len < sizeof(cmd) - 1)
+						cmd[cmd_len++] = buf[i];
+					continue;
+				}
+				cmd[cmd_len] = ';';
+				if (handle_command(cmd, cmd_len, complete, busy_ns, reply_ns) == -1) {
+					done = 1;
+					break;
+				}
+				cmd_len = 0;
+			}
+		}
+		if (pfds[1].fd != -1 && (pfds[1].revents & (POLLIN | POLLHUP))) {
+			got = read(STDIN_FILENO, buf, sizeof(buf));
+			if (got <= 0) {
+				pfds[1].fd = -1;
+				continue;
+			}
+			for (i = 0; i < got; i++) {
+				if (buf[i] == '\n' || buf[i] == '\r' || buf[i] == ' ')
+					continue;
+				if (buf[i] != ';') {
+					if (panel_len < sizeof(panel) - 1)
+						panel[panel_len++] = buf[i];
+					continue;
+				}
+				if (panel_change(panel, panel_len) == -1) {
+					done = 1;
+					break;
+				}
+				panel_len = 0;
+			}
+		}
+	}
+	print_counters();
+	sim_close(&port);
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "Usage: %s [-a] [-l link] [-m model] [-s speed] [-b busy_ms] [-r reply_ms] [-t tune_ms] [-v]\n\n"
+	    "model is one of TS-140S, TS-680S, TS-711, TS-811 or TS-940S\n", argv[0]);
+	return EXIT_FAILURE;
+}
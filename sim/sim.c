@@ -0,0 +1,149 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef WITH_PTY_H
+#include <pty.h>
+#endif
+#ifdef WITH_LIBUTIL_H
+#include <libutil.h>
+#endif
+
+#include "sim.h"
+
+uint64_t sim_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void sim_sleep_until(uint64_t ns)
+{
+	struct timespec	ts;
+
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+int sim_open(struct sim_port *p, const char *link, unsigned speed, unsigned bits)
+{
+	struct termios	t;
+
+	memset(p, 0, sizeof(*p));
+	p->fd = -1;
+	p->slave = -1;
+	if (speed == 0 || bits == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	p->char_ns = 1000000000ULL * bits / speed;
+	if (openpty(&p->fd, &p->slave, p->name, NULL, NULL) == -1)
+		return -1;
+	// Nothing may be echoed or translated before the daemon sets the port up
+	if (tcgetattr(p->slave, &t) == 0) {
+		cfmakeraw(&t);
+		tcsetattr(p->slave, TCSANOW, &t);
+	}
+	if (link) {
+		unlink(link);
+		if (symlink(p->name, link) == -1) {
+			sim_close(p);
+			return -1;
+		}
+		p->link = link;
+	}
+	return 0;
+}
+
+void sim_close(struct sim_port *p)
+{
+	if (p->link)
+		unlink(p->link);
+	if (p->slave != -1)
+		close(p->slave);
+	if (p->fd != -1)
+		close(p->fd);
+	p->fd = p->slave = -1;
+	p->link = NULL;
+}
+
+uint64_t sim_received(struct sim_port *p, uint64_t now)
+{
+	if (p->rx_end < now)
+		p->rx_end = now;
+	p->rx_end += p->char_ns;
+	return p->rx_end;
+}
+
+int sim_send(struct sim_port *p, const void *buf, size_t len)
+{
+	const char	*pos = buf;
+	uint64_t	now = sim_ns();
+	ssize_t		ret;
+
+	if (p->tx_end < now)
+		p->tx_end = now;
+	p->tx_end += p->char_ns * len;
+	sim_sleep_until(p->tx_end);
+	sim_log(p, ">>", buf, len);
+	while (len) {
+		ret = write(p->fd, pos, len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+void sim_log(struct sim_port *p, const char *dir, const void *buf, size_t len)
+{
+	const unsigned char	*c = buf;
+	size_t				i;
+
+	if (!p->verbose)
+		return;
+	fprintf(stderr, "%s ", dir);
+	for (i = 0; i < len; i++) {
+		if (p->binary)
+			fprintf(stderr, "%02x%s", c[i], i + 1 < len ? " " : "");
+		else
+			fputc(c[i], stderr);
+	}
+	fputc('\n', stderr);
+}
@@ -0,0 +1,78 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+/*
+ * Shared by the rig simulators.  A simulated rig sits on the master
+ * side of a pty, the daemon opens the slave as if it were the rig's
+ * serial port.  Characters are paced as if they crossed a real serial
+ * line at the configured speed.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct sim_port {
+	int				fd;			// pty master
+	int				slave;		// Kept open so the master never sees a hangup
+	char			name[64];	// Slave device
+	const char		*link;		// Symlink to the slave, removed by sim_close()
+	uint64_t		char_ns;	// Time one character takes on the line
+	uint64_t		rx_end;		// When the last received character was complete
+	uint64_t		tx_end;		// When the last sent character will be complete
+	bool			verbose;	// Log traffic to stderr
+	bool			binary;		// Log traffic as hex
+};
+
+/*
+ * Opens a pty for a line at speed baud with bits per character
+ * (including start and stop bits).  If link isn't NULL, it is made a
+ * symlink to the slave so the config can name a fixed path.
+ * Returns 0 on success or -1 with errno set.
+ */
+int sim_open(struct sim_port *p, const char *link, unsigned speed, unsigned bits);
+void sim_close(struct sim_port *p);
+
+uint64_t sim_ns(void);
+void sim_sleep_until(uint64_t ns);
+
+/*
+ * Accounts for one character that was read at now, returns when it
+ * would have finished arriving over the serial line.
+ */
+uint64_t sim_received(struct sim_port *p, uint64_t now);
+
+/*
+ * Sends buf once it would have finished crossing the line.  Returns 0
+ * on success or -1 if the write failed.
+ */
+int sim_send(struct sim_port *p, const void *buf, size_t len);
+
+void sim_log(struct sim_port *p, const char *dir, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,548 @@
+/* Copyright (c) 2014 OpenHam
+ * Developers:
+ * Stephen Hurd (K6BSD/VE5BSD) <shurd@FreeBSD.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice, developer list, and this permission notice shall
+ * be included in all copies or substantial portions of the Software. If you meet
+ * us some day, and you think this stuff is worth it, you can buy us a beer in
+ * return
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Simulates the Yaesu FT-736R's binary CAT on a pty so the yaesu_bincat
+ * backend can be run without a rig.  Every frame from ybc_cmd[] is
+ * decoded and applied to the simulated rig: frequency (BIGBCD, 10Hz
+ * units), mode, PTT, split offset and direction, full duplex RX/TX
+ * frequency and mode, and CTCSS.  The 0xE7 squelch and 0xF7 S-meter
+ * queries are answered with the value repeated five times, since the
+ * backend reads a five byte response.
+ *
+ * The rig needs time to act on each frame (-p, 50ms by default).  A
+ * frame that starts arriving before the previous one has been processed
+ * is counted as an overrun and dropped, as the rig would.  The smallest
+ * gap seen between frames is reported with the counters so the safe
+ * rate for duplex and Doppler updates can be read off directly.  A frame
+ * left incomplete for more than ten character times is discarded.
+ *
+ * The squelch and S-meter can be scripted from stdin with lines like
+ * "squelch 1" or "smeter 180".  SIGUSR1 prints counters.
+ *
+ * Usage: or-sim-yaesu [-l link] [-s speed] [-p process_ms] [-q squelch]
+ *            [-m smeter] [-v]
+ *
+ * e.g. or-sim-yaesu -l /tmp/ft736 then "port = /tmp/ft736" in the
+ * rig's section.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+#define LINE_BITS	11	// 8N2 plus the start bit
+#define FRAME_LEN	5
+
+enum frame_type {
+	FRAME_NONE,
+	FRAME_FREQ,
+	FRAME_MODE,
+	FRAME_TONE
+};
+
+struct opcode {
+	unsigned char	op;
+	const char		*name;
+	enum frame_type	type;
+};
+
+/* The opcodes in yaesu_bincat.c's ybc_cmd[] */
+static const struct opcode opcodes[] = {
+	{0x00, "CAT ON", FRAME_NONE},
+	{0x80, "CAT OFF", FRAME_NONE},
+	{0x01, "FREQUENCY", FRAME_FREQ},
+	{0x07, "MODE", FRAME_MODE},
+	{0x08, "TX", FRAME_NONE},
+	{0x88, "RX", FRAME_NONE},
+	{0x49, "SPLIT +", FRAME_NONE},
+	{0x09, "SPLIT -", FRAME_NONE},
+	{0x89, "SPLIT OFF", FRAME_NONE},
+	{0xF9, "SPLIT OFFSET", FRAME_FREQ},
+	{0x0A, "CTCSS ENC/DEC", FRAME_NONE},
+	{0x4A, "CTCSS ENC", FRAME_NONE},
+	{0x8A, "CTCSS OFF", FRAME_NONE},
+	{0xFA, "CTCSS TONE", FRAME_TONE},
+	{0x0E, "DUPLEX ON", FRAME_NONE},
+	{0x8E, "DUPLEX OFF", FRAME_NONE},
+	{0x17, "DUPLEX RX MODE", FRAME_MODE},
+	{0x27, "DUPLEX TX MODE", FRAME_MODE},
+	{0x1E, "DUPLEX RX FREQ", FRAME_FREQ},
+	{0x2E, "DUPLEX TX FREQ", FRAME_FREQ},
+	{0x0B, "AQS ON", FRAME_NONE},
+	{0x8B, "AQS OFF", FRAME_NONE},
+	{0x05, "CALLSIGN", FRAME_NONE},
+	{0x04, "GROUP CODE", FRAME_NONE},
+	{0x0D, "CAC ON", FRAME_NONE},
+	{0x02, "CONTROL FREQ", FRAME_FREQ},
+	{0x03, "COMM FREQ", FRAME_FREQ},
+	{0x8D, "AQS RESET", FRAME_NONE},
+	{0x0C, "DIGITAL SQL ON", FRAME_NONE},
+	{0x8C, "DIGITAL SQL OFF", FRAME_NONE},
+	{0xE7, "READ SQUELCH", FRAME_NONE},
+	{0xF7, "READ S-METER", FRAME_NONE},
+	{0, NULL, FRAME_NONE}
+};
+
+struct mode {
+	unsigned char	code;
+	const char		*name;
+};
+
+static const struct mode modes[] = {
+	{0x00, "LSB"},
+	{0x01, "USB"},
+	{0x02, "CW"},
+	{0x82, "CWN"},
+	{0x08, "FM"},
+	{0x88, "FMN"},
+	{0, NULL}
+};
+
+struct rig {
+	bool			cat;
+	uint64_t		freq;
+	unsigned char	mode;
+	bool			tx;
+	int				split;		// -1, 0 or +1
+	uint64_t		offset;
+	bool			duplex;
+	uint64_t		duplex_rx;
+	uint64_t		duplex_tx;
+	unsigned char	duplex_rx_mode;
+	unsigned char	duplex_tx_mode;
+	unsigned char	ctcss;		// 0 off, 1 encode, 2 encode/decode
+	unsigned		tone;
+	unsigned char	squelch;	// Non-zero when open
+	unsigned char	smeter;
+	uint64_t		busy_until;
+};
+
+struct counters {
+	uint64_t	frames;
+	uint64_t	overruns;	// Arrived while the previous frame was being processed
+	uint64_t	partial;	// Incomplete frames discarded
+	uint64_t	bad;		// Unknown opcode or bad BCD
+	uint64_t	queries;
+	uint64_t	min_gap_ns;	// Shortest time between the ends of two frames
+};
+
+static struct sim_port			port;
+static struct rig				rig = {false, 144000000, 0x08};
+static struct counters			counters = {.min_gap_ns = UINT64_MAX};
+static volatile sig_atomic_t	done;
+static volatile sig_atomic_t	show_counters;
+
+static void on_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		show_counters = 1;
+	else
+		done = 1;
+}
+
+static const struct opcode *find_opcode(unsigned char op)
+{
+	int		i;
+
+	for (i = 0; opcodes[i].name; i++) {
+		if (opcodes[i].op == op)
+			return &opcodes[i];
+	}
+	return NULL;
+}
+
+static const char *mode_name(unsigned char code)
+{
+	int		i;
+
+	for (i = 0; modes[i].name; i++) {
+		if (modes[i].code == code)
+			return modes[i].name;
+	}
+	return NULL;
+}
+
+/*
+ * Decodes nybbles of BCD starting at the high nybble of buf[0].  If big
+ * is set the first nybble may be hex (a=10 etc.) as fill_bcd() writes
+ * it.  Returns -1 if any other nybble isn't a decimal digit.
+ */
+static int decode_bcd(const unsigned char *buf, unsigned nybbles, bool big, uint64_t *val)
+{
+	unsigned		i;
+	unsigned char	n;
+
+	*val = 0;
+	for (i = 0; i < nybbles; i++) {
+		n = buf[i / 2];
+		n = (i % 2) ? n & 0x0f : n >> 4;
+		if (n > 9 && !(i == 0 && big))
+			return -1;
+		*val = *val * 10 + n;
+	}
+	return 0;
+}
+
+static void print_counters(void)
+{
+	fprintf(stderr, "frames %" PRIu64 " overruns %" PRIu64 " partial %" PRIu64 " bad %" PRIu64 " queries %" PRIu64,
+	    counters.frames, counters.overruns, counters.partial, counters.bad, counters.queries);
+	if (counters.min_gap_ns != UINT64_MAX)
+		fprintf(stderr, " min_gap_ms %.3f", counters.min_gap_ns / 1000000.0);
+	fprintf(stderr, "\n");
+}
+
+static int answer(unsigned char val)
+{
+	unsigned char	buf[FRAME_LEN];
+
+	counters.queries++;
+	memset(buf, val, sizeof(buf));
+	return sim_send(&port, buf, sizeof(buf));
+}
+
+/*
+ * Applies one complete frame.  Returns -1 if a reply couldn't be sent.
+ */
+static int run_frame(const unsigned char *frame)
+{
+	const struct opcode	*op = find_opcode(frame[4]);
+	uint64_t			val = 0;
+	const char			*name = NULL;
+
+	if (op == NULL) {
+		counters.bad++;
+		fprintf(stderr, "Unknown opcode 0x%02x\n", frame[4]);
+		return 0;
+	}
+	switch (op->type) {
+		case FRAME_FREQ:
+			if (decode_bcd(frame, 8, true, &val) == -1) {
+				counters.bad++;
+				fprintf(stderr, "%s: bad BCD %02x %02x %02x %02x\n", op->name, frame[0], frame[1], frame[2], frame[3]);
+				return 0;
+			}
+			val *= 10;
+			break;
+		case FRAME_MODE:
+			name = mode_name(frame[0]);
+			if (name == NULL) {
+				counters.bad++;
+				fprintf(stderr, "%s: unknown mode 0x%02x\n", op->name, frame[0]);
+				return 0;
+			}
+			break;
+		case FRAME_TONE:
+			if (decode_bcd(frame, 2, false, &val) == -1) {
+				counters.bad++;
+				fprintf(stderr, "%s: bad BCD %02x\n", op->name, frame[0]);
+				return 0;
+			}
+			break;
+		case FRAME_NONE:
+			break;
+	}
+	if (port.verbose) {
+		if (op->type == FRAME_MODE)
+			fprintf(stderr, "%s %s\n", op->name, name);
+		else if (op->type != FRAME_NONE)
+			fprintf(stderr, "%s %" PRIu64 "\n", op->name, val);
+		else
+			fprintf(stderr, "%s\n", op->name);
+	}
+
+	/* Only CAT ON is accepted while CAT is off */
+	if (!rig.cat && op->op != 0x00)
+		return 0;
+	switch (op->op) {
+		case 0x00:
+			rig.cat = true;
+			break;
+		case 0x80:
+			rig.cat = false;
+			break;
+		case 0x01:
+			rig.freq = val;
+			break;
+		case 0x07:
+			rig.mode = frame[0];
+			break;
+		case 0x08:
+		case 0x88:
+			rig.tx = op->op == 0x08;
+			break;
+		case 0x49:
+			rig.split = 1;
+			break;
+		case 0x09:
+			rig.split = -1;
+			break;
+		case 0x89:
+			rig.split = 0;
+			break;
+		case 0xF9:
+			rig.offset = val;
+			break;
+		case 0x0A:
+			rig.ctcss = 2;
+			break;
+		case 0x4A:
+			rig.ctcss = 1;
+			break;
+		case 0x8A:
+			rig.ctcss = 0;
+			break;
+		case 0xFA:
+			rig.tone = val;
+			break;
+		case 0x0E:
+		case 0x8E:
+			rig.duplex = op->op == 0x0E;
+			break;
+		case 0x17:
+			rig.duplex_rx_mode = frame[0];
+			break;
+		case 0x27:
+			rig.duplex_tx_mode = frame[0];
+			break;
+		case 0x1E:
+			rig.duplex_rx = val;
+			break;
+		case 0x2E:
+			rig.duplex_tx = val;
+			break;
+		case 0xE7:
+			return answer(rig.squelch ? 0x80 : 0x00);
+		case 0xF7:
+			return answer(rig.smeter);
+	}
+	return 0;
+}
+
+/*
+ * A frame from the serial port.  start is when its first character was
+ * complete and end when its last one was.
+ */
+static int handle_frame(const unsigned char *frame, uint64_t start, uint64_t end, uint64_t *last_end, uint64_t process_ns)
+{
+	sim_sleep_until(end);
+	sim_log(&port, "<<", frame, FRAME_LEN);
+	counters.frames++;
+	if (*last_end && end - *last_end < counters.min_gap_ns)
+		counters.min_gap_ns = end - *last_end;
+	*last_end = end;
+	if (start < rig.busy_until) {
+		counters.overruns++;
+		if (port.verbose)
+			fprintf(stderr, "Overrun, opcode 0x%02x arrived %.3fms early\n", frame[4],
+			    (rig.busy_until - start) / 1000000.0);
+		return 0;
+	}
+	rig.busy_until = end + process_ns;
+	return run_frame(frame);
+}
+
+static void print_state(void)
+{
+	const char	*mode = mode_name(rig.mode);
+
+	fprintf(stderr, "cat %s freq %" PRIu64 " mode %s %s split %c%" PRIu64 " ctcss %u tone %u",
+	    rig.cat ? "on" : "off", rig.freq, mode ? mode : "?", rig.tx ? "TX" : "RX",
+	    rig.split < 0 ? '-' : rig.split > 0 ? '+' : '0', rig.offset, rig.ctcss, rig.tone);
+	if (rig.duplex) {
+		const char	*rx_mode = mode_name(rig.duplex_rx_mode);
+		const char	*tx_mode = mode_name(rig.duplex_tx_mode);
+
+		fprintf(stderr, " duplex rx %" PRIu64 " %s tx %" PRIu64 " %s", rig.duplex_rx,
+		    rx_mode ? rx_mode : "?", rig.duplex_tx, tx_mode ? tx_mode : "?");
+	}
+	fprintf(stderr, "\n");
+}
+
+/*
+ * A line from stdin: "squelch <0|1>", "smeter <0-255>" or "state".
+ */
+static void script_line(char *line)
+{
+	char			*arg = strchr(line, ' ');
+	unsigned long	val = 0;
+	char			*end = NULL;
+
+	if (arg) {
+		*arg++ = 0;
+		val = strtoul(arg, &end, 0);
+	}
+	if (strcmp(line, "state") == 0 && arg == NULL)
+		print_state();
+	else if (strcmp(line, "squelch") == 0 && end && *end == 0 && end != arg)
+		rig.squelch = val != 0;
+	else if (strcmp(line, "smeter") == 0 && end && *end == 0 && end != arg && val <= 255)
+		rig.smeter = val;
+	else if (*line)
+		fprintf(stderr, "Bad script line %s\n", line);
+}
+
+int main(int argc, char **argv)
+{
+	const char		*link = NULL;
+	unsigned		speed = 4800;
+	uint64_t		process_ns = 50000000;
+	uint64_t		char_gap_ns;
+	uint64_t		start = 0;
+	uint64_t		end = 0;
+	uint64_t		last_end = 0;
+	uint64_t		now;
+	struct pollfd	pfds[2];
+	unsigned char	buf[256];
+	unsigned char	frame[FRAME_LEN];
+	size_t			frame_len = 0;
+	char			line[64];
+	size_t			line_len = 0;
+	ssize_t			got;
+	ssize_t			i;
+	int				timeout;
+	int				opt;
+	bool			verbose = false;
+
+	while ((opt = getopt(argc, argv, "l:s:p:q:m:v")) != -1) {
+		switch (opt) {
+			case 'l':
+				link = optarg;
+				break;
+			case 's':
+				speed = strtoul(optarg, NULL, 10);
+				break;
+			case 'p':
+				process_ns = strtoull(optarg, NULL, 10) * 1000000;
+				break;
+			case 'q':
+				rig.squelch = strtoul(optarg, NULL, 10) != 0;
+				break;
+			case 'm':
+				rig.smeter = strtoul(optarg, NULL, 0);
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				goto usage;
+		}
+	}
+	if (optind != argc || speed == 0)
+		goto usage;
+
+	if (sim_open(&port, link, speed, LINE_BITS) == -1) {
+		fprintf(stderr, "Unable to open a pty: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	port.verbose = verbose;
+	port.binary = true;
+	char_gap_ns = port.char_ns * 10;
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGHUP, on_signal);
+	signal(SIGUSR1, on_signal);
+	printf("%s\n", port.name);
+	fflush(stdout);
+
+	pfds[0].fd = port.fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = STDIN_FILENO;
+	pfds[1].events = POLLIN;
+	while (!done) {
+		if (show_counters) {
+			show_counters = 0;
+			print_counters();
+		}
+		timeout = -1;
+		if (frame_len) {
+			now = sim_ns();
+			if (now >= end + char_gap_ns) {
+				counters.partial++;
+				sim_log(&port, "<< partial", frame, frame_len);
+				frame_len = 0;
+				continue;
+			}
+			timeout = (end + char_gap_ns - now) / 1000000 + 1;
+		}
+		if (poll(pfds, pfds[1].fd == -1 ? 1 : 2, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfds[0].revents & POLLIN) {
+			got = read(port.fd, buf, sizeof(buf));
+			if (got == -1 && errno != EINTR && errno != EAGAIN)
+				break;
+			now = sim_ns();
+			for (i = 0; i < got; i++) {
+				end = sim_received(&port, now);
+				if (frame_len == 0)
+					start = end;
+				frame[frame_len++] = buf[i];
+				if (frame_len < FRAME_LEN)
+					continue;
+				frame_len = 0;
+				if (handle_frame(frame, start, end, &last_end, process_ns) == -1) {
+					done = 1;
+					break;
+				}
+			}
+		}
+		if (pfds[1].fd != -1 && (pfds[1].revents & (POLLIN | POLLHUP))) {
+			got = read(STDIN_FILENO, buf, sizeof(buf));
+			if (got <= 0) {
+				pfds[1].fd = -1;
+				continue;
+			}
+			for (i = 0; i < got; i++) {
+				if (buf[i] != '\n') {
+					if (line_len < sizeof(line) - 1)
+						line[line_len++] = buf[i];
+					continue;
+				}
+				line[line_len] = 0;
+				script_line(line);
+				line_len = 0;
+			}
+		}
+	}
+	print_counters();
+	sim_close(&port);
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "Usage: %s [-l link] [-s speed] [-p process_ms] [-q squelch] [-m smeter] [-v]\n", argv[0]);
+	return EXIT_FAILURE;
+}